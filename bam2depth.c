@@ -40,6 +40,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/sam.h"
 #include "samtools.h"
 #include "sam_opts.h"
+#include "bedidx.h"
 
 typedef struct {     // auxiliary data structure
     samFile *fp;     // the file handle
@@ -48,10 +49,6 @@ typedef struct {     // auxiliary data structure
     int min_mapQ, min_len; // mapQ filter; length filter
 } aux_t;
 
-void *bed_read(const char *fn); // read a BED or position list file
-void bed_destroy(void *_h);     // destroy the BED data structure
-int bed_overlap(const void *_h, const char *chr, int beg, int end); // test if chr:beg-end overlaps
-int bed_query(const void *_h, const char *chr, int pos, int *beg, int *end);
 
 // This function reads a BAM alignment from one BAM file.
 static int read_bam(void *data, bam1_t *b) // read level filters better go here to avoid pileup
@@ -105,6 +102,8 @@ int main_depth(int argc, char *argv[])
     const bam_pileup1_t **plp;
     char *reg = 0; // specified region
     void *bed = 0; // BED data structure
+    void *bed_tids = 0; // BED data resolved against the header of the 1st input
+    bed_cursor_t bed_cur = BED_CURSOR_INIT;
     char *file_list = NULL, **fn = NULL;
     bam_hdr_t *h = NULL; // BAM header of the 1st input
     aux_t **data;
@@ -197,6 +196,11 @@ int main_depth(int argc, char *argv[])
     }
 
     h = data[0]->hdr; // easy access to the header of the 1st BAM
+    if (bed && (bed_tids = bed_tid_index(bed, h)) == NULL) {
+        print_error("depth", "failed to index the regions in the BED file");
+        status = EXIT_FAILURE;
+        goto depth_end;
+    }
     if (reg) {
         beg = data[0]->iter->beg; // and to the parsed region coordinates
         end = data[0]->iter->end;
@@ -219,8 +223,7 @@ int main_depth(int argc, char *argv[])
                 if (last_tid >= 0 && !reg) {
                     // Deal with remainder or entirety of last tid.
                     while (++last_pos < h->target_len[last_tid]) {
-                        // Horribly inefficient, but the bed API is an obfuscated black box.
-                        if (bed && bed_overlap(bed, h->target_name[last_tid], last_pos, last_pos + 1) == 0)
+                        if (bed && bed_overlap_tid(bed_tids, last_tid, last_pos, last_pos + 1, &bed_cur) == 0)
                             continue;
                         fputs(h->target_name[last_tid], stdout); printf("\t%d", last_pos+1);
                         for (i = 0; i < n; i++)
@@ -237,7 +240,7 @@ int main_depth(int argc, char *argv[])
             // Deal with missing portion of current tid
             while (++last_pos < pos) {
                 if (last_pos < beg) continue; // out of range; skip
-                if (bed && bed_overlap(bed, h->target_name[tid], last_pos, last_pos + 1) == 0)
+                if (bed && bed_overlap_tid(bed_tids, tid, last_pos, last_pos + 1, &bed_cur) == 0)
                     continue;
                 fputs(h->target_name[tid], stdout); printf("\t%d", last_pos+1);
                 for (i = 0; i < n; i++)
@@ -248,7 +251,7 @@ int main_depth(int argc, char *argv[])
             last_tid = tid;
             last_pos = pos;
         }
-        if (bed && bed_overlap(bed, h->target_name[tid], pos, pos + 1) == 0) continue;
+        if (bed && bed_overlap_tid(bed_tids, tid, pos, pos + 1, &bed_cur) == 0) continue;
         fputs(h->target_name[tid], stdout); printf("\t%d", pos+1); // a customized printf() would be faster
         for (i = 0; i < n; ++i) { // base level filters have to go here
             int j, m = 0;
@@ -274,7 +277,7 @@ int main_depth(int argc, char *argv[])
         while (last_tid >= 0 && last_tid < h->n_targets) {
             while (++last_pos < h->target_len[last_tid]) {
                 if (last_pos >= end) break;
-                if (bed && bed_overlap(bed, h->target_name[last_tid], last_pos, last_pos + 1) == 0)
+                if (bed && bed_overlap_tid(bed_tids, last_tid, last_pos, last_pos + 1, &bed_cur) == 0)
                     continue;
                 fputs(h->target_name[last_tid], stdout); printf("\t%d", last_pos+1);
                 for (i = 0; i < n; i++)
@@ -297,6 +300,7 @@ depth_end:
     }
     free(data); free(reg);
     if (bed) bed_destroy(bed);
+    if (bed_tids) bed_tid_destroy(bed_tids);
     if ( file_list )
     {
         for (i=0; i<n; i++) free(fn[i]);
@@ -41,12 +41,25 @@ Illumina.
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 #include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+#include "htslib/hts_endian.h"
+#include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/cram.h"
 #include "htslib/khash.h"
 #include "samtools.h"
+#include "bam_idx.h"
 
 KHASH_MAP_INIT_STR(s2i, int)
 
@@ -412,6 +425,349 @@ int cram_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outcram)
 }
 
 
+/*
+ * Index splicing.  When the inputs are coordinate sorted and indexed, and
+ * follow on from each other (e.g. one per chromosome or per region), the
+ * index of the concatenated file is the union of the input indexes with
+ * their virtual offsets moved to where the data ended up in the output.
+ */
+
+// Where the data from one input went in the output
+typedef struct {
+    uint64_t first_block;       // input block holding the end of the header
+    uint64_t hdr_uoff;          // where the header ended in that block
+    uint64_t piece[2];          // output blocks holding the rest of it
+    int n_piece;
+    uint64_t raw_start;         // input offset where block copying started
+    uint64_t out_raw_start;     // output offset it was copied to
+} cat_rebase_t;
+
+static uint64_t cat_rebase(const cat_rebase_t *rb, uint64_t voff)
+{
+    uint64_t c = voff >> 16, u = voff & 0xffff;
+    if (rb->n_piece > 0 && c == rb->first_block) {
+        int k;
+        u = u >= rb->hdr_uoff ? u - rb->hdr_uoff : 0;
+        k = u / BGZF_BLOCK_SIZE;
+        if (k >= rb->n_piece) return rb->out_raw_start << 16;
+        return rb->piece[k] << 16 | (u - (uint64_t) k * BGZF_BLOCK_SIZE);
+    }
+    if (c < rb->raw_start) return rb->out_raw_start << 16;
+    return (c - rb->raw_start + rb->out_raw_start) << 16 | u;
+}
+
+// Finds the index for a BAM file, trying in.bam.csi, in.bam.bai and in.bai
+static char *cat_index_name(const char *fn, int *fmt)
+{
+    kstring_t s = { 0, 0, NULL };
+    size_t l = strlen(fn);
+
+    ksprintf(&s, "%s.csi", fn);
+    if (access(s.s, R_OK) == 0) { *fmt = HTS_FMT_CSI; return s.s; }
+    s.l = 0; ksprintf(&s, "%s.bai", fn);
+    if (access(s.s, R_OK) == 0) { *fmt = HTS_FMT_BAI; return s.s; }
+    if (l > 4 && strcmp(fn + l - 4, ".bam") == 0) {
+        s.l = 0; ksprintf(&s, "%.*s.bai", (int) l - 4, fn);
+        if (access(s.s, R_OK) == 0) { *fmt = HTS_FMT_BAI; return s.s; }
+    }
+    free(s.s);
+    return NULL;
+}
+
+static int cat_read(BGZF *fp, void *buf, size_t len)
+{
+    return bgzf_read(fp, buf, len) == (ssize_t) len ? 0 : -1;
+}
+
+// Reads one input index and merges it into idx, rebasing its offsets
+static int cat_index_merge(bam_idx_t *idx, const char *fn, const cat_rebase_t *rb)
+{
+    char *idx_fn;
+    int fmt, i, j, ret = -1;
+    uint8_t buf[16];
+    BGZF *fp = NULL;
+
+    if (!(idx_fn = cat_index_name(fn, &fmt))) {
+        print_error("cat", "no index found for \"%s\"", fn);
+        return -1;
+    }
+    if (!(fp = bgzf_open(idx_fn, "r"))) {
+        print_error_errno("cat", "failed to open index \"%s\"", idx_fn);
+        free(idx_fn);
+        return -1;
+    }
+
+    if (cat_read(fp, buf, 4) < 0) goto read_fail;
+    if (memcmp(buf, fmt == HTS_FMT_CSI ? "CSI\1" : "BAI\1", 4) != 0) {
+        print_error("cat", "\"%s\" is not a %s index", idx_fn, fmt == HTS_FMT_CSI ? "CSI" : "BAI");
+        goto fail;
+    }
+
+    int min_shift = 14, n_lvls = 5;
+    uint32_t l_meta = 0;
+    uint8_t *meta = NULL;
+    if (fmt == HTS_FMT_CSI) {
+        if (cat_read(fp, buf, 12) < 0) goto read_fail;
+        min_shift = le_to_i32(buf);
+        n_lvls = le_to_i32(buf + 4);
+        l_meta = le_to_u32(buf + 8);
+        if (l_meta && (!(meta = malloc(l_meta)) || cat_read(fp, meta, l_meta) < 0)) {
+            free(meta);
+            goto read_fail;
+        }
+    }
+    if (idx->fmt < 0) {
+        idx->fmt = fmt;
+        idx->min_shift = min_shift;
+        idx->n_lvls = n_lvls;
+        idx->l_meta = l_meta;
+        idx->meta = meta;
+    } else {
+        free(meta);
+        if (fmt != idx->fmt || min_shift != idx->min_shift || n_lvls != idx->n_lvls) {
+            print_error("cat", "index \"%s\" does not match the type of the earlier ones", idx_fn);
+            goto fail;
+        }
+    }
+    uint32_t pseudo = bam_idx_meta_bin(n_lvls);
+
+    if (cat_read(fp, buf, 4) < 0) goto read_fail;
+    int n_ref = le_to_i32(buf);
+    if (n_ref < 0) goto read_fail;
+    if (n_ref > idx->n_ref) {
+        bam_idx_ref_t *ref = realloc(idx->ref, n_ref * sizeof(*ref));
+        if (!ref) goto mem_fail;
+        memset(ref + idx->n_ref, 0, (n_ref - idx->n_ref) * sizeof(*ref));
+        idx->ref = ref;
+        idx->n_ref = n_ref;
+    }
+
+    for (i = 0; i < n_ref; i++) {
+        bam_idx_ref_t *r = &idx->ref[i];
+        if (!r->bins && !(r->bins = kh_init(bam_idx_bin))) goto mem_fail;
+
+        if (cat_read(fp, buf, 4) < 0) goto read_fail;
+        int n_bin = le_to_i32(buf);
+        for (j = 0; j < n_bin; j++) {
+            uint32_t bin;
+            uint64_t loff = 0;
+            int32_t n_chunk, c, absent;
+            if (cat_read(fp, buf, 4) < 0) goto read_fail;
+            bin = le_to_u32(buf);
+            if (fmt == HTS_FMT_CSI) {
+                if (cat_read(fp, buf, 8) < 0) goto read_fail;
+                loff = cat_rebase(rb, le_to_u64(buf));
+            }
+            if (cat_read(fp, buf, 4) < 0) goto read_fail;
+            n_chunk = le_to_i32(buf);
+
+            khint_t k = kh_put(bam_idx_bin, r->bins, bin, &absent);
+            if (absent < 0) goto mem_fail;
+            bam_idx_bin_t *b = &kh_val(r->bins, k);
+            if (absent) {
+                memset(b, 0, sizeof(*b));
+                b->loff = loff;
+            } else if (loff < b->loff) {
+                b->loff = loff;
+            }
+
+            for (c = 0; c < n_chunk; c++) {
+                uint64_t u, v;
+                if (cat_read(fp, buf, 16) < 0) goto read_fail;
+                u = le_to_u64(buf);
+                v = le_to_u64(buf + 8);
+                if (bin == pseudo) {
+                    // The pseudo-bin holds the span of the reference's
+                    // reads, then its mapped and unmapped read counts
+                    if (c == 0) {
+                        u = cat_rebase(rb, u);
+                        v = cat_rebase(rb, v);
+                    }
+                    if (b->n > c) {
+                        if (c == 0) {
+                            b->list[0].v = v;
+                        } else {
+                            b->list[c].u += u;
+                            b->list[c].v += v;
+                        }
+                        continue;
+                    }
+                } else {
+                    u = cat_rebase(rb, u);
+                    v = cat_rebase(rb, v);
+                }
+                if (bam_idx_add_chunk(b, u, v) < 0) goto mem_fail;
+            }
+        }
+
+        if (fmt == HTS_FMT_BAI) {
+            if (cat_read(fp, buf, 4) < 0) goto read_fail;
+            int n_intv = le_to_i32(buf);
+            if (n_intv > r->m_lin) {
+                uint64_t *lin = realloc(r->lin, n_intv * sizeof(*lin));
+                if (!lin) goto mem_fail;
+                r->lin = lin;
+                r->m_lin = n_intv;
+            }
+            if (n_intv > r->n_lin) {
+                memset(r->lin + r->n_lin, 0, (n_intv - r->n_lin) * sizeof(*r->lin));
+                r->n_lin = n_intv;
+            }
+            for (j = 0; j < n_intv; j++) {
+                if (cat_read(fp, buf, 8) < 0) goto read_fail;
+                uint64_t off = le_to_u64(buf);
+                if (off == 0) continue;
+                // Earlier inputs come first in the output, so keep theirs
+                if (r->lin[j] == 0) r->lin[j] = cat_rebase(rb, off);
+            }
+        }
+    }
+
+    // Optional count of reads with no coordinates
+    if (bgzf_read(fp, buf, 8) == 8) {
+        idx->has_no_coor = 1;
+        idx->n_no_coor += le_to_u64(buf);
+    }
+    ret = 0;
+    goto fail;
+
+ mem_fail:
+    print_error_errno("cat", "out of memory reading index \"%s\"", idx_fn);
+    goto fail;
+ read_fail:
+    print_error("cat", "failed to read index \"%s\"", idx_fn);
+ fail:
+    bgzf_close(fp);
+    free(idx_fn);
+    return ret;
+}
+
+static int cat_index_save(const bam_idx_t *idx, const char *outbam)
+{
+    kstring_t fn = { 0, 0, NULL };
+    int ret;
+
+    ksprintf(&fn, "%s.%s", outbam, idx->fmt == HTS_FMT_CSI ? "csi" : "bai");
+    if ((ret = bam_idx_save(idx, fn.s)) < 0)
+        print_error_errno("cat", "failed to write index \"%s\"", fn.s);
+    free(fn.s);
+    return ret;
+}
+
+/*
+ * The placed reads of one input: the first and last references holding
+ * any, and the positions of the first and last of them.  Spliced indexes
+ * are only right if each input follows on from the one before.
+ */
+typedef struct {
+    int first_tid, last_tid;    // -1 if there are no placed reads
+    int first_pos, last_pos;
+    int has_no_coor;            // ends with reads that have no coordinates
+} cat_span_t;
+
+// Position of the last read on tid, searching back from the end
+static int cat_last_pos(samFile *in, hts_idx_t *idx, int tid, int len, bam1_t *b)
+{
+    int64_t w = 0x10000;
+    int ret, pos;
+
+    for (;; w *= 2) {
+        int beg = w < len ? len - w : 0;
+        hts_itr_t *iter = sam_itr_queryi(idx, tid, beg, len);
+        if (!iter) return -2;
+        pos = -1;
+        while ((ret = sam_itr_next(in, iter, b)) >= 0)
+            if (b->core.pos > pos) pos = b->core.pos;
+        hts_itr_destroy(iter);
+        if (ret < -1) return -2;
+        // Reads starting before beg may not be the last ones
+        if (pos >= beg || beg == 0) return pos;
+    }
+}
+
+static int cat_index_span(const char *fn, cat_span_t *sp)
+{
+    samFile *in = NULL;
+    bam_hdr_t *h = NULL;
+    hts_idx_t *idx = NULL;
+    bam1_t *b = NULL;
+    char *idx_fn = NULL;
+    int fmt, tid, ret = -1;
+    uint64_t mapped, unmapped;
+
+    sp->first_tid = sp->last_tid = -1;
+    sp->first_pos = sp->last_pos = -1;
+    if (!(idx_fn = cat_index_name(fn, &fmt))) {
+        print_error("cat", "no index found for \"%s\"", fn);
+        return -1;
+    }
+    if (!(in = sam_open(fn, "r")) || !(h = sam_hdr_read(in))
+        || !(idx = sam_index_load2(in, fn, idx_fn)) || !(b = bam_init1())) {
+        print_error("cat", "failed to read \"%s\" or its index", fn);
+        goto out;
+    }
+
+    for (tid = 0; tid < h->n_targets; tid++) {
+        if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) < 0
+            || mapped + unmapped == 0) continue;
+        if (sp->first_tid < 0) sp->first_tid = tid;
+        sp->last_tid = tid;
+    }
+    sp->has_no_coor = hts_idx_get_n_no_coor(idx) > 0;
+
+    if (sp->first_tid >= 0) {
+        hts_itr_t *iter = sam_itr_queryi(idx, sp->first_tid, 0, h->target_len[sp->first_tid]);
+        if (!iter || sam_itr_next(in, iter, b) < 0) {
+            hts_itr_destroy(iter);
+            print_error("cat", "failed to read the first record of \"%s\"", fn);
+            goto out;
+        }
+        sp->first_pos = b->core.pos;
+        hts_itr_destroy(iter);
+        sp->last_pos = cat_last_pos(in, idx, sp->last_tid, h->target_len[sp->last_tid], b);
+        if (sp->last_pos < -1) {
+            print_error("cat", "failed to read the last records of \"%s\"", fn);
+            goto out;
+        }
+    }
+    ret = 0;
+
+ out:
+    if (b) bam_destroy1(b);
+    if (idx) hts_idx_destroy(idx);
+    if (h) bam_hdr_destroy(h);
+    if (in) sam_close(in);
+    free(idx_fn);
+    return ret;
+}
+
+// Checks that each input starts at or after where the ones before ended
+static int cat_check_order(int nfn, char * const *fn)
+{
+    cat_span_t cur;
+    int i, last_tid = -1, last_pos = -1, no_coor = 0;
+    const char *last_fn = NULL;
+
+    for (i = 0; i < nfn; i++) {
+        if (cat_index_span(fn[i], &cur) < 0) return -1;
+        if (cur.first_tid >= 0) {
+            if (no_coor || cur.first_tid < last_tid
+                || (cur.first_tid == last_tid && cur.first_pos < last_pos)) {
+                print_error("cat", "\"%s\" does not follow on from \"%s\" in coordinate order, "
+                            "so their indexes can't be spliced; use samtools merge, "
+                            "or cat without --write-index and index the result", fn[i], last_fn);
+                return -1;
+            }
+            last_tid = cur.last_tid;
+            last_pos = cur.last_pos;
+        }
+        // Reads with no coordinates must come after all the others
+        if (cur.has_no_coor) no_coor = 1;
+        if (cur.first_tid >= 0 || cur.has_no_coor) last_fn = fn[i];
+    }
+    return 0;
+}
+
 #define BUF_SIZE 0x10000
 
 #define GZIPID1 31
@@ -419,17 +775,184 @@ int cram_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outcram)
 
 #define BGZF_EMPTY_BLOCK_SIZE 28
 
-int bam_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outbam)
+/*
+ * Inputs are opened, and their headers read, in a separate thread while the
+ * previous one is being copied.  On Linux the compressed blocks of regular
+ * files are then copied by the kernel with copy_file_range(), or sendfile()
+ * where that is unavailable, which on copy-on-write filesystems can share
+ * the data instead of copying it at all.  Otherwise they go through a
+ * user-space buffer as before.
+ */
+#ifdef __linux__
+#define CAT_KERNEL_COPY
+#endif
+
+typedef struct {
+    const char *fn;
+    BGZF *in;
+    bam_hdr_t *hdr;
+    int err;            // errno from a failed open
+    int fd;             // plain descriptor for kernel-side copying, or -1
+    int64_t size;
+    pthread_t tid;
+    int running;
+} cat_input_t;
+
+static void *cat_open_input(void *arg)
+{
+    cat_input_t *ci = (cat_input_t *) arg;
+
+    ci->fd = -1;
+    ci->in = strcmp(ci->fn, "-")? bgzf_open(ci->fn, "r") : bgzf_fdopen(fileno(stdin), "r");
+    if (ci->in == NULL) {
+        ci->err = errno;
+        return NULL;
+    }
+    if (ci->in->is_write) return NULL;
+    ci->hdr = bam_hdr_read(ci->in);
+
+#ifdef CAT_KERNEL_COPY
+    if (ci->hdr && strcmp(ci->fn, "-") != 0) {
+        struct stat st;
+        int fd = open(ci->fn, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            ci->fd = fd;
+            ci->size = st.st_size;
+            (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+#endif
+    return NULL;
+}
+
+static void cat_start_input(cat_input_t *ci, const char *fn)
+{
+    memset(ci, 0, sizeof(*ci));
+    ci->fn = fn;
+    if (pthread_create(&ci->tid, NULL, cat_open_input, ci) == 0)
+        ci->running = 1;
+    else
+        cat_open_input(ci);
+}
+
+static void cat_finish_input(cat_input_t *ci)
+{
+    if (ci->running) {
+        pthread_join(ci->tid, NULL);
+        ci->running = 0;
+    }
+}
+
+static void cat_close_input(cat_input_t *ci)
+{
+    cat_finish_input(ci);
+    if (ci->hdr) bam_hdr_destroy(ci->hdr);
+    if (ci->in) bgzf_close(ci->in);
+    if (ci->fd >= 0) close(ci->fd);
+    memset(ci, 0, sizeof(*ci));
+    ci->fd = -1;
+}
+
+#ifdef CAT_KERNEL_COPY
+/*
+ * Copies len bytes at offset off in in_fd to the current position of out_fd
+ * inside the kernel.  Returns 0 on success, 1 if the kernel can't do this
+ * for these files (in which case nothing has been written) and -1 on error.
+ */
+static int cat_copy_range(int out_fd, int in_fd, int64_t off, int64_t len)
+{
+    int64_t done = 0;
+    int use_sendfile = 0;
+
+    while (done < len) {
+        size_t chunk = len - done > 0x40000000 ? 0x40000000 : len - done;
+        ssize_t n;
+        if (!use_sendfile) {
+#ifdef SYS_copy_file_range
+            int64_t o = off + done;
+            n = syscall(SYS_copy_file_range, in_fd, &o, out_fd, NULL, chunk, 0);
+#else
+            n = -1;
+            errno = ENOSYS;
+#endif
+            if (n < 0 && done == 0
+                && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                    || errno == EOPNOTSUPP || errno == EBADF)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else {
+            off_t o = off + done;
+            n = sendfile(out_fd, in_fd, &o, chunk);
+            if (n < 0 && done == 0 && (errno == ENOSYS || errno == EINVAL))
+                return 1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+#endif
+
+static int cat_is_eof_block(const uint8_t *ebuf)
+{
+    const int es=BGZF_EMPTY_BLOCK_SIZE;
+    return ebuf[0] == GZIPID1 && ebuf[1] == GZIPID2 && le_to_u32(ebuf+es-4) == 0;
+}
+
+int bam_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outbam, int write_index)
 {
     BGZF *fp, *in = NULL;
     uint8_t *buf = NULL;
     uint8_t ebuf[BGZF_EMPTY_BLOCK_SIZE];
     const int es=BGZF_EMPTY_BLOCK_SIZE;
-    int i;
+    int i, out_fd = -1;
+    int64_t out_copied = 0; // bytes written behind the back of fp's hFILE
+    bam_idx_t *idx = NULL;
+    cat_input_t cur, next;
+
+    memset(&cur, 0, sizeof(cur));
+    memset(&next, 0, sizeof(next));
+    cur.fd = next.fd = -1;
+
+    if (write_index) {
+        if (strcmp(outbam, "-") == 0) {
+            print_error("cat", "an output file name is needed to write an index");
+            return -1;
+        }
+        if (cat_check_order(nfn, fn) < 0) return -1;
+        if (!(idx = calloc(1, sizeof(*idx)))) {
+            print_error_errno("cat", "out of memory");
+            return -1;
+        }
+        idx->fmt = -1;
+    }
 
+#ifdef CAT_KERNEL_COPY
+    if (!strstr(outbam, "://")) {
+        // Open it ourselves so that the descriptor is known
+        struct stat st;
+        int fd = strcmp(outbam, "-")? open(outbam, O_WRONLY|O_CREAT|O_TRUNC, 0666) : fileno(stdout);
+        fp = fd >= 0 ? bgzf_fdopen(fd, "w") : NULL;
+        if (fp && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+            out_fd = fd;
+        else if (!fp && fd >= 0 && strcmp(outbam, "-"))
+            close(fd);
+    } else
+#endif
     fp = strcmp(outbam, "-")? bgzf_open(outbam, "w") : bgzf_fdopen(fileno(stdout), "w");
     if (fp == 0) {
         print_error_errno("cat", "fail to open output file '%s'", outbam);
+        bam_idx_destroy(idx);
         return -1;
     }
     if (h) {
@@ -444,23 +967,31 @@ int bam_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outbam)
         fprintf(stderr, "[%s] Couldn't allocate buffer\n", __func__);
         goto fail;
     }
+    if (nfn > 0) cat_start_input(&next, fn[0]);
     for(i = 0; i < nfn; ++i){
         bam_hdr_t *old;
         int len,j;
 
-        in = strcmp(fn[i], "-")? bgzf_open(fn[i], "r") : bgzf_fdopen(fileno(stdin), "r");
+        cat_finish_input(&next);
+        cur = next;
+        memset(&next, 0, sizeof(next));
+        next.fd = -1;
+        in = cur.in;
         if (in == 0) {
+            errno = cur.err;
             print_error_errno("cat", "fail to open file '%s'", fn[i]);
             goto fail;
         }
-        if (in->is_write) return -1;
+        if (in->is_write) goto fail;
 
-        old = bam_hdr_read(in);
+        old = cur.hdr;
         if (old == NULL) {
             fprintf(stderr, "[%s] ERROR: couldn't read header for '%s'.\n",
                     __func__, fn[i]);
             goto fail;
         }
+        if (i + 1 < nfn) cat_start_input(&next, fn[i + 1]);
+
         if (h == 0 && i == 0) {
             if (bam_hdr_write(fp, old) < 0) {
                 print_error_errno("cat", "Couldn't write header");
@@ -468,11 +999,62 @@ int bam_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outbam)
             }
         }
 
-        if (in->block_offset < in->block_length) {
+        if (idx) {
+            // Put the first records in blocks of their own, so that the
+            // offsets of everything from this input are simple to work out
+            cat_rebase_t rb;
+            int64_t len = in->block_length - in->block_offset;
+            memset(&rb, 0, sizeof(rb));
+            if (bgzf_flush(fp) != 0) goto write_fail;
+            rb.first_block = in->block_address;
+            rb.hdr_uoff = in->block_offset;
+            while (len > 0) {
+                int piece = len < BGZF_BLOCK_SIZE ? len : BGZF_BLOCK_SIZE;
+                rb.piece[rb.n_piece++] = htell(fp->fp) + out_copied;
+                if (bgzf_write(fp, (char *)in->uncompressed_block + in->block_length - len, piece) < 0) goto write_fail;
+                if (bgzf_flush(fp) != 0) goto write_fail;
+                len -= piece;
+            }
+            rb.raw_start = htell(in->fp);
+            rb.out_raw_start = htell(fp->fp) + out_copied;
+            if (cat_index_merge(idx, fn[i], &rb) < 0) goto fail;
+        } else if (in->block_offset < in->block_length) {
             if (bgzf_write(fp, (char *)in->uncompressed_block + in->block_offset, in->block_length - in->block_offset) < 0) goto write_fail;
             if (bgzf_flush(fp) != 0) goto write_fail;
         }
 
+#ifdef CAT_KERNEL_COPY
+        if (out_fd >= 0 && cur.fd >= 0) {
+            // Copy everything after the header apart from the EOF block
+            int64_t start = htell(in->fp), end = cur.size, ret;
+            if (end - start < es) {
+                fprintf(stderr, "[%s] ERROR: truncated file?: '%s'.\n", __func__, fn[i]);
+                goto fail;
+            }
+            if (pread(cur.fd, ebuf, es, end - es) != es) {
+                print_error_errno("cat", "failed to read '%s'", fn[i]);
+                goto fail;
+            }
+            if (!cat_is_eof_block(ebuf)) {
+                fprintf(stderr, "[%s] WARNING: Unexpected block structure in file '%s'.", __func__, fn[i]);
+                fprintf(stderr, " Possible output corruption.\n");
+            } else {
+                end -= es;
+            }
+            if (bgzf_flush(fp) != 0 || hflush(fp->fp) != 0) goto write_fail;
+            ret = cat_copy_range(out_fd, cur.fd, start, end - start);
+            if (ret < 0) goto write_fail;
+            if (ret == 0) {
+                out_copied += end - start;
+                cat_close_input(&cur);
+                in = NULL;
+                continue;
+            }
+            // Not possible for these files, so copy them the usual way
+            out_fd = -1;
+        }
+#endif
+
         j=0;
         while ((len = bgzf_raw_read(in, buf, BUF_SIZE)) > 0) {
             if(len<es){
@@ -497,33 +1079,35 @@ int bam_cat(int nfn, char * const *fn, const bam_hdr_t *h, const char* outbam)
         }
 
         /* check final gzip block */
-        {
-            const uint8_t gzip1=ebuf[0];
-            const uint8_t gzip2=ebuf[1];
-            const uint32_t isize=*((uint32_t*)(ebuf+es-4));
-            if(((gzip1!=GZIPID1) || (gzip2!=GZIPID2)) || (isize!=0)) {
-                fprintf(stderr, "[%s] WARNING: Unexpected block structure in file '%s'.", __func__, fn[i]);
-                fprintf(stderr, " Possible output corruption.\n");
-                if (bgzf_raw_write(fp, ebuf, es) < 0) goto write_fail;
-            }
+        if (!cat_is_eof_block(ebuf)) {
+            fprintf(stderr, "[%s] WARNING: Unexpected block structure in file '%s'.", __func__, fn[i]);
+            fprintf(stderr, " Possible output corruption.\n");
+            if (bgzf_raw_write(fp, ebuf, es) < 0) goto write_fail;
         }
-        bam_hdr_destroy(old);
-        bgzf_close(in);
+        cat_close_input(&cur);
         in = NULL;
     }
     free(buf);
     if (bgzf_close(fp) < 0) {
         fprintf(stderr, "[%s] Error on closing '%s'.\n", __func__, outbam);
+        bam_idx_destroy(idx);
         return -1;
     }
+    if (idx) {
+        int ret = cat_index_save(idx, outbam);
+        bam_idx_destroy(idx);
+        return ret;
+    }
     return 0;
 
  write_fail:
     fprintf(stderr, "[%s] Error writing to '%s'.\n", __func__, outbam);
  fail:
-    if (in) bgzf_close(in);
+    cat_close_input(&cur);
+    cat_close_input(&next);
     if (fp) bgzf_close(fp);
     free(buf);
+    bam_idx_destroy(idx);
     return -1;
 }
 
@@ -534,10 +1118,15 @@ int main_cat(int argc, char *argv[])
     char *outfn = 0;
     char **infns = NULL; // files to concatenate
     int infns_size = 0;
-    int c, ret = 0;
+    int c, ret = 0, write_index = 0;
     samFile *in;
 
-    while ((c = getopt(argc, argv, "h:o:b:")) >= 0) {
+    static const struct option lopts[] = {
+        {"write-index", no_argument, NULL, 1},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "h:o:b:", lopts, NULL)) >= 0) {
         switch (c) {
             case 'h': {
                 samFile *fph = sam_open(optarg, "r");
@@ -556,6 +1145,7 @@ int main_cat(int argc, char *argv[])
                 break;
             }
             case 'o': outfn = strdup(optarg); break;
+            case 1: write_index = 1; break;
             case 'b': {
                 // add file names in "optarg" to the list
                 // of files to concatenate
@@ -592,6 +1182,9 @@ int main_cat(int argc, char *argv[])
         fprintf(stderr, "Options: -b FILE  list of input BAM/CRAM file names, one per line\n");
         fprintf(stderr, "         -h FILE  copy the header from FILE [default is 1st input file]\n");
         fprintf(stderr, "         -o FILE  output BAM/CRAM\n");
+        fprintf(stderr, "         --write-index\n");
+        fprintf(stderr, "                  combine the inputs' BAI/CSI indexes into one for the\n");
+        fprintf(stderr, "                  output, which must be a BAM file given with -o\n");
         return 1;
     }
 
@@ -604,12 +1197,17 @@ int main_cat(int argc, char *argv[])
     switch (hts_get_format(in)->format) {
     case bam:
         sam_close(in);
-        if (bam_cat(infns_size+nargv_fns, infns, h, outfn? outfn : "-") < 0)
+        if (bam_cat(infns_size+nargv_fns, infns, h, outfn? outfn : "-", write_index) < 0)
             ret = 1;
         break;
 
     case cram:
         sam_close(in);
+        if (write_index) {
+            print_error("cat", "--write-index is only supported for BAM files");
+            ret = 1;
+            break;
+        }
         if (cram_cat(infns_size+nargv_fns, infns, h, outfn? outfn : "-") < 0)
             ret = 1;
         break;
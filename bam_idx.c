@@ -0,0 +1,136 @@
+/*  bam_idx.c -- in-memory BAI and CSI indexes.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "htslib/hts.h"
+#include "htslib/bgzf.h"
+#include "htslib/hts_endian.h"
+#include "bam_idx.h"
+
+void bam_idx_destroy(bam_idx_t *idx)
+{
+    int i;
+    khint_t k;
+    if (!idx) return;
+    for (i = 0; i < idx->n_ref; i++) {
+        khash_t(bam_idx_bin) *bins = idx->ref[i].bins;
+        if (bins) {
+            for (k = kh_begin(bins); k != kh_end(bins); k++)
+                if (kh_exist(bins, k)) free(kh_val(bins, k).list);
+            kh_destroy(bam_idx_bin, bins);
+        }
+        free(idx->ref[i].lin);
+    }
+    free(idx->ref);
+    free(idx->meta);
+    free(idx);
+}
+
+int bam_idx_add_chunk(bam_idx_bin_t *b, uint64_t u, uint64_t v)
+{
+    if (b->n == b->m) {
+        int m = b->m ? b->m * 2 : 4;
+        bam_idx_chunk_t *list = realloc(b->list, m * sizeof(*list));
+        if (!list) return -1;
+        b->list = list;
+        b->m = m;
+    }
+    b->list[b->n].u = u;
+    b->list[b->n].v = v;
+    b->n++;
+    return 0;
+}
+
+static int idx_write(BGZF *fp, const void *buf, size_t len)
+{
+    return bgzf_write(fp, buf, len) == (ssize_t) len ? 0 : -1;
+}
+
+int bam_idx_save(const bam_idx_t *idx, const char *fn)
+{
+    uint8_t buf[16];
+    BGZF *fp;
+    int i, j, save_errno;
+    khint_t k;
+
+    // BAI files are not compressed
+    fp = bgzf_open(fn, idx->fmt == HTS_FMT_CSI ? "w" : "wu");
+    if (!fp) return -1;
+
+    if (idx_write(fp, idx->fmt == HTS_FMT_CSI ? "CSI\1" : "BAI\1", 4) < 0) goto fail;
+    if (idx->fmt == HTS_FMT_CSI) {
+        i32_to_le(idx->min_shift, buf);
+        i32_to_le(idx->n_lvls, buf + 4);
+        u32_to_le(idx->l_meta, buf + 8);
+        if (idx_write(fp, buf, 12) < 0) goto fail;
+        if (idx->l_meta && idx_write(fp, idx->meta, idx->l_meta) < 0) goto fail;
+    }
+    i32_to_le(idx->n_ref, buf);
+    if (idx_write(fp, buf, 4) < 0) goto fail;
+
+    for (i = 0; i < idx->n_ref; i++) {
+        const bam_idx_ref_t *r = &idx->ref[i];
+        i32_to_le(r->bins ? kh_size(r->bins) : 0, buf);
+        if (idx_write(fp, buf, 4) < 0) goto fail;
+        for (k = r->bins ? kh_begin(r->bins) : 0; r->bins && k != kh_end(r->bins); k++) {
+            if (!kh_exist(r->bins, k)) continue;
+            const bam_idx_bin_t *b = &kh_val(r->bins, k);
+            u32_to_le(kh_key(r->bins, k), buf);
+            if (idx_write(fp, buf, 4) < 0) goto fail;
+            if (idx->fmt == HTS_FMT_CSI) {
+                u64_to_le(b->loff, buf);
+                if (idx_write(fp, buf, 8) < 0) goto fail;
+            }
+            i32_to_le(b->n, buf);
+            if (idx_write(fp, buf, 4) < 0) goto fail;
+            for (j = 0; j < b->n; j++) {
+                u64_to_le(b->list[j].u, buf);
+                u64_to_le(b->list[j].v, buf + 8);
+                if (idx_write(fp, buf, 16) < 0) goto fail;
+            }
+        }
+        if (idx->fmt == HTS_FMT_BAI) {
+            i32_to_le(r->n_lin, buf);
+            if (idx_write(fp, buf, 4) < 0) goto fail;
+            for (j = 0; j < r->n_lin; j++) {
+                u64_to_le(r->lin[j], buf);
+                if (idx_write(fp, buf, 8) < 0) goto fail;
+            }
+        }
+    }
+    if (idx->has_no_coor) {
+        u64_to_le(idx->n_no_coor, buf);
+        if (idx_write(fp, buf, 8) < 0) goto fail;
+    }
+
+    return bgzf_close(fp);
+
+ fail:
+    save_errno = errno;
+    bgzf_close(fp);
+    errno = save_errno;
+    return -1;
+}
@@ -0,0 +1,79 @@
+/*  bam_idx.h -- in-memory BAI and CSI indexes.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef BAM_IDX_H
+#define BAM_IDX_H
+
+#include <stdint.h>
+#include "htslib/khash.h"
+
+/*
+ * htslib does not let an index be built up other than by pushing records
+ * to it in file order, so the commands that assemble indexes from pieces
+ * (cat --write-index and the multi-threaded index) use this structure,
+ * which mirrors the on-disk layout, and write it out themselves.
+ */
+
+typedef struct {
+    uint64_t u, v;
+} bam_idx_chunk_t;
+
+typedef struct {
+    uint64_t loff;              // CSI only
+    int n, m;
+    bam_idx_chunk_t *list;
+} bam_idx_bin_t;
+
+KHASH_MAP_INIT_INT(bam_idx_bin, bam_idx_bin_t)
+
+typedef struct {
+    khash_t(bam_idx_bin) *bins;
+    int n_lin, m_lin;
+    uint64_t *lin;              // BAI linear index
+} bam_idx_ref_t;
+
+typedef struct {
+    int fmt, min_shift, n_lvls; // fmt is HTS_FMT_BAI or HTS_FMT_CSI
+    uint32_t l_meta;
+    uint8_t *meta;
+    int n_ref;
+    bam_idx_ref_t *ref;
+    int has_no_coor;
+    uint64_t n_no_coor;
+} bam_idx_t;
+
+// The pseudo-bin holding the span of a reference's reads and their counts
+#define bam_idx_meta_bin(n_lvls) (((1 << 3 * ((n_lvls) + 1)) - 1) / 7 + 1)
+
+void bam_idx_destroy(bam_idx_t *idx);
+
+// Appends the chunk [u, v) to a bin.  Returns 0 on success, -1 on failure.
+int bam_idx_add_chunk(bam_idx_bin_t *b, uint64_t u, uint64_t v);
+
+/*
+ * Writes idx to fn, as an uncompressed BAI or a BGZF compressed CSI file in
+ * the same way as htslib.  Bins are written in hash order.
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int bam_idx_save(const bam_idx_t *idx, const char *fn);
+
+#endif
@@ -29,15 +29,22 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/hts.h>
 #include <htslib/sam.h>
 #include <htslib/khash.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "samtools.h"
 #include "sam_opts.h"
+#include "bam_idx.h"
+#include "bam_part.h"
 
 #define BAM_LIDX_SHIFT    14
 
@@ -52,6 +59,595 @@ static void index_usage(FILE *fp)
 "  -@ INT   Sets the number of threads [none]\n", BAM_LIDX_SHIFT);
 }
 
+/*
+ * Multi-threaded index building for BGZF compressed BAM files.
+ *
+ * The file is cut into partitions at BGZF block boundaries, and each thread
+ * indexes the records that start in its partition, following the last one
+ * into the next partition if needed.  Threads other than the first don't
+ * know where their first record starts, so they look for an offset in their
+ * first block from which several plausible records follow on from each
+ * other.  Once all are done, each guess is checked against where the
+ * previous partition's last record ended, and any partition that guessed
+ * wrong is indexed again from the right place.
+ *
+ * The partial indexes are then merged, inserting bins in the order htslib
+ * would have seen them and applying the same linear index filling and bin
+ * compression as hts_idx_finish(), so the result is identical to the index
+ * made by sam_index_build3().
+ */
+
+#define INDEX_MIN_MARKER_DIST 0x10000
+
+// The records for one reference within one partition
+typedef struct {
+    int tid;
+    int first_beg, last_beg;        // for checking the sort order
+    uint64_t off_beg, off_end;      // first record and end of the last
+    uint64_t n_mapped, n_unmapped;
+    khash_t(bam_idx_bin) *bins;
+    int n_order, m_order;
+    uint32_t *order;                // bins in the order first seen
+    int n_lin, m_lin;
+    uint64_t *lin;                  // (uint64_t) -1 where not set
+} ipart_ref_t;
+
+typedef struct {
+    const char *fn;
+    const bam_hdr_t *h;
+    int min_shift, n_lvls;
+    int64_t beg_block, end_block;   // end_block is -1 for the last partition
+    int start_known;
+    uint64_t start;
+    // Results
+    int ret;                        // 0 if done, -1 on error, 1 if no start found
+    kstring_t msg;
+    uint64_t first, end;
+    int n_ref, m_ref;
+    ipart_ref_t *ref;
+} ipart_t;
+
+static void ipart_clear(ipart_t *p)
+{
+    int i;
+    khint_t k;
+    for (i = 0; i < p->n_ref; i++) {
+        ipart_ref_t *r = &p->ref[i];
+        if (r->bins) {
+            for (k = kh_begin(r->bins); k != kh_end(r->bins); k++)
+                if (kh_exist(r->bins, k)) free(kh_val(r->bins, k).list);
+            kh_destroy(bam_idx_bin, r->bins);
+        }
+        free(r->order);
+        free(r->lin);
+    }
+    free(p->ref);
+    p->ref = NULL;
+    p->n_ref = p->m_ref = 0;
+    p->msg.l = 0;
+}
+
+static ipart_ref_t *ipart_add_ref(ipart_t *p, int tid, int beg, uint64_t off)
+{
+    ipart_ref_t *r;
+    if (p->n_ref == p->m_ref) {
+        int m = p->m_ref ? p->m_ref * 2 : 4;
+        ipart_ref_t *ref = realloc(p->ref, m * sizeof(*ref));
+        if (!ref) return NULL;
+        p->ref = ref;
+        p->m_ref = m;
+    }
+    r = &p->ref[p->n_ref];
+    memset(r, 0, sizeof(*r));
+    if (tid >= 0 && !(r->bins = kh_init(bam_idx_bin))) return NULL;
+    r->tid = tid;
+    r->first_beg = r->last_beg = beg;
+    r->off_beg = off;
+    p->n_ref++;
+    return r;
+}
+
+// Notes that a run of records in bin has started, keeping first-seen order
+static int ipart_add_bin(ipart_ref_t *r, uint32_t bin)
+{
+    int absent;
+    khint_t k = kh_put(bam_idx_bin, r->bins, bin, &absent);
+    if (absent < 0) return -1;
+    if (!absent) return 0;
+    memset(&kh_val(r->bins, k), 0, sizeof(bam_idx_bin_t));
+    if (r->n_order == r->m_order) {
+        int m = r->m_order ? r->m_order * 2 : 16;
+        uint32_t *order = realloc(r->order, m * sizeof(*order));
+        if (!order) return -1;
+        r->order = order;
+        r->m_order = m;
+    }
+    r->order[r->n_order++] = bin;
+    return 0;
+}
+
+static int ipart_end_run(ipart_ref_t *r, uint32_t bin, uint64_t u, uint64_t v)
+{
+    khint_t k = kh_get(bam_idx_bin, r->bins, bin);
+    return bam_idx_add_chunk(&kh_val(r->bins, k), u, v);
+}
+
+// As insert_to_l() in htslib
+static int ipart_add_lin(ipart_ref_t *r, int beg, int end, uint64_t off, int min_shift)
+{
+    int i, b = beg >> min_shift, e = (end - 1) >> min_shift;
+    if (b < 0) b = 0;
+    if (r->m_lin < e + 1) {
+        int m = r->m_lin * 2 > e + 1 ? r->m_lin * 2 : e + 1;
+        uint64_t *lin = realloc(r->lin, m * sizeof(*lin));
+        if (!lin) return -1;
+        memset(lin + r->m_lin, 0xff, (m - r->m_lin) * sizeof(*lin));
+        r->lin = lin;
+        r->m_lin = m;
+    }
+    for (i = b; i <= e; i++)
+        if (r->lin[i] == (uint64_t) -1) r->lin[i] = off;
+    if (r->n_lin < e + 1) r->n_lin = e + 1;
+    return 0;
+}
+
+// Indexes one partition, in the same way as hts_idx_push()
+static int ipart_run(ipart_t *p)
+{
+    BGZF *fp = NULL;
+    bam1_t *b = NULL;
+    ipart_ref_t *cur = NULL;
+    int64_t maxpos = (int64_t) 1 << (p->min_shift + p->n_lvls * 3);
+    uint64_t last_off, save_off = 0;
+    int save_bin = -1, r, i;
+
+    p->ret = -1;
+    if (!(fp = bgzf_open(p->fn, "r")) || !(b = bam_init1())) {
+        ksprintf(&p->msg, "failed to open \"%s\"", p->fn);
+        goto done;
+    }
+    if (!p->start_known) {
+        r = bam_part_find_start(fp, p->h, p->beg_block, &p->start);
+        if (r != 0) {
+            p->ret = 1;
+            goto done;
+        }
+    }
+    if (bgzf_seek(fp, p->start, SEEK_SET) < 0) {
+        ksprintf(&p->msg, "failed to seek in \"%s\"", p->fn);
+        goto done;
+    }
+    p->first = last_off = p->start;
+
+    for (;;) {
+        int tid, beg, end, bin;
+        if (p->end_block >= 0 && (int64_t) (last_off >> 16) >= p->end_block)
+            break;
+        if ((r = bam_read1(fp, b)) < 0) {
+            if (r < -1) {
+                ksprintf(&p->msg, "\"%s\" is truncated or corrupt", p->fn);
+                goto done;
+            }
+            last_off = bgzf_tell(fp);
+            break;
+        }
+        tid = b->core.tid;
+        if (tid < 0) {
+            beg = -1, end = 0;
+        } else {
+            beg = b->core.pos, end = bam_endpos(b);
+            if (beg > maxpos || end > maxpos) {
+                ksprintf(&p->msg, "region %d..%d cannot be stored in a %s index; "
+                         "try using a CSI index", beg, end,
+                         p->min_shift == 14 && p->n_lvls == 5 ? "BAI" : "CSI");
+                goto done;
+            }
+        }
+
+        if (!cur || cur->tid != tid) {
+            if (cur) {
+                if (cur->tid >= 0 && ipart_end_run(cur, save_bin, save_off, last_off) < 0)
+                    goto mem_fail;
+                cur->off_end = last_off;
+                if (cur->tid < 0) {
+                    ksprintf(&p->msg, "unplaced reads are not all at the end of the file");
+                    goto done;
+                }
+            }
+            for (i = 0; i < p->n_ref; i++) {
+                if (p->ref[i].tid == tid) {
+                    ksprintf(&p->msg, "the reads for each reference are not together");
+                    goto done;
+                }
+            }
+            if (!(cur = ipart_add_ref(p, tid, beg, last_off))) goto mem_fail;
+            save_bin = -1;
+        } else if (tid >= 0 && cur->last_beg > beg) {
+            ksprintf(&p->msg, "unsorted positions on sequence #%d: %d followed by %d",
+                     tid + 1, cur->last_beg + 1, beg + 1);
+            goto done;
+        }
+
+        if (tid >= 0) {
+            if (!(b->core.flag & BAM_FUNMAP)
+                && ipart_add_lin(cur, beg, end, last_off, p->min_shift) < 0)
+                goto mem_fail;
+            bin = hts_reg2bin(beg, end, p->min_shift, p->n_lvls);
+            if (bin != save_bin) {
+                if (save_bin >= 0 && ipart_end_run(cur, save_bin, save_off, last_off) < 0)
+                    goto mem_fail;
+                if (ipart_add_bin(cur, bin) < 0) goto mem_fail;
+                save_off = last_off;
+                save_bin = bin;
+            }
+        }
+        if (b->core.flag & BAM_FUNMAP) cur->n_unmapped++;
+        else cur->n_mapped++;
+        cur->last_beg = beg;
+        last_off = bgzf_tell(fp);
+    }
+
+    if (cur) {
+        if (cur->tid >= 0 && ipart_end_run(cur, save_bin, save_off, last_off) < 0)
+            goto mem_fail;
+        cur->off_end = last_off;
+    }
+    p->end = last_off;
+    p->ret = 0;
+    goto done;
+
+ mem_fail:
+    ksprintf(&p->msg, "out of memory");
+ done:
+    if (b) bam_destroy1(b);
+    if (fp) bgzf_close(fp);
+    return p->ret;
+}
+
+static void *ipart_thread(void *arg)
+{
+    ipart_run((ipart_t *) arg);
+    return NULL;
+}
+
+static int index_bin_level(uint32_t bin)
+{
+    int l;
+    for (l = 0; bin; l++) bin = (bin - 1) >> 3;
+    return l;
+}
+
+#define index_bin_first(l) (((1 << (3 * (l))) - 1) / 7)
+
+static int index_chunk_cmp(const void *a, const void *b)
+{
+    uint64_t u1 = ((const bam_idx_chunk_t *) a)->u, u2 = ((const bam_idx_chunk_t *) b)->u;
+    return u1 < u2 ? -1 : u1 > u2;
+}
+
+// As update_loff() and compress_binning() in htslib
+static int index_finish_ref(bam_idx_t *idx, bam_idx_ref_t *r)
+{
+    khash_t(bam_idx_bin) *bins = r->bins;
+    uint32_t n_bins = ((1 << (3 * idx->n_lvls + 3)) - 1) / 7;
+    uint64_t offset0 = 0;
+    khint_t k;
+    int l, i, m;
+
+    if (bins) {
+        k = kh_get(bam_idx_bin, bins, bam_idx_meta_bin(idx->n_lvls));
+        if (k != kh_end(bins)) offset0 = kh_val(bins, k).list[0].u;
+        for (l = 0; l < r->n_lin && r->lin[l] == (uint64_t) -1; l++)
+            r->lin[l] = offset0;
+    } else {
+        l = 1;
+    }
+    for (; l < r->n_lin; l++)
+        if (r->lin[l] == (uint64_t) -1) r->lin[l] = r->lin[l-1];
+    if (!bins) return 0;
+
+    for (k = kh_begin(bins); k != kh_end(bins); k++) {
+        if (!kh_exist(bins, k)) continue;
+        uint32_t bin = kh_key(bins, k);
+        if (bin < n_bins) {
+            int bl = index_bin_level(bin);
+            int bot = (bin - index_bin_first(bl)) << (idx->n_lvls - bl) * 3;
+            kh_val(bins, k).loff = bot < r->n_lin ? r->lin[bot] : 0;
+        } else {
+            kh_val(bins, k).loff = 0;
+        }
+    }
+    if (idx->fmt == HTS_FMT_CSI) {
+        free(r->lin);
+        r->lin = NULL;
+        r->n_lin = r->m_lin = 0;
+    }
+
+    // Merge bins with little data into their parents
+    for (l = idx->n_lvls; l > 0; l--) {
+        uint32_t start = index_bin_first(l);
+        for (k = kh_begin(bins); k != kh_end(bins); k++) {
+            if (!kh_exist(bins, k) || kh_key(bins, k) >= n_bins || kh_key(bins, k) < start)
+                continue;
+            bam_idx_bin_t *p = &kh_val(bins, k), *q;
+            if (l < idx->n_lvls && p->n > 1)
+                qsort(p->list, p->n, sizeof(*p->list), index_chunk_cmp);
+            if ((p->list[p->n-1].v >> 16) - (p->list[0].u >> 16) < INDEX_MIN_MARKER_DIST) {
+                khint_t kp = kh_get(bam_idx_bin, bins, (kh_key(bins, k) - 1) >> 3);
+                if (kp == kh_end(bins)) continue;
+                q = &kh_val(bins, kp);
+                for (i = 0; i < p->n; i++)
+                    if (bam_idx_add_chunk(q, p->list[i].u, p->list[i].v) < 0) return -1;
+                free(p->list);
+                kh_del(bam_idx_bin, bins, k);
+            }
+        }
+    }
+    k = kh_get(bam_idx_bin, bins, 0);
+    if (k != kh_end(bins))
+        qsort(kh_val(bins, k).list, kh_val(bins, k).n, sizeof(bam_idx_chunk_t), index_chunk_cmp);
+
+    // Merge adjacent chunks that start in the same BGZF block
+    for (k = kh_begin(bins); k != kh_end(bins); k++) {
+        if (!kh_exist(bins, k) || kh_key(bins, k) >= n_bins) continue;
+        bam_idx_bin_t *p = &kh_val(bins, k);
+        for (i = 1, m = 0; i < p->n; i++) {
+            if (p->list[m].v >> 16 >= p->list[i].u >> 16) {
+                if (p->list[m].v < p->list[i].v) p->list[m].v = p->list[i].v;
+            } else {
+                p->list[++m] = p->list[i];
+            }
+        }
+        p->n = m + 1;
+    }
+    return 0;
+}
+
+static int index_add_meta(bam_idx_t *idx, int tid, uint64_t beg, uint64_t end,
+                          uint64_t n_mapped, uint64_t n_unmapped)
+{
+    int absent;
+    khint_t k = kh_put(bam_idx_bin, idx->ref[tid].bins,
+                       bam_idx_meta_bin(idx->n_lvls), &absent);
+    if (absent < 0) return -1;
+    if (absent) memset(&kh_val(idx->ref[tid].bins, k), 0, sizeof(bam_idx_bin_t));
+    bam_idx_bin_t *b = &kh_val(idx->ref[tid].bins, k);
+    if (bam_idx_add_chunk(b, beg, end) < 0 || bam_idx_add_chunk(b, n_mapped, n_unmapped) < 0)
+        return -1;
+    return 0;
+}
+
+// Adds one partition's records for a reference to the index
+static int index_merge_ref(bam_idx_t *idx, const ipart_ref_t *s)
+{
+    bam_idx_ref_t *r;
+    int i, j, absent;
+
+    if (s->tid >= idx->n_ref) {
+        bam_idx_ref_t *ref = realloc(idx->ref, (s->tid + 1) * sizeof(*ref));
+        if (!ref) return -1;
+        memset(ref + idx->n_ref, 0, (s->tid + 1 - idx->n_ref) * sizeof(*ref));
+        idx->ref = ref;
+        idx->n_ref = s->tid + 1;
+    }
+    r = &idx->ref[s->tid];
+    if (!r->bins && !(r->bins = kh_init(bam_idx_bin))) return -1;
+
+    for (i = 0; i < s->n_order; i++) {
+        khint_t ks = kh_get(bam_idx_bin, s->bins, s->order[i]);
+        const bam_idx_bin_t *sb = &kh_val(s->bins, ks);
+        khint_t k = kh_put(bam_idx_bin, r->bins, s->order[i], &absent);
+        if (absent < 0) return -1;
+        if (absent) memset(&kh_val(r->bins, k), 0, sizeof(bam_idx_bin_t));
+        for (j = 0; j < sb->n; j++)
+            if (bam_idx_add_chunk(&kh_val(r->bins, k), sb->list[j].u, sb->list[j].v) < 0)
+                return -1;
+    }
+
+    if (s->n_lin > r->m_lin) {
+        uint64_t *lin = realloc(r->lin, s->n_lin * sizeof(*lin));
+        if (!lin) return -1;
+        r->lin = lin;
+        r->m_lin = s->n_lin;
+    }
+    if (s->n_lin > r->n_lin) {
+        memset(r->lin + r->n_lin, 0xff, (s->n_lin - r->n_lin) * sizeof(*r->lin));
+        r->n_lin = s->n_lin;
+    }
+    for (i = 0; i < s->n_lin; i++)
+        if (r->lin[i] == (uint64_t) -1) r->lin[i] = s->lin[i];
+    return 0;
+}
+
+// Merges the partial indexes, which must follow on from each other
+static bam_idx_t *index_merge(ipart_t *parts, int n_parts, const bam_hdr_t *h,
+                              int fmt, int min_shift, int n_lvls)
+{
+    bam_idx_t *idx = calloc(1, sizeof(*idx));
+    uint64_t m_beg = 0, m_end = 0, n_mapped = 0, n_unmapped = 0;
+    int cur_tid = -2, last_beg = 0, no_coor = 0, i, j;
+
+    if (!idx || !(idx->ref = calloc(h->n_targets ? h->n_targets : 1, sizeof(*idx->ref))))
+        goto mem_fail;
+    idx->fmt = fmt;
+    idx->min_shift = min_shift;
+    idx->n_lvls = n_lvls;
+    idx->n_ref = h->n_targets;
+    idx->has_no_coor = 1;
+
+    for (i = 0; i < n_parts; i++) {
+        for (j = 0; j < parts[i].n_ref; j++) {
+            const ipart_ref_t *s = &parts[i].ref[j];
+            if (s->tid != cur_tid) {
+                if (cur_tid >= 0
+                    && index_add_meta(idx, cur_tid, m_beg, m_end, n_mapped, n_unmapped) < 0)
+                    goto mem_fail;
+                if (s->tid >= 0) {
+                    if (no_coor) {
+                        print_error("index", "unplaced reads are not all at the end of the file");
+                        goto fail;
+                    }
+                    if (s->tid < idx->n_ref && idx->ref[s->tid].bins) {
+                        print_error("index", "the reads for each reference are not together");
+                        goto fail;
+                    }
+                } else {
+                    no_coor = 1;
+                }
+                cur_tid = s->tid;
+                m_beg = s->off_beg;
+                n_mapped = n_unmapped = 0;
+            } else if (s->tid >= 0 && last_beg > s->first_beg) {
+                print_error("index", "unsorted positions on sequence #%d: %d followed by %d",
+                            s->tid + 1, last_beg + 1, s->first_beg + 1);
+                goto fail;
+            }
+            m_end = s->off_end;
+            n_mapped += s->n_mapped;
+            n_unmapped += s->n_unmapped;
+            last_beg = s->last_beg;
+            if (s->tid < 0)
+                idx->n_no_coor += s->n_mapped + s->n_unmapped;
+            else if (index_merge_ref(idx, s) < 0)
+                goto mem_fail;
+        }
+    }
+    if (cur_tid >= 0 && index_add_meta(idx, cur_tid, m_beg, m_end, n_mapped, n_unmapped) < 0)
+        goto mem_fail;
+
+    for (i = 0; i < idx->n_ref; i++)
+        if (index_finish_ref(idx, &idx->ref[i]) < 0) goto mem_fail;
+    return idx;
+
+ mem_fail:
+    print_error_errno("index", "out of memory");
+ fail:
+    bam_idx_destroy(idx);
+    return NULL;
+}
+
+/*
+ * Builds the index of a BAM file using n_threads threads.  Returns the same
+ * values as sam_index_build3(), or 1 if the file is not suitable (not a
+ * seekable, BGZF compressed BAM file, or too small to be worth splitting)
+ * and sam_index_build3() should be used instead.
+ */
+static int bam_index_parallel(const char *fn, const char *fnidx, int min_shift, int n_threads)
+{
+    struct stat st;
+    samFile *fp;
+    bam_hdr_t *h = NULL;
+    ipart_t *parts = NULL;
+    pthread_t *tids = NULL;
+    bam_idx_t *idx = NULL;
+    int64_t *starts = NULL;
+    int fmt, n_lvls, n_parts, n_started = 0, i, ret = -1;
+    uint64_t offset0;
+
+    if (n_threads < 2 || stat(fn, &st) < 0 || !S_ISREG(st.st_mode)) return 1;
+    if (!(fp = sam_open(fn, "r"))) return -2;
+    if (hts_get_format(fp)->format != bam || hts_get_format(fp)->compression != bgzf) {
+        sam_close(fp);
+        return 1;
+    }
+    if (!(h = sam_hdr_read(fp))) {
+        sam_close(fp);
+        return -1;
+    }
+    offset0 = bgzf_tell(fp->fp.bgzf);
+    sam_close(fp);
+
+    n_parts = (st.st_size - (int64_t) (offset0 >> 16)) / BAM_PART_MIN_SIZE;
+    if (n_parts > n_threads) n_parts = n_threads;
+    if (n_parts < 2) {
+        bam_hdr_destroy(h);
+        return 1;
+    }
+
+    if (min_shift > 0) {
+        int64_t max_len = 0, s;
+        for (i = 0; i < h->n_targets; i++)
+            if (max_len < h->target_len[i]) max_len = h->target_len[i];
+        max_len += 256;
+        for (n_lvls = 0, s = 1 << min_shift; max_len > s; ++n_lvls, s <<= 3)
+            ;
+        fmt = HTS_FMT_CSI;
+    } else {
+        min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
+    }
+
+    // Cut the file at block boundaries
+    if (!(starts = malloc((n_parts + 1) * sizeof(*starts)))) goto out;
+    if ((n_parts = bam_part_split(fn, st.st_size, offset0 >> 16, n_parts, starts)) < 0) {
+        ret = -2;
+        goto out;
+    }
+    starts[n_parts] = -1;
+
+    if (!(parts = calloc(n_parts, sizeof(*parts)))
+        || !(tids = calloc(n_parts, sizeof(*tids))))
+        goto out;
+    for (i = 0; i < n_parts; i++) {
+        parts[i].fn = fn;
+        parts[i].h = h;
+        parts[i].min_shift = min_shift;
+        parts[i].n_lvls = n_lvls;
+        parts[i].beg_block = starts[i];
+        parts[i].end_block = starts[i+1];
+        parts[i].start_known = (i == 0);
+        parts[i].start = offset0;
+    }
+    for (n_started = 0; n_started < n_parts; n_started++) {
+        if (pthread_create(&tids[n_started], NULL, ipart_thread, &parts[n_started]) != 0) {
+            print_error_errno("index", "failed to start thread");
+            goto out;
+        }
+    }
+    for (i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+    n_started = 0;
+
+    // Redo any partition that didn't start where the one before it ended
+    for (i = 0; i < n_parts; i++) {
+        if (i > 0 && (parts[i].ret != 0 || parts[i].first != parts[i-1].end)) {
+            ipart_clear(&parts[i]);
+            parts[i].start_known = 1;
+            parts[i].start = parts[i-1].end;
+            ipart_run(&parts[i]);
+        }
+        if (parts[i].ret != 0) {
+            print_error("index", "%s", parts[i].msg.s ? parts[i].msg.s : "failed to read the file");
+            goto out;
+        }
+    }
+
+    if (!(idx = index_merge(parts, n_parts, h, fmt, min_shift, n_lvls)))
+        goto out;
+
+    if (fnidx) {
+        ret = bam_idx_save(idx, fnidx) < 0 ? -4 : 0;
+    } else {
+        kstring_t s = { 0, 0, NULL };
+        ksprintf(&s, "%s.%s", fn, fmt == HTS_FMT_CSI ? "csi" : "bai");
+        ret = bam_idx_save(idx, s.s) < 0 ? -4 : 0;
+        free(s.s);
+    }
+
+ out:
+    for (i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+    for (i = 0; parts && i < n_parts; i++) {
+        ipart_clear(&parts[i]);
+        free(parts[i].msg.s);
+    }
+    free(parts);
+    free(tids);
+    free(starts);
+    bam_idx_destroy(idx);
+    bam_hdr_destroy(h);
+    return ret;
+}
+
 int bam_index(int argc, char *argv[])
 {
     int csi = 0;
@@ -75,7 +671,9 @@ int bam_index(int argc, char *argv[])
         return 1;
     }
 
-    ret = sam_index_build3(argv[optind], argv[optind+1], csi? min_shift : 0, n_threads);
+    ret = bam_index_parallel(argv[optind], argv[optind+1], csi? min_shift : 0, n_threads);
+    if (ret == 1)
+        ret = sam_index_build3(argv[optind], argv[optind+1], csi? min_shift : 0, n_threads);
     switch (ret) {
     case 0:
         return 0;
@@ -103,6 +701,19 @@ int bam_index(int argc, char *argv[])
     return EXIT_FAILURE;
 }
 
+static void print_counts(const bam_hdr_t *header, const sam_count_t *counts)
+{
+    int i;
+    for (i = 0; i < header->n_targets; i++) {
+        printf("%s\t%d\t%"PRIu64"\t%"PRIu64"\n",
+               header->target_name[i],
+               header->target_len[i],
+               counts[i].mapped, counts[i].unmapped);
+    }
+    printf("*\t0\t%"PRIu64"\t%"PRIu64"\n",
+           counts[header->n_targets].mapped, counts[header->n_targets].unmapped);
+}
+
 /*
  * Cram indices do not contain mapped/unmapped record counts, so we have to
  * decode each record and count.  However we can speed this up as much as
@@ -121,43 +732,37 @@ int slow_idxstats(samFile *fp, bam_hdr_t *header) {
     if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, SAM_RNAME | SAM_FLAG))
         return -1;
 
-    uint64_t (*count0)[2] = calloc(header->n_targets+1, sizeof(*count0));
-    uint64_t (*counts)[2] = count0+1;
-    if (!count0)
+    // Reads with no reference are counted last
+    sam_count_t *counts = calloc(header->n_targets+1, sizeof(*counts));
+    if (!counts)
         return -1;
 
     while ((ret = sam_read1(fp, header, b)) >= 0) {
         if (b->core.tid >= header->n_targets || b->core.tid < -1) {
-            free(count0);
+            free(counts);
             return -1;
         }
 
+        sam_count_t *c = &counts[b->core.tid >= 0 ? b->core.tid : header->n_targets];
         if (b->core.tid != last_tid) {
             if (last_tid >= -1) {
-                if (counts[b->core.tid][0] + counts[b->core.tid][1]) {
+                if (c->mapped + c->unmapped) {
                     print_error("idxstats", "file is not position sorted");
-                    free(count0);
+                    free(counts);
                     return -1;
                 }
             }
             last_tid = b->core.tid;
         }
 
-        counts[b->core.tid][(b->core.flag & BAM_FUNMAP) ? 1 : 0]++;
+        if (b->core.flag & BAM_FUNMAP) c->unmapped++;
+        else c->mapped++;
     }
 
-    if (ret == -1) {
-        int i;
-        for (i = 0; i < header->n_targets; i++) {
-            printf("%s\t%d\t%"PRIu64"\t%"PRIu64"\n",
-                   header->target_name[i],
-                   header->target_len[i],
-                   counts[i][0], counts[i][1]);
-        }
-        printf("*\t0\t%"PRIu64"\t%"PRIu64"\n", counts[-1][0], counts[-1][1]);
-    }
+    if (ret == -1)
+        print_counts(header, counts);
 
-    free(count0);
+    free(counts);
 
     bam_destroy1(b);
 
@@ -210,6 +815,13 @@ int bam_idxstats(int argc, char *argv[])
     }
 
     if (hts_get_format(fp)->format != bam) {
+        sam_count_t *counts = calloc(header->n_targets + 1, sizeof(*counts));
+        if (counts && sam_counts_load(argv[optind], header->n_targets, counts) == 0) {
+            print_counts(header, counts);
+            free(counts);
+            goto done;
+        }
+        free(counts);
     slow_method:
         if (ga.nthreads)
             hts_set_threads(fp, ga.nthreads);
@@ -240,6 +852,7 @@ int bam_idxstats(int argc, char *argv[])
         hts_idx_destroy(idx);
     }
 
+ done:
     bam_hdr_destroy(header);
     sam_close(fp);
     return 0;
@@ -476,7 +476,7 @@ static int add_duplicate(khash_t(duplicates) *d_hash, bam1_t *dupe) {
    Marking the supplementary reads of a duplicate as also duplicates takes an extra file read/write
    step.  This is because the duplicate can occur before the primary read.*/
 
-static int bam_mark_duplicates(samFile *in, samFile *out, char *prefix, int remove_dups, int32_t max_length, int do_stats, int supp, int tag) {
+static int bam_mark_duplicates(samFile *in, samFile *out, char *prefix, int remove_dups, int32_t max_length, int do_stats, int supp, int tag, size_t header_pad) {
     bam_hdr_t *header;
     khiter_t k;
     khash_t(reads) *pair_hash        = kh_init(reads);
@@ -511,6 +511,11 @@ static int bam_mark_duplicates(samFile *in, samFile *out, char *prefix, int remo
        }
     }
 
+    if (header_pad && sam_hdr_text_pad(&header->text, &header->l_text, header_pad) < 0) {
+        fprintf(stderr, "[markdup] error padding header.\n");
+        return 1;
+    }
+
     if (sam_hdr_write(out, header) < 0) {
         fprintf(stderr, "[markdup] error writing header.\n");
         return 1;
@@ -935,6 +940,8 @@ static int markdup_usage(void) {
     fprintf(stderr, "  -T PREFIX    Write temporary files to PREFIX.samtools.nnnn.nnnn.tmp.\n");
     fprintf(stderr, "  -t           Mark primary duplicates with the name of the original in a \'do\' tag."
                                   " Mainly for information and debugging.\n");
+    fprintf(stderr, "  --header-pad INT\n"
+                    "               Reserve space for INT more bytes of header, for reheader -i.\n");
 
     sam_global_opt_help(stderr, "-.O..@");
 
@@ -948,6 +955,7 @@ static int markdup_usage(void) {
 int bam_markdup(int argc, char **argv) {
     int c, ret, remove_dups = 0, report_stats = 0, include_supplementary = 0, tag_dup = 0;
     int32_t max_length = 300;
+    size_t header_pad = 0;
     samFile *in = NULL, *out = NULL;
     char wmode[3] = {'w', 'b', 0};
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
@@ -958,6 +966,7 @@ int bam_markdup(int argc, char **argv) {
 
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
+        {"header-pad", required_argument, NULL, 1},
         {NULL, 0, NULL, 0}
     };
 
@@ -969,6 +978,10 @@ int bam_markdup(int argc, char **argv) {
             case 'T': kputs(optarg, &tmpprefix); break;
             case 'S': include_supplementary = 1; break;
             case 't': tag_dup = 1; break;
+            case 1:
+                if (sam_hdr_pad_parse("markdup", optarg, &header_pad) < 0)
+                    return 1;
+                break;
             default: if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             /* else fall-through */
             case '?': return markdup_usage();
@@ -1021,7 +1034,7 @@ int bam_markdup(int argc, char **argv) {
     t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
     ksprintf(&tmpprefix, "samtools.%d.%u.tmp", (int) getpid(), t % 10000);
 
-    ret = bam_mark_duplicates(in, out, tmpprefix.s, remove_dups, max_length, report_stats, include_supplementary, tag_dup);
+    ret = bam_mark_duplicates(in, out, tmpprefix.s, remove_dups, max_length, report_stats, include_supplementary, tag_dup, header_pad);
 
     sam_close(in);
 
@@ -30,10 +30,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
+#include <errno.h>
 #include "htslib/faidx.h"
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "htslib/thread_pool.h"
+#include "htslib/hts_endian.h"
 #include "sam_opts.h"
 #include "samtools.h"
 
@@ -46,22 +49,81 @@ DEALINGS IN THE SOFTWARE.  */
 
 int bam_aux_drop_other(bam1_t *b, uint8_t *s);
 
-void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm, int quiet_mode)
+/*
+ * Counts how many bases from the start of seq (which must be at an even
+ * position) match ref exactly, comparing eight at a time in the packed
+ * 4-bit form.  Stops at the first block of eight with a mismatch, an
+ * ambiguous base or '=' in the read, or an N or the end of the string in the
+ * reference, leaving those to the caller.  Matching bases are changed to
+ * '=' if use_equal is set.  Returns the number of bases matched, a multiple
+ * of eight no greater than n.
+ */
+static int md_match_run(uint8_t *seq, const char *ref, int n, int use_equal)
+{
+    static const uint8_t zero[4] = { 0, 0, 0, 0 };
+    uint8_t expect[4];
+    int j, k;
+
+    for (j = 0; j + 8 <= n; j += 8) {
+        for (k = 0; k < 8; k += 2) {
+            int c1 = seq_nt16_table[(unsigned char) ref[j+k]], c2;
+            if (c1 == 15) return j;
+            c2 = seq_nt16_table[(unsigned char) ref[j+k+1]];
+            if (c2 == 15) return j;
+            expect[k/2] = c1 << 4 | c2;
+        }
+        if (memcmp(seq + j/2, expect, 4) != 0) break;
+        if (use_equal) memcpy(seq + j/2, zero, 4);
+    }
+    return j;
+}
+
+// Overwrites an integer tag in place if its type can hold val, or else
+// replaces it with an 'i' tag at the end of the record
+static void md_update_int(bam1_t *b, uint8_t *s, const char tag[2], int32_t val)
+{
+    switch (*s) {
+    case 'c': if (val >= INT8_MIN && val <= INT8_MAX) { s[1] = (uint8_t) val; return; } break;
+    case 'C': if (val >= 0 && val <= UINT8_MAX) { s[1] = val; return; } break;
+    case 's': if (val >= INT16_MIN && val <= INT16_MAX) { i16_to_le(val, s + 1); return; } break;
+    case 'S': if (val >= 0 && val <= UINT16_MAX) { u16_to_le(val, s + 1); return; } break;
+    case 'i': i32_to_le(val, s + 1); return;
+    case 'I': if (val >= 0) { u32_to_le(val, s + 1); return; } break;
+    }
+    bam_aux_del(b, s);
+    bam_aux_append(b, tag, 'i', 4, (uint8_t*)&val);
+}
+
+/*
+ * Calculates MD and NM and updates the record.  str is a buffer for building
+ * the MD string, which can be reused between calls.  Messages about changed
+ * tags go to msg if it is not NULL, or to stderr.
+ */
+static void fillmd_core(bam1_t *b, const char *ref, int ref_len, int flag, int max_nm,
+                        int quiet_mode, kstring_t *str, kstring_t *msg)
 {
     uint8_t *seq = bam_get_seq(b);
     uint32_t *cigar = bam_get_cigar(b);
     bam1_core_t *c = &b->core;
     int i, x, y, u = 0;
-    kstring_t *str;
     int32_t old_nm_i = -1, nm = 0;
 
-    str = (kstring_t*)calloc(1, sizeof(kstring_t));
+    str->l = 0;
     for (i = y = 0, x = c->pos; i < c->n_cigar; ++i) {
         int j, l = cigar[i]>>4, op = cigar[i]&0xf;
         if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
             for (j = 0; j < l; ++j) {
                 int c1, c2, z = y + j;
                 if (x+j >= ref_len || ref[x+j] == '\0') break; // out of bounds
+                if (!(z&1) && l - j >= 8) {
+                    int n = l - j < ref_len - (x+j) ? l - j : ref_len - (x+j);
+                    int m = md_match_run(seq + z/2, ref + x+j, n, flag&USE_EQUAL);
+                    if (m > 0) {
+                        u += m;
+                        j += m - 1;
+                        continue;
+                    }
+                }
                 c1 = bam_seqi(seq, z), c2 = seq_nt16_table[(int)ref[x+j]];
                 if ((c1 == c2 && c1 != 15 && c2 != 15) || c1 == 0) { // a match
                     if (flag&USE_EQUAL) seq[z/2] &= (z&1)? 0xf0 : 0x0f;
@@ -117,10 +179,10 @@ void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm, i
         if (!old_nm) bam_aux_append(b, "NM", 'i', 4, (uint8_t*)&nm);
         else if (nm != old_nm_i) {
             if (!quiet_mode) {
-                fprintf(stderr, "[bam_fillmd1] different NM for read '%s': %d -> %d\n", bam_get_qname(b), old_nm_i, nm);
+                if (msg) ksprintf(msg, "[bam_fillmd1] different NM for read '%s': %d -> %d\n", bam_get_qname(b), old_nm_i, nm);
+                else fprintf(stderr, "[bam_fillmd1] different NM for read '%s': %d -> %d\n", bam_get_qname(b), old_nm_i, nm);
             }
-            bam_aux_del(b, old_nm);
-            bam_aux_append(b, "NM", 'i', 4, (uint8_t*)&nm);
+            md_update_int(b, old_nm, "NM", nm);
         }
     }
     // update MD
@@ -128,8 +190,9 @@ void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm, i
         uint8_t *old_md = bam_aux_get(b, "MD");
         if (!old_md) bam_aux_append(b, "MD", 'Z', str->l + 1, (uint8_t*)str->s);
         else {
-            int is_diff = 0;
+            int is_diff = 0, same_len = 0;
             if (strlen((char*)old_md+1) == str->l) {
+                same_len = (*old_md == 'Z');
                 for (i = 0; i < str->l; ++i)
                     if (toupper(old_md[i+1]) != toupper(str->s[i]))
                         break;
@@ -137,10 +200,15 @@ void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm, i
             } else is_diff = 1;
             if (is_diff) {
                 if (!quiet_mode) {
-                    fprintf(stderr, "[bam_fillmd1] different MD for read '%s': '%s' -> '%s'\n", bam_get_qname(b), old_md+1, str->s);
+                    if (msg) ksprintf(msg, "[bam_fillmd1] different MD for read '%s': '%s' -> '%s'\n", bam_get_qname(b), old_md+1, str->s);
+                    else fprintf(stderr, "[bam_fillmd1] different MD for read '%s': '%s' -> '%s'\n", bam_get_qname(b), old_md+1, str->s);
+                }
+                if (same_len) {
+                    memcpy(old_md + 1, str->s, str->l);
+                } else {
+                    bam_aux_del(b, old_md);
+                    bam_aux_append(b, "MD", 'Z', str->l + 1, (uint8_t*)str->s);
                 }
-                bam_aux_del(b, old_md);
-                bam_aux_append(b, "MD", 'Z', str->l + 1, (uint8_t*)str->s);
             }
         }
     }
@@ -156,8 +224,13 @@ void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm, i
         for (i = 0; i < b->core.l_qseq; ++i)
             if (qual[i] >= 3) qual[i] = qual[i]/10*10 + 7;
     }
+}
 
-    free(str->s); free(str);
+void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm, int quiet_mode)
+{
+    kstring_t str = { 0, 0, NULL };
+    fillmd_core(b, ref, ref_len, flag, max_nm, quiet_mode, &str, NULL);
+    free(str.s);
 }
 
 void bam_fillmd1(bam1_t *b, char *ref, int flag, int quiet_mode)
@@ -165,6 +238,263 @@ void bam_fillmd1(bam1_t *b, char *ref, int flag, int quiet_mode)
     bam_fillmd1_core(b, ref, INT_MAX, flag, 0, quiet_mode);
 }
 
+/*
+ * Batched processing.
+ *
+ * With threads, records are gathered into batches which the thread pool
+ * runs through BAQ, mapQ capping and MD/NM calculation.  Batches come back
+ * in their original order to be written by the main thread, together with
+ * any messages about changed tags, so the output is the same as without
+ * threads.  Each batch keeps its MD buffer between uses.
+ *
+ * A batch can span several references.  References are counted by the
+ * records using them, and freed once the last is written.
+ */
+
+#define CALMD_BATCH_SIZE 1024
+
+typedef struct {
+    char *seq;                  // NULL if not found in the FASTA file
+    int len;
+    int users, current;
+} calmd_ref_t;
+
+typedef struct {
+    int flag, max_nm, quiet_mode, is_realn, baq_flag, capQ;
+} calmd_opts_t;
+
+typedef struct calmd_batch {
+    struct calmd_batch *next;   // link in the free list
+    bam1_t **bams;
+    calmd_ref_t **refs;
+    int n;
+    const calmd_opts_t *opts;
+    kstring_t md, msg;
+} calmd_batch_t;
+
+typedef struct {
+    hts_tpool_process *q;
+    hts_tpool *pool;
+    calmd_batch_t *cur, *free_list;
+    int n_queued;
+    samFile *out;
+    bam_hdr_t *h;
+    const calmd_opts_t *opts;
+} calmd_pipeline_t;
+
+static void calmd_ref_release(calmd_ref_t *r)
+{
+    if (r && --r->users == 0 && !r->current) {
+        free(r->seq);
+        free(r);
+    }
+}
+
+// Called when the main thread moves on from a reference
+static void calmd_ref_retire(calmd_ref_t *r)
+{
+    if (r) {
+        r->current = 0;
+        if (r->users == 0) {
+            free(r->seq);
+            free(r);
+        }
+    }
+}
+
+static void calmd_process(bam1_t *b, const calmd_ref_t *r, const calmd_opts_t *o,
+                          kstring_t *md, kstring_t *msg)
+{
+    if (!r->seq) return;
+    if (o->is_realn) sam_prob_realn(b, r->seq, r->len, o->baq_flag);
+    if (o->capQ > 10) {
+        int q = sam_cap_mapq(b, r->seq, r->len, o->capQ);
+        if (b->core.qual > q) b->core.qual = q;
+    }
+    fillmd_core(b, r->seq, r->len, o->flag, o->max_nm, o->quiet_mode, md, msg);
+}
+
+static void *calmd_batch_worker(void *arg)
+{
+    calmd_batch_t *batch = (calmd_batch_t *) arg;
+    int i;
+
+    batch->msg.l = 0;
+    for (i = 0; i < batch->n; i++)
+        if (batch->refs[i])
+            calmd_process(batch->bams[i], batch->refs[i], batch->opts, &batch->md, &batch->msg);
+    return batch;
+}
+
+static void calmd_batch_free(calmd_batch_t *batch)
+{
+    int i;
+    if (!batch) return;
+    for (i = 0; i < CALMD_BATCH_SIZE; i++)
+        if (batch->bams[i]) bam_destroy1(batch->bams[i]);
+    for (i = 0; i < batch->n; i++)
+        calmd_ref_release(batch->refs[i]);
+    free(batch->bams);
+    free(batch->refs);
+    free(batch->md.s);
+    free(batch->msg.s);
+    free(batch);
+}
+
+static calmd_batch_t *calmd_batch_get(calmd_pipeline_t *pl)
+{
+    calmd_batch_t *batch;
+    int i;
+
+    if (pl->free_list) {
+        batch = pl->free_list;
+        pl->free_list = batch->next;
+        batch->n = 0;
+        return batch;
+    }
+
+    batch = calloc(1, sizeof(calmd_batch_t));
+    if (!batch) return NULL;
+    batch->bams = calloc(CALMD_BATCH_SIZE, sizeof(bam1_t *));
+    batch->refs = calloc(CALMD_BATCH_SIZE, sizeof(calmd_ref_t *));
+    if (!batch->bams || !batch->refs) goto fail;
+    for (i = 0; i < CALMD_BATCH_SIZE; i++)
+        if (!(batch->bams[i] = bam_init1())) goto fail;
+    batch->opts = pl->opts;
+    return batch;
+
+ fail:
+    if (batch->bams && batch->refs) {
+        calmd_batch_free(batch);
+    } else {
+        free(batch->bams);
+        free(batch->refs);
+        free(batch);
+    }
+    return NULL;
+}
+
+// Write out one finished batch, and put it on the free list
+static int calmd_write_batch(calmd_pipeline_t *pl, calmd_batch_t *batch)
+{
+    int i, r = 0;
+    if (batch->msg.l) fputs(batch->msg.s, stderr);
+    for (i = 0; i < batch->n; i++) {
+        if (r >= 0 && sam_write1(pl->out, pl->h, batch->bams[i]) < 0) r = -1;
+        calmd_ref_release(batch->refs[i]);
+        batch->refs[i] = NULL;
+    }
+    batch->n = 0;
+    batch->next = pl->free_list;
+    pl->free_list = batch;
+    return r;
+}
+
+/* Write the next batch in order.  If wait is set, block until it is
+   ready.  Returns 0 if a batch was written, 1 if none was available and
+   -1 on error. */
+static int calmd_pipeline_write_next(calmd_pipeline_t *pl, int wait)
+{
+    hts_tpool_result *r;
+    calmd_batch_t *batch;
+
+    if (pl->n_queued == 0) return 1;
+    r = wait ? hts_tpool_next_result_wait(pl->q) : hts_tpool_next_result(pl->q);
+    if (!r) return 1;
+    batch = (calmd_batch_t *) hts_tpool_result_data(r);
+    hts_tpool_delete_result(r, 0);
+    pl->n_queued--;
+    return calmd_write_batch(pl, batch);
+}
+
+static int calmd_pipeline_dispatch(calmd_pipeline_t *pl)
+{
+    int r;
+
+    if (!pl->cur || pl->cur->n == 0) return 0;
+    while (hts_tpool_dispatch2(pl->pool, pl->q, calmd_batch_worker, pl->cur, 1) < 0) {
+        if (errno != EAGAIN) return -1;
+        // Queue full; make space by writing out the oldest batch
+        if (calmd_pipeline_write_next(pl, 1) < 0) return -1;
+    }
+    pl->n_queued++;
+    pl->cur = NULL;
+
+    // Write anything that has already finished
+    while ((r = calmd_pipeline_write_next(pl, 0)) == 0);
+    return r < 0 ? -1 : 0;
+}
+
+static calmd_pipeline_t *calmd_pipeline_init(hts_tpool *pool, bam_hdr_t *h, samFile *out,
+                                             const calmd_opts_t *opts)
+{
+    calmd_pipeline_t *pl = calloc(1, sizeof(calmd_pipeline_t));
+    if (!pl) return NULL;
+    pl->q = hts_tpool_process_init(pool, hts_tpool_size(pool) * 2, 0);
+    if (!pl->q) {
+        free(pl);
+        return NULL;
+    }
+    pl->pool = pool;
+    pl->h = h;
+    pl->out = out;
+    pl->opts = opts;
+    return pl;
+}
+
+/* Hand a record over to the pipeline, with its reference (or NULL if it is
+   unplaced).  The record in *b is swapped for an empty one, so the caller
+   can carry on reading into it. */
+static int calmd_pipeline_add(calmd_pipeline_t *pl, bam1_t **b, calmd_ref_t *ref)
+{
+    bam1_t *tmp;
+    if (!pl->cur && !(pl->cur = calmd_batch_get(pl))) {
+        print_error_errno("calmd", "failed to allocate memory");
+        return -1;
+    }
+    tmp = pl->cur->bams[pl->cur->n];
+    pl->cur->bams[pl->cur->n] = *b;
+    pl->cur->refs[pl->cur->n++] = ref;
+    if (ref) ref->users++;
+    *b = tmp;
+    if (pl->cur->n == CALMD_BATCH_SIZE && calmd_pipeline_dispatch(pl) < 0) {
+        print_error_errno("calmd", "failed to write to output file");
+        return -1;
+    }
+    return 0;
+}
+
+// Send any partial batch and write out everything still queued
+static int calmd_pipeline_flush(calmd_pipeline_t *pl)
+{
+    int r = 0;
+    if (calmd_pipeline_dispatch(pl) < 0) r = -1;
+    while (pl->n_queued > 0)
+        if (calmd_pipeline_write_next(pl, 1) < 0) r = -1;
+    if (r < 0) print_error_errno("calmd", "failed to write to output file");
+    return r;
+}
+
+static void calmd_pipeline_destroy(calmd_pipeline_t *pl)
+{
+    calmd_batch_t *batch;
+    if (!pl) return;
+    while (pl->n_queued > 0) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(pl->q);
+        if (!r) break;
+        calmd_batch_free((calmd_batch_t *) hts_tpool_result_data(r));
+        hts_tpool_delete_result(r, 0);
+        pl->n_queued--;
+    }
+    hts_tpool_process_destroy(pl->q);
+    calmd_batch_free(pl->cur);
+    while ((batch = pl->free_list) != NULL) {
+        pl->free_list = batch->next;
+        calmd_batch_free(batch);
+    }
+    free(pl);
+}
+
 int calmd_usage() {
     fprintf(stderr,
 "Usage: samtools calmd [-eubrAESQ] <aln.bam> <ref.fasta>\n"
@@ -184,13 +514,17 @@ int calmd_usage() {
 
 int bam_fillmd(int argc, char *argv[])
 {
-    int c, flt_flag, tid = -2, ret, len, is_bam_out, is_uncompressed, max_nm, is_realn, capQ, baq_flag, quiet_mode;
+    int c, tid = -2, ret, is_bam_out, is_uncompressed;
     htsThreadPool p = {NULL, 0};
     samFile *fp = NULL, *fpout = NULL;
     bam_hdr_t *header = NULL;
     faidx_t *fai = NULL;
-    char *ref = NULL, mode_w[8], *ref_file;
+    char mode_w[8], *ref_file;
     bam1_t *b = NULL;
+    calmd_ref_t *ref = NULL;
+    calmd_pipeline_t *pl = NULL;
+    calmd_opts_t opts;
+    kstring_t md = { 0, 0, NULL };
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
 
     static const struct option lopts[] = {
@@ -198,25 +532,26 @@ int bam_fillmd(int argc, char *argv[])
         { NULL, 0, NULL, 0 }
     };
 
-    flt_flag = UPDATE_NM | UPDATE_MD;
-    is_bam_out = is_uncompressed = is_realn = max_nm = capQ = baq_flag = quiet_mode = 0;
+    memset(&opts, 0, sizeof(opts));
+    opts.flag = UPDATE_NM | UPDATE_MD;
+    is_bam_out = is_uncompressed = 0;
     strcpy(mode_w, "w");
     while ((c = getopt_long(argc, argv, "EqQreuNhbSC:n:Ad@:", lopts, NULL)) >= 0) {
         switch (c) {
-        case 'r': is_realn = 1; break;
-        case 'e': flt_flag |= USE_EQUAL; break;
-        case 'd': flt_flag |= DROP_TAG; break;
-        case 'q': flt_flag |= BIN_QUAL; break;
-        case 'h': flt_flag |= HASH_QNM; break;
-        case 'N': flt_flag &= ~(UPDATE_MD|UPDATE_NM); break;
+        case 'r': opts.is_realn = 1; break;
+        case 'e': opts.flag |= USE_EQUAL; break;
+        case 'd': opts.flag |= DROP_TAG; break;
+        case 'q': opts.flag |= BIN_QUAL; break;
+        case 'h': opts.flag |= HASH_QNM; break;
+        case 'N': opts.flag &= ~(UPDATE_MD|UPDATE_NM); break;
         case 'b': is_bam_out = 1; break;
         case 'u': is_uncompressed = is_bam_out = 1; break;
         case 'S': break;
-        case 'n': max_nm = atoi(optarg); break;
-        case 'C': capQ = atoi(optarg); break;
-        case 'A': baq_flag |= 1; break;
-        case 'E': baq_flag |= 2; break;
-        case 'Q': quiet_mode = 1; break;
+        case 'n': opts.max_nm = atoi(optarg); break;
+        case 'C': opts.capQ = atoi(optarg); break;
+        case 'A': opts.baq_flag |= 1; break;
+        case 'E': opts.baq_flag |= 2; break;
+        case 'Q': opts.quiet_mode = 1; break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             fprintf(stderr, "[bam_fillmd] unrecognized option '-%c'\n\n", c);
             /* else fall-through */
@@ -257,6 +592,10 @@ int bam_fillmd(int argc, char *argv[])
         }
         hts_set_opt(fp,    HTS_OPT_THREAD_POOL, &p);
         hts_set_opt(fpout, HTS_OPT_THREAD_POOL, &p);
+        if (!(pl = calmd_pipeline_init(p.pool, header, fpout, &opts))) {
+            fprintf(stderr, "Error creating thread pool\n");
+            goto fail;
+        }
     }
 
     ref_file = argc > optind + 1 ? argv[optind+1] : ga.reference;
@@ -273,24 +612,26 @@ int bam_fillmd(int argc, char *argv[])
         goto fail;
     }
     while ((ret = sam_read1(fp, header, b)) >= 0) {
-        if (b->core.tid >= 0) {
-            if (tid != b->core.tid) {
-                free(ref);
-                ref = fai_fetch(fai, header->target_name[b->core.tid], &len);
-                tid = b->core.tid;
-                if (ref == 0) { // FIXME: Should this always be fatal?
-                    fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
-                            header->target_name[tid]);
-                    if (is_realn || capQ > 10) goto fail; // Would otherwise crash
-                }
+        if (b->core.tid >= 0 && tid != b->core.tid) {
+            calmd_ref_retire(ref);
+            if (!(ref = calloc(1, sizeof(calmd_ref_t)))) {
+                fprintf(stderr, "[bam_fillmd] Failed to allocate memory\n");
+                goto fail;
             }
-            if (is_realn) sam_prob_realn(b, ref, len, baq_flag);
-            if (capQ > 10) {
-                int q = sam_cap_mapq(b, ref, len, capQ);
-                if (b->core.qual > q) b->core.qual = q;
+            ref->current = 1;
+            ref->seq = fai_fetch(fai, header->target_name[b->core.tid], &ref->len);
+            tid = b->core.tid;
+            if (ref->seq == 0) { // FIXME: Should this always be fatal?
+                fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
+                        header->target_name[tid]);
+                if (opts.is_realn || opts.capQ > 10) goto fail; // Would otherwise crash
             }
-            if (ref) bam_fillmd1_core(b, ref, len, flt_flag, max_nm, quiet_mode);
         }
+        if (pl) {
+            if (calmd_pipeline_add(pl, &b, b->core.tid >= 0 ? ref : NULL) < 0) goto fail;
+            continue;
+        }
+        if (b->core.tid >= 0) calmd_process(b, ref, &opts, &md, NULL);
         if (sam_write1(fpout, header, b) < 0) {
             print_error_errno("calmd", "failed to write to output file");
             goto fail;
@@ -300,10 +641,16 @@ int bam_fillmd(int argc, char *argv[])
         fprintf(stderr, "[bam_fillmd] Error reading input.\n");
         goto fail;
     }
+    if (pl) {
+        if (calmd_pipeline_flush(pl) < 0) goto fail;
+        calmd_pipeline_destroy(pl);
+        pl = NULL;
+    }
     bam_destroy1(b);
     bam_hdr_destroy(header);
 
-    free(ref);
+    calmd_ref_retire(ref);
+    free(md.s);
     fai_destroy(fai);
     sam_close(fp);
     if (sam_close(fpout) < 0) {
@@ -315,7 +662,9 @@ int bam_fillmd(int argc, char *argv[])
     return 0;
 
  fail:
-    free(ref);
+    calmd_pipeline_destroy(pl);
+    calmd_ref_retire(ref);
+    free(md.s);
     if (b) bam_destroy1(b);
     if (header) bam_hdr_destroy(header);
     if (fai) fai_destroy(fai);
@@ -0,0 +1,188 @@
+/*  bam_part.c -- splitting BGZF compressed BAM files between threads.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+#include "htslib/hts_endian.h"
+#include "bam_part.h"
+
+#define PART_GUESS_LEN (3 << 16)   // data checked when guessing a record start
+
+int bam_part_is_block(const uint8_t *p)
+{
+    return p[0] == 31 && p[1] == 139 && p[2] == 8 && (p[3] & 4)
+        && le_to_u16(p + 10) == 6 && p[12] == 'B' && p[13] == 'C'
+        && le_to_u16(p + 14) == 2;
+}
+
+// Finds the first BGZF block starting at or after pos, or returns -1
+static int64_t part_next_block(int fd, int64_t pos, int64_t size)
+{
+    uint8_t buf[0x10000], hdr[18];
+
+    while (pos < size) {
+        ssize_t n = pread(fd, buf, sizeof(buf), pos), i;
+        if (n < 18) return -1;
+        for (i = 0; i + 18 <= n; i++) {
+            if (!bam_part_is_block(buf + i)) continue;
+            int64_t next = pos + i + le_to_u16(buf + i + 16) + 1;
+            if (next == size
+                || (next < size && pread(fd, hdr, 18, next) == 18 && bam_part_is_block(hdr)))
+                return pos + i;
+        }
+        pos += n - 17;
+    }
+    return -1;
+}
+
+/*
+ * Checks whether p could be the start of a BAM record.  Returns its length
+ * if it is complete and plausible, -1 if it is plausible as far as it goes
+ * but runs past the end of the data, and 0 if it is not a record.
+ */
+static int64_t part_check_record(const uint8_t *p, size_t avail, const bam_hdr_t *h)
+{
+    int32_t block_len, tid, pos, mtid, mpos, l_seq;
+    uint32_t l_name, n_cigar, i;
+
+    if (avail < 4) return -1;
+    block_len = le_to_i32(p);
+    if (block_len < 32) return 0;
+    if (avail < 36) return -1;
+    tid = le_to_i32(p + 4);
+    pos = le_to_i32(p + 8);
+    l_name = p[12];
+    n_cigar = le_to_u16(p + 16);
+    l_seq = le_to_i32(p + 20);
+    mtid = le_to_i32(p + 24);
+    mpos = le_to_i32(p + 28);
+    if (tid < -1 || tid >= h->n_targets || mtid < -1 || mtid >= h->n_targets)
+        return 0;
+    if (pos < -1 || (tid >= 0 && pos > (int64_t) h->target_len[tid]) || mpos < -1)
+        return 0;
+    if (l_name < 1 || l_seq < 0
+        || 32 + l_name + 4 * (int64_t) n_cigar + ((int64_t) l_seq + 1) / 2 + l_seq > block_len)
+        return 0;
+    if (avail < 4 + (size_t) block_len) return -1;
+
+    for (i = 0; i < l_name - 1; i++)
+        if (p[36 + i] < '!' || p[36 + i] > '~' || p[36 + i] == '@') return 0;
+    if (p[36 + l_name - 1] != '\0') return 0;
+    for (i = 0; i < n_cigar; i++)
+        if ((le_to_u32(p + 36 + l_name + 4 * i) & BAM_CIGAR_MASK) > BAM_CBACK) return 0;
+
+    return 4 + (int64_t) block_len;
+}
+
+// Every record after the start, up to the end of the data read, must look valid
+int bam_part_find_start(BGZF *fp, const bam_hdr_t *h, int64_t block, uint64_t *voff)
+{
+    uint8_t *buf;
+    ssize_t n, c;
+    int len0, ret = 1;
+
+    if (bgzf_seek(fp, block << 16, SEEK_SET) < 0 || bgzf_read_block(fp) < 0)
+        return -1;
+    if ((len0 = fp->block_length) <= 0) return 1;
+    if (!(buf = malloc(PART_GUESS_LEN))) return -1;
+    if ((n = bgzf_read(fp, buf, PART_GUESS_LEN)) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    for (c = 0; c < len0 && c < n; c++) {
+        const uint8_t *p = buf + c;
+        size_t avail = n - c;
+        int64_t len = 0;
+        int n_ok = 0;
+        while (avail > 0 && (len = part_check_record(p, avail, h)) > 0) {
+            p += len;
+            avail -= len;
+            n_ok++;
+        }
+        // Stop at a record that isn't valid, or at a partial one at EOF
+        if (len == 0 || n_ok == 0 || (avail > 0 && n < PART_GUESS_LEN)) continue;
+        *voff = (uint64_t) block << 16 | c;
+        ret = 0;
+        break;
+    }
+    free(buf);
+    return ret;
+}
+
+int bam_part_split(const char *fn, int64_t size, int64_t first, int n_parts, int64_t *starts)
+{
+    int fd, i, n = 1;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) return -1;
+    starts[0] = first;
+    for (i = 1; i < n_parts; i++) {
+        int64_t b = part_next_block(fd, size / n_parts * i, size);
+        if (b > starts[n-1]) starts[n++] = b;
+    }
+    close(fd);
+    return n;
+}
+
+// As bgzf_read(), but skips the data if buf is NULL
+static ssize_t part_read(BGZF *fp, uint8_t *buf, size_t len)
+{
+    size_t done = 0, n;
+    while (done < len) {
+        if (fp->block_offset >= fp->block_length) {
+            if (bgzf_read_block(fp) < 0) return -1;
+            if (fp->block_length <= 0) break;
+        }
+        n = fp->block_length - fp->block_offset;
+        if (n > len - done) n = len - done;
+        if (buf) memcpy(buf + done, (uint8_t *) fp->uncompressed_block + fp->block_offset, n);
+        fp->block_offset += n;
+        done += n;
+    }
+    return done;
+}
+
+int bam_part_read_core(BGZF *fp, uint8_t core[36], uint64_t *voff)
+{
+    int32_t block_len;
+
+    if (fp->block_offset >= fp->block_length) {
+        if (bgzf_read_block(fp) < 0) return -2;
+        if (fp->block_length <= 0) {
+            *voff = bgzf_tell(fp);
+            return -1;
+        }
+    }
+    *voff = bgzf_tell(fp);
+    if (part_read(fp, core, 36) != 36) return -2;
+    block_len = le_to_i32(core);
+    if (block_len < 32) return -2;
+    if (part_read(fp, NULL, block_len - 32) != block_len - 32) return -2;
+    return 0;
+}
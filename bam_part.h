@@ -0,0 +1,67 @@
+/*  bam_part.h -- splitting BGZF compressed BAM files between threads.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef BAM_PART_H
+#define BAM_PART_H
+
+#include <stdint.h>
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+
+/*
+ * A BAM file can be cut into partitions at BGZF block boundaries and each
+ * given to a thread, but only the first thread knows where its first record
+ * starts.  The others guess with bam_part_find_start(), and the caller then
+ * checks each guess against where the previous partition's last record
+ * ended, redoing any partition that guessed wrong.
+ */
+
+// Smallest partition worth giving a thread of its own
+#define BAM_PART_MIN_SIZE (1 << 18)
+
+// Checks whether the 18 bytes at p are the header of a BGZF block
+int bam_part_is_block(const uint8_t *p);
+
+/*
+ * Cuts the BGZF file fn, size bytes long, into at most n_parts partitions
+ * starting at or after the block at first.  Fills in starts[] with the
+ * file offsets of the blocks each partition starts at, and returns the
+ * number of partitions, or -1 on error with errno set.
+ */
+int bam_part_split(const char *fn, int64_t size, int64_t first, int n_parts, int64_t *starts);
+
+/*
+ * Looks for the first record starting in the block at file offset block.
+ * A start is only accepted if several records follow on from it.
+ * Returns 0 and sets *voff if found, 1 if not, -1 on error.
+ */
+int bam_part_find_start(BGZF *fp, const bam_hdr_t *h, int64_t block, uint64_t *voff);
+
+/*
+ * Reads the next record's length and fixed-size fields (the first 36 bytes
+ * of the record) into core, and skips over the rest of it without copying.
+ * *voff is set to the virtual offset of the record.  Returns 0 on success,
+ * -1 at the end of the file and -2 if the file is truncated or corrupt.
+ */
+int bam_part_read_core(BGZF *fp, uint8_t core[36], uint64_t *voff);
+
+#endif
@@ -43,6 +43,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "sam_header.h"
 #include "samtools.h"
 #include "sam_opts.h"
+#include "bedidx.h"
 
 static inline int printw(int c, FILE *fp)
 {
@@ -115,10 +116,6 @@ static inline void pileup_seq(FILE *fp, const bam_pileup1_t *p, int pos, int ref
 #define MPLP_SMART_OVERLAPS (1<<12)
 #define MPLP_PRINT_QNAME (1<<13)
 
-void *bed_read(const char *fn);
-void bed_destroy(void *_h);
-int bed_overlap(const void *_h, const char *chr, int beg, int end);
-
 typedef struct {
     int min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag, all;
     int rflag_require, rflag_filter;
@@ -126,7 +123,7 @@ typedef struct {
     double min_frac; // for indels
     char *reg, *pl_list, *fai_fname, *output_fname;
     faidx_t *fai;
-    void *bed, *rghash;
+    void *bed, *bed_tids, *rghash;
     int argc;
     char **argv;
     sam_global_args ga;
@@ -146,6 +143,7 @@ typedef struct {
     bam_hdr_t *h;
     mplp_ref_t *ref;
     const mplp_conf_t *conf;
+    bed_cursor_t bed_cur;
 } mplp_aux_t;
 
 typedef struct {
@@ -244,7 +242,7 @@ static int mplp_func(void *data, bam1_t *b)
         if (ma->conf->rflag_require && !(ma->conf->rflag_require&b->core.flag)) { skip = 1; continue; }
         if (ma->conf->rflag_filter && ma->conf->rflag_filter&b->core.flag) { skip = 1; continue; }
         if (ma->conf->bed && ma->conf->all == 0) { // test overlap
-            skip = !bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_endpos(b));
+            skip = !bed_overlap_tid(ma->conf->bed_tids, b->core.tid, b->core.pos, bam_endpos(b), &ma->bed_cur);
             if (skip) continue;
         }
         if (ma->conf->rghash) { // exclude read groups
@@ -375,6 +373,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         }
         data[i]->conf = conf;
         data[i]->ref = &mp_ref;
+        data[i]->bed_cur.tid = -1;
         h_tmp = sam_hdr_read(data[i]->fp);
         if ( !h_tmp ) {
             fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn[i]);
@@ -409,6 +408,14 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
             data[i]->h = h;
         }
     }
+    if (conf->bed) {
+        // all files are looked up using the first header, as above
+        conf->bed_tids = bed_tid_index(conf->bed, h);
+        if (!conf->bed_tids) {
+            fprintf(stderr, "[%s] failed to index the regions in the BED file\n", __func__);
+            exit(EXIT_FAILURE);
+        }
+    }
     // allocate data storage proportionate to number of samples being studied sm->n
     gplp.n = sm->n;
     gplp.n_plp = calloc(sm->n, sizeof(int));
@@ -566,6 +573,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
     bcf1_t *bcf_rec = bcf_init1();
     int ret;
     int last_tid = -1, last_pos = -1;
+    bed_cursor_t bed_cur = BED_CURSOR_INIT;
 
     // begin pileup
     while ( (ret=bam_mplp_auto(iter, &tid, &pos, n_plp, plp)) > 0) {
@@ -574,7 +582,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         //printf("tid=%d len=%d ref=%p/%s\n", tid, ref_len, ref, ref);
         if (conf->flag & MPLP_BCF) {
             int total_depth, _ref0, ref16;
-            if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, h->target_name[tid], pos, pos+1)) continue;
+            if (conf->bed && tid >= 0 && !bed_overlap_tid(conf->bed_tids, tid, pos, pos+1, &bed_cur)) continue;
             for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
             group_smpl(&gplp, sm, &buf, n, fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
             _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
@@ -605,7 +613,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
                 while (tid > last_tid) {
                     if (last_tid >= 0 && !conf->reg) {
                         while (++last_pos < h->target_len[last_tid]) {
-                            if (conf->bed && bed_overlap(conf->bed, h->target_name[last_tid], last_pos, last_pos + 1) == 0)
+                            if (conf->bed && bed_overlap_tid(conf->bed_tids, last_tid, last_pos, last_pos + 1, &bed_cur) == 0)
                                 continue;
                             print_empty_pileup(pileup_fp, conf, h->target_name[last_tid], last_pos, n, ref, ref_len);
                         }
@@ -620,14 +628,14 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
                 // Deal with missing portion of current tid
                 while (++last_pos < pos) {
                     if (conf->reg && last_pos < beg0) continue; // out of range; skip
-                    if (conf->bed && bed_overlap(conf->bed, h->target_name[tid], last_pos, last_pos + 1) == 0)
+                    if (conf->bed && bed_overlap_tid(conf->bed_tids, tid, last_pos, last_pos + 1, &bed_cur) == 0)
                         continue;
                     print_empty_pileup(pileup_fp, conf, h->target_name[tid], last_pos, n, ref, ref_len);
                 }
                 last_tid = tid;
                 last_pos = pos;
             }
-            if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, h->target_name[tid], pos, pos+1)) continue;
+            if (conf->bed && tid >= 0 && !bed_overlap_tid(conf->bed_tids, tid, pos, pos+1, &bed_cur)) continue;
 
             fprintf(pileup_fp, "%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
             for (i = 0; i < n; ++i) {
@@ -732,7 +740,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
        while (last_tid >= 0 && last_tid < h->n_targets) {
             while (++last_pos < h->target_len[last_tid]) {
                 if (last_pos >= end0) break;
-                if (conf->bed && bed_overlap(conf->bed, h->target_name[last_tid], last_pos, last_pos + 1) == 0)
+                if (conf->bed && bed_overlap_tid(conf->bed_tids, last_tid, last_pos, last_pos + 1, &bed_cur) == 0)
                     continue;
                 print_empty_pileup(pileup_fp, conf, h->target_name[last_tid], last_pos, n, ref, ref_len);
             }
@@ -765,6 +773,8 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
     bcf_call_del_rghash(rghash);
     bam_mplp_destroy(iter);
     bam_hdr_destroy(h);
+    if (conf->bed_tids) bed_tid_destroy(conf->bed_tids);
+    conf->bed_tids = NULL;
     for (i = 0; i < n; ++i) {
         sam_close(data[i]->fp);
         if (data[i]->iter) hts_itr_destroy(data[i]->iter);
@@ -26,9 +26,18 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
+#include <htslib/hts_endian.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bam_part.h"
 
 /* File status flags (zero means OK). It's possible for more than one to be
  * set on a single file.   The final exit status is the bitwise-or of the
@@ -38,6 +47,8 @@ DEALINGS IN THE SOFTWARE.  */
 #define QC_BAD_HEADER    8
 #define QC_NO_EOF_BLOCK 16
 #define QC_FAIL_CLOSE   32
+#define QC_BAD_BLOCK    64
+#define QC_BAD_RECORD  128
 
 static void usage_quickcheck(FILE *write_to)
 {
@@ -46,6 +57,9 @@ static void usage_quickcheck(FILE *write_to)
 "Options:\n"
 "  -v              verbose output (repeat for more verbosity)\n"
 "  -q              suppress warning messages\n"
+"  -d              deep check: verify the CRC32 and size of every BGZF block\n"
+"  -r              deep check: decode every record\n"
+"  -@ INT          number of threads for deep checks [0]\n"
 "\n"
 "Notes:\n"
 "\n"
@@ -68,6 +82,10 @@ static void usage_quickcheck(FILE *write_to)
 "\tsamtools quickcheck -qv *.bam > bad_bams.fofn \\\n"
 "\t   && echo 'all ok' \\\n"
 "\t   || echo 'some files failed check, see bad_bams.fofn'\n"
+"\n"
+"3. The -d and -r deep checks read the whole of each file, so they find\n"
+"   corruption that the default checks miss.  The threads share out the\n"
+"   blocks of large files and the files given on the command line.\n"
     );
 }
 
@@ -75,12 +93,174 @@ static void usage_quickcheck(FILE *write_to)
     file_state |= (state);                                              \
     if (!quiet || verbose >= (v)) fprintf(stderr, (msg), (arg1))
 
+/*
+ * Deep checks.  Each job checks either the BGZF blocks in one part of a file
+ * or every record in a whole file, and the jobs for all the files are run
+ * together, so threads are kept busy both by large files and by long lists
+ * of small ones.
+ */
+
+// Smallest part of a file worth a block checking job of its own
+#define QC_MIN_PART (1 << 22)
+
+typedef struct {
+    int file;                   // index of the file in argv
+    const char *fn;
+    int records;                // decode records rather than check blocks
+    int64_t beg, end;           // for block checks, the file offsets to check
+    // Results
+    int64_t bad_off;            // file offset of the first bad block, or -1
+    int64_t bad_rec;            // number of the first bad record, or 0
+    const char *why;
+} qc_job_t;
+
+static void *qc_check_blocks(void *arg)
+{
+    qc_job_t *j = (qc_job_t *) arg;
+    uint8_t *cdata = NULL, *udata = NULL;
+    z_stream zs;
+    int64_t pos = j->beg;
+    int fd, zinit = 0;
+
+    j->bad_off = j->beg;
+    j->why = "could not be read";
+    if ((fd = open(j->fn, O_RDONLY)) < 0) return NULL;
+    if (!(cdata = malloc(BGZF_MAX_BLOCK_SIZE)) || !(udata = malloc(BGZF_MAX_BLOCK_SIZE)))
+        goto out;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) goto out;
+    zinit = 1;
+
+    while (pos < j->end) {
+        int bsize;
+        uint32_t isize, crc;
+        ssize_t n = pread(fd, cdata, 18, pos);
+        j->bad_off = pos;
+        if (n < 0) goto out;
+        if (n < 18) { j->why = "is truncated"; goto out; }
+        if (!bam_part_is_block(cdata)) { j->why = "does not have a BGZF header"; goto out; }
+        bsize = le_to_u16(cdata + 16) + 1;
+        if (bsize < 26) { j->why = "has an invalid BSIZE"; goto out; }
+        if ((n = pread(fd, cdata + 18, bsize - 18, pos + 18)) < 0) goto out;
+        if (n < bsize - 18) { j->why = "is truncated"; goto out; }
+        crc = le_to_u32(cdata + bsize - 8);
+        isize = le_to_u32(cdata + bsize - 4);
+        if (isize > BGZF_MAX_BLOCK_SIZE) { j->why = "has an invalid ISIZE"; goto out; }
+
+        zs.next_in = cdata + 18;
+        zs.avail_in = bsize - 26;
+        zs.next_out = udata;
+        zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END) { j->why = "could not be decompressed"; goto out; }
+        if (zs.total_out != isize) { j->why = "does not match its ISIZE"; goto out; }
+        if (crc32(crc32(0L, NULL, 0), udata, isize) != crc) { j->why = "failed its CRC32 check"; goto out; }
+        if (inflateReset(&zs) != Z_OK) goto out;
+        pos += bsize;
+    }
+    // The last block must end where the next part starts; j->bad_off is
+    // still its offset
+    if (pos != j->end) { j->why = "runs past the start of the next block"; goto out; }
+    j->bad_off = -1;
+    j->why = NULL;
+
+ out:
+    if (zinit) inflateEnd(&zs);
+    free(cdata);
+    free(udata);
+    close(fd);
+    return NULL;
+}
+
+static void *qc_check_records(void *arg)
+{
+    qc_job_t *j = (qc_job_t *) arg;
+    htsFile *fp;
+    bam_hdr_t *h = NULL;
+    bam1_t *b = NULL;
+    int64_t n = 0, voff = -1;
+    int bgzf_in, r;
+
+    j->bad_rec = 1;
+    j->why = "could not be read";
+    if (!(fp = hts_open(j->fn, "r"))) return NULL;
+    // Sequences are not decoded from CRAM, so that no reference is needed
+    hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, ~SAM_SEQ);
+    hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0);
+    bgzf_in = hts_get_format(fp)->format == bam && hts_get_format(fp)->compression == bgzf;
+    if (!(h = sam_hdr_read(fp)) || !(b = bam_init1())) goto out;
+
+    do {
+        n++;
+        if (bgzf_in) voff = bgzf_tell(fp->fp.bgzf);
+    } while ((r = sam_read1(fp, h, b)) >= 0);
+    if (r == -1) {
+        j->bad_rec = 0;
+        j->why = NULL;
+    } else {
+        j->bad_rec = n;
+        j->bad_off = voff >= 0 ? voff >> 16 : -1;
+        j->why = "could not be decoded";
+    }
+
+ out:
+    bam_destroy1(b);
+    if (h) bam_hdr_destroy(h);
+    hts_close(fp);
+    return NULL;
+}
+
+static qc_job_t *qc_add_job(qc_job_t **jobs, int *n, int *m)
+{
+    if (*n == *m) {
+        int new_m = *m ? *m * 2 : 16;
+        qc_job_t *j = realloc(*jobs, new_m * sizeof(**jobs));
+        if (!j) return NULL;
+        *jobs = j;
+        *m = new_m;
+    }
+    memset(&(*jobs)[*n], 0, sizeof(**jobs));
+    (*jobs)[*n].bad_off = -1;
+    return &(*jobs)[(*n)++];
+}
+
+// Splits a BGZF file into block checking jobs.  Returns 0 on success, -1 on error.
+static int qc_add_block_jobs(qc_job_t **jobs, int *n, int *m, int file,
+                             const char *fn, int n_threads)
+{
+    struct stat st;
+    int64_t *starts;
+    int n_parts, i;
+
+    if (stat(fn, &st) < 0) return -1;
+    n_parts = st.st_size / QC_MIN_PART;
+    if (n_parts > n_threads) n_parts = n_threads;
+    if (n_parts < 1) n_parts = 1;
+    if (!(starts = malloc(n_parts * sizeof(*starts)))) return -1;
+    if ((n_parts = bam_part_split(fn, st.st_size, 0, n_parts, starts)) < 0) {
+        free(starts);
+        return -1;
+    }
+    for (i = 0; i < n_parts; i++) {
+        qc_job_t *j = qc_add_job(jobs, n, m);
+        if (!j) {
+            free(starts);
+            return -1;
+        }
+        j->file = file;
+        j->fn = fn;
+        j->beg = starts[i];
+        j->end = i + 1 < n_parts ? starts[i+1] : st.st_size;
+    }
+    free(starts);
+    return 0;
+}
+
 int main_quickcheck(int argc, char** argv)
 {
-    int verbose = 0, quiet = 0;
+    int verbose = 0, quiet = 0, deep_blocks = 0, deep_records = 0, n_threads = 0;
     hts_verbose = 0;
 
-    const char* optstring = "vq";
+    const char* optstring = "vqdr@:";
     int opt;
     while ((opt = getopt(argc, argv, optstring)) != -1) {
         switch (opt) {
@@ -90,6 +270,15 @@ int main_quickcheck(int argc, char** argv)
         case 'q':
             quiet = 1;
             break;
+        case 'd':
+            deep_blocks = 1;
+            break;
+        case 'r':
+            deep_records = 1;
+            break;
+        case '@':
+            n_threads = atoi(optarg);
+            break;
         default:
             usage_quickcheck(stderr);
             return 1;
@@ -112,8 +301,17 @@ int main_quickcheck(int argc, char** argv)
         hts_verbose = 3;
     }
 
-    int ret = 0;
+    int ret = 0, fail = 0;
     int i;
+    int *states = calloc(argc, sizeof(*states));
+    qc_job_t *jobs = NULL;
+    int n_jobs = 0, m_jobs = 0;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *queue = NULL;
+    if (!states) {
+        fprintf(stderr, "[quickcheck] out of memory\n");
+        return 1;
+    }
 
     for (i = 0; i < argc; i++) {
         char* fn = argv[i];
@@ -171,16 +369,99 @@ int main_quickcheck(int argc, char** argv)
                 }
             }
 
+            // queue up the deep checks
+            struct stat st;
+            if (deep_blocks && fmt->compression == bgzf
+                && stat(fn, &st) == 0 && S_ISREG(st.st_mode)) {
+                if (qc_add_block_jobs(&jobs, &n_jobs, &m_jobs, i, fn, n_threads) < 0) {
+                    QC_ERR(QC_BAD_BLOCK, 2, "%s could not be read for checking its blocks.\n", fn);
+                }
+            }
+            else if (deep_blocks && verbose >= 3) {
+                fprintf(stderr, "%s cannot have its blocks checked as it is not a BGZF compressed file.\n", fn);
+            }
+            if (deep_records && !(file_state & (QC_NOT_SEQUENCE | QC_BAD_HEADER))) {
+                qc_job_t *j = qc_add_job(&jobs, &n_jobs, &m_jobs);
+                if (!j) {
+                    fprintf(stderr, "[quickcheck] out of memory\n");
+                    hts_close(hts_fp);
+                    fail = 1;
+                    goto cleanup;
+                }
+                j->file = i;
+                j->fn = fn;
+                j->records = 1;
+            }
+
             if (hts_close(hts_fp) < 0) {
                 QC_ERR(QC_FAIL_CLOSE, 2, "%s did not close cleanly.\n", fn);
             }
         }
 
-        if (file_state > 0 && verbose >= 1) {
-            fprintf(stdout, "%s\n", fn);
+        states[i] = file_state;
+    }
+
+    // run the deep checks
+    if (n_jobs > 0) {
+        if (n_threads > 0
+            && (!(pool = hts_tpool_init(n_threads))
+                || !(queue = hts_tpool_process_init(pool, n_threads * 2, 1)))) {
+            fprintf(stderr, "[quickcheck] error creating thread pool\n");
+            fail = 1;
+            goto cleanup;
+        }
+        for (i = 0; i < n_jobs; i++) {
+            void *(*func)(void *) = jobs[i].records ? qc_check_records : qc_check_blocks;
+            if (!pool) func(&jobs[i]);
+            else if (hts_tpool_dispatch(pool, queue, func, &jobs[i]) < 0) {
+                fprintf(stderr, "[quickcheck] error dispatching job\n");
+                fail = 1;
+                goto cleanup;
+            }
+        }
+        if (queue) hts_tpool_process_flush(queue);
+    }
+
+    // report the first bad block and the first bad record in each file
+    for (i = 0; i < n_jobs; i++) {
+        qc_job_t *j = &jobs[i];
+        int file_state = states[j->file];
+        if (!j->why) continue;
+        if (!j->records && !(file_state & QC_BAD_BLOCK)) {
+            file_state |= QC_BAD_BLOCK;
+            if (!quiet || verbose >= 2)
+                fprintf(stderr, "%s has a BGZF block at offset %lld that %s.\n",
+                        j->fn, (long long) j->bad_off, j->why);
         }
-        ret |= file_state;
+        else if (j->records) {
+            file_state |= QC_BAD_RECORD;
+            if (!quiet || verbose >= 2) {
+                if (j->bad_off >= 0)
+                    fprintf(stderr, "%s has record %lld, in the BGZF block at offset %lld, that %s.\n",
+                            j->fn, (long long) j->bad_rec, (long long) j->bad_off, j->why);
+                else
+                    fprintf(stderr, "%s has record %lld that %s.\n",
+                            j->fn, (long long) j->bad_rec, j->why);
+            }
+        }
+        states[j->file] = file_state;
     }
 
-    return ret;
+    for (i = 0; i < argc; i++) {
+        if (states[i] > 0 && verbose >= 1) {
+            fprintf(stdout, "%s\n", argv[i]);
+        }
+        ret |= states[i];
+    }
+
+ cleanup:
+    // Jobs already dispatched must finish before jobs is freed
+    if (queue) {
+        hts_tpool_process_flush(queue);
+        hts_tpool_process_destroy(queue);
+    }
+    if (pool) hts_tpool_destroy(pool);
+    free(jobs);
+    free(states);
+    return fail ? 1 : ret;
 }
@@ -27,17 +27,46 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "htslib/bgzf.h"
 #include "htslib/sam.h"
 #include "htslib/hfile.h"
 #include "htslib/cram.h"
+#include "htslib/hts_endian.h"
+#include "htslib/kstring.h"
 #include "samtools.h"
 
 #define BUF_SIZE 0x10000
 
+static int bam_hdr_add_PG(bam_hdr_t *h, const char *arg_list)
+{
+    // Around the houses, but it'll do until we can manipulate bam_hdr_t natively.
+    SAM_hdr *sh = sam_hdr_parse_(h->text, h->l_text);
+    if (!sh)
+        return -1;
+    if (sam_hdr_add_PG(sh, "samtools",
+                       "VN", samtools_version(),
+                       arg_list ? "CL": NULL,
+                       arg_list ? arg_list : NULL,
+                       NULL) != 0) {
+        sam_hdr_free(sh);
+        return -1;
+    }
+
+    free(h->text);
+    h->text = strdup(sam_hdr_str(sh));
+    h->l_text = sam_hdr_length(sh);
+    sam_hdr_free(sh);
+    return h->text ? 0 : -1;
+}
+
 /*
  * Reads a file and outputs a new BAM file to fd with 'h' replaced as
  * the header.    No checks are made to the validity.
@@ -48,7 +77,6 @@ int bam_reheader(BGZF *in, bam_hdr_t *h, int fd,
     BGZF *fp = NULL;
     ssize_t len;
     uint8_t *buf = NULL;
-    SAM_hdr *sh = NULL;
     if (in->is_write) return -1;
     buf = malloc(BUF_SIZE);
     if (!buf) {
@@ -65,26 +93,8 @@ int bam_reheader(BGZF *in, bam_hdr_t *h, int fd,
         goto fail;
     }
 
-    if (add_PG) {
-        // Around the houses, but it'll do until we can manipulate bam_hdr_t natively.
-        sh = sam_hdr_parse_(h->text, h->l_text);
-        if (!sh)
-            goto fail;
-        if (sam_hdr_add_PG(sh, "samtools",
-                           "VN", samtools_version(),
-                           arg_list ? "CL": NULL,
-                           arg_list ? arg_list : NULL,
-                           NULL) != 0)
-            goto fail;
-
-        free(h->text);
-        h->text = strdup(sam_hdr_str(sh));
-        h->l_text = sam_hdr_length(sh);
-        if (!h->text)
-            goto fail;
-        sam_hdr_free(sh);
-        sh = NULL;
-    }
+    if (add_PG && bam_hdr_add_PG(h, arg_list) < 0)
+        goto fail;
 
     if (bam_hdr_write(fp, h) < 0) {
         print_error_errno("reheader", "Couldn't write header");
@@ -114,10 +124,193 @@ int bam_reheader(BGZF *in, bam_hdr_t *h, int fd,
  fail:
     bgzf_close(fp);
     free(buf);
-    sam_hdr_free(sh);
     return -1;
 }
 
+/*
+ * Writes a BGZF block holding len bytes of src stored without compression,
+ * so its size is always len + BGZF_STORED_OVERHEAD.
+ */
+#define BGZF_STORED_OVERHEAD 31
+static size_t bgzf_stored_block(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    static const uint8_t gz_hdr[16] = {
+        31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0
+    };
+    size_t bsize = len + BGZF_STORED_OVERHEAD;
+
+    memcpy(dst, gz_hdr, 16);
+    dst[16] = (bsize - 1) & 0xff;
+    dst[17] = (bsize - 1) >> 8;
+    dst[18] = 1; // final deflate block, stored
+    dst[19] = len & 0xff;
+    dst[20] = len >> 8;
+    dst[21] = ~len & 0xff;
+    dst[22] = (~len >> 8) & 0xff;
+    memcpy(dst + 23, src, len);
+    u32_to_le(crc32(crc32(0L, NULL, 0), src, len), dst + 23 + len);
+    u32_to_le(len, dst + 27 + len);
+    return bsize;
+}
+
+// Appends the BGZF compressed form of src to out
+static int bgzf_compress_blocks(kstring_t *out, const uint8_t *src, size_t len)
+{
+    while (len > 0) {
+        size_t n = len < BGZF_BLOCK_SIZE ? len : BGZF_BLOCK_SIZE;
+        size_t dlen = BGZF_MAX_BLOCK_SIZE;
+        if (ks_resize(out, out->l + BGZF_MAX_BLOCK_SIZE) < 0) return -1;
+        if (bgzf_compress(out->s + out->l, &dlen, src, n, 9) < 0) return -1;
+        out->l += dlen;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Removes header padding lines, which are replaced rather than kept
+static void strip_hdr_padding(bam_hdr_t *h)
+{
+    size_t tag_len = strlen(SAM_HDR_PAD_TAG);
+    char *in = h->text, *out = h->text, *end = h->text + h->l_text;
+
+    while (in < end) {
+        char *nl = memchr(in, '\n', end - in);
+        size_t len = nl ? nl + 1 - in : end - in;
+        if (len < tag_len || memcmp(in, SAM_HDR_PAD_TAG, tag_len) != 0) {
+            memmove(out, in, len);
+            out += len;
+        }
+        in += len;
+    }
+    h->l_text = out - h->text;
+    h->text[h->l_text] = '\0';
+}
+
+/*
+ * Replaces the header of a BAM file without rewriting the rest of it.  This
+ * needs the old header to end on a BGZF block boundary, and the new one to
+ * fit in the space the old one took up.  That space can be made larger by
+ * writing the file with --header-pad.  The new header is laid out as
+ *
+ *   [stored: magic, l_text][compressed: text][stored: padding][compressed: refs]
+ *
+ * with the padding @CO line sized so that the blocks exactly fill the old
+ * space.  The alignment records don't move, so any index stays valid.
+ */
+int bam_reheader_inplace(BGZF *in, const char *fn, bam_hdr_t *h,
+                         const char *arg_list, int add_PG)
+{
+    bam_hdr_t *old;
+    kstring_t text_blk = { 0, 0, NULL }, refs = { 0, 0, NULL };
+    kstring_t refs_blk = { 0, 0, NULL }, out = { 0, 0, NULL };
+    char *pad = NULL;
+    uint32_t pad_len = 0;
+    int64_t space, avail;
+    int fd = -1, i, n_pad, ret = -1;
+    size_t tag_len = strlen(SAM_HDR_PAD_TAG);
+    uint8_t buf[8];
+
+    if (in->is_write) return -1;
+    if ((old = bam_hdr_read(in)) == NULL) {
+        fprintf(stderr, "Couldn't read header\n");
+        return -1;
+    }
+    bam_hdr_destroy(old);
+    if (in->block_offset != in->block_length) {
+        print_error("reheader", "the header of \"%s\" shares a BGZF block with alignments, so can't be replaced in place", fn);
+        return -1;
+    }
+    space = htell(in->fp);
+
+    if (add_PG && bam_hdr_add_PG(h, arg_list) < 0)
+        return -1;
+    strip_hdr_padding(h);
+    if (h->l_text > 0 && h->text[h->l_text-1] != '\n') {
+        kstring_t t = { h->l_text, h->l_text + 1, h->text };
+        if (kputc('\n', &t) < 0) return -1;
+        h->text = t.s;
+        h->l_text = t.l;
+    }
+
+    // Reference list
+    i32_to_le(h->n_targets, buf);
+    if (kputsn((char *) buf, 4, &refs) < 0) goto mem_fail;
+    for (i = 0; i < h->n_targets; i++) {
+        size_t l = strlen(h->target_name[i]) + 1;
+        i32_to_le(l, buf);
+        if (kputsn((char *) buf, 4, &refs) < 0
+            || kputsn(h->target_name[i], l, &refs) < 0) goto mem_fail;
+        u32_to_le(h->target_len[i], buf);
+        if (kputsn((char *) buf, 4, &refs) < 0) goto mem_fail;
+    }
+
+    if (bgzf_compress_blocks(&text_blk, (uint8_t *) h->text, h->l_text) < 0
+        || bgzf_compress_blocks(&refs_blk, (uint8_t *) refs.s, refs.l) < 0) {
+        print_error("reheader", "failed to compress the new header");
+        goto fail;
+    }
+
+    // Work out how many stored blocks of padding fill the gap
+    avail = space - (8 + BGZF_STORED_OVERHEAD) - text_blk.l - refs_blk.l;
+    for (n_pad = 1; avail - n_pad * BGZF_STORED_OVERHEAD > (int64_t) n_pad * BGZF_BLOCK_SIZE; n_pad++)
+        ;
+    // The padding line needs its tag, at least one character and a newline
+    if (avail - n_pad * BGZF_STORED_OVERHEAD < (int64_t) tag_len + 2) {
+        print_error("reheader", "the new header is %"PRId64" bytes too large to replace in place; "
+                    "rewrite \"%s\" without -i, or with more --header-pad",
+                    (int64_t) tag_len + 2 - (avail - n_pad * BGZF_STORED_OVERHEAD), fn);
+        goto fail;
+    }
+    if (sam_hdr_text_pad(&pad, &pad_len, avail - n_pad * BGZF_STORED_OVERHEAD - tag_len - 1) < 0)
+        goto mem_fail;
+
+    // Assemble the new header blocks
+    if (ks_resize(&out, space) < 0) goto mem_fail;
+    memcpy(buf, "BAM\1", 4);
+    u32_to_le(h->l_text + pad_len, buf + 4);
+    out.l += bgzf_stored_block((uint8_t *) out.s + out.l, buf, 8);
+    memcpy(out.s + out.l, text_blk.s, text_blk.l);
+    out.l += text_blk.l;
+    for (i = 0; i < n_pad; i++) {
+        size_t start = (size_t) pad_len * i / n_pad;
+        size_t end = (size_t) pad_len * (i + 1) / n_pad;
+        out.l += bgzf_stored_block((uint8_t *) out.s + out.l, (uint8_t *) pad + start, end - start);
+    }
+    memcpy(out.s + out.l, refs_blk.s, refs_blk.l);
+    out.l += refs_blk.l;
+    assert(out.l == space);
+
+    fd = open(fn, O_WRONLY);
+    if (fd < 0) {
+        print_error_errno("reheader", "failed to open \"%s\" for writing", fn);
+        goto fail;
+    }
+    if (pwrite(fd, out.s, out.l, 0) != (ssize_t) out.l) {
+        print_error_errno("reheader", "failed to write the new header to \"%s\"", fn);
+        goto fail;
+    }
+    if (close(fd) < 0) {
+        fd = -1;
+        print_error_errno("reheader", "error closing \"%s\"", fn);
+        goto fail;
+    }
+    fd = -1;
+    ret = 0;
+    goto fail;
+
+ mem_fail:
+    print_error_errno("reheader", "out of memory");
+ fail:
+    if (fd >= 0) close(fd);
+    free(text_blk.s);
+    free(refs.s);
+    free(refs_blk.s);
+    free(out.s);
+    free(pad);
+    return ret;
+}
+
 /*
  * Reads a file and outputs a new CRAM file to stdout with 'h'
  * replaced as the header.  No checks are made to the validity.
@@ -494,7 +687,10 @@ int main_reheader(int argc, char *argv[])
         return 1;
     }
     if (hts_get_format(in)->format == bam) {
-        r = bam_reheader(in->fp.bgzf, h, fileno(stdout), arg_list, add_PG);
+        if (inplace)
+            r = bam_reheader_inplace(in->fp.bgzf, argv[optind+1], h, arg_list, add_PG);
+        else
+            r = bam_reheader(in->fp.bgzf, h, fileno(stdout), arg_list, add_PG);
     } else {
         if (inplace)
             r = cram_reheader_inplace(in->fp.cram, h, arg_list, add_PG);
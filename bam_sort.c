@@ -98,6 +98,7 @@ KLIST_INIT(hdrln, char*, hdrln_free_char)
 static int g_is_by_qname = 0;
 static int g_is_by_tag = 0;
 static char g_sort_tag[2] = {0,0};
+static size_t g_header_pad = 0;
 
 static int strnum_cmp(const char *_a, const char *_b)
 {
@@ -1131,6 +1132,33 @@ int* rtrans_build(int n, int n_targets, trans_tbl_t* translation_tbl)
  * file. Finally we write our chosen read it to the output file.
  */
 
+/*
+ * CRAM indexes hold no read counts, so when the final output is a CRAM file
+ * the reads written for each reference are counted and saved alongside it
+ * for idxstats.  These return or take NULL when no counts are being kept.
+ */
+static sam_count_t *counts_init(samFile *fp, const char *fn, const bam_hdr_t *h)
+{
+    if (hts_get_format(fp)->format != cram || strcmp(fn, "-") == 0) return NULL;
+    return calloc(h->n_targets + 1, sizeof(sam_count_t));
+}
+
+static inline void counts_add(sam_count_t *counts, const bam_hdr_t *h, const bam1_t *b)
+{
+    if (!counts || b->core.tid >= h->n_targets) return;
+    sam_count_t *c = &counts[b->core.tid >= 0 ? b->core.tid : h->n_targets];
+    if (b->core.flag & BAM_FUNMAP) c->unmapped++;
+    else c->mapped++;
+}
+
+static void counts_save(sam_count_t *counts, const char *fn, int n_ref, const char *cmd)
+{
+    if (!counts) return;
+    if (sam_counts_save(fn, n_ref, counts) < 0)
+        print_error_errno(cmd, "failed to write read counts for \"%s\"", fn);
+    free(counts);
+}
+
 /*!
   @abstract    Merge multiple sorted BAM.
   @param  by_qname    whether to sort by query name
@@ -1167,6 +1195,8 @@ int bam_merge_core2(int by_qname, char* sort_tag, const char *out, const char *m
     bam_hdr_t **hdr = NULL;
     trans_tbl_t *translation_tbl = NULL;
     int *rtrans = NULL;
+    sam_count_t *counts = NULL;
+    int n_ref;
     merged_header_t *merged_hdr = init_merged_header();
     if (!merged_hdr) return -1;
 
@@ -1393,6 +1423,10 @@ int bam_merge_core2(int by_qname, char* sort_tag, const char *out, const char *m
     }
 
     // Open output file and write header
+    if (g_header_pad && sam_hdr_text_pad(&hout->text, &hout->l_text, g_header_pad) < 0) {
+        print_error_errno(cmd, "failed to pad header");
+        return -1;
+    }
     if ((fpout = sam_open_format(out, mode, out_fmt)) == 0) {
         print_error_errno(cmd, "failed to create \"%s\"", out);
         return -1;
@@ -1403,6 +1437,8 @@ int bam_merge_core2(int by_qname, char* sort_tag, const char *out, const char *m
         return -1;
     }
     if (!(flag & MERGE_UNCOMP)) hts_set_threads(fpout, n_threads);
+    counts = counts_init(fpout, out, hout);
+    n_ref = hout->n_targets;
 
     // Begin the actual merge
     ks_heapmake(heap, n, heap);
@@ -1416,8 +1452,10 @@ int bam_merge_core2(int by_qname, char* sort_tag, const char *out, const char *m
         if (sam_write1(fpout, hout, b) < 0) {
             print_error_errno(cmd, "failed writing to \"%s\"", out);
             sam_close(fpout);
+            free(counts);
             return -1;
         }
+        counts_add(counts, hout, b);
         if ((j = (iter[heap->i]? sam_itr_next(fp[heap->i], iter[heap->i], b) : sam_read1(fp[heap->i], hdr[heap->i], b))) >= 0) {
             bam_translate(b, translation_tbl + heap->i);
             heap->pos = ((uint64_t)b->core.tid<<32) | (uint32_t)((int)b->core.pos+1);
@@ -1457,8 +1495,10 @@ int bam_merge_core2(int by_qname, char* sort_tag, const char *out, const char *m
     free(RG); free(translation_tbl); free(fp); free(heap); free(iter); free(hdr);
     if (sam_close(fpout) < 0) {
         print_error(cmd, "error closing output file");
+        free(counts);
         return -1;
     }
+    counts_save(counts, out, n_ref, cmd);
     return 0;
 
  mem_fail:
@@ -1486,6 +1526,7 @@ int bam_merge_core2(int by_qname, char* sort_tag, const char *out, const char *m
     free(heap);
     free(fp);
     free(rtrans);
+    free(counts);
     return -1;
 }
 
@@ -1517,7 +1558,9 @@ static void merge_usage(FILE *to)
 "  -c         Combine @RG headers with colliding IDs [alter IDs to be distinct]\n"
 "  -p         Combine @PG headers with colliding IDs [alter IDs to be distinct]\n"
 "  -s VALUE   Override random seed\n"
-"  -b FILE    List of input BAM filenames, one per line [null]\n");
+"  -b FILE    List of input BAM filenames, one per line [null]\n"
+"  --header-pad INT\n"
+"             Reserve space for INT more bytes of header, for reheader -i\n");
     sam_global_opt_help(to, "-.O..@");
 }
 
@@ -1534,6 +1577,7 @@ int bam_merge(int argc, char *argv[])
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
         { "threads", required_argument, NULL, '@' },
+        { "header-pad", required_argument, NULL, 1 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -1556,6 +1600,12 @@ int bam_merge(int argc, char *argv[])
         case 'c': flag |= MERGE_COMBINE_RG; break;
         case 'p': flag |= MERGE_COMBINE_PG; break;
         case 's': random_seed = atol(optarg); break;
+        case 1:
+            if (sam_hdr_pad_parse("merge", optarg, &g_header_pad) < 0) {
+                ret = 1;
+                goto end;
+            }
+            break;
         case 'b': {
             // load the list of files to read
             int nfiles;
@@ -1684,6 +1734,7 @@ static int bam_merge_simple(int by_qname, char *sort_tag, const char *out,
                             const htsFormat *out_fmt) {
     samFile *fpout = NULL, **fp = NULL;
     heap1_t *heap = NULL;
+    sam_count_t *counts = NULL;
     uint64_t idx = 0;
     int i, heap_size = n + num_in_mem;
 
@@ -1749,6 +1800,7 @@ static int bam_merge_simple(int by_qname, char *sort_tag, const char *out,
         sam_close(fpout);
         return -1;
     }
+    counts = counts_init(fpout, out, hout);
 
     // Now do the merge
     ks_heapmake(heap, heap_size, heap);
@@ -1757,8 +1809,10 @@ static int bam_merge_simple(int by_qname, char *sort_tag, const char *out,
         if (sam_write1(fpout, hout, b) < 0) {
             print_error_errno(cmd, "failed writing to \"%s\"", out);
             sam_close(fpout);
+            free(counts);
             return -1;
         }
+        counts_add(counts, hout, b);
         if (heap_add_read(heap, n, fp, num_in_mem, in_mem, buf, &idx, hout) < 0) {
             assert(heap->i < n);
             print_error(cmd, "Error reading \"%s\" : %s",
@@ -1778,8 +1832,10 @@ static int bam_merge_simple(int by_qname, char *sort_tag, const char *out,
     free(heap);
     if (sam_close(fpout) < 0) {
         print_error(cmd, "error closing output file");
+        free(counts);
         return -1;
     }
+    counts_save(counts, out, hout->n_targets, cmd);
     return 0;
  mem_fail:
     print_error(cmd, "Out of memory");
@@ -1791,6 +1847,7 @@ static int bam_merge_simple(int by_qname, char *sort_tag, const char *out,
     }
     free(fp);
     free(heap);
+    free(counts);
     if (fpout) sam_close(fpout);
     return -1;
 }
@@ -1922,20 +1979,29 @@ typedef struct {
 
 // Returns 0 for success
 //        -1 for failure
-static int write_buffer(const char *fn, const char *mode, size_t l, bam1_tag *buf, const bam_hdr_t *h, int n_threads, const htsFormat *fmt)
+// If final is set, also saves read counts for CRAM output
+static int write_buffer(const char *fn, const char *mode, size_t l, bam1_tag *buf, const bam_hdr_t *h, int n_threads, const htsFormat *fmt, int final)
 {
     size_t i;
     samFile* fp;
+    sam_count_t *counts = NULL;
     fp = sam_open_format(fn, mode, fmt);
     if (fp == NULL) return -1;
     if (sam_hdr_write(fp, h) != 0) goto fail;
     if (n_threads > 1) hts_set_threads(fp, n_threads);
+    if (final) counts = counts_init(fp, fn, h);
     for (i = 0; i < l; ++i) {
         if (sam_write1(fp, h, buf[i].bam_record) < 0) goto fail;
+        counts_add(counts, h, buf[i].bam_record);
     }
-    if (sam_close(fp) < 0) return -1;
+    if (sam_close(fp) < 0) {
+        free(counts);
+        return -1;
+    }
+    counts_save(counts, fn, h->n_targets, "sort");
     return 0;
  fail:
+    free(counts);
     sam_close(fp);
     return -1;
 }
@@ -2035,10 +2101,10 @@ static void *worker(void *data)
             return 0;
         }
 
-        if (write_buffer(name, "wcx1", w->buf_len, w->buf, w->h, 0, &fmt) < 0)
+        if (write_buffer(name, "wcx1", w->buf_len, w->buf, w->h, 0, &fmt, 0) < 0)
             w->error = errno;
     } else {
-        if (write_buffer(name, "wbx1", w->buf_len, w->buf, w->h, 0, NULL) < 0)
+        if (write_buffer(name, "wbx1", w->buf_len, w->buf, w->h, 0, NULL, 0) < 0)
             w->error = errno;
     }
 
@@ -2252,8 +2318,12 @@ int bam_sort_core_ext(int is_by_qname, char* sort_by_tag, const char *fn, const
     }
 
     // write the final output
+    if (g_header_pad && sam_hdr_text_pad(&header->text, &header->l_text, g_header_pad) < 0) {
+        print_error_errno("sort", "failed to pad header");
+        goto err;
+    }
     if (n_files == 0 && num_in_mem < 2) { // a single block
-        if (write_buffer(fnout, modeout, k, buf, header, n_threads, out_fmt) != 0) {
+        if (write_buffer(fnout, modeout, k, buf, header, n_threads, out_fmt, 1) != 0) {
             print_error_errno("sort", "failed to create \"%s\"", fnout);
             goto err;
         }
@@ -2321,7 +2391,9 @@ static void sort_usage(FILE *fp)
 "  -n         Sort by read name\n"
 "  -t TAG     Sort by value of TAG. Uses position as secondary index (or read name if -n is set)\n"
 "  -o FILE    Write final output to FILE rather than standard output\n"
-"  -T PREFIX  Write temporary files to PREFIX.nnnn.bam\n");
+"  -T PREFIX  Write temporary files to PREFIX.nnnn.bam\n"
+"  --header-pad INT\n"
+"             Reserve space for INT more bytes of header, for reheader -i\n");
     sam_global_opt_help(fp, "-.O..@");
 }
 
@@ -2355,6 +2427,7 @@ int bam_sort(int argc, char *argv[])
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0, '@'),
         { "threads", required_argument, NULL, '@' },
+        { "header-pad", required_argument, NULL, 1 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -2373,6 +2446,12 @@ int bam_sort(int argc, char *argv[])
             }
         case 'T': kputs(optarg, &tmpprefix); break;
         case 'l': level = atoi(optarg); break;
+        case 1:
+            if (sam_hdr_pad_parse("sort", optarg, &g_header_pad) < 0) {
+                ret = EXIT_FAILURE;
+                goto sort_end;
+            }
+            break;
 
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
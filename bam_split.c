@@ -42,28 +42,58 @@ DEALINGS IN THE SOFTWARE.  */
 
 KHASH_MAP_INIT_STR(c2i, int)
 
+// Records held for an output whose file is closed are written in batches of
+// this many, or when all the batches together grow past SPLIT_MAX_BUFFER.
+#define SPLIT_BATCH_SIZE 1024
+#define SPLIT_MAX_BUFFER (256 << 20)
+// File descriptors kept back from the default -M for the input, unaccounted
+// output and whatever else the process has open.
+#define SPLIT_RESERVED_FDS 32
+
 struct parsed_opts {
     char* merged_input_name;
     char* unaccounted_header_name;
     char* unaccounted_name;
     char* output_format_string;
+    char* tag;
+    bool by_ref;
     bool verbose;
+    size_t max_open;
     sam_global_args ga;
 };
 
 typedef struct parsed_opts parsed_opts_t;
 
+typedef struct {
+    bam1_t** recs;
+    size_t n, m;
+    uint64_t last_used;
+    bool started;      // header has been written, so reopen for appending
+} out_batch_t;
+
 struct state {
     samFile* merged_input_file;
     bam_hdr_t* merged_input_header;
     samFile* unaccounted_file;
     bam_hdr_t* unaccounted_header;
     size_t output_count;
+    size_t output_max;
     char** rg_id;
     char **rg_output_file_name;
     samFile** rg_output_file;
     bam_hdr_t** rg_output_header;
+    out_batch_t* rg_batch;
     kh_c2i_t* rg_hash;
+    bam_hdr_t* output_header;  // shared by all outputs when splitting by tag or reference
+    size_t n_open, max_open;
+    uint64_t n_writes;
+    size_t batch_mem;
+    bam1_t** spare;            // records from flushed batches, for reuse
+    size_t n_spare, m_spare;
+    kstring_t tag_value;
+    const parsed_opts_t* opts;
+    const char* arg_list;
+    char* input_base_name;
     htsThreadPool p;
 };
 
@@ -76,11 +106,15 @@ static void usage(FILE *write_to)
 {
     fprintf(write_to,
 "Usage: samtools split [-u <unaccounted.bam>[:<unaccounted_header.sam>]]\n"
-"                      [-f <format_string>] [-v] <merged.bam>\n"
+"                      [-f <format_string>] [-d <tag> | --by-ref] [-v] <merged.bam>\n"
 "Options:\n"
 "  -f STRING       output filename format string [\"%%*_%%#.%%.\"]\n"
 "  -u FILE1        put reads with no RG tag or an unrecognised RG tag in FILE1\n"
 "  -u FILE1:FILE2  ...and override the header with FILE2\n"
+"  -d TAG          split by the value of TAG instead of by read group\n"
+"      --by-ref    split by reference; unplaced reads go to the -u file\n"
+"  -M INT          maximum number of output files open at once [from fd limit]\n"
+"                  (ignored for CRAM output)\n"
 "  -v              verbose output\n");
     sam_global_opt_help(write_to, "-....@");
     fprintf(write_to,
@@ -88,8 +122,8 @@ static void usage(FILE *write_to)
 "Format string expansions:\n"
 "  %%%%     %%\n"
 "  %%*     basename\n"
-"  %%#     @RG index\n"
-"  %%!     @RG ID\n"
+"  %%#     @RG index (tag value or reference index with -d or --by-ref)\n"
+"  %%!     @RG ID (tag value or reference name with -d or --by-ref)\n"
 "  %%.     filename extension for output format\n"
       );
 }
@@ -99,11 +133,12 @@ static parsed_opts_t* parse_args(int argc, char** argv)
 {
     if (argc == 1) { usage(stdout); return NULL; }
 
-    const char* optstring = "vf:u:@:";
+    const char* optstring = "vf:u:d:M:@:";
     char* delim;
 
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@'),
+        { "by-ref", no_argument, NULL, 1 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -131,6 +166,30 @@ static parsed_opts_t* parse_args(int argc, char** argv)
                 if (! retval->unaccounted_header_name ) { perror("cannot allocate string memory"); return NULL; }
             }
             break;
+        case 'd':
+            if (strlen(optarg) != 2) {
+                print_error("split", "Invalid tag \"%s\"", optarg);
+                cleanup_opts(retval);
+                return NULL;
+            }
+            free(retval->tag);
+            retval->tag = strdup(optarg);
+            if (! retval->tag ) { perror("cannot allocate string memory"); return NULL; }
+            break;
+        case 1:
+            retval->by_ref = true;
+            break;
+        case 'M': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*end || n < 1) {
+                print_error("split", "Invalid number of open files \"%s\"", optarg);
+                cleanup_opts(retval);
+                return NULL;
+            }
+            retval->max_open = n;
+            break;
+        }
         default:
             if (parse_sam_global_opt(opt, optarg, lopts, &retval->ga) == 0) break;
             /* else fall-through */
@@ -143,6 +202,12 @@ static parsed_opts_t* parse_args(int argc, char** argv)
 
     if (retval->output_format_string == NULL) retval->output_format_string = strdup("%*_%#.%.");
 
+    if (retval->tag && retval->by_ref) {
+        print_error("split", "The -d and --by-ref options cannot be used together");
+        cleanup_opts(retval);
+        return NULL;
+    }
+
     argc -= optind;
     argv += optind;
 
@@ -272,6 +337,30 @@ static bool count_RG(bam_hdr_t* hdr, size_t* count, char*** output_name)
     return true;
 }
 
+// Adds a samtools @PG line to the header text
+static bool header_add_pg(bam_hdr_t* hdr, const char *arg_list)
+{
+    SAM_hdr *sh = sam_hdr_parse_(hdr->text, hdr->l_text);
+    if (!sh) return false;
+    if (sam_hdr_add_PG(sh, "samtools",
+                           "VN", samtools_version(),
+                           arg_list ? "CL": NULL,
+                           arg_list ? arg_list : NULL,
+                           NULL) != 0) {
+        sam_hdr_free(sh);
+        return false;
+    }
+
+    free(hdr->text);
+    hdr->text = strdup(sam_hdr_str(sh));
+    hdr->l_text = sam_hdr_length(sh);
+    sam_hdr_free(sh);
+    if (!hdr->text)
+        return false;
+
+    return true;
+}
+
 // Filters a header of @RG lines where ID != id_keep
 // TODO: strip @PG's descended from other RGs and their descendants
 static bool filter_header_rg(bam_hdr_t* hdr, const char* id_keep, const char *arg_list)
@@ -319,23 +408,240 @@ static bool filter_header_rg(bam_hdr_t* hdr, const char* id_keep, const char *ar
     free(hdr->text);
     hdr->text = ks_release(&str);
 
-    // Add the PG line
-    SAM_hdr *sh = sam_hdr_parse_(hdr->text, hdr->l_text);
-    if (sam_hdr_add_PG(sh, "samtools",
-                           "VN", samtools_version(),
-                           arg_list ? "CL": NULL,
-                           arg_list ? arg_list : NULL,
-                           NULL) != 0)
+    return header_add_pg(hdr, arg_list);
+}
+
+// Number of outputs to allow open at once when -M is not given
+static size_t default_max_open(void)
+{
+#ifdef _SC_OPEN_MAX
+    long n = sysconf(_SC_OPEN_MAX);
+    if (n > 2 * SPLIT_RESERVED_FDS) return n - SPLIT_RESERVED_FDS;
+    if (n > 0) return n / 2 > 0 ? n / 2 : 1;
+#endif
+    return 1024 - SPLIT_RESERVED_FDS;
+}
+
+// Adds an output with the given name, taking ownership of id.
+// Returns its index, or -1 on error.
+static int add_output(state_t* state, char* id, int idx)
+{
+    size_t i = state->output_count;
+
+    if (i == state->output_max) {
+        size_t new_max = state->output_max ? state->output_max * 2 : 16;
+        char** new_id = realloc(state->rg_id, new_max * sizeof(*new_id));
+        if (new_id) state->rg_id = new_id;
+        char** new_name = realloc(state->rg_output_file_name, new_max * sizeof(*new_name));
+        if (new_name) state->rg_output_file_name = new_name;
+        samFile** new_file = realloc(state->rg_output_file, new_max * sizeof(*new_file));
+        if (new_file) state->rg_output_file = new_file;
+        bam_hdr_t** new_header = realloc(state->rg_output_header, new_max * sizeof(*new_header));
+        if (new_header) state->rg_output_header = new_header;
+        out_batch_t* new_batch = realloc(state->rg_batch, new_max * sizeof(*new_batch));
+        if (new_batch) state->rg_batch = new_batch;
+        if (!new_id || !new_name || !new_file || !new_header || !new_batch) {
+            print_error_errno("split", "Could not grow output file array");
+            free(id);
+            return -1;
+        }
+        state->output_max = new_max;
+    }
+
+    char* output_filename = expand_format_string(state->opts->output_format_string,
+                                                 state->input_base_name,
+                                                 id, idx,
+                                                 &state->opts->ga.out);
+    if ( output_filename == NULL ) {
+        print_error("split", "Error expanding output filename format string");
+        free(id);
         return -1;
+    }
 
-    free(hdr->text);
-    hdr->text = strdup(sam_hdr_str(sh));
-    hdr->l_text = sam_hdr_length(sh);
-    if (!hdr->text)
-        return false;
-    sam_hdr_free(sh);
+    state->rg_id[i] = id;
+    state->rg_output_file_name[i] = output_filename;
+    state->rg_output_file[i] = NULL;
+    state->rg_output_header[i] = NULL;
+    memset(&state->rg_batch[i], 0, sizeof(state->rg_batch[i]));
+    state->output_count++;
+
+    // Record index in hash
+    int ret;
+    khiter_t iter = kh_put_c2i(state->rg_hash, id, &ret);
+    if (ret < 0) {
+        print_error_errno("split", "Could not add \"%s\" to output hash", id);
+        return -1;
+    }
+    kh_val(state->rg_hash, iter) = i;
 
-    return true;
+    return i;
+}
+
+// Returns the header to use when writing records to output i
+static bam_hdr_t* output_header(const state_t* state, size_t i)
+{
+    if (state->rg_output_header[i]) return state->rg_output_header[i];
+    if (state->output_header) return state->output_header;
+    return state->merged_input_header;
+}
+
+// Closes the least recently used open output to free up a file descriptor
+static int evict_output(state_t* state)
+{
+    size_t i, lru = state->output_count;
+    for (i = 0; i < state->output_count; i++) {
+        if (state->rg_output_file[i]
+            && (lru == state->output_count
+                || state->rg_batch[i].last_used < state->rg_batch[lru].last_used))
+            lru = i;
+    }
+    if (lru == state->output_count) return 0;
+
+    int ret = sam_close(state->rg_output_file[lru]);
+    state->rg_output_file[lru] = NULL;
+    state->n_open--;
+    // A per-RG header differs from the input only in its text, so once it
+    // has been written the input header serves for the records.
+    if (state->rg_output_header[lru]) {
+        bam_hdr_destroy(state->rg_output_header[lru]);
+        state->rg_output_header[lru] = NULL;
+    }
+    if (ret < 0) {
+        print_error("split", "Error on closing output file \"%s\"", state->rg_output_file_name[lru]);
+        return -1;
+    }
+    return 0;
+}
+
+// Opens output i, closing another one first if too many are open.  The
+// first open writes the header; later ones append to what is there.
+static int open_output(state_t* state, size_t i)
+{
+    out_batch_t* ob = &state->rg_batch[i];
+
+    if (state->n_open >= state->max_open && evict_output(state) < 0)
+        return -1;
+
+    samFile* fp = sam_open_format(state->rg_output_file_name[i],
+                                  ob->started ? "ab" : "wb",
+                                  &state->opts->ga.out);
+    if (fp == NULL) {
+        print_error_errno("split", "Could not open \"%s\"", state->rg_output_file_name[i]);
+        return -1;
+    }
+    if (state->p.pool)
+        hts_set_opt(fp, HTS_OPT_THREAD_POOL, &state->p);
+    state->rg_output_file[i] = fp;
+    state->n_open++;
+
+    if (!ob->started) {
+        if (!state->output_header) {
+            // Set and edit header
+            bam_hdr_t* hdr = bam_hdr_dup(state->merged_input_header);
+            if (!hdr || !filter_header_rg(hdr, state->rg_id[i], state->arg_list)) {
+                print_error("split", "Could not rewrite header for \"%s\"", state->rg_output_file_name[i]);
+                if (hdr) bam_hdr_destroy(hdr);
+                return -1;
+            }
+            state->rg_output_header[i] = hdr;
+        }
+        if (sam_hdr_write(fp, output_header(state, i)) != 0) {
+            print_error_errno("split", "Could not write file header to \"%s\"", state->rg_output_file_name[i]);
+            return -1;
+        }
+        ob->started = true;
+    }
+    return 0;
+}
+
+// Writes out the records held for output i
+static int flush_output(state_t* state, size_t i)
+{
+    out_batch_t* ob = &state->rg_batch[i];
+    size_t j;
+
+    if (!state->rg_output_file[i] && open_output(state, i) < 0)
+        return -1;
+
+    for (j = 0; j < ob->n; j++) {
+        bam1_t* b = ob->recs[j];
+        if (sam_write1(state->rg_output_file[i], output_header(state, i), b) < 0) {
+            print_error_errno("split", "Could not write to \"%s\"", state->rg_output_file_name[i]);
+            return -1;
+        }
+        state->batch_mem -= sizeof(bam1_t) + b->l_data;
+        // Hand the record back for reuse by any output
+        if (state->n_spare == state->m_spare) {
+            size_t new_m = state->m_spare ? state->m_spare * 2 : 1024;
+            bam1_t** new_spare = realloc(state->spare, new_m * sizeof(*new_spare));
+            if (!new_spare) {
+                print_error_errno("split", "Out of memory");
+                return -1;
+            }
+            state->spare = new_spare;
+            state->m_spare = new_m;
+        }
+        state->spare[state->n_spare++] = b;
+        ob->recs[j] = NULL;
+    }
+    ob->n = 0;
+    return 0;
+}
+
+static int flush_all(state_t* state)
+{
+    size_t i;
+    for (i = 0; i < state->output_count; i++) {
+        if (state->rg_batch[i].n > 0 && flush_output(state, i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Sends a record to output i.  If the file is open it is written straight
+// away, otherwise it is copied into the output's batch until the batch is
+// large enough to be worth opening the file for.
+static int write_output(state_t* state, size_t i, const bam1_t* b)
+{
+    out_batch_t* ob = &state->rg_batch[i];
+
+    ob->last_used = ++state->n_writes;
+    if (!state->rg_output_file[i] && ob->n == 0 && state->n_open < state->max_open
+        && open_output(state, i) < 0)
+        return -1;
+
+    if (state->rg_output_file[i]) {
+        if (sam_write1(state->rg_output_file[i], output_header(state, i), b) < 0) {
+            print_error_errno("split", "Could not write to \"%s\"", state->rg_output_file_name[i]);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (ob->n == ob->m) {
+        size_t new_m = ob->m ? ob->m * 2 : 16;
+        bam1_t** new_recs = realloc(ob->recs, new_m * sizeof(*new_recs));
+        if (!new_recs) {
+            print_error_errno("split", "Out of memory");
+            return -1;
+        }
+        ob->recs = new_recs;
+        ob->m = new_m;
+    }
+    bam1_t* copy = state->n_spare ? state->spare[--state->n_spare] : bam_init1();
+    if (!copy || !bam_copy1(copy, b)) {
+        print_error_errno("split", "Out of memory");
+        if (copy) bam_destroy1(copy);
+        return -1;
+    }
+    ob->recs[ob->n++] = copy;
+    state->batch_mem += sizeof(bam1_t) + b->l_data;
+
+    if (ob->n >= SPLIT_BATCH_SIZE)
+        return flush_output(state, i);
+    if (state->batch_mem > SPLIT_MAX_BUFFER)
+        return flush_all(state);
+    return 0;
 }
 
 // Set the initial state
@@ -346,10 +652,13 @@ static state_t* init(parsed_opts_t* opts, const char *arg_list)
         print_error_errno("split", "Initialisation failed");
         return NULL;
     }
+    retval->opts = opts;
+    retval->arg_list = arg_list;
 
     if (opts->ga.nthreads > 0) {
         if (!(retval->p.pool = hts_tpool_init(opts->ga.nthreads))) {
             fprintf(stderr, "Error creating thread pool\n");
+            free(retval);
             return NULL;
         }
     }
@@ -357,7 +666,7 @@ static state_t* init(parsed_opts_t* opts, const char *arg_list)
     retval->merged_input_file = sam_open_format(opts->merged_input_name, "rb", &opts->ga.in);
     if (!retval->merged_input_file) {
         print_error_errno("split", "Could not open \"%s\"", opts->merged_input_name);
-        free(retval);
+        cleanup_state(retval, false);
         return NULL;
     }
     if (retval->p.pool)
@@ -398,90 +707,130 @@ static state_t* init(parsed_opts_t* opts, const char *arg_list)
             hts_set_opt(retval->unaccounted_file, HTS_OPT_THREAD_POOL, &retval->p);
     }
 
-    // Open output files for RGs
-    if (!count_RG(retval->merged_input_header, &retval->output_count, &retval->rg_id)) return NULL;
-    if (opts->verbose) fprintf(stderr, "@RG's found %zu\n",retval->output_count);
+    // Outputs are opened as records arrive, keeping at most max_open of
+    // them open.  CRAM can't be appended to, so it gets no limit.
+    retval->max_open = opts->max_open ? opts->max_open : default_max_open();
+    if (opts->ga.out.format == cram) retval->max_open = SIZE_MAX;
 
-    retval->rg_output_file_name = (char **)calloc(retval->output_count, sizeof(char *));
-    retval->rg_output_file = (samFile**)calloc(retval->output_count, sizeof(samFile*));
-    retval->rg_output_header = (bam_hdr_t**)calloc(retval->output_count, sizeof(bam_hdr_t*));
     retval->rg_hash = kh_init_c2i();
-    if (!retval->rg_output_file_name || !retval->rg_output_file || !retval->rg_output_header || !retval->rg_hash) {
+    if (!retval->rg_hash) {
         print_error_errno("split", "Could not initialise output file array");
         cleanup_state(retval, false);
         return NULL;
     }
 
     char* dirsep = strrchr(opts->merged_input_name, '/');
-    char* input_base_name = strdup(dirsep? dirsep+1 : opts->merged_input_name);
-    if (!input_base_name) {
+    retval->input_base_name = strdup(dirsep? dirsep+1 : opts->merged_input_name);
+    if (!retval->input_base_name) {
         print_error_errno("split", "Filename manipulation failed");
         cleanup_state(retval, false);
         return NULL;
     }
-    char* extension = strrchr(input_base_name, '.');
+    char* extension = strrchr(retval->input_base_name, '.');
     if (extension) *extension = '\0';
 
-    size_t i;
-    for (i = 0; i < retval->output_count; i++) {
-        char* output_filename = NULL;
-
-        output_filename = expand_format_string(opts->output_format_string,
-                                               input_base_name,
-                                               retval->rg_id[i], i,
-                                               &opts->ga.out);
-
-        if ( output_filename == NULL ) {
-            print_error("split", "Error expanding output filename format string");
+    if (opts->tag || opts->by_ref) {
+        // Every output gets the whole input header
+        retval->output_header = bam_hdr_dup(retval->merged_input_header);
+        if (!retval->output_header || !header_add_pg(retval->output_header, arg_list)) {
+            print_error("split", "Could not create output header");
             cleanup_state(retval, false);
-            free(input_base_name);
             return NULL;
         }
+    }
 
-        retval->rg_output_file_name[i] = output_filename;
-        retval->rg_output_file[i] = sam_open_format(output_filename, "wb", &opts->ga.out);
-        if (retval->rg_output_file[i] == NULL) {
-            print_error_errno("split", "Could not open \"%s\"", output_filename);
+    if (opts->by_ref) {
+        bam_hdr_t* h = retval->merged_input_header;
+        int32_t tid;
+        for (tid = 0; tid < h->n_targets; tid++) {
+            char* id = strdup(h->target_name[tid]);
+            if (!id || add_output(retval, id, tid) < 0) {
+                cleanup_state(retval, false);
+                return NULL;
+            }
+        }
+        if (opts->verbose) fprintf(stderr, "References found %zu\n", retval->output_count);
+    } else if (!opts->tag) {
+        // Set up outputs for RGs
+        size_t n_rg = 0;
+        char** names = NULL;
+        if (!count_RG(retval->merged_input_header, &n_rg, &names)) {
             cleanup_state(retval, false);
-            free(input_base_name);
             return NULL;
         }
-        if (retval->p.pool)
-            hts_set_opt(retval->rg_output_file[i], HTS_OPT_THREAD_POOL, &retval->p);
+        if (opts->verbose) fprintf(stderr, "@RG's found %zu\n", n_rg);
 
-        // Record index in hash
-        int ret;
-        khiter_t iter = kh_put_c2i(retval->rg_hash, retval->rg_id[i], &ret);
-        kh_val(retval->rg_hash,iter) = i;
-
-        // Set and edit header
-        retval->rg_output_header[i] = bam_hdr_dup(retval->merged_input_header);
-        if ( !filter_header_rg(retval->rg_output_header[i], retval->rg_id[i], arg_list) ) {
-            print_error("split", "Could not rewrite header for \"%s\"", output_filename);
-            cleanup_state(retval, false);
-            free(input_base_name);
-            return NULL;
+        size_t i;
+        for (i = 0; i < n_rg; i++) {
+            if (add_output(retval, names[i], i) < 0) {
+                for (i++; i < n_rg; i++) free(names[i]);
+                free(names);
+                cleanup_state(retval, false);
+                return NULL;
+            }
         }
+        free(names);
     }
 
-    free(input_base_name);
-
     return retval;
 }
 
+// Finds the output a record belongs to, adding one for a new tag value when
+// splitting by tag.  Returns the index, -1 if the record is unaccounted for
+// or -2 on error.
+static int find_output(state_t* state, const bam1_t* b)
+{
+    const parsed_opts_t* opts = state->opts;
+
+    if (opts->by_ref)
+        return b->core.tid >= 0 ? b->core.tid : -1;
+
+    uint8_t* tag = bam_aux_get(b, opts->tag ? opts->tag : "RG");
+    if (tag == NULL) return -1;
+
+    const char* value;
+    state->tag_value.l = 0;
+    switch (*tag) {
+    case 'Z': case 'H':
+        value = (const char *) tag + 1;
+        break;
+    case 'A':
+        kputc(tag[1], &state->tag_value);
+        value = ks_str(&state->tag_value);
+        break;
+    case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+        kputl(bam_aux2i(tag), &state->tag_value);
+        value = ks_str(&state->tag_value);
+        break;
+    case 'f': case 'd':
+        ksprintf(&state->tag_value, "%g", bam_aux2f(tag));
+        value = ks_str(&state->tag_value);
+        break;
+    default:
+        return -1;
+    }
+
+    khiter_t iter = kh_get_c2i(state->rg_hash, value);
+    if (iter != kh_end(state->rg_hash)) return kh_val(state->rg_hash, iter);
+    if (!opts->tag) return -1;
+
+    char* id = strdup(value);
+    if (!id) {
+        print_error_errno("split", "Out of memory");
+        return -2;
+    }
+    int i = add_output(state, id, state->output_count);
+    if (i < 0) return -2;
+    if (opts->verbose) fprintf(stderr, "New %s value \"%s\"\n", opts->tag, id);
+    return i;
+}
+
 static bool split(state_t* state)
 {
     if (state->unaccounted_file && sam_hdr_write(state->unaccounted_file, state->unaccounted_header) != 0) {
         print_error_errno("split", "Could not write output file header");
         return false;
     }
-    size_t i;
-    for (i = 0; i < state->output_count; i++) {
-        if (sam_hdr_write(state->rg_output_file[i], state->rg_output_header[i]) != 0) {
-            print_error_errno("split", "Could not write file header to \"%s\"", state->rg_output_file_name[i]);
-            return false;
-        }
-    }
 
     bam1_t* file_read = bam_init1();
     // Read the first record
@@ -497,32 +846,33 @@ static bool split(state_t* state)
     }
 
     while (file_read != NULL) {
-        // Get RG tag from read and look it up in hash to find file to output it to
-        uint8_t* tag = bam_aux_get(file_read, "RG");
-        khiter_t iter;
-        if ( tag != NULL ) {
-            char* rg = bam_aux2Z(tag);
-            iter = kh_get_c2i(state->rg_hash, rg);
-        } else {
-            iter = kh_end(state->rg_hash);
+        // Look up the file to output the read to
+        int i = find_output(state, file_read);
+        if (i < -1) {
+            bam_destroy1(file_read);
+            return false;
         }
 
         // Write the read out to correct file
-        if (iter != kh_end(state->rg_hash)) {
+        if (i >= 0) {
             // if found write to the appropriate untangled bam
-            int i = kh_val(state->rg_hash,iter);
-            if (sam_write1(state->rg_output_file[i], state->rg_output_header[i], file_read) < 0) {
-                print_error_errno("split", "Could not write to \"%s\"", state->rg_output_file_name[i]);
+            if (write_output(state, i, file_read) < 0) {
                 bam_destroy1(file_read);
                 return false;
             }
         } else {
             // otherwise write to the unaccounted bam if there is one or fail
             if (state->unaccounted_file == NULL) {
-                if (tag) {
+                const char* tag_name = state->opts->tag ? state->opts->tag : "RG";
+                uint8_t* tag = state->opts->by_ref ? NULL : bam_aux_get(file_read, tag_name);
+                if (state->opts->by_ref) {
+                    fprintf(stderr, "Read \"%s\" is not placed on a reference.\n", bam_get_qname(file_read));
+                } else if (tag && *tag == 'Z') {
                     fprintf(stderr, "Read \"%s\" with unaccounted for tag \"%s\".\n", bam_get_qname(file_read), bam_aux2Z(tag));
+                } else if (tag) {
+                    fprintf(stderr, "Read \"%s\" has an unusable %s tag.\n", bam_get_qname(file_read), tag_name);
                 } else {
-                    fprintf(stderr, "Read \"%s\" has no RG tag.\n", bam_get_qname(file_read));
+                    fprintf(stderr, "Read \"%s\" has no %s tag.\n", bam_get_qname(file_read), tag_name);
                 }
                 bam_destroy1(file_read);
                 return false;
@@ -547,6 +897,15 @@ static bool split(state_t* state)
         }
     }
 
+    // Write whatever is still held back, and the headers of any outputs
+    // that got no reads at all
+    if (flush_all(state) < 0) return false;
+    size_t i;
+    for (i = 0; i < state->output_count; i++) {
+        if (!state->rg_batch[i].started && open_output(state, i) < 0)
+            return false;
+    }
+
     return true;
 }
 
@@ -562,31 +921,44 @@ static int cleanup_state(state_t* status, bool check_close)
             ret = -1;
         }
     }
-    sam_close(status->merged_input_file);
-    size_t i;
+    if (status->merged_input_file)
+        sam_close(status->merged_input_file);
+    size_t i, j;
     for (i = 0; i < status->output_count; i++) {
-        if (status->rg_output_header && status->rg_output_header[i])
+        if (status->rg_output_header[i])
             bam_hdr_destroy(status->rg_output_header[i]);
-        if (status->rg_output_file && status->rg_output_file[i]) {
+        if (status->rg_output_file[i]) {
             if (sam_close(status->rg_output_file[i]) < 0 && check_close) {
                 print_error("split", "Error on closing output file \"%s\"", status->rg_output_file_name[i]);
                 ret = -1;
             }
         }
-        if (status->rg_id) free(status->rg_id[i]);
-        if (status->rg_output_file_name) free(status->rg_output_file_name[i]);
+        for (j = 0; j < status->rg_batch[i].n; j++)
+            bam_destroy1(status->rg_batch[i].recs[j]);
+        free(status->rg_batch[i].recs);
+        free(status->rg_id[i]);
+        free(status->rg_output_file_name[i]);
     }
+    for (j = 0; j < status->n_spare; j++)
+        bam_destroy1(status->spare[j]);
+    free(status->spare);
     if (status->merged_input_header)
         bam_hdr_destroy(status->merged_input_header);
+    if (status->output_header)
+        bam_hdr_destroy(status->output_header);
     free(status->rg_output_header);
     free(status->rg_output_file);
     free(status->rg_output_file_name);
-    kh_destroy_c2i(status->rg_hash);
+    free(status->rg_batch);
+    if (status->rg_hash)
+        kh_destroy_c2i(status->rg_hash);
     free(status->rg_id);
-    free(status);
+    free(status->tag_value.s);
+    free(status->input_base_name);
 
     if (status->p.pool)
         hts_tpool_destroy(status->p.pool);
+    free(status);
 
     return ret;
 }
@@ -598,6 +970,7 @@ static void cleanup_opts(parsed_opts_t* opts)
     free(opts->unaccounted_header_name);
     free(opts->unaccounted_name);
     free(opts->output_format_string);
+    free(opts->tag);
     sam_global_args_free(&opts->ga);
     free(opts);
 }
@@ -31,10 +31,15 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdio.h>
 #include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/hts_endian.h"
 #include "samtools.h"
 #include "sam_opts.h"
+#include "bam_part.h"
 
 typedef struct {
     long long n_reads[2], n_mapped[2], n_pair_all[2], n_pair_map[2], n_pair_good[2];
@@ -69,6 +74,31 @@ typedef struct {
         if ((c)->flag & BAM_FDUP) ++(s)->n_dup[w];                      \
     } while (0)
 
+/*
+ * Counts the records in a BGZF compressed BAM file from the current position,
+ * reading only their fixed-size fields.  If end_block >= 0, stops at the
+ * first record starting at or after that block and sets *end to its virtual
+ * offset.  Returns 0 on success, -1 if the file is truncated or corrupt.
+ */
+static int flagstat_bam(BGZF *fp, int64_t end_block, bam_flagstat_t *s, uint64_t *end)
+{
+    uint8_t buf[36];
+    bam1_core_t core, *c = &core;
+    uint64_t voff = 0;
+    int ret;
+
+    while ((ret = bam_part_read_core(fp, buf, &voff)) == 0) {
+        if (end_block >= 0 && (int64_t) (voff >> 16) >= end_block) break;
+        c->tid = le_to_i32(buf + 4);
+        c->qual = buf[13];
+        c->flag = le_to_u16(buf + 18);
+        c->mtid = le_to_i32(buf + 24);
+        flagstat_loop(s, c);
+    }
+    *end = voff;
+    return ret < -1 ? -1 : 0;
+}
+
 bam_flagstat_t *bam_flagstat_core(samFile *fp, bam_hdr_t *h)
 {
     bam_flagstat_t *s;
@@ -76,6 +106,12 @@ bam_flagstat_t *bam_flagstat_core(samFile *fp, bam_hdr_t *h)
     bam1_core_t *c;
     int ret;
     s = (bam_flagstat_t*)calloc(1, sizeof(bam_flagstat_t));
+    if (hts_get_format(fp)->format == bam && hts_get_format(fp)->compression == bgzf) {
+        uint64_t end;
+        if (flagstat_bam(fp->fp.bgzf, -1, s, &end) < 0)
+            fprintf(stderr, "[bam_flagstat_core] Truncated file? Continue anyway.\n");
+        return s;
+    }
     b = bam_init1();
     c = &b->core;
     while ((ret = sam_read1(fp, h, b)) >= 0)
@@ -86,6 +122,161 @@ bam_flagstat_t *bam_flagstat_core(samFile *fp, bam_hdr_t *h)
     return s;
 }
 
+/*
+ * Multi-threaded counting for BGZF compressed BAM files.  The file is split
+ * between threads as described in bam_part.h, each thread counts the records
+ * starting in its partition, and the counts are then added up.
+ */
+
+typedef struct {
+    const char *fn;
+    const bam_hdr_t *h;
+    int64_t beg_block, end_block;   // end_block is -1 for the last partition
+    int start_known;
+    uint64_t start;
+    // Results
+    int ret;                        // 0 if done, -1 on error, 1 if no start found
+    uint64_t first, end;
+    bam_flagstat_t s;
+} fpart_t;
+
+static int fpart_run(fpart_t *p)
+{
+    BGZF *fp;
+
+    memset(&p->s, 0, sizeof(p->s));
+    p->ret = -1;
+    if (!(fp = bgzf_open(p->fn, "r"))) return p->ret;
+    if (!p->start_known
+        && (p->ret = bam_part_find_start(fp, p->h, p->beg_block, &p->start)) != 0)
+        goto done;
+    p->ret = -1;
+    if (bgzf_seek(fp, p->start, SEEK_SET) < 0) goto done;
+    p->first = p->start;
+    p->ret = flagstat_bam(fp, p->end_block, &p->s, &p->end);
+ done:
+    bgzf_close(fp);
+    return p->ret;
+}
+
+static void *fpart_thread(void *arg)
+{
+    fpart_run((fpart_t *) arg);
+    return NULL;
+}
+
+static void flagstat_add(bam_flagstat_t *s, const bam_flagstat_t *t)
+{
+    int w;
+    for (w = 0; w < 2; w++) {
+        s->n_reads[w] += t->n_reads[w];
+        s->n_mapped[w] += t->n_mapped[w];
+        s->n_pair_all[w] += t->n_pair_all[w];
+        s->n_pair_map[w] += t->n_pair_map[w];
+        s->n_pair_good[w] += t->n_pair_good[w];
+        s->n_sgltn[w] += t->n_sgltn[w];
+        s->n_read1[w] += t->n_read1[w];
+        s->n_read2[w] += t->n_read2[w];
+        s->n_dup[w] += t->n_dup[w];
+        s->n_diffchr[w] += t->n_diffchr[w];
+        s->n_diffhigh[w] += t->n_diffhigh[w];
+        s->n_secondary[w] += t->n_secondary[w];
+        s->n_supp[w] += t->n_supp[w];
+    }
+}
+
+/*
+ * Counts the records in fn using n_threads threads.  Returns 0 on success,
+ * -1 on error, or 1 if the file is not suitable (not a seekable, BGZF
+ * compressed BAM file, or too small to be worth splitting) and
+ * bam_flagstat_core() should be used instead.
+ */
+static int flagstat_parallel(const char *fn, int n_threads, bam_flagstat_t *s)
+{
+    struct stat st;
+    samFile *fp;
+    bam_hdr_t *h = NULL;
+    fpart_t *parts = NULL;
+    pthread_t *tids = NULL;
+    int64_t *starts = NULL;
+    int n_parts, n_started = 0, i, ret = -1;
+    uint64_t offset0;
+
+    if (n_threads < 2 || stat(fn, &st) < 0 || !S_ISREG(st.st_mode)) return 1;
+    if (!(fp = sam_open(fn, "r"))) return 1;
+    if (hts_get_format(fp)->format != bam || hts_get_format(fp)->compression != bgzf) {
+        sam_close(fp);
+        return 1;
+    }
+    if (!(h = sam_hdr_read(fp))) {
+        sam_close(fp);
+        return 1;
+    }
+    offset0 = bgzf_tell(fp->fp.bgzf);
+    sam_close(fp);
+
+    n_parts = (st.st_size - (int64_t) (offset0 >> 16)) / BAM_PART_MIN_SIZE;
+    if (n_parts > n_threads) n_parts = n_threads;
+    if (n_parts < 2) {
+        bam_hdr_destroy(h);
+        return 1;
+    }
+
+    if (!(starts = malloc((n_parts + 1) * sizeof(*starts)))) goto out;
+    if ((n_parts = bam_part_split(fn, st.st_size, offset0 >> 16, n_parts, starts)) < 0) {
+        print_error_errno("flagstat", "failed to read \"%s\"", fn);
+        goto out;
+    }
+    starts[n_parts] = -1;
+
+    if (!(parts = calloc(n_parts, sizeof(*parts)))
+        || !(tids = calloc(n_parts, sizeof(*tids))))
+        goto out;
+    for (i = 0; i < n_parts; i++) {
+        parts[i].fn = fn;
+        parts[i].h = h;
+        parts[i].beg_block = starts[i];
+        parts[i].end_block = starts[i+1];
+        parts[i].start_known = (i == 0);
+        parts[i].start = offset0;
+    }
+    for (n_started = 0; n_started < n_parts; n_started++) {
+        if (pthread_create(&tids[n_started], NULL, fpart_thread, &parts[n_started]) != 0) {
+            print_error_errno("flagstat", "failed to start thread");
+            goto out;
+        }
+    }
+    for (i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+    n_started = 0;
+
+    // Redo any partition that didn't start where the one before it ended,
+    // and as bam_flagstat_core() does, stop counting at a corrupt record
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < n_parts; i++) {
+        if (i > 0 && (parts[i].ret != 0 || parts[i].first != parts[i-1].end)) {
+            parts[i].start_known = 1;
+            parts[i].start = parts[i-1].end;
+            fpart_run(&parts[i]);
+        }
+        flagstat_add(s, &parts[i].s);
+        if (parts[i].ret != 0) {
+            fprintf(stderr, "[bam_flagstat_core] Truncated file? Continue anyway.\n");
+            break;
+        }
+    }
+    ret = 0;
+
+ out:
+    for (i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+    free(parts);
+    free(tids);
+    free(starts);
+    bam_hdr_destroy(h);
+    return ret;
+}
+
 static const char *percent(char *buffer, long long n, long long total)
 {
     if (total != 0) sprintf(buffer, "%.2f%%", (float)n / total * 100.0);
@@ -93,9 +284,63 @@ static const char *percent(char *buffer, long long n, long long total)
     return buffer;
 }
 
+static void out_fmt_default(const bam_flagstat_t *s)
+{
+    char b0[16], b1[16];
+    printf("%lld + %lld in total (QC-passed reads + QC-failed reads)\n", s->n_reads[0], s->n_reads[1]);
+    printf("%lld + %lld secondary\n", s->n_secondary[0], s->n_secondary[1]);
+    printf("%lld + %lld supplementary\n", s->n_supp[0], s->n_supp[1]);
+    printf("%lld + %lld duplicates\n", s->n_dup[0], s->n_dup[1]);
+    printf("%lld + %lld mapped (%s : %s)\n", s->n_mapped[0], s->n_mapped[1], percent(b0, s->n_mapped[0], s->n_reads[0]), percent(b1, s->n_mapped[1], s->n_reads[1]));
+    printf("%lld + %lld paired in sequencing\n", s->n_pair_all[0], s->n_pair_all[1]);
+    printf("%lld + %lld read1\n", s->n_read1[0], s->n_read1[1]);
+    printf("%lld + %lld read2\n", s->n_read2[0], s->n_read2[1]);
+    printf("%lld + %lld properly paired (%s : %s)\n", s->n_pair_good[0], s->n_pair_good[1], percent(b0, s->n_pair_good[0], s->n_pair_all[0]), percent(b1, s->n_pair_good[1], s->n_pair_all[1]));
+    printf("%lld + %lld with itself and mate mapped\n", s->n_pair_map[0], s->n_pair_map[1]);
+    printf("%lld + %lld singletons (%s : %s)\n", s->n_sgltn[0], s->n_sgltn[1], percent(b0, s->n_sgltn[0], s->n_pair_all[0]), percent(b1, s->n_sgltn[1], s->n_pair_all[1]));
+    printf("%lld + %lld with mate mapped to a different chr\n", s->n_diffchr[0], s->n_diffchr[1]);
+    printf("%lld + %lld with mate mapped to a different chr (mapQ>=5)\n", s->n_diffhigh[0], s->n_diffhigh[1]);
+}
+
+static void json_percent(const char *key, long long n, long long total)
+{
+    if (total != 0) printf("  \"%s %%\": %.2f,\n", key, (float)n / total * 100.0);
+    else printf("  \"%s %%\": null,\n", key);
+}
+
+static void out_fmt_json(const bam_flagstat_t *s)
+{
+    static const char *const name[2] = { "QC-passed reads", "QC-failed reads" };
+    int w;
+    printf("{\n");
+    for (w = 0; w < 2; w++) {
+        printf(" \"%s\": {\n", name[w]);
+        printf("  \"total\": %lld,\n", s->n_reads[w]);
+        printf("  \"secondary\": %lld,\n", s->n_secondary[w]);
+        printf("  \"supplementary\": %lld,\n", s->n_supp[w]);
+        printf("  \"duplicates\": %lld,\n", s->n_dup[w]);
+        printf("  \"mapped\": %lld,\n", s->n_mapped[w]);
+        json_percent("mapped", s->n_mapped[w], s->n_reads[w]);
+        printf("  \"paired in sequencing\": %lld,\n", s->n_pair_all[w]);
+        printf("  \"read1\": %lld,\n", s->n_read1[w]);
+        printf("  \"read2\": %lld,\n", s->n_read2[w]);
+        printf("  \"properly paired\": %lld,\n", s->n_pair_good[w]);
+        json_percent("properly paired", s->n_pair_good[w], s->n_pair_all[w]);
+        printf("  \"with itself and mate mapped\": %lld,\n", s->n_pair_map[w]);
+        printf("  \"singletons\": %lld,\n", s->n_sgltn[w]);
+        json_percent("singletons", s->n_sgltn[w], s->n_pair_all[w]);
+        printf("  \"with mate mapped to a different chr\": %lld,\n", s->n_diffchr[w]);
+        printf("  \"with mate mapped to a different chr (mapQ>=5)\": %lld\n", s->n_diffhigh[w]);
+        printf(" }%s\n", w == 0 ? "," : "");
+    }
+    printf("}\n");
+}
+
 static void usage_exit(FILE *fp, int exit_status)
 {
     fprintf(fp, "Usage: samtools flagstat [options] <in.bam>\n");
+    fprintf(fp, "  -O, --output-fmt FORMAT\n"
+                "               Output format, \"default\" or \"json\" [default]\n");
     sam_global_opt_help(fp, "-.---@");
     exit(exit_status);
 }
@@ -105,8 +350,7 @@ int bam_flagstat(int argc, char *argv[])
     samFile *fp;
     bam_hdr_t *header;
     bam_flagstat_t *s;
-    char b0[16], b1[16];
-    int c;
+    int c, out_json = 0, r;
 
     enum {
         INPUT_FMT_OPTION = CHAR_MAX+1,
@@ -115,11 +359,20 @@ int bam_flagstat(int argc, char *argv[])
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', '-', '@'),
+        {"output-fmt", required_argument, NULL, 'O'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((c = getopt_long(argc, argv, "@:", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "@:O:", lopts, NULL)) >= 0) {
         switch (c) {
+        case 'O':
+            if (strcmp(optarg, "json") == 0) out_json = 1;
+            else if (strcmp(optarg, "default") == 0) out_json = 0;
+            else {
+                print_error("flagstat", "unknown output format \"%s\"", optarg);
+                usage_exit(stderr, EXIT_FAILURE);
+            }
+            break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
             /* else fall-through */
         case '?':
@@ -131,6 +384,21 @@ int bam_flagstat(int argc, char *argv[])
         if (argc == optind) usage_exit(stdout, EXIT_SUCCESS);
         else usage_exit(stderr, EXIT_FAILURE);
     }
+
+    // Large BAM files are split between the threads rather than having the
+    // threads only decompress for a single reader
+    if (!(s = calloc(1, sizeof(*s)))) {
+        print_error("flagstat", "out of memory");
+        return 1;
+    }
+    r = ga.in.format == unknown_format ? flagstat_parallel(argv[optind], ga.nthreads, s) : 1;
+    if (r < 0) {
+        free(s);
+        return 1;
+    }
+    if (r == 0) goto print;
+    free(s);
+
     fp = sam_open_format(argv[optind], "r", &ga.in);
     if (fp == NULL) {
         print_error_errno("flagstat", "Cannot open input file \"%s\"", argv[optind]);
@@ -140,7 +408,7 @@ int bam_flagstat(int argc, char *argv[])
         hts_set_threads(fp, ga.nthreads);
 
     if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS,
-                    SAM_FLAG | SAM_MAPQ | SAM_RNEXT)) {
+                    SAM_RNAME | SAM_FLAG | SAM_MAPQ | SAM_RNEXT)) {
         fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
         return 1;
     }
@@ -156,22 +424,13 @@ int bam_flagstat(int argc, char *argv[])
         return 1;
     }
     s = bam_flagstat_core(fp, header);
-    printf("%lld + %lld in total (QC-passed reads + QC-failed reads)\n", s->n_reads[0], s->n_reads[1]);
-    printf("%lld + %lld secondary\n", s->n_secondary[0], s->n_secondary[1]);
-    printf("%lld + %lld supplementary\n", s->n_supp[0], s->n_supp[1]);
-    printf("%lld + %lld duplicates\n", s->n_dup[0], s->n_dup[1]);
-    printf("%lld + %lld mapped (%s : %s)\n", s->n_mapped[0], s->n_mapped[1], percent(b0, s->n_mapped[0], s->n_reads[0]), percent(b1, s->n_mapped[1], s->n_reads[1]));
-    printf("%lld + %lld paired in sequencing\n", s->n_pair_all[0], s->n_pair_all[1]);
-    printf("%lld + %lld read1\n", s->n_read1[0], s->n_read1[1]);
-    printf("%lld + %lld read2\n", s->n_read2[0], s->n_read2[1]);
-    printf("%lld + %lld properly paired (%s : %s)\n", s->n_pair_good[0], s->n_pair_good[1], percent(b0, s->n_pair_good[0], s->n_pair_all[0]), percent(b1, s->n_pair_good[1], s->n_pair_all[1]));
-    printf("%lld + %lld with itself and mate mapped\n", s->n_pair_map[0], s->n_pair_map[1]);
-    printf("%lld + %lld singletons (%s : %s)\n", s->n_sgltn[0], s->n_sgltn[1], percent(b0, s->n_sgltn[0], s->n_pair_all[0]), percent(b1, s->n_sgltn[1], s->n_pair_all[1]));
-    printf("%lld + %lld with mate mapped to a different chr\n", s->n_diffchr[0], s->n_diffchr[1]);
-    printf("%lld + %lld with mate mapped to a different chr (mapQ>=5)\n", s->n_diffhigh[0], s->n_diffhigh[1]);
-    free(s);
     bam_hdr_destroy(header);
     sam_close(fp);
+
+ print:
+    if (out_json) out_fmt_json(s);
+    else out_fmt_default(s);
+    free(s);
     sam_global_args_free(&ga);
     return 0;
 }
@@ -42,8 +42,11 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
 #include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "tmp_file.h"
 
 #define DEF_CLEVEL 1
+#define DEF_MAX_MEM (768 << 20)
 
 static inline unsigned hash_Wang(unsigned key)
 {
@@ -66,10 +69,24 @@ static inline unsigned hash_X31_Wang(const char *s)
 }
 
 typedef struct {
-    unsigned key;
+    uint64_t key; // temporary file number and hash of the read name
     bam1_t *b;
 } elem_t;
 
+// Sorting on this key gives the same order whether the reads went through
+// the temporary files or were collated in memory.
+static inline uint64_t elem_key(const bam1_t *b, int n_files)
+{
+    unsigned h = hash_X31_Wang(bam_get_qname(b));
+    return (uint64_t) (h % n_files) << 32 | h;
+}
+
+// Approximate memory used to hold a read for collating in memory
+static inline size_t elem_mem(const bam1_t *b)
+{
+    return sizeof(elem_t) + sizeof(bam1_t) + b->m_data;
+}
+
 static inline int elem_lt(elem_t x, elem_t y)
 {
     if (x.key < y.key) return 1;
@@ -87,10 +104,12 @@ KSORT_INIT(bamshuf, elem_t, elem_lt)
 typedef struct {
     int written;
     bam1_t *b;
+    uint64_t n; // number of reads stored before this one
 } bam_item_t;
 
 typedef struct {
-    bam1_t *bam_pool;
+    bam1_t **bam_pools;
+    size_t n_pools;
     bam_item_t *items;
     size_t size;
     size_t index;
@@ -129,20 +148,27 @@ static int create_bam_list(bam_list_t *list, size_t max_size) {
     size_t i;
 
     list->size = list->index = 0;
-    list->items    = NULL;
-    list->bam_pool = NULL;
+    list->items     = NULL;
+    list->bam_pools = NULL;
+    list->n_pools   = 0;
 
     if ((list->items = malloc(max_size * sizeof(bam_item_t))) == NULL) {
         return 1;
     }
 
-    if ((list->bam_pool = calloc(max_size, sizeof(bam1_t))) == NULL) {
+    if ((list->bam_pools = malloc(sizeof(bam1_t *))) == NULL) {
+        return 1;
+    }
+
+    if ((list->bam_pools[0] = calloc(max_size, sizeof(bam1_t))) == NULL) {
         return 1;
     }
+    list->n_pools = 1;
 
     for (i = 0; i < max_size; i++) {
-        list->items[i].b = &list->bam_pool[i];
+        list->items[i].b = &list->bam_pools[0][i];
         list->items[i].written = 1;
+        list->items[i].n = 0;
     }
 
     list->size  = max_size;
@@ -152,43 +178,456 @@ static int create_bam_list(bam_list_t *list, size_t max_size) {
 }
 
 
+// Make the list bigger.  The stored reads keep their order, so the oldest
+// one is still the next to be replaced, and the hash entries pointing at
+// them are updated to match.
+static int grow_bam_list(bam_list_t *list, size_t new_size, khash_t(bam_store) *stored) {
+    size_t i, old_size = list->size;
+    bam_item_t *items;
+    bam1_t *pool, **pools;
+    khiter_t itr;
+
+    if (new_size <= old_size) return 0;
+
+    if ((pools = realloc(list->bam_pools, (list->n_pools + 1) * sizeof(bam1_t *))) == NULL) {
+        return 1;
+    }
+    list->bam_pools = pools;
+
+    if ((items = malloc(new_size * sizeof(bam_item_t))) == NULL) {
+        return 1;
+    }
+
+    if ((pool = calloc(new_size - old_size, sizeof(bam1_t))) == NULL) {
+        free(items);
+        return 1;
+    }
+    list->bam_pools[list->n_pools++] = pool;
+
+    for (i = 0; i < old_size; i++) {
+        items[i] = list->items[(list->index + i) % old_size];
+    }
+
+    for (; i < new_size; i++) {
+        items[i].b = &pool[i - old_size];
+        items[i].written = 1;
+        items[i].n = 0;
+    }
+
+    for (itr = kh_begin(stored); itr != kh_end(stored); ++itr) {
+        if (kh_exist(stored, itr)) {
+            size_t j = kh_value(stored, itr).bi - list->items;
+            kh_value(stored, itr).bi = &items[(j + old_size - list->index) % old_size];
+        }
+    }
+
+    free(list->items);
+    list->items = items;
+    list->index = old_size;
+    list->size  = new_size;
+
+    return 0;
+}
+
+
 static void destroy_bam_list(bam_list_t *list) {
     size_t i;
 
     for (i = 0; i < list->size; i++) {
-        free(list->bam_pool[i].data);
+        free(list->items[i].b->data);
+    }
+
+    for (i = 0; i < list->n_pools; i++) {
+        free(list->bam_pools[i]);
     }
 
-    free(list->bam_pool);
+    free(list->bam_pools);
     free(list->items);
 }
 
 
-static inline int write_to_bin_file(bam1_t *bam, int64_t *count, samFile **bin_files, char **names, bam_hdr_t *header, int files) {
+/*
+ * Second level store for streaming mode.  Reads that drop out of the fast
+ * mode window wait here, in the order they arrived, for their mates.  Only
+ * when this is full does the oldest read go to the temporary files, so most
+ * pairs can still be written out before the end of the input.
+ */
+typedef struct {
+    bam1_t *b;
+    uint64_t n; // number of reads stored before this one
+} spill_item_t;
+
+KHASH_MAP_INIT_STR(spill_names, uint64_t)
+
+typedef struct {
+    khash_t(spill_names) *names; // position in items by read name
+    spill_item_t *items;         // circular, size a power of 2
+    uint64_t head, tail;         // positions of the oldest and next items
+    size_t size;
+    size_t mem, max_mem;
+} spill_store_t;
+
+
+static inline size_t spill_mem(const bam1_t *b) {
+    return sizeof(bam1_t) + sizeof(spill_item_t) + b->m_data + 16;
+}
+
+
+static int init_spill_store(spill_store_t *spill, size_t max_mem) {
+    spill->head = spill->tail = 0;
+    spill->size = 1024;
+    spill->mem = 0;
+    spill->max_mem = max_mem;
+    spill->items = calloc(spill->size, sizeof(spill_item_t));
+    spill->names = kh_init(spill_names);
+    return spill->items && spill->names ? 0 : 1;
+}
+
+
+/*
+ * Close up the gaps left by reads taken out of the middle of the store, so
+ * that the items array only grows when most of it is in use.
+ */
+static void spill_store_compact(spill_store_t *spill) {
+    uint64_t i, j = spill->head, mask = spill->size - 1;
+
+    for (i = spill->head; i < spill->tail; i++) {
+        spill_item_t *item = &spill->items[i & mask];
+        if (!item->b) continue;
+        if (i != j) {
+            khiter_t itr = kh_get(spill_names, spill->names, bam_get_qname(item->b));
+            if (itr != kh_end(spill->names)) kh_value(spill->names, itr) = j;
+            spill->items[j & mask] = *item;
+            item->b = NULL;
+        }
+        j++;
+    }
+    spill->tail = j;
+}
+
+
+/*
+ * Move a read that has left the window into the store.  The contents of b
+ * are moved rather than copied, leaving b empty.
+ * Returns 0 on success, 1 if a read of the same name is already stored and
+ * -1 on error.
+ */
+static int spill_store_add(spill_store_t *spill, bam1_t *b, uint64_t n) {
+    bam1_t *c, tmp;
+    khiter_t itr;
+    int ret;
+
+    if (spill->tail - spill->head == spill->size
+        && kh_size(spill->names) <= spill->size / 2)
+        spill_store_compact(spill);
+
+    if (spill->tail - spill->head == spill->size) {
+        size_t new_size = spill->size * 2;
+        spill_item_t *items = malloc(new_size * sizeof(spill_item_t));
+        uint64_t i;
+        if (!items) return -1;
+        for (i = spill->head; i < spill->tail; i++) {
+            items[i & (new_size - 1)] = spill->items[i & (spill->size - 1)];
+        }
+        free(spill->items);
+        spill->items = items;
+        spill->size = new_size;
+    }
+
+    if ((c = bam_init1()) == NULL) return -1;
+    tmp = *c; *c = *b; *b = tmp;
+
+    itr = kh_put(spill_names, spill->names, bam_get_qname(c), &ret);
+    if (ret <= 0) {
+        // Give the read back
+        tmp = *c; *c = *b; *b = tmp;
+        bam_destroy1(c);
+        return ret == 0 ? 1 : -1;
+    }
+
+    kh_value(spill->names, itr) = spill->tail;
+    spill->items[spill->tail & (spill->size - 1)].b = c;
+    spill->items[spill->tail & (spill->size - 1)].n = n;
+    spill->tail++;
+    spill->mem += spill_mem(c);
+
+    return 0;
+}
+
+
+// Remove the read called name, if present, setting *n to its number.
+static bam1_t *spill_store_take(spill_store_t *spill, const char *name, uint64_t *n) {
+    khiter_t itr = kh_get(spill_names, spill->names, name);
+    spill_item_t *item;
+    bam1_t *b;
+
+    if (itr == kh_end(spill->names)) return NULL;
+
+    item = &spill->items[kh_value(spill->names, itr) & (spill->size - 1)];
+    b = item->b;
+    *n = item->n;
+    item->b = NULL;
+    kh_del(spill_names, spill->names, itr);
+    spill->mem -= spill_mem(b);
+
+    // Don't let taken reads at the old end hold the window open
+    while (spill->head < spill->tail && !spill->items[spill->head & (spill->size - 1)].b)
+        spill->head++;
+
+    return b;
+}
+
+
+// Remove the oldest read, or return NULL if there are none left.
+static bam1_t *spill_store_pop(spill_store_t *spill) {
+    while (spill->head < spill->tail) {
+        spill_item_t *item = &spill->items[spill->head++ & (spill->size - 1)];
+        if (item->b) {
+            bam1_t *b = item->b;
+            khiter_t itr = kh_get(spill_names, spill->names, bam_get_qname(b));
+            if (itr != kh_end(spill->names)) kh_del(spill_names, spill->names, itr);
+            item->b = NULL;
+            spill->mem -= spill_mem(b);
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void destroy_spill_store(spill_store_t *spill) {
+    bam1_t *b;
+
+    if (spill->items && spill->names) {
+        while ((b = spill_store_pop(spill)) != NULL) bam_destroy1(b);
+    }
+
+    free(spill->items);
+
+    if (spill->names) kh_destroy(spill_names, spill->names);
+}
+
+
+static inline int write_to_bin_file(bam1_t *bam, int64_t *count, size_t *mem, tmp_file_t *bin_files, int files) {
     uint32_t x;
 
     x = hash_X31_Wang(bam_get_qname(bam)) % files;
 
-    if (sam_write1(bin_files[x], header, bam) < 0) {
-        print_error_errno("collate", "Couldn't write to intermediate file \"%s\"", names[x]);
+    if (tmp_file_write(&bin_files[x], bam)) {
+        print_error("collate", "Couldn't write to intermediate file \"%s\"", bin_files[x].name);
         return 1;
     }
 
     ++count[x];
+    mem[x] += sizeof(elem_t) + sizeof(bam1_t) + bam->l_data;
+
+    return 0;
+}
+
+
+// Open the temporary files.  Returns the number opened, which is less than
+// n_files on failure.
+static int open_bin_files(tmp_file_t *bin_files, int n_files, const char *pre) {
+    kstring_t name = { 0, 0, NULL };
+    int i;
+
+    for (i = 0; i < n_files; ++i) {
+        name.l = 0;
+        if (ksprintf(&name, "%s.%04d", pre, i) < 0) break;
+        if (tmp_file_open_write(&bin_files[i], name.s, 1)) {
+            print_error("collate", "Cannot open intermediate file \"%s\"", name.s);
+            break;
+        }
+    }
+
+    free(name.s);
+    return i;
+}
+
+
+// Read back the c reads in one of the temporary files.  tb is used to
+// receive reads from the file before they are copied to a[]; it borrows the
+// file's buffer, so is detached from it again before returning.
+static int read_bin_file(tmp_file_t *tmp, int64_t c, elem_t *a, int n_files, bam1_t *tb) {
+    int64_t j;
+    int ret = 0;
+
+    if (tmp_file_end_write(tmp) || tmp_file_begin_read(tmp, NULL)) {
+        print_error("collate", "Couldn't rewind intermediate file \"%s\"", tmp->name);
+        return -1;
+    }
+
+    for (j = 0; j < c; ++j) {
+        if (tmp_file_read(tmp, tb) <= 0 || !bam_copy1(a[j].b, tb)) {
+            print_error("collate", "Error reading \"%s\"", tmp->name);
+            ret = -1;
+            break;
+        }
+        a[j].key = elem_key(a[j].b, n_files);
+    }
+
+    tb->data = NULL;
+    return ret;
+}
 
+
+// Make sure a[] has at least n reads allocated.
+static int grow_elems(elem_t **a, int64_t *m_a, int64_t *n_b, int64_t n) {
+    if (n > *m_a) {
+        int64_t m = *m_a ? *m_a : 1024;
+        elem_t *tmp;
+        while (m < n) m *= 2;
+        tmp = realloc(*a, m * sizeof(elem_t));
+        if (!tmp) return -1;
+        *a = tmp;
+        *m_a = m;
+    }
+    for (; *n_b < n; ++*n_b) {
+        if (!((*a)[*n_b].b = bam_init1())) return -1;
+    }
     return 0;
 }
 
 
+static int write_elems(samFile *fpw, bam_hdr_t *h, elem_t *a, int64_t c) {
+    int64_t j;
+
+    for (j = 0; j < c; ++j) {
+        if (sam_write1(fpw, h, a[j].b) < 0) {
+            print_error_errno("collate", "Error writing to output");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Reading back, decoding and sorting the temporary files is done by the
+ * thread pool when there is one.  Several files can be in progress at once,
+ * subject to the memory limit, while the main thread writes out the
+ * finished ones in order.
+ */
+typedef struct {
+    tmp_file_t *tmp;   // file to load
+    int64_t c;         // number of reads in it
+    int n_files;
+    int bin;
+    elem_t *a;         // the reads, sorted into output order
+    int64_t m_a, n_b;
+    bam1_t *tb;
+    int ret;
+} bin_job_t;
+
+static void *load_bin_file(void *arg) {
+    bin_job_t *job = (bin_job_t *) arg;
+
+    job->ret = -1;
+    if (grow_elems(&job->a, &job->m_a, &job->n_b, job->c) < 0
+        || (!job->tb && !(job->tb = bam_init1()))) {
+        print_error("collate", "Out of memory");
+        return job;
+    }
+    if (read_bin_file(job->tmp, job->c, job->a, job->n_files, job->tb) < 0)
+        return job;
+
+    ks_introsort(bamshuf, job->c, job->a); // Shuffle all the reads
+    job->ret = 0;
+    return job;
+}
+
+static int write_bins_threaded(samFile *fpw, bam_hdr_t *h, tmp_file_t *fpt,
+                               int64_t *cnt, size_t *bin_mem, int n_files,
+                               size_t max_mem, hts_tpool *pool, int *n_done) {
+    int qsize = hts_tpool_size(pool) * 2, n_jobs = 0, next = 0, i, ret = -1;
+    int *free_jobs = NULL, n_free = 0;
+    size_t mem = 0;
+    bin_job_t *jobs = NULL;
+    hts_tpool_process *q = NULL;
+    int64_t j;
+
+    jobs = calloc(qsize, sizeof(*jobs));
+    free_jobs = malloc(qsize * sizeof(*free_jobs));
+    if (!jobs || !free_jobs) {
+        print_error("collate", "Out of memory");
+        goto out;
+    }
+    for (i = 0; i < qsize; ++i) free_jobs[n_free++] = qsize - 1 - i;
+
+    if (!(q = hts_tpool_process_init(pool, qsize, 0))) {
+        print_error("collate", "Couldn't create thread pool queue");
+        goto out;
+    }
+
+    while (*n_done < n_files) {
+        hts_tpool_result *r;
+        bin_job_t *job;
+
+        // Start on as many files as the memory limit allows, but always
+        // at least the next one needed.
+        while (next < n_files && n_free > 0
+               && (n_jobs == 0 || mem + bin_mem[next] <= max_mem)) {
+            job = &jobs[free_jobs[--n_free]];
+            job->tmp = &fpt[next];
+            job->c = cnt[next];
+            job->n_files = n_files;
+            job->bin = next;
+            if (hts_tpool_dispatch(pool, q, load_bin_file, job) < 0) {
+                print_error_errno("collate", "Couldn't dispatch job");
+                goto out;
+            }
+            mem += bin_mem[next++];
+            ++n_jobs;
+        }
+
+        if (!(r = hts_tpool_next_result_wait(q))) {
+            print_error("collate", "Couldn't get result from thread pool");
+            goto out;
+        }
+        job = (bin_job_t *) hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        if (job->ret < 0) goto out;
+
+        tmp_file_destroy(job->tmp, NULL, 0);
+        *n_done = job->bin + 1;
+        if (write_elems(fpw, h, job->a, job->c) < 0) goto out;
+
+        mem -= bin_mem[job->bin];
+        --n_jobs;
+        free_jobs[n_free++] = job - jobs;
+    }
+    ret = 0;
+
+ out:
+    // Waits for any jobs still running
+    if (q) hts_tpool_process_destroy(q);
+    if (jobs) {
+        for (i = 0; i < qsize; ++i) {
+            for (j = 0; j < jobs[i].n_b; ++j) bam_destroy1(jobs[i].a[j].b);
+            free(jobs[i].a);
+            if (jobs[i].tb) bam_destroy1(jobs[i].tb);
+        }
+    }
+    free(jobs);
+    free(free_jobs);
+    return ret;
+}
+
+
 static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
-                   int is_stdout, const char *output_file, int fast, int store_max, sam_global_args *ga)
+                   int is_stdout, const char *output_file, int fast, int stream,
+                   int store_max, size_t max_mem, sam_global_args *ga)
 {
-    samFile *fp, *fpw = NULL, **fpt = NULL;
-    char **fnt = NULL, modew[8];
-    bam1_t *b = NULL;
-    int i, counter, l, r;
+    samFile *fp, *fpw = NULL;
+    tmp_file_t *fpt = NULL;
+    char modew[8];
+    bam1_t *b = NULL, *tb = NULL;
+    int i, n_open = 0, n_done = 0, l, r = 0;
     bam_hdr_t *h = NULL;
-    int64_t j, max_cnt = 0, *cnt = NULL;
+    int64_t j, max_cnt = 0, *cnt = NULL, n_a = 0, m_a = 0, n_b = 0;
+    size_t *bin_mem = NULL;
     elem_t *a = NULL;
     htsThreadPool p = {NULL, 0};
 
@@ -259,46 +698,47 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
         goto fail;
     }
 
-    fnt = (char**)calloc(n_files, sizeof(char*));
-    if (!fnt) goto mem_fail;
-    fpt = (samFile**)calloc(n_files, sizeof(samFile*));
+    // The temporary files hold LZ4 compressed records (see tmp_file.c),
+    // which are much quicker to write and read back than BGZF.
+    fpt = (tmp_file_t*)calloc(n_files, sizeof(tmp_file_t));
     if (!fpt) goto mem_fail;
     cnt = (int64_t*)calloc(n_files, 8);
     if (!cnt) goto mem_fail;
-
-    for (i = counter = 0; i < n_files; ++i) {
-        fnt[i] = (char*)calloc(l + 20, 1);
-        if (!fnt[i]) goto mem_fail;
-        do {
-            sprintf(fnt[i], "%s.%04d.bam", pre, counter++);
-            fpt[i] = sam_open(fnt[i], "wxb1");
-        } while (!fpt[i] && errno == EEXIST);
-        if (fpt[i] == NULL) {
-            print_error_errno("collate", "Cannot open intermediate file \"%s\"", fnt[i]);
-            goto fail;
-        }
-        if (p.pool) hts_set_opt(fpt[i], HTS_OPT_THREAD_POOL, &p);
-        if (sam_hdr_write(fpt[i], h) < 0) {
-            print_error_errno("collate", "Couldn't write header to intermediate file \"%s\"", fnt[i]);
-            goto fail;
-        }
-    }
+    bin_mem = (size_t*)calloc(n_files, sizeof(size_t));
+    if (!bin_mem) goto mem_fail;
 
     if (fast) {
         khash_t(bam_store) *stored = kh_init(bam_store);
         khiter_t itr;
         bam_list_t list;
+        spill_store_t spill;
+        uint64_t n_stored = 0, n_len = 0, max_dist = 0;
+        size_t epoch = 0, epoch_pairs = 0, epoch_misses = 0;
         int err = 0;
         if (!stored) goto mem_fail;
+        memset(&spill, 0, sizeof(spill));
 
         if (store_max < 2) store_max = 2;
 
+        if ((n_open = open_bin_files(fpt, n_files, pre)) < n_files) {
+            kh_destroy(bam_store, stored);
+            goto fail;
+        }
+
         if (create_bam_list(&list, store_max)) {
             fprintf(stderr, "[collate[ ERROR: unable to create bam list.\n");
             err = 1;
             goto fast_fail;
         }
 
+        // In streaming mode half the memory goes to the second level store
+        // and the rest is available for growing the window.
+        if (stream && init_spill_store(&spill, max_mem / 2)) {
+            fprintf(stderr, "[collate] ERROR: unable to create read store.\n");
+            err = 1;
+            goto fast_fail;
+        }
+
         while ((r = sam_read1(fp, h, list.items[list.index].b)) >= 0) {
             int ret;
             bam1_t *b = list.items[list.index].b;
@@ -307,34 +747,102 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
             // strictly paired reads only
             if (!(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) && (readflag == BAM_FREAD1 || readflag == BAM_FREAD2)) {
 
+                bam1_t *mate = NULL;
+                uint64_t mate_n;
+
                 itr = kh_get(bam_store, stored, bam_get_qname(b));
 
-                if (itr == kh_end(stored)) {
+                if (itr == kh_end(stored) && stream
+                    && (mate = spill_store_take(&spill, bam_get_qname(b), &mate_n)) != NULL) {
+                    // The mate has left the window, but is still in memory
+                    bam1_t *r1 = (b->core.flag & BAM_FREAD1) ? b : mate;
+                    bam1_t *r2 = (b->core.flag & BAM_FREAD1) ? mate : b;
+
+                    if (sam_write1(fpw, h, r1) < 0 || sam_write1(fpw, h, r2) < 0) {
+                        fprintf(stderr, "[collate] ERROR: could not write alignments.\n");
+                        bam_destroy1(mate);
+                        err = 1;
+                        goto fast_fail;
+                    }
+
+                    bam_destroy1(mate);
+                    epoch_pairs++;
+                    epoch_misses++;
+                    if (max_dist < n_stored - mate_n) max_dist = n_stored - mate_n;
+                } else if (itr == kh_end(stored)) {
                     // new read
                     itr = kh_put(bam_store, stored, bam_get_qname(b), &ret);
 
                     if (ret > 0) { // okay to go ahead store it
-                        kh_value(stored, itr).bi = store_bam(&list);
+                        bam_item_t *bi = store_bam(&list);
+                        kh_value(stored, itr).bi = bi;
+                        bi->n = n_stored++;
+                        n_len += b->l_data;
 
                         // see if the next one on the list needs to be written out
                         if (write_bam_needed(&list)) {
-                            if (write_to_bin_file(list.items[list.index].b, cnt, fpt, fnt, h, n_files) < 0) {
+                            bam1_t *old = list.items[list.index].b;
+
+                            itr = kh_get(bam_store, stored, bam_get_qname(old));
+
+                            if (itr != kh_end(stored)) {
+                                kh_del(bam_store, stored, itr);
+                            } else {
+                                fprintf(stderr, "[collate] ERROR: stored value not in hash.\n");
+                                err = 1;
+                                goto fast_fail;
+                            }
+
+                            ret = 1;
+                            if (stream) {
+                                ret = spill_store_add(&spill, old, list.items[list.index].n);
+                                if (ret < 0) {
+                                    fprintf(stderr, "[collate] ERROR: unable to store read.\n");
+                                    err = 1;
+                                    goto fast_fail;
+                                }
+                            }
+
+                            if (ret > 0 && write_to_bin_file(old, cnt, bin_mem, fpt, n_files)) {
                                 fprintf(stderr, "[collate] ERROR: could not write line.\n");
                                 err = 1;
                                 goto fast_fail;
-                            } else {
-                                mark_bam_as_written(&list);
+                            }
+
+                            mark_bam_as_written(&list);
 
-                                itr = kh_get(bam_store, stored, bam_get_qname(list.items[list.index].b));
+                            // Only reads whose mates are a long way away
+                            // go to the temporary files
+                            while (stream && spill.mem > spill.max_mem) {
+                                bam1_t *sb = spill_store_pop(&spill);
+                                if (!sb) break;
+                                if (write_to_bin_file(sb, cnt, bin_mem, fpt, n_files)) {
+                                    bam_destroy1(sb);
+                                    err = 1;
+                                    goto fast_fail;
+                                }
+                                bam_destroy1(sb);
+                            }
+                        }
 
-                                if (itr != kh_end(stored)) {
-                                    kh_del(bam_store, stored, itr);
-                                } else {
-                                    fprintf(stderr, "[collate] ERROR: stored value not in hash.\n");
+                        // If too many pairs are being missed by the window,
+                        // make it big enough to cover the distances seen.
+                        if (stream && ++epoch >= list.size) {
+                            size_t per_read = sizeof(bam1_t) + sizeof(bam_item_t) + 32 + n_len / n_stored;
+                            size_t max_size = max_mem / 2 / per_read, new_size;
+
+                            if (epoch_misses * 100 > epoch_pairs && list.size < max_size) {
+                                new_size = list.size * 2;
+                                if (new_size < max_dist + max_dist / 4) new_size = max_dist + max_dist / 4;
+                                if (new_size > max_size) new_size = max_size;
+                                if (grow_bam_list(&list, new_size, stored)) {
+                                    fprintf(stderr, "[collate] ERROR: unable to grow bam list.\n");
                                     err = 1;
                                     goto fast_fail;
                                 }
                             }
+                            epoch = epoch_pairs = epoch_misses = 0;
+                            max_dist = 0;
                         }
                     } else if (ret == 0) {
                         fprintf(stderr, "[collate] ERROR: value already in hash.\n");
@@ -374,6 +882,7 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
                     // remove stored read
                     kh_value(stored, itr).bi->written = 1;
                     kh_del(bam_store, stored, itr);
+                    epoch_pairs++;
                 }
             }
         }
@@ -382,7 +891,7 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
             if (write_bam_needed(&list)) {
                 bam1_t *b = list.items[list.index].b;
 
-                if (write_to_bin_file(b, cnt, fpt, fnt, h, n_files)) {
+                if (write_to_bin_file(b, cnt, bin_mem, fpt, n_files)) {
                     err = 1;
                     goto fast_fail;
                 } else {
@@ -392,7 +901,20 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
             }
         }
 
+        if (stream) {
+            bam1_t *sb;
+            while ((sb = spill_store_pop(&spill)) != NULL) {
+                if (write_to_bin_file(sb, cnt, bin_mem, fpt, n_files)) {
+                    bam_destroy1(sb);
+                    err = 1;
+                    goto fast_fail;
+                }
+                bam_destroy1(sb);
+            }
+        }
+
  fast_fail:
+        destroy_spill_store(&spill);
         if (err) {
             for (itr = kh_begin(stored); itr != kh_end(stored); ++itr) {
                 if (kh_exist(stored, itr)) {
@@ -409,85 +931,92 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
         }
 
     } else {
-        b = bam_init1();
-        if (!b) goto mem_fail;
+        size_t mem = 0;
+
+        // Keep reads in memory for as long as they fit
+        for (;;) {
+            if (grow_elems(&a, &m_a, &n_b, n_a + 1) < 0) goto mem_fail;
+            if ((r = sam_read1(fp, h, a[n_a].b)) < 0) break;
+            a[n_a].key = elem_key(a[n_a].b, n_files);
+            mem += elem_mem(a[n_a].b);
+            ++n_a;
+            if (mem >= max_mem) break;
+        }
 
-        while ((r = sam_read1(fp, h, b)) >= 0) {
-            if (write_to_bin_file(b, cnt, fpt, fnt, h, n_files)) {
-                bam_destroy1(b);
+        if (r == -1) {
+            // Everything fitted, so no need for temporary files
+            ks_introsort(bamshuf, n_a, a); // Shuffle all the reads
+            if (write_elems(fpw, h, a, n_a) < 0) goto fail;
+            goto done;
+        }
+
+        if (r >= 0) {
+            // Out of memory; move everything to the temporary files and
+            // carry on there
+            if ((n_open = open_bin_files(fpt, n_files, pre)) < n_files)
                 goto fail;
+            for (j = 0; j < n_a; ++j) {
+                if (write_to_bin_file(a[j].b, cnt, bin_mem, fpt, n_files)) goto fail;
+            }
+
+            b = bam_init1();
+            if (!b) goto mem_fail;
+
+            while ((r = sam_read1(fp, h, b)) >= 0) {
+                if (write_to_bin_file(b, cnt, bin_mem, fpt, n_files)) {
+                    bam_destroy1(b);
+                    goto fail;
+                }
             }
-        }
 
-        bam_destroy1(b);
+            bam_destroy1(b);
+        }
     }
 
     if (r < -1) {
         fprintf(stderr, "Error reading input file\n");
         goto fail;
     }
-    for (i = 0; i < n_files; ++i) {
-        // Close split output
-        r = sam_close(fpt[i]);
-        fpt[i] = NULL;
-        if (r < 0) {
-            fprintf(stderr, "Error on closing '%s'\n", fnt[i]);
-            return 1;
-        }
+    sam_close(fp);
+    fp = NULL;
+
+    if (p.pool) {
+        // The reads held in memory so far are not needed any more
+        for (j = 0; j < n_b; ++j) bam_destroy1(a[j].b);
+        n_b = 0;
+        if (write_bins_threaded(fpw, h, fpt, cnt, bin_mem, n_files, max_mem,
+                                p.pool, &n_done) < 0)
+            goto fail;
+        goto done;
+    }
 
+    for (i = 0; i < n_files; ++i) {
         // Find biggest count
         if (max_cnt < cnt[i]) max_cnt = cnt[i];
     }
-    free(fpt);
-    fpt = NULL;
-    sam_close(fp);
-    fp = NULL;
 
     // merge
-    a = malloc(max_cnt * sizeof(elem_t));
-    if (!a) goto mem_fail;
-    for (j = 0; j < max_cnt; ++j) {
-        a[j].b = bam_init1();
-        if (!a[j].b) { max_cnt = j; goto mem_fail; }
-    }
+    if (grow_elems(&a, &m_a, &n_b, max_cnt) < 0) goto mem_fail;
+    tb = bam_init1();
+    if (!tb) goto mem_fail;
 
     for (i = 0; i < n_files; ++i) {
-        int64_t c = cnt[i];
-        fp = sam_open_format(fnt[i], "r", &ga->in);
-        if (NULL == fp) {
-            print_error_errno("collate", "Couldn't open \"%s\"", fnt[i]);
-            goto fail;
-        }
-        if (p.pool) hts_set_opt(fp, HTS_OPT_THREAD_POOL, &p);
-        bam_hdr_destroy(sam_hdr_read(fp)); // Skip over header
-
         // Slurp in one of the split files
-        for (j = 0; j < c; ++j) {
-            if (sam_read1(fp, h, a[j].b) < 0) {
-                fprintf(stderr, "Error reading '%s'\n", fnt[i]);
-                goto fail;
-            }
-            a[j].key = hash_X31_Wang(bam_get_qname(a[j].b));
-        }
-        sam_close(fp);
-        unlink(fnt[i]);
-        free(fnt[i]);
-        fnt[i] = NULL;
-
-        ks_introsort(bamshuf, c, a); // Shuffle all the reads
+        if (read_bin_file(&fpt[i], cnt[i], a, n_files, tb) < 0) goto fail;
+        tmp_file_destroy(&fpt[i], NULL, 0);
+        n_done = i + 1;
 
         // Write them out again
-        for (j = 0; j < c; ++j) {
-            if (sam_write1(fpw, h, a[j].b) < 0) {
-                print_error_errno("collate", "Error writing to output");
-                goto fail;
-            }
-        }
+        ks_introsort(bamshuf, cnt[i], a); // Shuffle all the reads
+        if (write_elems(fpw, h, a, cnt[i]) < 0) goto fail;
     }
 
+ done:
+    if (fp) sam_close(fp);
     bam_hdr_destroy(h);
-    for (j = 0; j < max_cnt; ++j) bam_destroy1(a[j].b);
-    free(a); free(fnt); free(cnt);
+    for (j = 0; j < n_b; ++j) bam_destroy1(a[j].b);
+    if (tb) bam_destroy1(tb);
+    free(a); free(fpt); free(cnt); free(bin_mem);
     sam_global_args_free(ga);
     if (sam_close(fpw) < 0) {
         fprintf(stderr, "Error on closing output\n");
@@ -504,17 +1033,15 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
     if (fp) sam_close(fp);
     if (fpw) sam_close(fpw);
     if (h) bam_hdr_destroy(h);
-    for (i = 0; i < n_files; ++i) {
-        if (fnt) free(fnt[i]);
-        if (fpt && fpt[i]) sam_close(fpt[i]);
-    }
+    for (i = n_done; i < n_open; ++i) tmp_file_destroy(&fpt[i], NULL, 0);
     if (a) {
-        for (j = 0; j < max_cnt; ++j) bam_destroy1(a[j].b);
+        for (j = 0; j < n_b; ++j) bam_destroy1(a[j].b);
         free(a);
     }
-    free(fnt);
+    if (tb) bam_destroy1(tb);
     free(fpt);
     free(cnt);
+    free(bin_mem);
     if (p.pool) hts_tpool_destroy(p.pool);
     sam_global_args_free(ga);
     return 1;
@@ -522,15 +1049,18 @@ static int bamshuf(const char *fn, int n_files, const char *pre, int clevel,
 
 static int usage(FILE *fp, int n_files, int reads_store) {
     fprintf(fp,
-            "Usage: samtools collate [-Ou] [-o <name>] [-n nFiles] [-l cLevel] <in.bam> [<prefix>]\n\n"
+            "Usage: samtools collate [-Ou] [-o <name>] [-n nFiles] [-l cLevel] [-m maxMem] <in.bam> [<prefix>]\n\n"
             "Options:\n"
             "      -O       output to stdout\n"
             "      -o       output file name (use prefix if not set)\n"
             "      -u       uncompressed BAM output\n"
             "      -f       fast (only primary alignments)\n"
             "      -r       working reads stored (with -f) [%d]\n" // reads_store
+            "      --stream fast mode, writing most pairs before the input ends\n"
             "      -l INT   compression level [%d]\n" // DEF_CLEVEL
-            "      -n INT   number of temporary files [%d]\n", // n_files
+            "      -n INT   number of temporary files [%d]\n" // n_files
+            "      -m INT   collate in memory if the input fits in INT bytes;\n"
+            "               suffix K/M/G recognized [768M]\n",
             reads_store, DEF_CLEVEL, n_files);
 
     sam_global_opt_help(fp, "-....@");
@@ -574,16 +1104,18 @@ char * generate_prefix() {
 
 int main_bamshuf(int argc, char *argv[])
 {
-    int c, n_files = 64, clevel = DEF_CLEVEL, is_stdout = 0, is_un = 0, fast_coll = 0, reads_store = 10000, ret, pre_mem = 0;
+    int c, n_files = 64, clevel = DEF_CLEVEL, is_stdout = 0, is_un = 0, fast_coll = 0, reads_store = 10000, ret, pre_mem = 0, stream = 0;
+    size_t max_mem = DEF_MAX_MEM;
     const char *output_file = NULL;
     char *prefix = NULL;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 0, 0, 0, '@'),
+        {"stream", no_argument, NULL, 1},
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "n:l:uOo:@:fr:", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "n:l:uOo:@:fr:m:", lopts, NULL)) >= 0) {
         switch (c) {
         case 'n': n_files = atoi(optarg); break;
         case 'l': clevel = atoi(optarg); break;
@@ -591,7 +1123,12 @@ int main_bamshuf(int argc, char *argv[])
         case 'O': is_stdout = 1; break;
         case 'o': output_file = optarg; break;
         case 'f': fast_coll = 1; break;
+        case  1 : stream = 1; break;
         case 'r': reads_store = atoi(optarg); break;
+        case 'm':
+            if (sam_mem_size_parse("collate", "-m", optarg, &max_mem) < 0)
+                return usage(stderr, n_files, reads_store);
+            break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
         case '?': return usage(stderr, n_files, reads_store);
@@ -613,7 +1150,7 @@ int main_bamshuf(int argc, char *argv[])
     if (!prefix) return EXIT_FAILURE;
 
     ret = bamshuf(argv[optind], n_files, prefix, clevel, is_stdout,
-                   output_file, fast_coll, reads_store, &ga);
+                   output_file, fast_coll || stream, stream, reads_store, max_mem, &ga);
 
     if (pre_mem) free(prefix);
 
@@ -31,10 +31,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/thread_pool.h"
 #include "sam_opts.h"
+#include "samtools.h"
 
 #include "htslib/kseq.h"
 KSTREAM_INIT(gzFile, gzread, 16384)
@@ -46,6 +49,42 @@ typedef struct {
     int min_mapQ;
 } aux_t;
 
+/* Everything needed to compute the coverage of one BED line over all of
+   the input files.  Each worker thread owns one of these, so that file
+   handles, indexes, iterators and pileup buffers are never shared.  (A CRAM
+   index holds the cram_fd it was loaded through, so it can't be shared.) */
+typedef struct {
+    int n;
+    aux_t **aux;
+    hts_idx_t **idx;
+    int *n_plp;
+    const bam_pileup1_t **plp;
+    int64_t *cnt;
+} bedcov_state_t;
+
+typedef struct {
+    int tid, beg, end;
+    size_t line;        // offset of the BED line in bedcov_job_t::lines
+} bedcov_reg_t;
+
+#define BEDCOV_BATCH 1024
+
+typedef struct bedcov_shared {
+    bedcov_state_t **free_st;
+    int n_free;
+    pthread_mutex_t lock;
+    int skip_DN;
+    int error;
+} bedcov_shared_t;
+
+typedef struct {
+    bedcov_shared_t *shared;
+    bedcov_reg_t *reg;
+    int n_reg, m_reg;
+    kstring_t lines;    // NUL-separated copies of the BED lines
+    kstring_t out;
+} bedcov_job_t;
+
 static int read_bam(void *data, bam1_t *b)
 {
     aux_t *aux = (aux_t*)data; // data in fact is a pointer to an auxiliary structure
@@ -61,25 +100,195 @@ static int read_bam(void *data, bam1_t *b)
     return ret;
 }
 
+static void bedcov_state_destroy(bedcov_state_t *st)
+{
+    int i;
+    if (!st) return;
+    for (i = 0; i < st->n; ++i) {
+        if (!st->aux[i]) continue;
+        if (st->aux[i]->iter) hts_itr_destroy(st->aux[i]->iter);
+        if (st->idx[i]) hts_idx_destroy(st->idx[i]);
+        if (st->aux[i]->header) bam_hdr_destroy(st->aux[i]->header);
+        if (st->aux[i]->fp) sam_close(st->aux[i]->fp);
+        free(st->aux[i]);
+    }
+    free(st->aux); free(st->idx); free(st->n_plp); free(st->plp); free(st->cnt);
+    free(st);
+}
+
+/* Open all of the input files and load their indexes. */
+static bedcov_state_t *bedcov_state_init(int n, char **fn, htsFormat *in,
+                                         int min_mapQ)
+{
+    int i;
+    bedcov_state_t *st = calloc(1, sizeof(bedcov_state_t));
+    if (!st) return NULL;
+    st->n = n;
+    st->aux = calloc(n, sizeof(aux_t*));
+    st->idx = calloc(n, sizeof(hts_idx_t*));
+    st->n_plp = calloc(n, sizeof(int));
+    st->plp = calloc(n, sizeof(bam_pileup1_t*));
+    st->cnt = calloc(n, sizeof(int64_t));
+    if (!st->aux || !st->idx || !st->n_plp || !st->plp || !st->cnt) goto fail;
+    for (i = 0; i < n; ++i) {
+        st->aux[i] = calloc(1, sizeof(aux_t));
+        if (!st->aux[i]) goto fail;
+        st->aux[i]->min_mapQ = min_mapQ;
+        st->aux[i]->fp = sam_open_format(fn[i], "r", in);
+        if (st->aux[i]->fp)
+            st->idx[i] = sam_index_load(st->aux[i]->fp, fn[i]);
+        if (st->aux[i]->fp == 0 || st->idx[i] == 0) {
+            fprintf(stderr, "ERROR: fail to open index BAM file '%s'\n", fn[i]);
+            goto fail;
+        }
+        // TODO bgzf_set_cache_size(aux[i]->fp, 20);
+        st->aux[i]->header = sam_hdr_read(st->aux[i]->fp);
+        if (st->aux[i]->header == NULL) {
+            fprintf(stderr, "ERROR: failed to read header for '%s'\n", fn[i]);
+            goto fail;
+        }
+    }
+    return st;
+
+ fail:
+    bedcov_state_destroy(st);
+    return NULL;
+}
+
+static int bedcov_region(bedcov_state_t *st, int skip_DN,
+                         int tid, int beg, int end)
+{
+    int i, j, m, n = st->n, pos;
+    bam_mplp_t mplp;
+
+    for (i = 0; i < n; ++i) {
+        if (st->aux[i]->iter) hts_itr_destroy(st->aux[i]->iter);
+        st->aux[i]->iter = sam_itr_queryi(st->idx[i], tid, beg, end);
+        if (!st->aux[i]->iter) return -1;
+    }
+    mplp = bam_mplp_init(n, read_bam, (void**)st->aux);
+    if (!mplp) return -1;
+    bam_mplp_set_maxcnt(mplp, 64000);
+    memset(st->cnt, 0, sizeof(int64_t) * n);
+    while (bam_mplp_auto(mplp, &tid, &pos, st->n_plp, st->plp) > 0)
+        if (pos >= beg && pos < end) {
+            for (i = 0, m = 0; i < n; ++i) {
+                if (skip_DN)
+                    for (j = 0; j < st->n_plp[i]; ++j) {
+                        const bam_pileup1_t *pi = st->plp[i] + j;
+                        if (pi->is_del || pi->is_refskip) ++m;
+                    }
+                st->cnt[i] += st->n_plp[i] - m;
+            }
+        }
+    bam_mplp_destroy(mplp);
+    return 0;
+}
+
+static void *bedcov_worker(void *arg)
+{
+    bedcov_job_t *job = (bedcov_job_t *) arg;
+    bedcov_shared_t *sh = job->shared;
+    bedcov_state_t *st;
+    int k, i;
+
+    pthread_mutex_lock(&sh->lock);
+    st = sh->n_free > 0 ? sh->free_st[--sh->n_free] : NULL;
+    pthread_mutex_unlock(&sh->lock);
+    if (!st) { // Can't happen; there is one state per thread
+        sh->error = 1;
+        return job;
+    }
+
+    job->out.l = 0;
+    for (k = 0; k < job->n_reg; ++k) {
+        bedcov_reg_t *r = &job->reg[k];
+        if (bedcov_region(st, sh->skip_DN, r->tid, r->beg, r->end) < 0) {
+            sh->error = 1;
+            break;
+        }
+        kputs(job->lines.s + r->line, &job->out);
+        for (i = 0; i < st->n; ++i) {
+            kputc('\t', &job->out);
+            kputl(st->cnt[i], &job->out);
+        }
+        kputc('\n', &job->out);
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    sh->free_st[sh->n_free++] = st;
+    pthread_mutex_unlock(&sh->lock);
+    return job;
+}
+
+static void bedcov_job_free(bedcov_job_t *job)
+{
+    if (!job) return;
+    free(job->reg);
+    free(job->lines.s);
+    free(job->out.s);
+    free(job);
+}
+
+static int bedcov_job_add(bedcov_job_t *job, const kstring_t *str,
+                          int tid, int beg, int end)
+{
+    if (job->n_reg == job->m_reg) {
+        int new_m = job->m_reg ? job->m_reg * 2 : 64;
+        bedcov_reg_t *tmp = realloc(job->reg, new_m * sizeof(bedcov_reg_t));
+        if (!tmp) return -1;
+        job->reg = tmp;
+        job->m_reg = new_m;
+    }
+    job->reg[job->n_reg].tid = tid;
+    job->reg[job->n_reg].beg = beg;
+    job->reg[job->n_reg].end = end;
+    job->reg[job->n_reg].line = job->lines.l;
+    job->n_reg++;
+    if (kputsn(str->s, str->l, &job->lines) < 0) return -1;
+    job->lines.l++; // keep the NUL as separator
+    return 0;
+}
+
+/* Write out the next finished batch.  Returns 0 on success, -1 on failure. */
+static int bedcov_write_result(hts_tpool_process *q, int wait)
+{
+    hts_tpool_result *r;
+    bedcov_job_t *job;
+    int ret = 0;
+
+    r = wait ? hts_tpool_next_result_wait(q) : hts_tpool_next_result(q);
+    if (!r) return 1;
+    job = (bedcov_job_t *) hts_tpool_result_data(r);
+    if (job->out.l && fwrite(job->out.s, 1, job->out.l, stdout) != job->out.l)
+        ret = -1;
+    bedcov_job_free(job);
+    hts_tpool_delete_result(r, 0);
+    return ret;
+}
+
 int main_bedcov(int argc, char *argv[])
 {
     gzFile fp;
     kstring_t str;
     kstream_t *ks;
-    hts_idx_t **idx;
-    aux_t **aux;
-    int *n_plp, dret, i, j, m, n, c, min_mapQ = 0, skip_DN = 0;
-    int64_t *cnt;
-    const bam_pileup1_t **plp;
+    bedcov_state_t *st = NULL;
+    bedcov_shared_t shared;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *queue = NULL;
+    bedcov_job_t *job = NULL;
+    bam_hdr_t *hdr;
+    int64_t n_queued = 0;
+    int dret, i, n, c, min_mapQ = 0, skip_DN = 0, n_st = 0, ret = 0;
     int usage = 0;
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
-        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '-'),
+        SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0, '@'),
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "Q:j", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "Q:j@:", lopts, NULL)) >= 0) {
         switch (c) {
         case 'Q': min_mapQ = atoi(optarg); break;
         case 'j': skip_DN = 1; break;
@@ -94,41 +303,48 @@ int main_bedcov(int argc, char *argv[])
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "      -Q <int>            mapping quality threshold [0]\n");
         fprintf(stderr, "      -j                  do not include deletions (D) and ref skips (N) in bedcov computation\n");
-        sam_global_opt_help(stderr, "-.--.-");
+        sam_global_opt_help(stderr, "-.--.@");
         return 1;
     }
     memset(&str, 0, sizeof(kstring_t));
+    memset(&shared, 0, sizeof(shared));
+    shared.skip_DN = skip_DN;
     n = argc - optind - 1;
-    aux = calloc(n, sizeof(aux_t*));
-    idx = calloc(n, sizeof(hts_idx_t*));
-    for (i = 0; i < n; ++i) {
-        aux[i] = calloc(1, sizeof(aux_t));
-        aux[i]->min_mapQ = min_mapQ;
-        aux[i]->fp = sam_open_format(argv[i+optind+1], "r", &ga.in);
-        if (aux[i]->fp)
-            idx[i] = sam_index_load(aux[i]->fp, argv[i+optind+1]);
-        if (aux[i]->fp == 0 || idx[i] == 0) {
-            fprintf(stderr, "ERROR: fail to open index BAM file '%s'\n", argv[i+optind+1]);
-            return 2;
+
+    st = bedcov_state_init(n, &argv[optind+1], &ga.in, min_mapQ);
+    if (!st) { ret = 2; goto end; }
+
+    hdr = st->aux[0]->header;
+
+    if (ga.nthreads > 0) {
+        shared.free_st = calloc(ga.nthreads, sizeof(bedcov_state_t*));
+        if (!shared.free_st) { ret = 2; goto end; }
+        pthread_mutex_init(&shared.lock, NULL);
+        shared.free_st[n_st++] = st;
+        st = NULL;
+        for (; n_st < ga.nthreads; ++n_st) {
+            shared.free_st[n_st] = bedcov_state_init(n, &argv[optind+1], &ga.in, min_mapQ);
+            if (!shared.free_st[n_st]) { ret = 2; goto end; }
         }
-        // TODO bgzf_set_cache_size(aux[i]->fp, 20);
-        aux[i]->header = sam_hdr_read(aux[i]->fp);
-        if (aux[i]->header == NULL) {
-            fprintf(stderr, "ERROR: failed to read header for '%s'\n",
-                    argv[i+optind+1]);
-            return 2;
+        shared.n_free = n_st;
+        if (!(pool = hts_tpool_init(ga.nthreads))
+            || !(queue = hts_tpool_process_init(pool, ga.nthreads * 2, 0))) {
+            print_error("bedcov", "error creating thread pool");
+            ret = 2;
+            goto end;
         }
     }
-    cnt = calloc(n, 8);
 
     fp = gzopen(argv[optind], "rb");
+    if (!fp) {
+        print_error_errno("bedcov", "can't open BED file '%s'", argv[optind]);
+        ret = 2;
+        goto end;
+    }
     ks = ks_init(fp);
-    n_plp = calloc(n, sizeof(int));
-    plp = calloc(n, sizeof(bam_pileup1_t*));
     while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
         char *p, *q;
-        int tid, beg, end, pos;
-        bam_mplp_t mplp;
+        int tid, beg, end;
 
         if (str.l == 0 || *str.s == '#') continue; /* empty or comment line */
         /* Track and browser lines.  Also look for a trailing *space* in
@@ -138,7 +354,7 @@ int main_bedcov(int argc, char *argv[])
         if (strncmp(str.s, "browser ", 8) == 0) continue;
         for (p = q = str.s; *p && *p != '\t'; ++p);
         if (*p != '\t') goto bed_error;
-        *p = 0; tid = bam_name2id(aux[0]->header, q); *p = '\t';
+        *p = 0; tid = bam_name2id(hdr, q); *p = '\t';
         if (tid < 0) goto bed_error;
         for (q = p = p + 1; isdigit(*p); ++p);
         if (*p != '\t') goto bed_error;
@@ -149,49 +365,83 @@ int main_bedcov(int argc, char *argv[])
             *p = 0; end = atoi(q); *p = c;
         } else goto bed_error;
 
-        for (i = 0; i < n; ++i) {
-            if (aux[i]->iter) hts_itr_destroy(aux[i]->iter);
-            aux[i]->iter = sam_itr_queryi(idx[i], tid, beg, end);
+        if (!pool) {
+            if (bedcov_region(st, skip_DN, tid, beg, end) < 0) {
+                print_error("bedcov", "failed to query region '%s'", str.s);
+                ret = 1;
+                break;
+            }
+            for (i = 0; i < n; ++i) {
+                kputc('\t', &str);
+                kputl(st->cnt[i], &str);
+            }
+            puts(str.s);
+            continue;
         }
-        mplp = bam_mplp_init(n, read_bam, (void**)aux);
-        bam_mplp_set_maxcnt(mplp, 64000);
-        memset(cnt, 0, 8 * n);
-        while (bam_mplp_auto(mplp, &tid, &pos, n_plp, plp) > 0)
-            if (pos >= beg && pos < end) {
-                for (i = 0, m = 0; i < n; ++i) {
-                    if (skip_DN) 
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            const bam_pileup1_t *pi = plp[i] + j; 
-                            if (pi->is_del || pi->is_refskip) ++m;
-                        }
-                    cnt[i] += n_plp[i] - m;
-                }
+
+        // Threaded: queue up the region, and send batches to the pool
+        if (!job && !(job = calloc(1, sizeof(bedcov_job_t)))) goto mem_error;
+        job->shared = &shared;
+        if (bedcov_job_add(job, &str, tid, beg, end) < 0) goto mem_error;
+        if (job->n_reg >= BEDCOV_BATCH) {
+            while (hts_tpool_dispatch2(pool, queue, bedcov_worker, job, 1) < 0) {
+                if (errno != EAGAIN || bedcov_write_result(queue, 1) < 0) goto write_error;
+                n_queued--;
+            }
+            job = NULL;
+            n_queued++;
+            while (n_queued > 0 && (c = bedcov_write_result(queue, 0)) <= 0) {
+                if (c < 0) goto write_error;
+                n_queued--;
             }
-        for (i = 0; i < n; ++i) {
-            kputc('\t', &str);
-            kputl(cnt[i], &str);
         }
-        puts(str.s);
-        bam_mplp_destroy(mplp);
         continue;
 
 bed_error:
         fprintf(stderr, "Errors in BED line '%s'\n", str.s);
     }
-    free(n_plp); free(plp);
+
+    if (pool && ret == 0) {
+        if (job && job->n_reg > 0) {
+            while (hts_tpool_dispatch2(pool, queue, bedcov_worker, job, 1) < 0) {
+                if (errno != EAGAIN || bedcov_write_result(queue, 1) < 0) goto write_error;
+                n_queued--;
+            }
+            job = NULL;
+            n_queued++;
+        }
+        for (; n_queued > 0; n_queued--)
+            if (bedcov_write_result(queue, 1) < 0) goto write_error;
+        if (shared.error) {
+            print_error("bedcov", "failed to query regions");
+            ret = 1;
+        }
+    }
+    goto close_bed;
+
+ mem_error:
+    print_error_errno("bedcov", "failed to allocate memory");
+    ret = 1;
+    goto close_bed;
+ write_error:
+    print_error_errno("bedcov", "error writing to stdout");
+    ret = 1;
+ close_bed:
     ks_destroy(ks);
     gzclose(fp);
 
-    free(cnt);
-    for (i = 0; i < n; ++i) {
-        if (aux[i]->iter) hts_itr_destroy(aux[i]->iter);
-        hts_idx_destroy(idx[i]);
-        bam_hdr_destroy(aux[i]->header);
-        sam_close(aux[i]->fp);
-        free(aux[i]);
+ end:
+    bedcov_job_free(job);
+    if (queue) hts_tpool_process_destroy(queue);
+    if (pool) hts_tpool_destroy(pool);
+    if (shared.free_st) {
+        for (i = 0; i < n_st; ++i)
+            bedcov_state_destroy(shared.free_st[i]);
+        free(shared.free_st);
+        pthread_mutex_destroy(&shared.lock);
     }
-    free(aux); free(idx);
+    bedcov_state_destroy(st);
     free(str.s);
     sam_global_args_free(&ga);
-    return 0;
+    return ret;
 }
@@ -49,12 +49,15 @@ KSTREAM_INIT(gzFile, gzread, 8192)
  * |---- beg ----|---- end ----|
  * @field n            actual number of elements contained by a
  * @field m            number of allocated elements to a (n <= m)
- * @field *idx         index array for computing the minimum offset
+ * @field *max         maximum end coordinate of each subtree in the implicit
+ * interval tree laid over the sorted array a (see bed_index_core)
+ * @field level        level of the root of the interval tree
  */
 typedef struct {
     int n, m;
     uint64_t *a;
-    int *idx;
+    uint32_t *max;
+    int level;
     int filter;
 } bed_reglist_t;
 
@@ -97,30 +100,57 @@ static void bed_print(void *reg_hash) {
 }
 #endif
 
-static int *bed_index_core(int n, uint64_t *a)
-{
-    int i, j, l, *idx;
-    l = 0; idx = 0;
-    for (i = 0; i < n; ++i) {
-        int beg, end;
-        beg = a[i]>>32 >> LIDX_SHIFT; end = ((uint32_t)a[i]) >> LIDX_SHIFT;
-        if (l < end + 1) {
-            int old_l = l;
-            l = end + 1;
-            kroundup32(l);
-            idx = realloc(idx, l * sizeof(int));
-            if (!idx)
-                return NULL;
+#define bed_beg(x) ((uint32_t)((x)>>32))
+#define bed_end(x) ((uint32_t)(x))
 
-            for (j = old_l; j < l; ++j)
-                idx[j] = -1;
-        }
+/* Implicit augmented interval tree.
+
+   The sorted interval array is treated as an in-order layout of a binary
+   search tree: leaves are at even indices, the nodes at level k have the
+   lowest k bits set and the root is at index (1<<level) - 1.  For each
+   node, max[] stores the largest end coordinate in its subtree, which
+   lets queries skip whole subtrees that end before the query starts.
+   This keeps lookups at O(log n + hits) even when intervals are long
+   or nested, without storing any pointers.
+
+   As the array length need not be a power of two, nodes beyond the end
+   are imaginary; their max is taken from the last real node on the
+   path, as tracked by last / last_i.
+ */
 
-        for (j = beg; j < end+1; ++j)
-            if (idx[j] < 0)
-                idx[j] = i;
+static int bed_index_core(int n, const uint64_t *a, uint32_t *max)
+{
+    int i, last_i = 0, k;
+    uint32_t last = 0;
+
+    if (n == 0) return -1;
+    for (i = 0; i < n; i += 2) last_i = i, last = max[i] = bed_end(a[i]);
+    for (k = 1; 1LL<<k <= n; ++k) {
+        int64_t x = 1LL<<(k-1), i0 = (x<<1) - 1, step = x<<2, j;
+        for (j = i0; j < n; j += step) {
+            uint32_t el = max[j - x];
+            uint32_t er = j + x < n ? max[j + x] : last;
+            uint32_t e = bed_end(a[j]);
+            e = e > el ? e : el;
+            e = e > er ? e : er;
+            max[j] = e;
+        }
+        last_i = last_i>>k&1 ? last_i - x : last_i + x;
+        if (last_i < n && max[last_i] > last) last = max[last_i];
     }
-    return idx;
+    return k - 1;
+}
+
+/* Build the tree over an interval list, which must already be sorted */
+static void bed_index_list(bed_reglist_t *p)
+{
+    free(p->max);
+    p->max = NULL;
+    p->level = -1;
+    if (p->n == 0) return;
+    p->max = malloc(p->n * sizeof(uint32_t));
+    if (p->max)
+        p->level = bed_index_core(p->n, p->a, p->max);
 }
 
 static void bed_index(void *_h)
@@ -130,44 +160,84 @@ static void bed_index(void *_h)
     for (k = 0; k < kh_end(h); ++k) {
         if (kh_exist(h, k)) {
             bed_reglist_t *p = &kh_val(h, k);
-            if (p->idx) free(p->idx);
-            ks_introsort(uint64_t, p->n, p->a);
-            p->idx = bed_index_core(p->n, p->a);
+            if (p->n) ks_introsort(uint64_t, p->n, p->a);
+            bed_index_list(p);
         }
     }
 }
 
-static int bed_minoff(const bed_reglist_t *p, unsigned int beg, unsigned int end) {
-    int i, min_off=0;
-
-    if (p && p->idx) {
-        min_off = (beg>>LIDX_SHIFT >= p->n)? p->idx[p->n-1] : p->idx[beg>>LIDX_SHIFT];
-        if (min_off < 0) { // TODO: this block can be improved, but speed should not matter too much here
-            int n = beg>>LIDX_SHIFT;
-            if (n > p->n)
-                n = p->n;
-            for (i = n - 1; i >= 0; --i)
-                if (p->idx[i] >= 0)
-                    break;
-            min_off = i >= 0? p->idx[i] : 0;
+typedef struct {
+    int64_t x;
+    int k, w;
+} bed_stack_t;
+
+static int bed_add_hit(int i, int **idx, int *m_idx, int n_hits)
+{
+    if (n_hits == *m_idx) {
+        int new_m = *m_idx ? *m_idx * 2 : 16;
+        int *tmp = realloc(*idx, new_m * sizeof(int));
+        if (!tmp) return -1;
+        *idx = tmp;
+        *m_idx = new_m;
+    }
+    (*idx)[n_hits] = i;
+    return n_hits + 1;
+}
+
+/* Find intervals in p overlapping [beg, end).  If idx is NULL, stop at the
+   first hit and return 1; otherwise store the indices (in increasing order
+   of start) of all overlapping intervals in *idx, growing it as needed,
+   and return the number found.  Returns -1 on memory allocation failure. */
+static int bed_query_core(const bed_reglist_t *p, uint32_t beg, uint32_t end,
+                          int **idx, int *m_idx)
+{
+    bed_stack_t stack[64];
+    int t = 0, n_hits = 0;
+    int64_t i;
+
+    if (!p || p->n == 0) return 0;
+    if (!p->max) { // index unavailable; fall back to a linear scan
+        for (i = 0; i < p->n && bed_beg(p->a[i]) < end; ++i) {
+            if (beg < bed_end(p->a[i])) {
+                if (!idx) return 1;
+                if ((n_hits = bed_add_hit(i, idx, m_idx, n_hits)) < 0) return -1;
+            }
         }
+        return n_hits;
     }
 
-    return min_off;
+    stack[t].k = p->level, stack[t].x = (1LL<<p->level) - 1, stack[t++].w = 0;
+    while (t) {
+        bed_stack_t z = stack[--t];
+        if (z.k <= 3) { // small subtree; scan it linearly
+            int64_t i0 = z.x >> z.k << z.k, i1 = i0 + (1LL<<(z.k+1)) - 1;
+            if (i1 >= p->n) i1 = p->n;
+            for (i = i0; i < i1 && bed_beg(p->a[i]) < end; ++i) {
+                if (beg < bed_end(p->a[i])) {
+                    if (!idx) return 1;
+                    if ((n_hits = bed_add_hit(i, idx, m_idx, n_hits)) < 0) return -1;
+                }
+            }
+        } else if (z.w == 0) { // left child not yet processed
+            int64_t y = z.x - (1LL<<(z.k-1));
+            stack[t].k = z.k, stack[t].x = z.x, stack[t++].w = 1;
+            if (y >= p->n || p->max[y] > beg)
+                stack[t].k = z.k - 1, stack[t].x = y, stack[t++].w = 0;
+        } else if (z.x < p->n && bed_beg(p->a[z.x]) < end) {
+            if (beg < bed_end(p->a[z.x])) {
+                if (!idx) return 1;
+                if ((n_hits = bed_add_hit(z.x, idx, m_idx, n_hits)) < 0) return -1;
+            }
+            stack[t].k = z.k - 1, stack[t].x = z.x + (1LL<<(z.k-1)), stack[t++].w = 0;
+        }
+    }
+    return n_hits;
 }
 
 static int bed_overlap_core(const bed_reglist_t *p, int beg, int end)
 {
-    int i, min_off;
-    if (p->n == 0) return 0;
-    min_off = bed_minoff(p, beg, end);
-
-    for (i = min_off; i < p->n; ++i) {
-        if ((int)(p->a[i]>>32) >= end) break; // out of range; no need to proceed
-        if ((int32_t)p->a[i] > beg && (int32_t)(p->a[i]>>32) < end)
-            return 1; // find the overlap; return
-    }
-    return 0;
+    if (p->n == 0 || end <= 0 || beg >= end) return 0;
+    return bed_query_core(p, beg < 0 ? 0 : beg, end, NULL, NULL) > 0;
 }
 
 int bed_overlap(const void *_h, const char *chr, int beg, int end)
@@ -180,9 +250,179 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end)
     return bed_overlap_core(&kh_val(h, k), beg, end);
 }
 
-/** @brief Trim a sorted interval list, inside a region hash table,
+/** @brief Find all intervals overlapping a region.
+ *  @param _h           the region hash table
+ *  @param chr          reference name
+ *  @param beg, end     0-based, half-open query region
+ *  @param intervals    array to fill with the overlapping intervals, in order
+ *                      of start position; reallocated as needed
+ *  @param m_intervals  allocated size of *intervals
+ *  @return             number of intervals found, or -1 on error
+ */
+int bed_overlap_all(const void *_h, const char *chr, int beg, int end,
+                    hts_pair32_t **intervals, int *m_intervals)
+{
+    const reghash_t *h = (const reghash_t*)_h;
+    const bed_reglist_t *p;
+    khint_t k;
+    int *idx = NULL, m_idx = 0, n, i;
+
+    if (!h || end <= 0 || beg >= end) return 0;
+    k = kh_get(reg, h, chr);
+    if (k == kh_end(h)) return 0;
+    p = &kh_val(h, k);
+    n = bed_query_core(p, beg < 0 ? 0 : beg, end, &idx, &m_idx);
+    if (n <= 0) {
+        free(idx);
+        return n;
+    }
+    if (n > *m_intervals) {
+        hts_pair32_t *tmp = realloc(*intervals, n * sizeof(hts_pair32_t));
+        if (!tmp) {
+            free(idx);
+            return -1;
+        }
+        *intervals = tmp;
+        *m_intervals = n;
+    }
+    for (i = 0; i < n; i++) {
+        (*intervals)[i].beg = bed_beg(p->a[idx[i]]);
+        (*intervals)[i].end = bed_end(p->a[idx[i]]);
+    }
+    free(idx);
+    return n;
+}
+
+/* BED intervals resolved against a header, so that lookups can be done by
+   tid without hashing the reference name.  pmax[i] is the largest end
+   coordinate of a[0..i], which is non-decreasing; it lets a cursor skip
+   intervals that finish before the query begins. */
+typedef struct {
+    int n;
+    uint64_t *a;
+    uint32_t *pmax;
+} bed_tidlist_t;
+
+typedef struct {
+    int n_targets;
+    bed_tidlist_t *l;
+} bed_tidx_t;
+
+/** @brief Index the regions of a hash table by the tids of a header.
+ *  @param reg_hash    the region hash table, as returned by bed_read()
+ *  @param h           header to resolve the reference names against
+ *  @return            tid-indexed copy of the intervals, to be queried with
+ *                     bed_overlap_tid() and freed with bed_tid_destroy();
+ *                     NULL on failure.
+ *  Regions on references not in the header are dropped.
+ */
+void *bed_tid_index(void *reg_hash, const bam_hdr_t *h)
+{
+    reghash_t *r = (reghash_t *)reg_hash;
+    bed_tidx_t *t;
+    int tid, i;
+
+    if (!r || !h) return NULL;
+    t = calloc(1, sizeof(bed_tidx_t));
+    if (!t) return NULL;
+    t->n_targets = h->n_targets;
+    t->l = calloc(h->n_targets > 0 ? h->n_targets : 1, sizeof(bed_tidlist_t));
+    if (!t->l) goto fail;
+
+    for (tid = 0; tid < h->n_targets; tid++) {
+        khint_t k = kh_get(reg, r, h->target_name[tid]);
+        bed_reglist_t *p;
+        bed_tidlist_t *l = &t->l[tid];
+        uint32_t max_end = 0;
+
+        if (k == kh_end(r)) continue;
+        p = &kh_val(r, k);
+        if (p->n == 0) continue;
+        l->a = malloc(p->n * sizeof(uint64_t));
+        l->pmax = malloc(p->n * sizeof(uint32_t));
+        if (!l->a || !l->pmax) goto fail;
+        memcpy(l->a, p->a, p->n * sizeof(uint64_t));
+        ks_introsort(uint64_t, p->n, l->a); // normally sorted already
+        for (i = 0; i < p->n; i++) {
+            if (bed_end(l->a[i]) > max_end) max_end = bed_end(l->a[i]);
+            l->pmax[i] = max_end;
+        }
+        l->n = p->n;
+    }
+    return t;
+
+ fail:
+    bed_tid_destroy(t);
+    return NULL;
+}
+
+void bed_tid_destroy(void *tidx)
+{
+    bed_tidx_t *t = (bed_tidx_t *)tidx;
+    int i;
+
+    if (!t) return;
+    if (t->l) {
+        for (i = 0; i < t->n_targets; i++) {
+            free(t->l[i].a);
+            free(t->l[i].pmax);
+        }
+        free(t->l);
+    }
+    free(t);
+}
+
+/** @brief Test if a region overlaps any interval in a tid index.
+ *  @param tidx   index returned by bed_tid_index()
+ *  @param tid    reference id in the header used to build the index
+ *  @param beg, end  0-based, half-open query region
+ *  @param cur    optional cursor; may be NULL
+ *  @return       1 if there is an overlap, 0 otherwise.
+ *
+ *  The cursor remembers the first interval that can still overlap a query
+ *  starting at or after the previous one.  On coordinate-sorted input the
+ *  cursor only moves forwards, making each test amortised O(1).  Unsorted
+ *  queries are still answered correctly, using a binary search to
+ *  reposition the cursor.
+ */
+int bed_overlap_tid(const void *tidx, int tid, int beg, int end, bed_cursor_t *cur)
+{
+    const bed_tidx_t *t = (const bed_tidx_t *)tidx;
+    const bed_tidlist_t *l;
+    bed_cursor_t tmp = BED_CURSOR_INIT;
+    uint32_t b;
+    int i;
+
+    if (!t || tid < 0 || tid >= t->n_targets) return 0;
+    l = &t->l[tid];
+    if (l->n == 0 || end <= 0 || beg >= end) return 0;
+    b = beg < 0 ? 0 : beg;
+    if (!cur) cur = &tmp;
+
+    if (cur->tid != tid || (cur->i > 0 && l->pmax[cur->i - 1] > b)) {
+        // Start again, using a binary search for the first interval
+        // that ends after beg.
+        int lo = 0, hi = l->n;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (l->pmax[mid] <= b) lo = mid + 1;
+            else hi = mid;
+        }
+        cur->tid = tid;
+        cur->i = lo;
+    }
+    i = cur->i;
+    while (i < l->n && l->pmax[i] <= b) i++;
+    cur->i = i;
+
+    // Nothing before i can overlap.  As pmax[i] > pmax[i-1], interval i
+    // itself ends after beg, and everything after i starts no earlier.
+    return i < l->n && bed_beg(l->a[i]) < (uint32_t) end;
+}
+
+/** @brief Sort and trim the interval lists inside a region hash table,
  *   by removing completely contained intervals and merging adjacent or
- *   overlapping intervals.
+ *   overlapping intervals, then index them for overlap queries.
  *  @param reg_hash    the region hash table with interval lists as values
  */
 
@@ -201,6 +441,7 @@ void bed_unify(void *reg_hash) {
         if (!kh_exist(h,i) || !(p = &kh_val(h,i)) || !(p->n))
             continue;
 
+        ks_introsort(uint64_t, p->n, p->a);
         for (new_n = 0, j = 1; j < p->n; j++) {
             if ((uint32_t)p->a[new_n] < (uint32_t)(p->a[j]>>32)) {
                 p->a[++new_n] = p->a[j];
@@ -211,6 +452,7 @@ void bed_unify(void *reg_hash) {
         }
 
         p->n = ++new_n;
+        bed_index_list(p);
     }
 }
 
@@ -354,7 +596,7 @@ void bed_destroy(void *_h)
     for (k = 0; k < kh_end(h); ++k) {
         if (kh_exist(h, k)) {
             free(kh_val(h, k).a);
-            free(kh_val(h, k).idx);
+            free(kh_val(h, k).max);
             free((char*)kh_key(h, k));
         }
     }
@@ -414,7 +656,7 @@ static void *bed_filter(void *reg_hash, void *tmp_hash) {
     bed_reglist_t *p, *q;
     khint_t l, k;
     uint64_t *new_a;
-    int i, j, new_n, min_off;
+    int i, j, new_n, n_hits, *hits = NULL, m_hits = 0;
     const char *reg;
     uint32_t beg, end;
 
@@ -435,20 +677,34 @@ static void *bed_filter(void *reg_hash, void *tmp_hash) {
             continue;
 
         new_a = (uint64_t *)calloc(q->n + p->n, sizeof(uint64_t));
-        if (!new_a)
+        if (!new_a) {
+            free(hits);
             return NULL;
+        }
         new_n = 0;
 
         for (i = 0; i < q->n; i++) {
             beg = (uint32_t)(q->a[i]>>32);
             end = (uint32_t)(q->a[i]);
 
-            min_off = bed_minoff(p, beg, end);
-            for (j = min_off; j < p->n; ++j) {
-                if ((uint32_t)(p->a[j]>>32) >= end) break; // out of range; no need to proceed
-                if ((uint32_t)(p->a[j]) > beg && (uint32_t)(p->a[j]>>32) < end) {
-                    new_a[new_n++] = ((uint64_t)MAX((uint32_t)(p->a[j]>>32), beg) << 32) | MIN((uint32_t)p->a[j], end);
+            n_hits = bed_query_core(p, beg, end, &hits, &m_hits);
+            if (n_hits < 0) {
+                free(new_a);
+                free(hits);
+                return NULL;
+            }
+            if (new_n + n_hits > q->n + p->n) {
+                uint64_t *tmp = realloc(new_a, (new_n + n_hits) * sizeof(uint64_t));
+                if (!tmp) {
+                    free(new_a);
+                    free(hits);
+                    return NULL;
                 }
+                new_a = tmp;
+            }
+            for (j = 0; j < n_hits; ++j) {
+                uint64_t x = p->a[hits[j]];
+                new_a[new_n++] = ((uint64_t)MAX((uint32_t)(x>>32), beg) << 32) | MIN((uint32_t)x, end);
             }
         }
 
@@ -458,12 +714,17 @@ static void *bed_filter(void *reg_hash, void *tmp_hash) {
             p->n = new_n;
             p->m = new_n;
             p->filter = FILTERED;
+            // The tree no longer matches; bed_unify() rebuilds it
+            free(p->max);
+            p->max = NULL;
+            p->level = -1;
         } else {
             free(new_a);
             p->filter = ALL;
         }
     }
 
+    free(hits);
     return h;
 }
 
@@ -524,16 +785,13 @@ void *bed_hash_regions(void *reg_hash, char **regs, int first, int last, int *op
     }
 
     if (!(*op)) {
-        bed_index(t);
         bed_unify(t);
         h = bed_filter(h, t);
         bed_destroy(t);
     }
 
-    if (h) {
-        bed_index(h);
+    if (h)
         bed_unify(h);
-    }
 
     return h;
 }
@@ -553,6 +811,22 @@ const char* bed_get(void *reg_hash, int i, int filter) {
     return kh_key(h, i);
 }
 
+/* The root of the interval tree spans the whole list, so its max[] entry
+   is the largest end coordinate. */
+static uint32_t bed_max_end(const bed_reglist_t *p) {
+    int j;
+    uint32_t max_end = 0;
+
+    if (p->n == 0)
+        return 0;
+    if (p->max)
+        return p->max[(1LL<<p->level) - 1];
+    for (j = 0; j < p->n; j++)
+        if ((uint32_t)p->a[j] > max_end)
+            max_end = (uint32_t)p->a[j];
+    return max_end;
+}
+
 hts_reglist_t *bed_reglist(void *reg_hash, int filter, int *n_reg) {
 
     reghash_t *h;
@@ -598,10 +872,8 @@ hts_reglist_t *bed_reglist(void *reg_hash, int filter, int *n_reg) {
         for (j = 0; j < p->n; j++) {
             reglist[count].intervals[j].beg = (uint32_t)(p->a[j]>>32);
             reglist[count].intervals[j].end = (uint32_t)(p->a[j]);
-
-            if (reglist[count].intervals[j].end > reglist[count].max_end)
-                reglist[count].max_end = reglist[count].intervals[j].end;
         }
+        reglist[count].max_end = bed_max_end(p);
         count++;
     }
 
@@ -2,20 +2,33 @@
 #define BEDIDX_H
 
 #include "htslib/hts.h"
+#include "htslib/sam.h"
 
-#define LIDX_SHIFT 13
 #define ALL 0
 #define FILTERED 1
 
+/* Position of a caller in a tid index, see bed_overlap_tid() */
+typedef struct {
+    int tid;
+    int i;
+} bed_cursor_t;
+
+#define BED_CURSOR_INIT { -1, 0 }
+
 #define MIN(A,B) ( ( (A) < (B) ) ? (A) : (B) )
 #define MAX(A,B) ( ( (A) > (B) ) ? (A) : (B) )
 
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
+int bed_overlap_all(const void *_h, const char *chr, int beg, int end,
+                    hts_pair32_t **intervals, int *m_intervals);
 void *bed_hash_regions(void *reg_hash, char **regs, int first, int last, int *op);
 const char* bed_get(void *reg_hash, int index, int filter);
 hts_reglist_t *bed_reglist(void *reg_hash, int filter, int *count_regs);
 void bed_unify(void *_h);
+void *bed_tid_index(void *reg_hash, const bam_hdr_t *h);
+void bed_tid_destroy(void *tidx);
+int bed_overlap_tid(const void *tidx, int tid, int beg, int end, bed_cursor_t *cur);
 
 #endif
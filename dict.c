@@ -25,10 +25,18 @@ DEALINGS IN THE SOFTWARE.  */
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <unistd.h>
 #include <zlib.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "htslib/kseq.h"
+#include "htslib/kstring.h"
+#include "htslib/bgzf.h"
 #include "htslib/hts.h"
 
 KSEQ_INIT(gzFile, gzread)
@@ -37,10 +45,43 @@ typedef struct _args_t
 {
     char *output_fname, *fname;
     char *assembly, *species, *uri;
-    int  header;
+    int  header, n_threads;
 }
 args_t;
 
+static FILE *dict_open_output(args_t *args)
+{
+    FILE *out = stdout;
+    if (args->output_fname) {
+        out = fopen(args->output_fname, "w");
+        if (out == NULL) {
+          fprintf(stderr, "dict: %s: Cannot open file for writing\n", args->output_fname);
+          exit(1);
+        }
+    }
+    return out;
+}
+
+static void write_sq(FILE *out, const char *fn, const char *name, int64_t len,
+                     const char *hex, args_t *args)
+{
+    fprintf(out, "@SQ\tSN:%s\tLN:%"PRId64"\tM5:%s", name, len, hex);
+    if (args->uri)
+        fprintf(out, "\tUR:%s", args->uri);
+    else if (strcmp(fn, "-") != 0) {
+#ifdef _WIN32
+        char *real_path = _fullpath(NULL, fn, PATH_MAX);
+#else
+        char *real_path = realpath(fn, NULL);
+#endif
+        fprintf(out, "\tUR:file://%s", real_path);
+        free(real_path);
+    }
+    if (args->assembly) fprintf(out, "\tAS:%s", args->assembly);
+    if (args->species) fprintf(out, "\tSP:%s", args->species);
+    fprintf(out, "\n");
+}
+
 static void write_dict(const char *fn, args_t *args)
 {
     hts_md5_context *md5;
@@ -55,14 +96,7 @@ static void write_dict(const char *fn, args_t *args)
         fprintf(stderr, "dict: %s: No such file or directory\n", fn);
         exit(1);
     }
-    FILE *out = stdout;
-    if (args->output_fname) {
-        out = fopen(args->output_fname, "w");
-        if (out == NULL) {
-          fprintf(stderr, "dict: %s: Cannot open file for writing\n", args->output_fname);
-          exit(1);
-        }
-    }
+    FILE *out = dict_open_output(args);
 
     if (!(md5 = hts_md5_init()))
         exit(1);
@@ -78,21 +112,7 @@ static void write_dict(const char *fn, args_t *args)
         hts_md5_update(md5, (unsigned char*)seq->seq.s, k);
         hts_md5_final(digest, md5);
         hts_md5_hex(hex, digest);
-        fprintf(out, "@SQ\tSN:%s\tLN:%d\tM5:%s", seq->name.s, k, hex);
-        if (args->uri)
-            fprintf(out, "\tUR:%s", args->uri);
-        else if (strcmp(fn, "-") != 0) {
-#ifdef _WIN32
-            char *real_path = _fullpath(NULL, fn, PATH_MAX);
-#else
-            char *real_path = realpath(fn, NULL);
-#endif
-            fprintf(out, "\tUR:file://%s", real_path);
-            free(real_path);
-        }
-        if (args->assembly) fprintf(out, "\tAS:%s", args->assembly);
-        if (args->species) fprintf(out, "\tSP:%s", args->species);
-        fprintf(out, "\n");
+        write_sq(out, fn, seq->name.s, k, hex, args);
     }
     kseq_destroy(seq);
     hts_md5_destroy(md5);
@@ -100,6 +120,260 @@ static void write_dict(const char *fn, args_t *args)
     if (args->output_fname) fclose(out);
 }
 
+/*
+ * Multi-threaded hashing using the .fai index.  Each thread streams whole
+ * sequences from its own file handle through a combined filter, uppercase
+ * and MD5 loop, so no sequence is held in memory.  As the index may be out
+ * of date, each thread checks that the header following a sequence is the
+ * next one in the index (or that the file ends after the last).  If
+ * anything does not match, write_dict() is used instead.
+ */
+
+#define DICT_BUF_SIZE 0x10000
+
+// Reasons for write_dict_parallel() to fall back to write_dict()
+#define DICT_MISMATCH     1
+#define DICT_NO_RESOURCES 2
+
+typedef struct {
+    char *name;
+    int64_t len, offset;
+    char hex[33];
+} dict_seq_t;
+
+typedef struct {
+    int64_t len;
+    int i;
+} dict_order_t;
+
+typedef struct {
+    const char *fn;
+    dict_seq_t *seq;
+    dict_order_t *order;    // sequences to hash, longest first
+    int n_seq, next;
+    int failed;             // DICT_MISMATCH or DICT_NO_RESOURCES, if set
+    pthread_mutex_t lock;
+} dict_pool_t;
+
+typedef struct {
+    BGZF *fp;
+    unsigned char *buf;
+    ssize_t i, l;
+} dict_reader_t;
+
+static int dict_getc(dict_reader_t *r)
+{
+    if (r->i == r->l) {
+        r->i = 0;
+        r->l = bgzf_read(r->fp, r->buf, DICT_BUF_SIZE);
+        if (r->l <= 0) {
+            r->l = 0;
+            return -1;
+        }
+    }
+    return r->buf[r->i++];
+}
+
+// Check the next sequence read by kseq would be called name, or that there
+// is none if name is NULL
+static int dict_check_next(dict_reader_t *r, const char *name)
+{
+    const char *p;
+    int c;
+
+    while ((c = dict_getc(r)) >= 0 && !(c >= '!' && c <= '~')) ;
+    if (!name) return c < 0 ? 0 : -1;
+    if (c != '>') return -1;
+    for (p = name; *p; p++)
+        if (dict_getc(r) != (unsigned char) *p) return -1;
+    c = dict_getc(r);
+    return c < 0 || isspace(c) ? 0 : -1;
+}
+
+static int dict_hash_seq(dict_reader_t *r, hts_md5_context *md5,
+                         const dict_seq_t *s, const char *next_name, char *hex)
+{
+    unsigned char digest[16];
+    int64_t n = 0;
+
+    if (bgzf_useek(r->fp, s->offset, SEEK_SET) < 0) return -1;
+    r->i = r->l = 0;
+    hts_md5_reset(md5);
+    while (n < s->len) {
+        unsigned char *buf = r->buf;
+        ssize_t i, k;
+        if (r->i == r->l) {
+            r->i = 0;
+            r->l = bgzf_read(r->fp, r->buf, DICT_BUF_SIZE);
+            if (r->l <= 0) {
+                r->l = 0;
+                return -1;
+            }
+        }
+        for (i = r->i, k = 0; i < r->l && n < s->len; i++) {
+            unsigned char c = buf[i];
+            if (c >= '!' && c <= '~') {
+                if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+                buf[k++] = c;
+                n++;
+            }
+        }
+        hts_md5_update(md5, buf, k);
+        r->i = i;
+    }
+    hts_md5_final(digest, md5);
+    hts_md5_hex(hex, digest);
+    return dict_check_next(r, next_name);
+}
+
+static void *dict_worker(void *arg)
+{
+    dict_pool_t *p = (dict_pool_t *) arg;
+    dict_reader_t r = { NULL, NULL, 0, 0 };
+    hts_md5_context *md5 = NULL;
+    int failed = 0;
+
+    if (!(r.fp = bgzf_open(p->fn, "r"))
+        || (r.fp->is_compressed && bgzf_index_load(r.fp, p->fn, ".gzi") < 0)
+        || !(r.buf = malloc(DICT_BUF_SIZE))
+        || !(md5 = hts_md5_init()))
+        failed = DICT_NO_RESOURCES;
+
+    for (;;) {
+        int i = -1;
+        pthread_mutex_lock(&p->lock);
+        if (failed) {
+            if (!p->failed) p->failed = failed;
+        } else if (!p->failed && p->next < p->n_seq) i = p->order[p->next++].i;
+        pthread_mutex_unlock(&p->lock);
+        if (i < 0) break;
+        if (dict_hash_seq(&r, md5, &p->seq[i],
+                          i + 1 < p->n_seq ? p->seq[i+1].name : NULL,
+                          p->seq[i].hex) < 0)
+            failed = DICT_MISMATCH;
+    }
+
+    if (md5) hts_md5_destroy(md5);
+    free(r.buf);
+    if (r.fp) bgzf_close(r.fp);
+    return NULL;
+}
+
+static int dict_load_fai(const char *fn, dict_seq_t **seq_out)
+{
+    kstring_t fai_fn = {0, 0, NULL}, line = {0, 0, NULL};
+    dict_seq_t *seq = NULL;
+    int n_seq = 0, m_seq = 0;
+    FILE *fp;
+
+    ksprintf(&fai_fn, "%s.fai", fn);
+    fp = fopen(fai_fn.s, "r");
+    free(fai_fn.s);
+    if (!fp) return -1;
+
+    while (line.l = 0, kgetline(&line, (kgets_func *) fgets, fp) >= 0) {
+        char *p = strchr(line.s, '\t'), *q;
+        if (!p) goto fail;
+        *p++ = '\0';
+        if (n_seq == m_seq) {
+            m_seq = m_seq ? m_seq * 2 : 64;
+            dict_seq_t *tmp = realloc(seq, m_seq * sizeof(*tmp));
+            if (!tmp) goto fail;
+            seq = tmp;
+        }
+        seq[n_seq].len = strtoll(p, &q, 10);
+        seq[n_seq].offset = strtoll(q, &q, 10);
+        if (q == p || seq[n_seq].len < 0 || seq[n_seq].offset < 0) goto fail;
+        if (!(seq[n_seq].name = strdup(line.s))) goto fail;
+        n_seq++;
+    }
+    fclose(fp);
+    free(line.s);
+    *seq_out = seq;
+    return n_seq;
+
+ fail:
+    while (n_seq > 0) free(seq[--n_seq].name);
+    free(seq);
+    free(line.s);
+    fclose(fp);
+    return -1;
+}
+
+static int dict_order_cmp(const void *av, const void *bv)
+{
+    const dict_order_t *a = av, *b = bv;
+    if (a->len != b->len) return a->len > b->len ? -1 : 1;
+    return a->i - b->i;
+}
+
+/*
+ * Returns 0 if the dictionary has been written, or 1 if there is no usable
+ * index and write_dict() should be used instead.
+ */
+static int write_dict_parallel(const char *fn, args_t *args)
+{
+    dict_pool_t p;
+    dict_reader_t r = { NULL, NULL, 0, 0 };
+    pthread_t *tids = NULL;
+    int i, n_started = 0, ret = 1, why = DICT_NO_RESOURCES;
+
+    memset(&p, 0, sizeof(p));
+    p.fn = fn;
+    if (strcmp(fn, "-") == 0 || (p.n_seq = dict_load_fai(fn, &p.seq)) <= 0)
+        return 1;
+
+    // Nothing but the first sequence may come before it
+    if (!(r.fp = bgzf_open(fn, "r")) || !(r.buf = malloc(DICT_BUF_SIZE)))
+        goto out;
+    if (dict_check_next(&r, p.seq[0].name) < 0) {
+        why = DICT_MISMATCH;
+        goto out;
+    }
+
+    if (!(p.order = malloc(p.n_seq * sizeof(*p.order)))
+        || !(tids = calloc(args->n_threads, sizeof(*tids))))
+        goto out;
+    for (i = 0; i < p.n_seq; i++) {
+        p.order[i].len = p.seq[i].len;
+        p.order[i].i = i;
+    }
+    qsort(p.order, p.n_seq, sizeof(*p.order), dict_order_cmp);
+
+    pthread_mutex_init(&p.lock, NULL);
+    for (n_started = 0; n_started < args->n_threads && n_started < p.n_seq; n_started++) {
+        if (pthread_create(&tids[n_started], NULL, dict_worker, &p) != 0) {
+            fprintf(stderr, "dict: failed to start thread\n");
+            break;
+        }
+    }
+    for (i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&p.lock);
+    if (p.failed) why = p.failed;
+    if (n_started == 0 || p.failed) goto out;
+
+    FILE *out = dict_open_output(args);
+    if (args->header) fprintf(out, "@HD\tVN:1.0\tSO:unsorted\n");
+    for (i = 0; i < p.n_seq; i++)
+        write_sq(out, fn, p.seq[i].name, p.seq[i].len, p.seq[i].hex, args);
+    if (args->output_fname) fclose(out);
+    ret = 0;
+
+ out:
+    if (ret != 0 && why == DICT_MISMATCH)
+        fprintf(stderr, "dict: %s.fai does not match %s, reading it without the index\n", fn, fn);
+    else if (ret != 0)
+        fprintf(stderr, "dict: could not open %s, allocate memory or start threads, reading it without the index\n", fn);
+    for (i = 0; i < p.n_seq; i++) free(p.seq[i].name);
+    free(p.seq);
+    free(p.order);
+    free(tids);
+    free(r.buf);
+    if (r.fp) bgzf_close(r.fp);
+    return ret;
+}
+
 static int dict_usage(void)
 {
     fprintf(stderr, "\n");
@@ -110,6 +384,7 @@ static int dict_usage(void)
     fprintf(stderr, "         -o, --output STR      file to write out dict file [stdout]\n");
     fprintf(stderr, "         -s, --species STR     species\n");
     fprintf(stderr, "         -u, --uri STR         URI [file:///abs/path/to/file.fa]\n");
+    fprintf(stderr, "         -@, --threads INT     hash sequences in INT threads in total, using the .fai index [0]\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -127,10 +402,11 @@ int dict_main(int argc, char *argv[])
         {"species", required_argument, NULL, 's'},
         {"uri", required_argument, NULL, 'u'},
         {"output", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, '@'},
         {NULL, 0, NULL, 0}
     };
     int c;
-    while ( (c=getopt_long(argc,argv,"?hHa:s:u:o:",loptions,NULL))>0 )
+    while ( (c=getopt_long(argc,argv,"?hHa:s:u:o:@:",loptions,NULL))>0 )
     {
         switch (c)
         {
@@ -139,6 +415,17 @@ int dict_main(int argc, char *argv[])
             case 'u': args->uri = optarg; break;
             case 'o': args->output_fname = optarg; break;
             case 'H': args->header = 0; break;
+            case '@': {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (end == optarg || *end || n < 0 || n > INT_MAX) {
+                    fprintf(stderr, "dict: invalid thread count \"%s\"\n", optarg);
+                    free(args);
+                    return dict_usage();
+                }
+                args->n_threads = n;
+                break;
+            }
             case 'h': return dict_usage();
             default: return dict_usage();
         }
@@ -152,7 +439,8 @@ int dict_main(int argc, char *argv[])
     }
     else fname = argv[optind];
 
-    write_dict(fname, args);
+    if (args->n_threads <= 0 || write_dict_parallel(fname, args) != 0)
+        write_dict(fname, args);
     free(args);
     return 0;
 }
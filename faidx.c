@@ -43,7 +43,9 @@ History:
 #include <htslib/faidx.h>
 #include <htslib/hts.h>
 #include <htslib/hfile.h>
+#include <htslib/bgzf.h>
 #include <htslib/kstring.h>
+#include <htslib/khash.h>
 #include "samtools.h"
 
 #define DEFAULT_FASTA_LINE_LEN 60
@@ -135,6 +137,413 @@ static int read_regions_from_file(faidx_t *faid, hFILE *in_file, FILE *file, con
 }
 
 
+/*
+ * Batch mode.  Rather than fetching each region with fai_fetch(), which seeks
+ * and decompresses independently for every call, regions are collected in
+ * chunks, sorted by their offset in the file and read in a single forward
+ * sweep so each BGZF block is decompressed once however many regions it
+ * serves.  The results are then written out in the order they were given.
+ *
+ * faidx_t is opaque, so the .fai file is read again here to get the offsets.
+ * Regions naming unknown sequences are passed to fai_fetch() when written so
+ * that htslib reports them with its own message.
+ */
+
+#define BATCH_MAX_REGS  (1 << 20)   // regions per chunk
+#define BATCH_MAX_BASES (1 << 28)   // bases (and qualities) per chunk
+#define BATCH_SKIP      0x10000     // read through gaps shorter than this
+
+typedef struct {
+    int64_t len, seq_offset, qual_offset;
+    int line_blen, line_len;
+} batch_seq_t;
+
+KHASH_MAP_INIT_STR(batch_seq, int)
+
+typedef struct {
+    size_t name;        // offset of the region string in names
+    int64_t data[2];    // offsets of the bases and qualities in the data arena
+    int len[2];         // their lengths, as returned by fai_fetch()
+} batch_reg_t;
+
+typedef struct {
+    int64_t off;        // file offset of the first base
+    int64_t dest;       // where the bases go in the data arena
+    int64_t n;          // number of bases wanted
+    size_t reg;
+    int which;          // 0 for bases, 1 for qualities
+} batch_piece_t;
+
+typedef struct {
+    BGZF *fp;
+    faidx_t *fai;       // not owned; used to report missing sequences
+    enum fai_format_options format;
+    batch_seq_t *seq;
+    khash_t(batch_seq) *hash;
+    int n_seq;
+    kstring_t names;
+    size_t n_reg, m_reg, n_piece, m_piece;
+    batch_reg_t *reg;
+    batch_piece_t *piece;
+    int64_t n_data;
+    char *data;
+    size_t m_data;
+} batch_t;
+
+static void batch_destroy(batch_t *bt)
+{
+    khint_t k;
+    if (!bt) return;
+    if (bt->hash) {
+        for (k = kh_begin(bt->hash); k != kh_end(bt->hash); k++)
+            if (kh_exist(bt->hash, k)) free((char *) kh_key(bt->hash, k));
+        kh_destroy(batch_seq, bt->hash);
+    }
+    if (bt->fp) bgzf_close(bt->fp);
+    free(bt->seq);
+    free(bt->names.s);
+    free(bt->reg);
+    free(bt->piece);
+    free(bt->data);
+    free(bt);
+}
+
+static int batch_load_fai(batch_t *bt, const char *fn)
+{
+    kstring_t fai_fn = {0, 0, NULL}, line = {0, 0, NULL};
+    int m_seq = 0, ret = -1, absent;
+    hFILE *fp;
+
+    ksprintf(&fai_fn, "%s.fai", fn);
+    if (!(fp = hopen(fai_fn.s, "r"))) {
+        print_error_errno("faidx", "failed to open \"%s\"", fai_fn.s);
+        free(fai_fn.s);
+        return -1;
+    }
+
+    while (line.l = 0, kgetline(&line, (kgets_func *)hgets, fp) >= 0) {
+        char *p = strchr(line.s, '\t'), *q;
+        batch_seq_t *s;
+        khint_t k;
+
+        if (!p) goto bad_line;
+        *p++ = '\0';
+        if (bt->n_seq == m_seq) {
+            m_seq = m_seq ? m_seq * 2 : 256;
+            batch_seq_t *tmp = realloc(bt->seq, m_seq * sizeof(*tmp));
+            if (!tmp) goto mem_fail;
+            bt->seq = tmp;
+        }
+        s = &bt->seq[bt->n_seq];
+        s->len = strtoll(p, &q, 10);
+        s->seq_offset = strtoll(q, &q, 10);
+        s->line_blen = strtol(q, &q, 10);
+        s->line_len = strtol(q, &q, 10);
+        s->qual_offset = bt->format == FAI_FASTQ ? strtoll(q, &q, 10) : 0;
+        if (s->len < 0 || s->line_blen < 0 || s->line_len < s->line_blen
+            || (s->len > 0 && s->line_blen == 0))
+            goto bad_line;
+
+        char *name = strdup(line.s);
+        if (!name) goto mem_fail;
+        k = kh_put(batch_seq, bt->hash, name, &absent);
+        if (absent < 0) { free(name); goto mem_fail; }
+        if (!absent) { free(name); continue; } // fai_load() keeps the first
+        kh_val(bt->hash, k) = bt->n_seq++;
+    }
+    ret = 0;
+    goto out;
+
+ bad_line:
+    fprintf(stderr, "[faidx] Could not understand %s line \"%s\"\n", fai_fn.s, line.s);
+    goto out;
+ mem_fail:
+    print_error_errno("faidx", "failed to read \"%s\"", fai_fn.s);
+ out:
+    if (hclose(fp) != 0) {
+        print_error_errno("faidx", "failed to close \"%s\"", fai_fn.s);
+        ret = -1;
+    }
+    free(fai_fn.s);
+    free(line.s);
+    return ret;
+}
+
+static batch_t *batch_init(faidx_t *fai, const char *fn, enum fai_format_options format)
+{
+    batch_t *bt = calloc(1, sizeof(*bt));
+    if (!bt || !(bt->hash = kh_init(batch_seq))) {
+        print_error_errno("faidx", "failed to allocate memory");
+        goto fail;
+    }
+    bt->fai = fai;
+    bt->format = format;
+    if (batch_load_fai(bt, fn) < 0) goto fail;
+
+    if (!(bt->fp = bgzf_open(fn, "r"))) {
+        print_error_errno("faidx", "failed to open \"%s\"", fn);
+        goto fail;
+    }
+    if (bt->fp->is_compressed && bgzf_index_load(bt->fp, fn, ".gzi") < 0) {
+        fprintf(stderr, "[faidx] Could not load %s.gzi\n", fn);
+        goto fail;
+    }
+    return bt;
+
+ fail:
+    batch_destroy(bt);
+    return NULL;
+}
+
+// Work out where the bases of str are, in the same way as fai_fetch().
+// This mirrors the region parsing in htslib's fai_get_val(), including
+// falling back to the whole string as a name containing ':'.
+static int batch_add(batch_t *bt, const char *str)
+{
+    size_t i, k, l = strlen(str), name_end;
+    int64_t beg, end, n;
+    khint_t it;
+    batch_reg_t *r;
+    int which;
+
+    if (bt->n_reg == bt->m_reg) {
+        size_t m = bt->m_reg ? bt->m_reg * 2 : 1024;
+        batch_reg_t *tmp = realloc(bt->reg, m * sizeof(*tmp));
+        if (!tmp) return -1;
+        bt->reg = tmp;
+        bt->m_reg = m;
+    }
+    if (bt->n_piece + 2 > bt->m_piece) {
+        size_t m = bt->m_piece ? bt->m_piece * 2 : 2048;
+        batch_piece_t *tmp = realloc(bt->piece, m * sizeof(*tmp));
+        if (!tmp) return -1;
+        bt->piece = tmp;
+        bt->m_piece = m;
+    }
+
+    // Keep the string as given for the output, and a copy without spaces
+    // after it to parse
+    r = &bt->reg[bt->n_reg];
+    r->name = bt->names.l;
+    if (kputsn(str, l, &bt->names) < 0 || kputc('\0', &bt->names) < 0 ||
+        ks_resize(&bt->names, bt->names.l + l + 1) < 0)
+        return -1;
+    char *s = bt->names.s + bt->names.l;
+    for (i = k = 0; i < l; i++)
+        if (!isspace((unsigned char) str[i])) s[k++] = str[i];
+    s[k] = '\0';
+    l = k;
+
+    // The name ends at the last colon, if what follows looks like a range
+    for (name_end = l; name_end > 0 && s[name_end - 1] != ':'; name_end--) ;
+    if (name_end > 0) {
+        int n_hyphen = 0;
+        name_end--;
+        for (i = name_end + 1; i < l; i++) {
+            if (s[i] == '-') n_hyphen++;
+            else if (!isdigit((unsigned char) s[i]) && s[i] != ',') break;
+        }
+        if (i < l || n_hyphen > 1) name_end = l;
+    } else {
+        name_end = l;
+    }
+    s[name_end] = '\0';
+    it = kh_get(batch_seq, bt->hash, s);
+    if (it == kh_end(bt->hash) && name_end < l) {
+        s[name_end] = ':';
+        name_end = l;
+        it = kh_get(batch_seq, bt->hash, s);
+    }
+
+    r->data[0] = r->data[1] = bt->n_data;
+    if (it == kh_end(bt->hash)) {
+        r->len[0] = r->len[1] = -2;
+        bt->n_reg++;
+        return 0;
+    }
+    const batch_seq_t *sq = &bt->seq[kh_val(bt->hash, it)];
+
+    if (name_end < l) {
+        char *ep;
+        for (i = k = name_end + 1; i < l; i++)
+            if (s[i] != ',') s[k++] = s[i];
+        s[k] = '\0';
+        if (s[name_end + 1] == '-') {
+            beg = 0;
+            ep = s + name_end + 2;
+        } else {
+            beg = strtoll(s + name_end + 1, &ep, 10);
+            if (*ep == '-') ep++;
+        }
+        end = *ep ? strtoll(ep, NULL, 10) : sq->len;
+        if (beg > 0) beg--;
+    } else {
+        beg = 0;
+        end = sq->len;
+    }
+    if (beg > sq->len) beg = sq->len;
+    if (end > sq->len) end = sq->len;
+    if (beg > end) beg = end;
+    n = end - beg;
+
+    for (which = 0; which < (bt->format == FAI_FASTQ ? 2 : 1); which++) {
+        batch_piece_t *p = &bt->piece[bt->n_piece++];
+        int64_t start = which ? sq->qual_offset : sq->seq_offset;
+        p->off = sq->line_blen ? start + beg / sq->line_blen * sq->line_len
+                                       + beg % sq->line_blen : start;
+        p->dest = bt->n_data;
+        p->n = n;
+        p->reg = bt->n_reg;
+        p->which = which;
+        r->data[which] = bt->n_data;
+        r->len[which] = 0;
+        bt->n_data += n;
+    }
+    bt->n_reg++;
+    return 0;
+}
+
+static int batch_piece_cmp(const void *av, const void *bv)
+{
+    const batch_piece_t *a = av, *b = bv;
+    if (a->off != b->off) return a->off < b->off ? -1 : 1;
+    return a->dest < b->dest ? -1 : a->dest > b->dest;
+}
+
+// Move to uncompressed offset off, reusing the current block where possible.
+// This steps block_offset and uncompressed_address through the buffer as
+// bgzf_read() does, and only calls bgzf_useek() for long or backward jumps.
+static int batch_seek(BGZF *fp, int64_t off)
+{
+    int64_t cur = bgzf_utell(fp);
+
+    if (off < cur && fp->block_length > 0 && cur - off <= fp->block_offset) {
+        fp->block_offset -= cur - off;
+        fp->uncompressed_address = off;
+        return 0;
+    }
+    if (off < cur || off - cur >= BATCH_SKIP)
+        return bgzf_useek(fp, off, SEEK_SET);
+
+    while (cur < off) {
+        if (fp->block_offset >= fp->block_length) {
+            if (bgzf_read_block(fp) < 0) return -1;
+            if (fp->block_length == 0) break;
+        }
+        int n = fp->block_length - fp->block_offset;
+        if (n > off - cur) n = off - cur;
+        fp->block_offset += n;
+        cur += n;
+    }
+    fp->uncompressed_address = cur;
+    return 0;
+}
+
+// Copy up to n printable characters straight out of the BGZF buffer,
+// as fai_retrieve()'s bgzf_getc() loop does but without a call per byte
+static int64_t batch_read(BGZF *fp, char *out, int64_t n)
+{
+    int64_t l = 0;
+
+    while (l < n) {
+        if (fp->block_offset >= fp->block_length) {
+            if (bgzf_read_block(fp) < 0) return -1;
+            if (fp->block_length == 0) break;
+        }
+        const char *buf = (const char *) fp->uncompressed_block;
+        int i = fp->block_offset, e = fp->block_length;
+        for (; i < e && l < n; i++)
+            if (isgraph((unsigned char) buf[i])) out[l++] = buf[i];
+        fp->uncompressed_address += i - fp->block_offset;
+        fp->block_offset = i;
+    }
+    return l;
+}
+
+static int batch_write(batch_t *bt, FILE *file, const batch_reg_t *r,
+                       const int ignore, const int length)
+{
+    const char *name = bt->names.s + r->name;
+    int len;
+
+    fprintf(file, bt->format == FAI_FASTA ? ">%s\n" : "@%s\n", name);
+    if (r->len[0] == -2) free(fai_fetch(bt->fai, name, &len));
+    if (write_line(file, bt->data + r->data[0], name, ignore, length, r->len[0]) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    if (bt->format == FAI_FASTQ) {
+        fprintf(file, "+\n");
+        if (r->len[1] == -2) free(fai_fetchqual(bt->fai, name, &len));
+        if (write_line(file, bt->data + r->data[1], name, ignore, length, r->len[1]) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Fetch everything in the current chunk, write it out and start a new one
+static int batch_flush(batch_t *bt, FILE *file, const int ignore, const int length)
+{
+    int ret = EXIT_SUCCESS;
+    size_t i;
+
+    if (bt->n_data > bt->m_data) {
+        char *tmp = realloc(bt->data, bt->n_data);
+        if (!tmp) {
+            print_error_errno("faidx", "failed to allocate memory");
+            return EXIT_FAILURE;
+        }
+        bt->data = tmp;
+        bt->m_data = bt->n_data;
+    }
+
+    qsort(bt->piece, bt->n_piece, sizeof(*bt->piece), batch_piece_cmp);
+    for (i = 0; i < bt->n_piece; i++) {
+        batch_piece_t *p = &bt->piece[i];
+        int64_t l = -1;
+        if (batch_seek(bt->fp, p->off) == 0)
+            l = batch_read(bt->fp, bt->data + p->dest, p->n);
+        bt->reg[p->reg].len[p->which] = l;
+    }
+
+    for (i = 0; i < bt->n_reg && ret == EXIT_SUCCESS; i++)
+        ret = batch_write(bt, file, &bt->reg[i], ignore, length);
+
+    bt->names.l = 0;
+    bt->n_reg = bt->n_piece = 0;
+    bt->n_data = 0;
+    return ret;
+}
+
+static int batch_push(batch_t *bt, const char *str, FILE *file, const int ignore,
+                      const int length)
+{
+    if (batch_add(bt, str) < 0) {
+        print_error_errno("faidx", "failed to allocate memory");
+        return EXIT_FAILURE;
+    }
+    if (bt->n_reg >= BATCH_MAX_REGS || bt->n_data >= BATCH_MAX_BASES)
+        return batch_flush(bt, file, ignore, length);
+    return EXIT_SUCCESS;
+}
+
+static int batch_regions_from_file(batch_t *bt, hFILE *in_file, FILE *file,
+                                   const int ignore, const int length)
+{
+    kstring_t line = {0, 0, NULL};
+    int ret = EXIT_SUCCESS;
+
+    while (ret == EXIT_SUCCESS &&
+           (line.l = 0, kgetline(&line, (kgets_func *)hgets, in_file) >= 0)) {
+        ret = batch_push(bt, line.s, file, ignore, length);
+    }
+
+    free(line.s);
+
+    return ret;
+}
+
+
 static int usage(FILE *fp, enum fai_format_options format, int exit_status)
 {
     char *tool, *file_type;
@@ -152,7 +561,8 @@ static int usage(FILE *fp, enum fai_format_options format, int exit_status)
                 " -o, --output      FILE Write %s to file.\n"
                 " -n, --length      INT  Length of %s sequence line. [60]\n"
                 " -c, --continue         Continue after trying to retrieve missing region.\n"
-                " -r, --region-file FILE File of regions.  Format is chr:from-to. One per line.\n",
+                " -r, --region-file FILE File of regions.  Format is chr:from-to. One per line.\n"
+                " -b, --batch            Fetch regions sorted by file position; output order is unchanged.\n",
                 file_type, file_type);
 
     if (format == FAI_FASTA) {
@@ -167,7 +577,7 @@ static int usage(FILE *fp, enum fai_format_options format, int exit_status)
 
 int faidx_core(int argc, char *argv[], enum fai_format_options format)
 {
-    int c, ignore_error = 0;
+    int c, ignore_error = 0, batch = 0;
     int line_len = DEFAULT_FASTA_LINE_LEN ;/* fasta line len */
     char* output_file = NULL; /* output file (default is stdout ) */
     char *region_file = NULL; // list of regions from file, one per line
@@ -180,10 +590,11 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
         { "continue", no_argument,          NULL, 'c' },
         { "region-file", required_argument, NULL, 'r' },
         { "fastq", no_argument,             NULL, 'f' },
+        { "batch", no_argument,             NULL, 'b' },
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "ho:n:cr:f", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "ho:n:cr:fb", lopts, NULL)) >= 0) {
         switch (c) {
             case 'o': output_file = optarg; break;
             case 'n': line_len = atoi(optarg);
@@ -195,6 +606,7 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
             case 'c': ignore_error = 1; break;
             case 'r': region_file = optarg; break;
             case 'f': format = FAI_FASTQ; break;
+            case 'b': batch = 1; break;
             case '?': return usage(stderr, format, EXIT_FAILURE);
             case 'h': return usage(stdout, format, EXIT_SUCCESS);
             default:  break;
@@ -237,7 +649,38 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
 
     int exit_status = EXIT_SUCCESS;
 
-    if (region_file) {
+    if (batch) {
+        // Loading fai made sure the index exists; batch mode reads it itself
+        batch_t *bt = batch_init(fai, argv[optind], format);
+        hFILE *rf;
+
+        if (!bt) {
+            exit_status = EXIT_FAILURE;
+        } else if (region_file) {
+            if ((rf = hopen(region_file, "r"))) {
+                exit_status = batch_regions_from_file(bt, rf, file_out, ignore_error, line_len);
+
+                if (hclose(rf) != 0) {
+                    fprintf(stderr, "[faidx] Warning: failed to close %s", region_file);
+                }
+            } else {
+                fprintf(stderr, "[faidx] Failed to open \"%s\" for reading.\n", region_file);
+                exit_status = EXIT_FAILURE;
+            }
+        }
+
+        while ( bt && ++optind<argc && exit_status == EXIT_SUCCESS) {
+            exit_status = batch_push(bt, argv[optind], file_out, ignore_error, line_len);
+        }
+
+        if (bt && exit_status == EXIT_SUCCESS)
+            exit_status = batch_flush(bt, file_out, ignore_error, line_len);
+
+        batch_destroy(bt);
+        optind = argc;
+    }
+
+    if (region_file && !batch) {
         hFILE *rf;
 
         if ((rf = hopen(region_file, "r"))) {
@@ -256,7 +699,7 @@ int faidx_core(int argc, char *argv[], enum fai_format_options format)
         exit_status = write_output(fai, file_out, argv[optind], ignore_error, line_len, format);
     }
 
-    fai_destroy(fai);
+    if (fai) fai_destroy(fai);
 
     if (fflush(file_out) == EOF) {
         print_error_errno("faidx", "failed to flush output");
@@ -0,0 +1,718 @@
+/*  sam_filter.c -- filter expressions on alignment records.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * The expression is compiled by a recursive descent parser into a short
+ * program for a stack machine.  Evaluation works directly on the bam1_t
+ * fields and aux data; nothing is converted to text apart from the sequence,
+ * and that only if the expression uses it.
+ *
+ * Values are numbers (doubles), strings, or null.  null is produced by
+ * missing aux tags and by arithmetic that makes no sense (e.g. division by
+ * zero or adding a string); it is false, and any comparison involving it is
+ * false.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <regex.h>
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+#include "samtools.h"
+#include "sam_filter.h"
+
+#define SF_MAX_STACK 64
+#define SF_MAX_NEST 256
+
+enum sf_op {
+    SF_NUM, SF_STR, SF_FIELD, SF_TAG,
+    SF_NOT, SF_NEG, SF_BNOT, SF_BOOL,
+    SF_ADD, SF_SUB, SF_MUL, SF_DIV, SF_MOD,
+    SF_BAND, SF_BOR, SF_BXOR,
+    SF_EQ, SF_NE, SF_LT, SF_LE, SF_GT, SF_GE,
+    SF_MATCH, SF_NMATCH,
+    SF_AND, SF_OR      // short-circuit jumps
+};
+
+enum sf_field {
+    F_QNAME, F_FLAG, F_RNAME, F_POS, F_ENDPOS, F_MAPQ, F_RNEXT, F_PNEXT,
+    F_TLEN, F_QLEN, F_RLEN, F_NCIGAR, F_SEQ
+};
+
+static const struct {
+    const char *name;
+    int field;
+} sf_fields[] = {
+    { "qname",  F_QNAME },
+    { "flag",   F_FLAG },
+    { "rname",  F_RNAME },
+    { "pos",    F_POS },
+    { "endpos", F_ENDPOS },
+    { "mapq",   F_MAPQ },
+    { "rnext",  F_RNEXT },
+    { "pnext",  F_PNEXT },
+    { "tlen",   F_TLEN },
+    { "qlen",   F_QLEN },
+    { "rlen",   F_RLEN },
+    { "ncigar", F_NCIGAR },
+    { "seq",    F_SEQ },
+    { NULL, 0 }
+};
+
+// Names usable as flag.NAME
+static const struct {
+    const char *name;
+    int flag;
+} sf_flags[] = {
+    { "paired",        BAM_FPAIRED },
+    { "proper_pair",   BAM_FPROPER_PAIR },
+    { "unmap",         BAM_FUNMAP },
+    { "munmap",        BAM_FMUNMAP },
+    { "reverse",       BAM_FREVERSE },
+    { "mreverse",      BAM_FMREVERSE },
+    { "read1",         BAM_FREAD1 },
+    { "read2",         BAM_FREAD2 },
+    { "secondary",     BAM_FSECONDARY },
+    { "qcfail",        BAM_FQCFAIL },
+    { "dup",           BAM_FDUP },
+    { "supplementary", BAM_FSUPPLEMENTARY },
+    { NULL, 0 }
+};
+
+typedef struct {
+    int op;
+    int arg;    // field, tag, string/regex index, flag mask or jump target
+    double num;
+} sf_insn_t;
+
+struct sam_filter {
+    sf_insn_t *code;
+    int n_code, m_code;
+    char **strs;
+    int n_strs, m_strs;
+    regex_t *res;
+    int n_res, m_res;
+};
+
+/* Parser */
+
+typedef struct {
+    const char *str, *p;
+    sam_filter_t *filt;
+    int depth, nest, error;
+} sf_parser_t;
+
+static void sf_error(sf_parser_t *ps, const char *msg)
+{
+    if (ps->error) return;
+    print_error("filter", "%s at column %d of expression \"%s\"",
+                msg, (int)(ps->p - ps->str) + 1, ps->str);
+    ps->error = 1;
+}
+
+static int sf_emit(sf_parser_t *ps, int op, int arg, double num)
+{
+    sam_filter_t *f = ps->filt;
+    if (ps->error) return -1;
+    if (f->n_code == f->m_code) {
+        int m = f->m_code ? f->m_code * 2 : 16;
+        sf_insn_t *c = realloc(f->code, m * sizeof(*c));
+        if (!c) {
+            sf_error(ps, "out of memory");
+            return -1;
+        }
+        f->code = c;
+        f->m_code = m;
+    }
+    f->code[f->n_code].op = op;
+    f->code[f->n_code].arg = arg;
+    f->code[f->n_code].num = num;
+
+    // Track the stack depth needed to run the program
+    switch (op) {
+    case SF_NUM: case SF_STR: case SF_FIELD: case SF_TAG:
+        if (++ps->depth > SF_MAX_STACK) sf_error(ps, "expression too complex");
+        break;
+    case SF_NOT: case SF_NEG: case SF_BNOT: case SF_BOOL:
+        break;
+    default:    // binary operators, and the fall-through path of jumps
+        ps->depth--;
+        break;
+    }
+    return f->n_code++;
+}
+
+static void sf_skip_space(sf_parser_t *ps)
+{
+    while (isspace((unsigned char) *ps->p)) ps->p++;
+}
+
+// Match an operator token.  Care is needed so that "<" does not match "<="
+static int sf_accept(sf_parser_t *ps, const char *tok, const char *not_before)
+{
+    size_t l = strlen(tok);
+    sf_skip_space(ps);
+    if (strncmp(ps->p, tok, l) != 0) return 0;
+    if (not_before && ps->p[l] && strchr(not_before, ps->p[l])) return 0;
+    ps->p += l;
+    return 1;
+}
+
+static void sf_parse_or(sf_parser_t *ps);
+
+static void sf_parse_string(sf_parser_t *ps)
+{
+    sam_filter_t *f = ps->filt;
+    char quote = *ps->p++;
+    kstring_t s = { 0, 0, NULL };
+
+    while (*ps->p && *ps->p != quote) {
+        char c = *ps->p++;
+        if (c == '\\' && *ps->p) {
+            c = *ps->p++;
+            if (c == 'n') c = '\n';
+            else if (c == 't') c = '\t';
+        }
+        kputc(c, &s);
+    }
+    if (*ps->p != quote) {
+        free(s.s);
+        sf_error(ps, "unterminated string");
+        return;
+    }
+    ps->p++;
+    if (!s.s) kputs("", &s);
+    if (f->n_strs == f->m_strs) {
+        int m = f->m_strs ? f->m_strs * 2 : 8;
+        char **strs = realloc(f->strs, m * sizeof(*strs));
+        if (!strs) {
+            free(s.s);
+            sf_error(ps, "out of memory");
+            return;
+        }
+        f->strs = strs;
+        f->m_strs = m;
+    }
+    f->strs[f->n_strs] = s.s;
+    sf_emit(ps, SF_STR, f->n_strs++, 0);
+}
+
+static void sf_parse_primary(sf_parser_t *ps)
+{
+    const char *p;
+
+    sf_skip_space(ps);
+    p = ps->p;
+    if (*p == '(') {
+        ps->p++;
+        sf_parse_or(ps);
+        if (!sf_accept(ps, ")", NULL)) sf_error(ps, "missing ')'");
+    } else if (*p == '"' || *p == '\'') {
+        sf_parse_string(ps);
+    } else if (*p == '[') {
+        if (isalpha((unsigned char) p[1]) && isalnum((unsigned char) p[2])
+            && p[3] == ']') {
+            sf_emit(ps, SF_TAG, (p[1] << 8) | p[2], 0);
+            ps->p += 4;
+        } else {
+            sf_error(ps, "invalid aux tag");
+        }
+    } else if (isdigit((unsigned char) *p)
+               || (*p == '.' && isdigit((unsigned char) p[1]))) {
+        char *end;
+        double d = strtod(p, &end);
+        if (end == p) {
+            sf_error(ps, "invalid number");
+            return;
+        }
+        ps->p = end;
+        sf_emit(ps, SF_NUM, 0, d);
+    } else if (isalpha((unsigned char) *p) || *p == '_') {
+        const char *e = p;
+        size_t l;
+        int i;
+        while (isalnum((unsigned char) *e) || *e == '_') e++;
+        l = e - p;
+        if (l == 4 && strncmp(p, "flag", 4) == 0 && *e == '.') {
+            const char *n = ++e;
+            while (isalnum((unsigned char) *e) || *e == '_') e++;
+            for (i = 0; sf_flags[i].name; i++) {
+                if (strlen(sf_flags[i].name) == (size_t)(e - n)
+                    && strncmp(sf_flags[i].name, n, e - n) == 0) break;
+            }
+            if (!sf_flags[i].name) {
+                ps->p = n;
+                sf_error(ps, "unknown flag name");
+                return;
+            }
+            // flag.NAME is (flag & MASK) != 0
+            sf_emit(ps, SF_FIELD, F_FLAG, 0);
+            sf_emit(ps, SF_NUM, 0, sf_flags[i].flag);
+            sf_emit(ps, SF_BAND, 0, 0);
+            sf_emit(ps, SF_BOOL, 0, 0);
+            ps->p = e;
+            return;
+        }
+        for (i = 0; sf_fields[i].name; i++) {
+            if (strlen(sf_fields[i].name) == l
+                && strncmp(sf_fields[i].name, p, l) == 0) break;
+        }
+        if (!sf_fields[i].name) {
+            sf_error(ps, "unknown field name");
+            return;
+        }
+        sf_emit(ps, SF_FIELD, sf_fields[i].field, 0);
+        ps->p = e;
+    } else {
+        sf_error(ps, *p ? "syntax error" : "unexpected end of expression");
+    }
+}
+
+static void sf_parse_unary(sf_parser_t *ps)
+{
+    // Limit recursion on things like "((((...))))" and "!!!!..."
+    if (++ps->nest > SF_MAX_NEST) {
+        sf_error(ps, "expression too complex");
+        return;
+    }
+    if (sf_accept(ps, "!", "=~")) {
+        sf_parse_unary(ps);
+        sf_emit(ps, SF_NOT, 0, 0);
+    } else if (sf_accept(ps, "-", NULL)) {
+        sf_parse_unary(ps);
+        sf_emit(ps, SF_NEG, 0, 0);
+    } else if (sf_accept(ps, "~", NULL)) {
+        sf_parse_unary(ps);
+        sf_emit(ps, SF_BNOT, 0, 0);
+    } else {
+        sf_parse_primary(ps);
+    }
+    ps->nest--;
+}
+
+static void sf_parse_mul(sf_parser_t *ps)
+{
+    sf_parse_unary(ps);
+    while (!ps->error) {
+        int op;
+        if (sf_accept(ps, "*", NULL)) op = SF_MUL;
+        else if (sf_accept(ps, "/", NULL)) op = SF_DIV;
+        else if (sf_accept(ps, "%", NULL)) op = SF_MOD;
+        else break;
+        sf_parse_unary(ps);
+        sf_emit(ps, op, 0, 0);
+    }
+}
+
+static void sf_parse_add(sf_parser_t *ps)
+{
+    sf_parse_mul(ps);
+    while (!ps->error) {
+        int op;
+        if (sf_accept(ps, "+", NULL)) op = SF_ADD;
+        else if (sf_accept(ps, "-", NULL)) op = SF_SUB;
+        else break;
+        sf_parse_mul(ps);
+        sf_emit(ps, op, 0, 0);
+    }
+}
+
+static void sf_parse_rel(sf_parser_t *ps)
+{
+    sf_parse_add(ps);
+    while (!ps->error) {
+        int op;
+        if (sf_accept(ps, "<=", NULL)) op = SF_LE;
+        else if (sf_accept(ps, ">=", NULL)) op = SF_GE;
+        else if (sf_accept(ps, "<", NULL)) op = SF_LT;
+        else if (sf_accept(ps, ">", NULL)) op = SF_GT;
+        else break;
+        sf_parse_add(ps);
+        sf_emit(ps, op, 0, 0);
+    }
+}
+
+static void sf_parse_eq(sf_parser_t *ps)
+{
+    sam_filter_t *f = ps->filt;
+
+    sf_parse_rel(ps);
+    while (!ps->error) {
+        int op, start;
+        if (sf_accept(ps, "==", NULL)) op = SF_EQ;
+        else if (sf_accept(ps, "!=", NULL)) op = SF_NE;
+        else if (sf_accept(ps, "=~", NULL)) op = SF_MATCH;
+        else if (sf_accept(ps, "!~", NULL)) op = SF_NMATCH;
+        else break;
+        start = f->n_code;
+        sf_parse_rel(ps);
+        if (ps->error) return;
+        if (op == SF_MATCH || op == SF_NMATCH) {
+            // The pattern must be a literal so it can be compiled up front.
+            // Replace the string push with the match instruction.
+            int err;
+            if (f->n_code != start + 1 || f->code[start].op != SF_STR) {
+                sf_error(ps, "regular expression must be a string");
+                return;
+            }
+            if (f->n_res == f->m_res) {
+                int m = f->m_res ? f->m_res * 2 : 4;
+                regex_t *res = realloc(f->res, m * sizeof(*res));
+                if (!res) {
+                    sf_error(ps, "out of memory");
+                    return;
+                }
+                f->res = res;
+                f->m_res = m;
+            }
+            err = regcomp(&f->res[f->n_res], f->strs[f->code[start].arg],
+                          REG_EXTENDED | REG_NOSUB);
+            if (err) {
+                char msg[256];
+                regerror(err, &f->res[f->n_res], msg, sizeof(msg));
+                sf_error(ps, msg);
+                return;
+            }
+            f->code[start].op = op;
+            f->code[start].arg = f->n_res++;
+            // Net effect of push + binary op is no change in depth
+            ps->depth--;
+        } else {
+            sf_emit(ps, op, 0, 0);
+        }
+    }
+}
+
+static void sf_parse_band(sf_parser_t *ps)
+{
+    sf_parse_eq(ps);
+    while (!ps->error && sf_accept(ps, "&", "&")) {
+        sf_parse_eq(ps);
+        sf_emit(ps, SF_BAND, 0, 0);
+    }
+}
+
+static void sf_parse_bxor(sf_parser_t *ps)
+{
+    sf_parse_band(ps);
+    while (!ps->error && sf_accept(ps, "^", NULL)) {
+        sf_parse_band(ps);
+        sf_emit(ps, SF_BXOR, 0, 0);
+    }
+}
+
+static void sf_parse_bor(sf_parser_t *ps)
+{
+    sf_parse_bxor(ps);
+    while (!ps->error && sf_accept(ps, "|", "|")) {
+        sf_parse_bxor(ps);
+        sf_emit(ps, SF_BOR, 0, 0);
+    }
+}
+
+static void sf_parse_and(sf_parser_t *ps)
+{
+    sf_parse_bor(ps);
+    while (!ps->error && sf_accept(ps, "&&", NULL)) {
+        int jmp = sf_emit(ps, SF_AND, 0, 0);
+        sf_parse_bor(ps);
+        sf_emit(ps, SF_BOOL, 0, 0);
+        if (!ps->error) ps->filt->code[jmp].arg = ps->filt->n_code;
+    }
+}
+
+static void sf_parse_or(sf_parser_t *ps)
+{
+    sf_parse_and(ps);
+    while (!ps->error && sf_accept(ps, "||", NULL)) {
+        int jmp = sf_emit(ps, SF_OR, 0, 0);
+        sf_parse_and(ps);
+        sf_emit(ps, SF_BOOL, 0, 0);
+        if (!ps->error) ps->filt->code[jmp].arg = ps->filt->n_code;
+    }
+}
+
+sam_filter_t *sam_filter_parse(const char *str)
+{
+    sf_parser_t ps;
+    sam_filter_t *f = calloc(1, sizeof(sam_filter_t));
+
+    if (!f) {
+        print_error_errno("filter", "failed to allocate memory");
+        return NULL;
+    }
+    ps.str = ps.p = str;
+    ps.filt = f;
+    ps.depth = ps.nest = ps.error = 0;
+
+    sf_parse_or(&ps);
+    sf_skip_space(&ps);
+    if (!ps.error && *ps.p) sf_error(&ps, "syntax error");
+    if (ps.error) {
+        sam_filter_destroy(f);
+        return NULL;
+    }
+    return f;
+}
+
+void sam_filter_destroy(sam_filter_t *f)
+{
+    int i;
+    if (!f) return;
+    for (i = 0; i < f->n_strs; i++) free(f->strs[i]);
+    for (i = 0; i < f->n_res; i++) regfree(&f->res[i]);
+    free(f->strs);
+    free(f->res);
+    free(f->code);
+    free(f);
+}
+
+/* Evaluation */
+
+enum { SV_NULL, SV_NUM, SV_STR };
+
+typedef struct {
+    int type;
+    double num;
+    const char *str;    // if NULL for a string, see chr
+    char chr[2];        // holds the value of 'A' type tags
+} sf_val_t;
+
+static inline const char *sv_str(const sf_val_t *v)
+{
+    return v->str ? v->str : v->chr;
+}
+
+static inline int sv_true(const sf_val_t *v)
+{
+    return v->type == SV_STR || (v->type == SV_NUM && v->num != 0);
+}
+
+static inline void sv_num(sf_val_t *v, double num)
+{
+    v->type = SV_NUM;
+    v->num = num;
+}
+
+static inline void sv_string(sf_val_t *v, const char *str)
+{
+    v->type = SV_STR;
+    v->str = str;
+}
+
+static const char *sf_ref_name(const bam_hdr_t *h, int tid)
+{
+    return tid >= 0 && tid < h->n_targets ? h->target_name[tid] : "*";
+}
+
+static int sf_get_field(sf_val_t *v, int field, const bam_hdr_t *h,
+                        const bam1_t *b, kstring_t *tmp)
+{
+    switch (field) {
+    case F_QNAME:  sv_string(v, bam_get_qname(b)); break;
+    case F_FLAG:   sv_num(v, b->core.flag); break;
+    case F_RNAME:  sv_string(v, sf_ref_name(h, b->core.tid)); break;
+    case F_POS:    sv_num(v, b->core.pos + 1); break;
+    case F_ENDPOS: sv_num(v, bam_endpos(b)); break;
+    case F_MAPQ:   sv_num(v, b->core.qual); break;
+    case F_RNEXT:  sv_string(v, sf_ref_name(h, b->core.mtid)); break;
+    case F_PNEXT:  sv_num(v, b->core.mpos + 1); break;
+    case F_TLEN:   sv_num(v, b->core.isize); break;
+    case F_QLEN:   sv_num(v, b->core.l_qseq); break;
+    case F_RLEN:
+        sv_num(v, bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b)));
+        break;
+    case F_NCIGAR: sv_num(v, b->core.n_cigar); break;
+    case F_SEQ: {
+        const uint8_t *seq = bam_get_seq(b);
+        int i, len = b->core.l_qseq;
+        if (ks_resize(tmp, len + 1) < 0) return -1;
+        for (i = 0; i < len; i++)
+            tmp->s[i] = seq_nt16_str[bam_seqi(seq, i)];
+        tmp->s[len] = '\0';
+        tmp->l = len;
+        sv_string(v, tmp->s);
+        break;
+    }
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static void sf_get_tag(sf_val_t *v, int tag, const bam1_t *b)
+{
+    char name[2] = { tag >> 8, tag & 0xff };
+    const uint8_t *s = bam_aux_get(b, name);
+
+    v->type = SV_NULL;
+    if (!s) return;
+    switch (*s) {
+    case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+        sv_num(v, bam_aux2i(s));
+        break;
+    case 'f': case 'd':
+        sv_num(v, bam_aux2f(s));
+        break;
+    case 'A':
+        v->type = SV_STR;
+        v->str = NULL;
+        v->chr[0] = s[1];
+        v->chr[1] = '\0';
+        break;
+    case 'Z': case 'H':
+        sv_string(v, (const char *) s + 1);
+        break;
+    default:    // B arrays are not supported
+        break;
+    }
+}
+
+static void sf_compare(sf_val_t *a, const sf_val_t *b, int op)
+{
+    int c;
+    if (a->type == SV_NULL || a->type != b->type) {
+        sv_num(a, 0);
+        return;
+    }
+    if (a->type == SV_NUM)
+        c = a->num < b->num ? -1 : a->num > b->num;
+    else
+        c = strcmp(sv_str(a), sv_str(b));
+    switch (op) {
+    case SF_EQ: c = c == 0; break;
+    case SF_NE: c = c != 0; break;
+    case SF_LT: c = c <  0; break;
+    case SF_LE: c = c <= 0; break;
+    case SF_GT: c = c >  0; break;
+    default:    c = c >= 0; break;
+    }
+    sv_num(a, c);
+}
+
+static void sf_arith(sf_val_t *a, const sf_val_t *b, int op)
+{
+    double x, y;
+    if (a->type != SV_NUM || b->type != SV_NUM) {
+        a->type = SV_NULL;
+        return;
+    }
+    x = a->num;
+    y = b->num;
+    switch (op) {
+    case SF_ADD: x += y; break;
+    case SF_SUB: x -= y; break;
+    case SF_MUL: x *= y; break;
+    case SF_DIV:
+        if (y == 0) { a->type = SV_NULL; return; }
+        x /= y;
+        break;
+    case SF_MOD:
+        if ((int64_t) y == 0) { a->type = SV_NULL; return; }
+        x = (int64_t) x % (int64_t) y;
+        break;
+    case SF_BAND: x = (int64_t) x & (int64_t) y; break;
+    case SF_BOR:  x = (int64_t) x | (int64_t) y; break;
+    default:      x = (int64_t) x ^ (int64_t) y; break;
+    }
+    a->num = x;
+}
+
+int sam_filter_eval(const sam_filter_t *f, const bam_hdr_t *h,
+                    const bam1_t *b, kstring_t *tmp)
+{
+    sf_val_t stack[SF_MAX_STACK], *v = stack - 1;
+    int pc;
+
+    for (pc = 0; pc < f->n_code; pc++) {
+        const sf_insn_t *in = &f->code[pc];
+        switch (in->op) {
+        case SF_NUM:
+            sv_num(++v, in->num);
+            break;
+        case SF_STR:
+            sv_string(++v, f->strs[in->arg]);
+            break;
+        case SF_FIELD:
+            if (sf_get_field(++v, in->arg, h, b, tmp) < 0) return -1;
+            break;
+        case SF_TAG:
+            sf_get_tag(++v, in->arg, b);
+            break;
+        case SF_NOT:
+            sv_num(v, !sv_true(v));
+            break;
+        case SF_BOOL:
+            sv_num(v, sv_true(v));
+            break;
+        case SF_NEG:
+            if (v->type == SV_NUM) v->num = -v->num;
+            else v->type = SV_NULL;
+            break;
+        case SF_BNOT:
+            if (v->type == SV_NUM) v->num = ~(int64_t) v->num;
+            else v->type = SV_NULL;
+            break;
+        case SF_ADD: case SF_SUB: case SF_MUL: case SF_DIV: case SF_MOD:
+        case SF_BAND: case SF_BOR: case SF_BXOR:
+            sf_arith(v - 1, v, in->op);
+            v--;
+            break;
+        case SF_EQ: case SF_NE: case SF_LT: case SF_LE: case SF_GT: case SF_GE:
+            sf_compare(v - 1, v, in->op);
+            v--;
+            break;
+        case SF_MATCH: case SF_NMATCH:
+            if (v->type != SV_STR) {
+                sv_num(v, 0);
+            } else {
+                int m = regexec(&f->res[in->arg], sv_str(v), 0, NULL, 0) == 0;
+                sv_num(v, in->op == SF_MATCH ? m : !m);
+            }
+            break;
+        case SF_AND:
+            if (!sv_true(v)) {
+                sv_num(v, 0);
+                pc = in->arg - 1;
+            } else {
+                v--;
+            }
+            break;
+        case SF_OR:
+            if (sv_true(v)) {
+                sv_num(v, 1);
+                pc = in->arg - 1;
+            } else {
+                v--;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    return v == stack ? sv_true(v) : -1;
+}
@@ -0,0 +1,54 @@
+/*  sam_filter.h -- filter expressions on alignment records.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef SAM_FILTER_H
+#define SAM_FILTER_H
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+
+typedef struct sam_filter sam_filter_t;
+
+/*
+ * Compile a filter expression, for example
+ *
+ *     mapq >= 20 && [NM] <= 3 && !flag.secondary && seq =~ "^TTAGGG"
+ *
+ * Returns the compiled filter, or NULL after printing a message to stderr if
+ * the expression is not valid.  The syntax is described in samtools.1.
+ */
+sam_filter_t *sam_filter_parse(const char *str);
+
+void sam_filter_destroy(sam_filter_t *filt);
+
+/*
+ * Evaluate a compiled filter on a record.  tmp is a scratch buffer, used
+ * when the sequence has to be decoded; callers running filters in several
+ * threads must give each thread its own.  The filter itself is not modified
+ * and can be shared.
+ *
+ * Returns 1 if the record passes, 0 if it does not and -1 on error.
+ */
+int sam_filter_eval(const sam_filter_t *filt, const bam_hdr_t *h,
+                    const bam1_t *b, kstring_t *tmp);
+
+#endif
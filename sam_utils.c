@@ -25,9 +25,14 @@ DEALINGS IN THE SOFTWARE.  */
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "samtools.h"
 
@@ -58,3 +63,135 @@ void print_error_errno(const char *subcommand, const char *format, ...)
     vprint_error_core(subcommand, format, args, err? strerror(err) : NULL);
     va_end(args);
 }
+
+int sam_hdr_text_pad(char **text, uint32_t *l_text, size_t n)
+{
+    static const char chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t l = *l_text, tag_len = strlen(SAM_HDR_PAD_TAG), i;
+    uint64_t x = 88172645463325252ULL; // fixed seed, so output is repeatable
+    int need_nl = l > 0 && (*text)[l-1] != '\n';
+    char *s;
+
+    if (n == 0) return 0;
+    if (l + need_nl + tag_len + n + 1 > UINT32_MAX) {
+        errno = ERANGE;
+        return -1;
+    }
+    s = realloc(*text, l + need_nl + tag_len + n + 2);
+    if (!s) return -1;
+
+    if (need_nl) s[l++] = '\n';
+    memcpy(s + l, SAM_HDR_PAD_TAG, tag_len);
+    l += tag_len;
+    for (i = 0; i < n; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        s[l++] = chars[x >> 58];
+    }
+    s[l++] = '\n';
+    s[l] = '\0';
+
+    *text = s;
+    *l_text = l;
+    return 0;
+}
+
+int sam_hdr_pad_parse(const char *subcommand, const char *arg, size_t *n)
+{
+    unsigned long long v;
+    char *end;
+
+    // strtoull() would accept a sign or leading space
+    if (!isdigit((unsigned char) *arg)) goto bad;
+    errno = 0;
+    v = strtoull(arg, &end, 0);
+    if (*end || errno == ERANGE || v > INT32_MAX) goto bad;
+    *n = v;
+    return 0;
+
+ bad:
+    print_error(subcommand, "invalid --header-pad size \"%s\"; expected a number from 0 to %d",
+                arg, INT32_MAX);
+    return -1;
+}
+
+int sam_mem_size_parse(const char *subcommand, const char *option,
+                       const char *arg, size_t *n)
+{
+    unsigned long long v;
+    char *end;
+    int shift = 0;
+
+    if (!isdigit((unsigned char) *arg)) goto bad;
+    errno = 0;
+    v = strtoull(arg, &end, 0);
+    if (errno == ERANGE) goto bad;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end || v == 0 || v > (SIZE_MAX >> shift)) goto bad;
+    *n = (size_t) v << shift;
+    return 0;
+
+ bad:
+    print_error(subcommand, "invalid %s size \"%s\"; expected a positive number, "
+                "optionally followed by K, M or G", option, arg);
+    return -1;
+}
+
+static char *sam_counts_name(const char *fn)
+{
+    char *name = malloc(strlen(fn) + sizeof(SAM_COUNTS_SUFFIX));
+    if (name) sprintf(name, "%s%s", fn, SAM_COUNTS_SUFFIX);
+    return name;
+}
+
+int sam_counts_save(const char *fn, int n_ref, const sam_count_t *counts)
+{
+    struct stat st;
+    char *name;
+    FILE *fp;
+    int i, ret = 0;
+
+    if (stat(fn, &st) < 0 || !(name = sam_counts_name(fn))) return -1;
+    if (!(fp = fopen(name, "w"))) {
+        free(name);
+        return -1;
+    }
+    if (fprintf(fp, "#samtools-counts\t%d\t%lld\t%lld\n", n_ref,
+                (long long) st.st_size, (long long) st.st_mtime) < 0)
+        ret = -1;
+    for (i = 0; i <= n_ref && ret == 0; i++)
+        if (fprintf(fp, "%"PRIu64"\t%"PRIu64"\n", counts[i].mapped, counts[i].unmapped) < 0)
+            ret = -1;
+    if (fclose(fp) != 0) ret = -1;
+    if (ret < 0) unlink(name);
+    free(name);
+    return ret;
+}
+
+int sam_counts_load(const char *fn, int n_ref, sam_count_t *counts)
+{
+    struct stat st;
+    long long size, mtime;
+    char *name;
+    FILE *fp;
+    int i, n, ret = -1;
+
+    if (stat(fn, &st) < 0 || !(name = sam_counts_name(fn))) return -1;
+    fp = fopen(name, "r");
+    free(name);
+    if (!fp) return -1;
+    if (fscanf(fp, "#samtools-counts\t%d\t%lld\t%lld\n", &n, &size, &mtime) != 3
+        || n != n_ref || size != (long long) st.st_size || mtime != (long long) st.st_mtime)
+        goto out;
+    for (i = 0; i <= n_ref; i++)
+        if (fscanf(fp, "%"SCNu64"\t%"SCNu64"\n", &counts[i].mapped, &counts[i].unmapped) != 2)
+            goto out;
+    if (fgetc(fp) == EOF) ret = 0;
+ out:
+    fclose(fp);
+    return ret;
+}
@@ -36,6 +36,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <assert.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <errno.h>
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
 #include "htslib/kstring.h"
@@ -43,9 +44,12 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/klist.h"
 #include "htslib/thread_pool.h"
 #include "htslib/bgzf.h"
+#include "htslib/hts_endian.h"
 #include "samtools.h"
 #include "sam_opts.h"
 #include "bedidx.h"
+#include "sam_filter.h"
+#include "tmp_file.h"
 
 #define DEFAULT_BARCODE_TAG "BC"
 #define DEFAULT_QUALITY_TAG "QT"
@@ -56,6 +60,15 @@ KLIST_INIT(ktaglist, char*, taglist_free)
 
 typedef khash_t(rg) *rghash_t;
 
+// An extra output, given by --split FILE=EXPR
+typedef struct {
+    char *fn;
+    sam_filter_t *filter;
+    samFile *fp;
+} view_output_t;
+
+#define VIEW_MAX_SPLIT 64
+
 // This structure contains the settings for a samview run
 typedef struct samview_settings {
     rghash_t rghash;
@@ -68,18 +81,35 @@ typedef struct samview_settings {
     uint32_t subsam_seed;
     double subsam_frac;
     char* library;
+    rghash_t lib_rghash;
     void* bed;
+    void* bed_tids;
+    bed_cursor_t bed_cur;
     size_t remove_aux_len;
     char** remove_aux;
     int multi_region;
+    sam_filter_t *filter;
+    kstring_t filter_buf;
+    view_output_t *split;
+    int n_split;
 } samview_settings_t;
 
 
 // TODO Add declarations of these to a viable htslib or samtools header
-extern const char *bam_get_library(bam_hdr_t *header, const bam1_t *b);
 extern int bam_remove_B(bam1_t *b);
 extern char *samfaipath(const char *fn_ref);
 
+static void strip_aux(bam1_t *b, const samview_settings_t* settings)
+{
+    size_t i;
+    for (i = 0; i < settings->remove_aux_len; ++i) {
+        uint8_t *s = bam_aux_get(b, settings->remove_aux[i]);
+        if (s) {
+            bam_aux_del(b, s);
+        }
+    }
+}
+
 // Returns 0 to indicate read should be output 1 otherwise
 static int process_aln(const bam_hdr_t *h, bam1_t *b, samview_settings_t* settings)
 {
@@ -96,7 +126,7 @@ static int process_aln(const bam_hdr_t *h, bam1_t *b, samview_settings_t* settin
         return 1;
     if (settings->flag_alloff && ((b->core.flag & settings->flag_alloff) == settings->flag_alloff))
         return 1;
-    if (!settings->multi_region && settings->bed && (b->core.tid < 0 || !bed_overlap(settings->bed, h->target_name[b->core.tid], b->core.pos, bam_endpos(b))))
+    if (!settings->multi_region && settings->bed && (b->core.tid < 0 || !bed_overlap_tid(settings->bed_tids, b->core.tid, b->core.pos, bam_endpos(b), &settings->bed_cur)))
         return 1;
     if (settings->subsam_frac > 0.) {
         uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(bam_get_qname(b)) ^ settings->subsam_seed);
@@ -110,21 +140,31 @@ static int process_aln(const bam_hdr_t *h, bam1_t *b, samview_settings_t* settin
         }
     }
     if (settings->library) {
-        const char *p = bam_get_library((bam_hdr_t*)h, b);
-        if (!p || strcmp(p, settings->library) != 0) return 1;
-    }
-    if (settings->remove_aux_len) {
-        size_t i;
-        for (i = 0; i < settings->remove_aux_len; ++i) {
-            uint8_t *s = bam_aux_get(b, settings->remove_aux[i]);
-            if (s) {
-                bam_aux_del(b, s);
-            }
-        }
+        uint8_t *s = bam_aux_get(b, "RG");
+        if (!s || *s != 'Z' || !settings->lib_rghash) return 1;
+        if (kh_get(rg, settings->lib_rghash, bam_aux2Z(s)) == kh_end(settings->lib_rghash)) return 1;
     }
+    if (settings->filter && sam_filter_eval(settings->filter, h, b, &settings->filter_buf) <= 0)
+        return 1;
+    strip_aux(b, settings);
     return 0;
 }
 
+/* As process_aln(), but also set the bits in *split for the --split outputs
+   that b should go to.  Their expressions see the record as it was read.
+   Any -x tags are removed from records going to any output. */
+static int process_aln_split(const bam_hdr_t *h, bam1_t *b, samview_settings_t* settings, uint64_t *split)
+{
+    int i, r;
+    *split = 0;
+    for (i = 0; i < settings->n_split; i++)
+        if (sam_filter_eval(settings->split[i].filter, h, b, &settings->filter_buf) > 0)
+            *split |= (uint64_t) 1 << i;
+    r = process_aln(h, b, settings);
+    if (r && *split) strip_aux(b, settings);
+    return r;
+}
+
 static char *drop_rg(char *hdtxt, rghash_t h, int *len)
 {
     char *p = hdtxt, *q, *r, *s;
@@ -156,8 +196,129 @@ static char *drop_rg(char *hdtxt, rghash_t h, int *len)
     return str.s;
 }
 
+/* Collect the IDs of the read groups belonging to library lib.  This is
+   done once from the header, so that the -l filter only needs a hash
+   lookup per read (and does not use the static buffer in
+   bam_get_library(), which would make it unsafe to run in threads). */
+static rghash_t library_rg_ids(const char *hdtxt, const char *lib)
+{
+    rghash_t h = kh_init(rg);
+    const char *p = hdtxt;
+    size_t lib_len = strlen(lib);
+
+    if (!h) return NULL;
+    while (p && *p) {
+        const char *eol = strchr(p, '\n'), *q, *id = NULL, *lb = NULL;
+        size_t id_len = 0, lb_len = 0;
+        if (!eol) eol = p + strlen(p);
+        if (strncmp(p, "@RG\t", 4) == 0) {
+            for (q = p + 3; q < eol; ) {
+                const char *f = ++q, *e; // skip the tab
+                for (e = f; e < eol && *e != '\t'; ++e);
+                if (e - f >= 3 && strncmp(f, "ID:", 3) == 0)
+                    id = f + 3, id_len = e - id;
+                else if (e - f >= 3 && strncmp(f, "LB:", 3) == 0)
+                    lb = f + 3, lb_len = e - lb;
+                q = e;
+            }
+            if (id && lb && lb_len == lib_len && strncmp(lb, lib, lib_len) == 0) {
+                char *d = malloc(id_len + 1);
+                int ret;
+                if (!d) goto fail;
+                memcpy(d, id, id_len);
+                d[id_len] = '\0';
+                kh_put(rg, h, d, &ret);
+                if (ret == -1) { free(d); goto fail; }
+                if (ret == 0) free(d); /* Duplicate */
+            }
+        }
+        p = *eol ? eol + 1 : eol;
+    }
+    return h;
+
+ fail:
+    {
+        khint_t k;
+        for (k = 0; k < kh_end(h); ++k)
+            if (kh_exist(h, k)) free((char*)kh_key(h, k));
+        kh_destroy(rg, h);
+    }
+    return NULL;
+}
+
 static int usage(FILE *fp, int exit_status, int is_long_help);
 
+// Parse a --split FILE=EXPR argument
+static int add_split_output(samview_settings_t *settings, const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    view_output_t *o;
+
+    if (!eq || eq == arg || !eq[1]) {
+        print_error("view", "--split argument \"%s\" should be FILE=EXPRESSION", arg);
+        return -1;
+    }
+    if (settings->n_split == VIEW_MAX_SPLIT) {
+        print_error("view", "too many --split outputs (the limit is %d)", VIEW_MAX_SPLIT);
+        return -1;
+    }
+    o = realloc(settings->split, (settings->n_split + 1) * sizeof(*o));
+    if (!o) goto mem_err;
+    settings->split = o;
+    o += settings->n_split;
+    o->fp = NULL;
+    if (!(o->fn = malloc(eq - arg + 1))) goto mem_err;
+    memcpy(o->fn, arg, eq - arg);
+    o->fn[eq - arg] = '\0';
+    if (!(o->filter = sam_filter_parse(eq + 1))) {
+        free(o->fn);
+        return -1;
+    }
+    settings->n_split++;
+    return 0;
+
+ mem_err:
+    print_error_errno("view", "Couldn't add --split output \"%s\"", arg);
+    return -1;
+}
+
+/* Open the --split outputs.  The format comes from the file name if it has
+   a known extension, otherwise it is the same as the main output. */
+static int open_split_outputs(samview_settings_t *settings, bam_hdr_t *header,
+                              const char *fn_list, const char *out_format,
+                              int compress_level, int is_header)
+{
+    int i;
+    for (i = 0; i < settings->n_split; i++) {
+        view_output_t *o = &settings->split[i];
+        char mode[5] = "w";
+        if (sam_open_mode(mode + 1, o->fn, NULL) < 0) {
+            mode[1] = *out_format;
+            mode[2] = '\0';
+        }
+        if (compress_level >= 0) {
+            char tmp[2];
+            tmp[0] = compress_level + '0'; tmp[1] = '\0';
+            strcat(mode, tmp);
+        }
+        if ((o->fp = sam_open(o->fn, mode)) == NULL) {
+            print_error_errno("view", "failed to open \"%s\" for writing", o->fn);
+            return -1;
+        }
+        if (fn_list && hts_set_fai_filename(o->fp, fn_list) != 0) {
+            fprintf(stderr, "[main_samview] failed to use reference \"%s\".\n", fn_list);
+            return -1;
+        }
+        if (is_header || mode[1] == 'b' || mode[1] == 'c') {
+            if (sam_hdr_write(o->fp, header) != 0) {
+                fprintf(stderr, "[main_samview] failed to write the SAM header to \"%s\"\n", o->fn);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
 static int add_read_group_single(const char *subcmd, samview_settings_t *settings, char *name)
 {
     char *d = strdup(name);
@@ -241,10 +402,447 @@ static void check_sam_close(const char *subcmd, samFile *fp, const char *fname,
     *retp = EXIT_FAILURE;
 }
 
+// Do any of the options select alignments, rather than just regions?
+static int view_has_filters(const samview_settings_t *settings)
+{
+    return settings->rghash || settings->min_mapQ || settings->flag_on
+        || settings->flag_off || settings->flag_alloff || settings->min_qlen
+        || settings->subsam_frac > 0. || settings->library || settings->bed
+        || settings->filter;
+}
+
+// The CRAM fields needed to apply the filters when only counting
+static int view_count_fields(const samview_settings_t *settings, int has_regions)
+{
+    int rf = SAM_FLAG | SAM_RNAME | SAM_POS;
+    if (settings->filter) return 0; // could use anything
+    if (settings->min_mapQ) rf |= SAM_MAPQ;
+    if (settings->min_qlen || settings->bed || has_regions) rf |= SAM_CIGAR;
+    if (settings->subsam_frac > 0.) rf |= SAM_QNAME;
+    if (settings->rghash || settings->library) rf |= SAM_AUX | SAM_RGAUX;
+    return rf;
+}
+
+/* Count the alignments in regions that each cover a whole reference (or
+   are "*"), using the mapped and unmapped counts stored in a BAM index.
+   If merge is set, repeated regions are only counted once.  Returns 0 if
+   the regions were counted, 1 if they are not all whole references and
+   -1 on error. */
+static int view_count_whole_refs(samFile *in, hts_idx_t *idx, bam_hdr_t *h,
+                                 char **regs, int n_regs, int merge,
+                                 int64_t *count)
+{
+    uint8_t *seen;
+    bam1_t *b = NULL;
+    int64_t n = 0;
+    int i, ret = 0;
+
+    for (i = 0; i < n_regs; i++)
+        if (strcmp(regs[i], "*") != 0 && bam_name2id(h, regs[i]) < 0) return 1;
+
+    if (!(seen = calloc(h->n_targets + 1, 1))) return -1;
+    for (i = 0; i < n_regs && ret == 0; i++) {
+        uint64_t mapped, unmapped;
+        int tid = strcmp(regs[i], "*") == 0 ? -1 : bam_name2id(h, regs[i]);
+        int slot = tid < 0 ? h->n_targets : tid, r;
+        hts_itr_t *iter;
+
+        if (merge && seen[slot]) continue;
+        seen[slot] = 1;
+        if (tid < 0) {
+            n += hts_idx_get_n_no_coor(idx);
+            continue;
+        }
+        if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0) {
+            n += mapped + unmapped;
+            continue;
+        }
+        // No counts for this reference, usually because it has no reads
+        if (!b && !(b = bam_init1())) {
+            ret = -1;
+            break;
+        }
+        if (!(iter = sam_itr_queryi(idx, tid, 0, INT_MAX))) {
+            ret = -1;
+            break;
+        }
+        while ((r = sam_itr_next(in, iter, b)) >= 0) n++;
+        hts_itr_destroy(iter);
+        if (r < -1) ret = -1;
+    }
+    if (b) bam_destroy1(b);
+    free(seen);
+    if (ret == 0) *count += n;
+    return ret;
+}
+
+/*
+ * Raw record pass-through.
+ *
+ * When reading and writing BAM without changing the records, there is no
+ * need to unpack each record into a bam1_t and pack it again.  Instead the
+ * raw bytes are read from the input BGZF stream, a bam1_t is pointed at them
+ * so the filters can be run, and if the record is kept the same bytes are
+ * written to the output.  The variable-length part of the record is placed
+ * in the buffer so that the CIGAR is 4-byte aligned, as it is in a bam1_t.
+ */
+
+typedef struct {
+    uint8_t fixed[36];  // block_size and the fixed-length fields
+    uint8_t *buf;       // variable-length fields, starting at buf + pad
+    size_t m_buf;
+    int pad;
+} view_raw_t;
+
+// Can records be passed through unchanged?
+static int view_raw_ok(samFile *in, samFile *out, samFile *un_out,
+                       const samview_settings_t *settings, int is_count)
+{
+#ifndef HTS_LITTLE_ENDIAN
+    // The filters would need the data in host byte order
+    return 0;
+#else
+    int i;
+    if (hts_get_format(in)->format != bam) return 0;
+    if (!is_count && (!out || hts_get_format(out)->format != bam)) return 0;
+    if (un_out && hts_get_format(un_out)->format != bam) return 0;
+    if (settings->remove_B || settings->remove_aux_len) return 0;
+    for (i = 0; i < settings->n_split; i++)
+        if (hts_get_format(settings->split[i].fp)->format != bam) return 0;
+    return 1;
+#endif
+}
+
+/* Read one record, and set up b to point at it.  b must not be passed to
+   any function that changes or frees its data.  Returns 0 on success, -1
+   on EOF, -2 or -3 on a read error or truncated file, -4 for an invalid
+   record and -5 if out of memory. */
+static int view_raw_read(BGZF *fp, const bam_hdr_t *h, view_raw_t *r, bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    uint32_t block_len, x;
+    ssize_t n;
+    int64_t l_var;
+
+    if ((n = bgzf_read(fp, r->fixed, 4)) != 4) return n == 0 ? -1 : -2;
+    block_len = le_to_u32(r->fixed);
+    if (block_len < 32) return -4;
+    if (bgzf_read(fp, r->fixed + 4, 32) != 32) return -3;
+
+    c->tid = le_to_i32(r->fixed + 4);
+    c->pos = le_to_i32(r->fixed + 8);
+    x = le_to_u32(r->fixed + 12);
+    c->bin = x >> 16;
+    c->qual = x >> 8 & 0xff;
+    c->l_qname = x & 0xff;
+    c->l_extranul = 0;
+    x = le_to_u32(r->fixed + 16);
+    c->flag = x >> 16;
+    c->n_cigar = x & 0xffff;
+    c->l_qseq = le_to_i32(r->fixed + 20);
+    c->mtid = le_to_i32(r->fixed + 24);
+    c->mpos = le_to_i32(r->fixed + 28);
+    c->isize = le_to_i32(r->fixed + 32);
+
+    l_var = block_len - 32;
+    if (c->l_qname == 0 || c->l_qseq < 0
+        || c->tid < -1 || c->tid >= h->n_targets
+        || c->mtid < -1 || c->mtid >= h->n_targets
+        || l_var < (int64_t) c->l_qname + 4 * (int64_t) c->n_cigar
+                   + ((c->l_qseq + 1) >> 1) + c->l_qseq)
+        return -4;
+
+    r->pad = (4 - (c->l_qname & 3)) & 3;
+    if (r->m_buf < l_var + r->pad) {
+        size_t m = l_var + r->pad + (l_var >> 1);
+        uint8_t *buf;
+        if (!(buf = realloc(r->buf, m))) return -5;
+        r->buf = buf;
+        r->m_buf = m;
+    }
+    if (bgzf_read(fp, r->buf + r->pad, l_var) != l_var) return -3;
+    b->data = r->buf + r->pad;
+    b->l_data = l_var;
+    b->m_data = l_var;
+    return 0;
+}
+
+static int view_raw_write(BGZF *fp, const view_raw_t *r, const bam1_t *b)
+{
+    if (bgzf_flush_try(fp, 36 + b->l_data) < 0) return -1;
+    if (bgzf_write(fp, r->fixed, 36) != 36) return -1;
+    if (bgzf_write(fp, b->data, b->l_data) != b->l_data) return -1;
+    return 0;
+}
+
+static int check_raw_write(samFile *fp, const view_raw_t *r, const bam1_t *b,
+                           const char *fname, int *retp)
+{
+    if (view_raw_write(fp->fp.bgzf, r, b) == 0) return 0;
+
+    if (fname) print_error_errno("view", "writing to \"%s\" failed", fname);
+    else print_error_errno("view", "writing to standard output failed");
+
+    *retp = EXIT_FAILURE;
+    return -1;
+}
+
+// Write b to the --split outputs in the split bit set.  If raw is set, the
+// record is copied from it.
+static int write_split(const samview_settings_t *settings, const bam_hdr_t *h,
+                       const bam1_t *b, const view_raw_t *raw, uint64_t split,
+                       int *retp)
+{
+    int i;
+    for (i = 0; split; i++, split >>= 1) {
+        const view_output_t *o = &settings->split[i];
+        if (!(split & 1)) continue;
+        if (raw) {
+            if (check_raw_write(o->fp, raw, b, o->fn, retp) < 0) return -1;
+        } else {
+            if (check_sam_write1(o->fp, h, b, o->fn, retp) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Batched filtering pipeline.
+ *
+ * When threads are available, records read by the main thread are gathered
+ * into batches which are run through process_aln() by the thread pool.
+ * The batches come back in their original order and are written out by the
+ * main thread, so the output is the same as for the serial code.
+ */
+
+#define VIEW_BATCH_SIZE 4096
+
+typedef struct view_batch {
+    struct view_batch *next;    // link in the free list
+    bam1_t **bams;
+    char *selected;
+    uint64_t *split;
+    int n;
+    const bam_hdr_t *h;
+    const samview_settings_t *settings;
+} view_batch_t;
+
+typedef struct {
+    hts_tpool_process *q;
+    hts_tpool *pool;
+    view_batch_t *cur, *free_list;
+    int n_queued;
+    samFile *out, *un_out;
+    const char *fn_out, *fn_un_out;
+    bam_hdr_t *h;
+    samview_settings_t *settings;
+    int is_count;
+    int64_t *count;
+    int *retp;
+} view_pipeline_t;
+
+static void *view_batch_worker(void *arg)
+{
+    view_batch_t *batch = (view_batch_t *)arg;
+    // Each batch gets its own copy of the settings, as the BED cursor and
+    // the filter expression buffer are updated while filtering.
+    samview_settings_t settings = *batch->settings;
+    int i;
+
+    settings.bed_cur = (bed_cursor_t) BED_CURSOR_INIT;
+    settings.filter_buf = (kstring_t) { 0, 0, NULL };
+    for (i = 0; i < batch->n; i++)
+        batch->selected[i] = !process_aln_split(batch->h, batch->bams[i], &settings, &batch->split[i]);
+    free(settings.filter_buf.s);
+    return batch;
+}
+
+static void view_batch_free(view_batch_t *batch)
+{
+    int i;
+    if (!batch) return;
+    for (i = 0; i < VIEW_BATCH_SIZE; i++)
+        if (batch->bams[i]) bam_destroy1(batch->bams[i]);
+    free(batch->bams);
+    free(batch->selected);
+    free(batch->split);
+    free(batch);
+}
+
+static view_batch_t *view_batch_get(view_pipeline_t *pl)
+{
+    view_batch_t *batch;
+    int i;
+
+    if (pl->free_list) {
+        batch = pl->free_list;
+        pl->free_list = batch->next;
+        batch->n = 0;
+        return batch;
+    }
+
+    batch = calloc(1, sizeof(view_batch_t));
+    if (!batch) return NULL;
+    batch->bams = calloc(VIEW_BATCH_SIZE, sizeof(bam1_t *));
+    batch->selected = calloc(VIEW_BATCH_SIZE, 1);
+    batch->split = calloc(VIEW_BATCH_SIZE, sizeof(uint64_t));
+    if (!batch->bams || !batch->selected || !batch->split) goto fail;
+    for (i = 0; i < VIEW_BATCH_SIZE; i++)
+        if (!(batch->bams[i] = bam_init1())) goto fail;
+    batch->h = pl->h;
+    batch->settings = pl->settings;
+    return batch;
+
+ fail:
+    if (batch->bams) {
+        view_batch_free(batch);
+    } else {
+        free(batch->selected);
+        free(batch->split);
+        free(batch);
+    }
+    return NULL;
+}
+
+// Write out one finished batch, and put it on the free list
+static int view_write_batch(view_pipeline_t *pl, view_batch_t *batch)
+{
+    int i, r = 0;
+    for (i = 0; i < batch->n && r >= 0; i++) {
+        if (batch->selected[i]) {
+            if (!pl->is_count)
+                r = check_sam_write1(pl->out, pl->h, batch->bams[i], pl->fn_out, pl->retp);
+            if (r >= 0) (*pl->count)++;
+        } else {
+            if (pl->un_out)
+                r = check_sam_write1(pl->un_out, pl->h, batch->bams[i], pl->fn_un_out, pl->retp);
+        }
+        if (r >= 0 && batch->split[i])
+            r = write_split(pl->settings, pl->h, batch->bams[i], NULL, batch->split[i], pl->retp);
+    }
+    batch->next = pl->free_list;
+    pl->free_list = batch;
+    return r < 0 ? -1 : 0;
+}
+
+/* Write the next batch in order.  If wait is set, block until it is
+   ready.  Returns 0 if a batch was written, 1 if none was available and
+   -1 on error. */
+static int view_pipeline_write_next(view_pipeline_t *pl, int wait)
+{
+    hts_tpool_result *r;
+    view_batch_t *batch;
+
+    if (pl->n_queued == 0) return 1;
+    r = wait ? hts_tpool_next_result_wait(pl->q) : hts_tpool_next_result(pl->q);
+    if (!r) return 1;
+    batch = (view_batch_t *) hts_tpool_result_data(r);
+    hts_tpool_delete_result(r, 0);
+    pl->n_queued--;
+    return view_write_batch(pl, batch);
+}
+
+static int view_pipeline_dispatch(view_pipeline_t *pl)
+{
+    int r;
+
+    if (!pl->cur || pl->cur->n == 0) return 0;
+    while (hts_tpool_dispatch2(pl->pool, pl->q, view_batch_worker, pl->cur, 1) < 0) {
+        if (errno != EAGAIN) return -1;
+        // Queue full; make space by writing out the oldest batch
+        if (view_pipeline_write_next(pl, 1) < 0) return -1;
+    }
+    pl->n_queued++;
+    pl->cur = NULL;
+
+    // Write anything that has already finished
+    while ((r = view_pipeline_write_next(pl, 0)) == 0);
+    return r < 0 ? -1 : 0;
+}
+
+static view_pipeline_t *view_pipeline_init(hts_tpool *pool, bam_hdr_t *h,
+                                           samview_settings_t *settings,
+                                           samFile *out, const char *fn_out,
+                                           samFile *un_out, const char *fn_un_out,
+                                           int is_count, int64_t *count,
+                                           int *retp)
+{
+    view_pipeline_t *pl = calloc(1, sizeof(view_pipeline_t));
+    if (!pl) return NULL;
+    pl->q = hts_tpool_process_init(pool, hts_tpool_size(pool) * 2, 0);
+    if (!pl->q) {
+        free(pl);
+        return NULL;
+    }
+    pl->pool = pool;
+    pl->h = h;
+    pl->settings = settings;
+    pl->out = out;
+    pl->fn_out = fn_out;
+    pl->un_out = un_out;
+    pl->fn_un_out = fn_un_out;
+    pl->is_count = is_count;
+    pl->count = count;
+    pl->retp = retp;
+    return pl;
+}
+
+/* Hand a record over to the pipeline.  The record in *b is swapped for an
+   empty one, so the caller can carry on reading into it. */
+static int view_pipeline_add(view_pipeline_t *pl, bam1_t **b)
+{
+    bam1_t *tmp;
+    if (!pl->cur && !(pl->cur = view_batch_get(pl))) {
+        print_error_errno("view", "failed to allocate memory");
+        *pl->retp = EXIT_FAILURE;
+        return -1;
+    }
+    tmp = pl->cur->bams[pl->cur->n];
+    pl->cur->bams[pl->cur->n++] = *b;
+    *b = tmp;
+    if (pl->cur->n == VIEW_BATCH_SIZE && view_pipeline_dispatch(pl) < 0) {
+        *pl->retp = EXIT_FAILURE;
+        return -1;
+    }
+    return 0;
+}
+
+// Send any partial batch and write out everything still queued
+static int view_pipeline_flush(view_pipeline_t *pl)
+{
+    int r = 0;
+    if (view_pipeline_dispatch(pl) < 0) r = -1;
+    while (pl->n_queued > 0)
+        if (view_pipeline_write_next(pl, 1) < 0) r = -1;
+    if (r < 0) *pl->retp = EXIT_FAILURE;
+    return r;
+}
+
+static void view_pipeline_destroy(view_pipeline_t *pl)
+{
+    view_batch_t *batch;
+    if (!pl) return;
+    while (pl->n_queued > 0) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(pl->q);
+        if (!r) break;
+        view_batch_free((view_batch_t *) hts_tpool_result_data(r));
+        hts_tpool_delete_result(r, 0);
+        pl->n_queued--;
+    }
+    hts_tpool_process_destroy(pl->q);
+    view_batch_free(pl->cur);
+    while ((batch = pl->free_list) != NULL) {
+        pl->free_list = batch->next;
+        view_batch_free(batch);
+    }
+    free(pl);
+}
+
 int main_samview(int argc, char *argv[])
 {
     int c, is_header = 0, is_header_only = 0, ret = 0, compress_level = -1, is_count = 0;
     int64_t count = 0;
+    size_t header_pad = 0;
     samFile *in = 0, *out = 0, *un_out=0;
     FILE *fp_out = NULL;
     bam_hdr_t *header = NULL;
@@ -252,7 +850,10 @@ int main_samview(int argc, char *argv[])
     char *fn_in = 0, *fn_out = 0, *fn_list = 0, *q, *fn_un_out = 0;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     htsThreadPool p = {NULL, 0};
-    int filter_state = ALL, filter_op = 0;
+    view_pipeline_t *pl = NULL;
+    int use_raw = 0;
+    uint64_t split;
+    int filter_state = ALL, filter_op = 0, merge_regions = 1;
     int result;
 
     samview_settings_t settings = {
@@ -266,12 +867,23 @@ int main_samview(int argc, char *argv[])
         .subsam_seed = 0,
         .subsam_frac = -1.,
         .library = NULL,
+        .lib_rghash = NULL,
         .bed = NULL,
-        .multi_region = 0
+        .bed_tids = NULL,
+        .bed_cur = BED_CURSOR_INIT,
+        .multi_region = 0,
+        .filter = NULL,
+        .filter_buf = { 0, 0, NULL },
+        .split = NULL,
+        .n_split = 0
     };
 
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 'T', '@'),
+        { "expr", required_argument, NULL, 'e' },
+        { "no-merge-regions", no_argument, NULL, 1 },
+        { "split", required_argument, NULL, 2 },
+        { "header-pad", required_argument, NULL, 3 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -288,7 +900,7 @@ int main_samview(int argc, char *argv[])
     opterr = 0;
 
     while ((c = getopt_long(argc, argv,
-                            "SbBcCt:h1Ho:O:q:f:F:G:ul:r:T:R:L:s:@:m:x:U:M",
+                            "SbBcCt:h1Ho:O:q:f:F:G:ul:r:T:R:L:s:@:m:x:U:Me:",
                             lopts, NULL)) >= 0) {
         switch (c) {
         case 's':
@@ -380,6 +992,26 @@ int main_samview(int argc, char *argv[])
             }
             break;
         case 'M': settings.multi_region = 1; break;
+        case 1: merge_regions = 0; break;
+        case 3:
+            if (sam_hdr_pad_parse("view", optarg, &header_pad) < 0) {
+                ret = 1;
+                goto view_end;
+            }
+            break;
+        case 2:
+            if (add_split_output(&settings, optarg) != 0) {
+                ret = 1;
+                goto view_end;
+            }
+            break;
+        case 'e':
+            sam_filter_destroy(settings.filter);
+            if ((settings.filter = sam_filter_parse(optarg)) == NULL) {
+                ret = 1;
+                goto view_end;
+            }
+            break;
         default:
             if (parse_sam_global_opt(c, optarg, lopts, &ga) != 0)
                 return usage(stderr, EXIT_FAILURE, 0);
@@ -437,6 +1069,29 @@ int main_samview(int argc, char *argv[])
         header->text = tmp;
         header->l_text = l;
     }
+    if (header_pad && sam_hdr_text_pad(&header->text, &header->l_text, header_pad) < 0) {
+        print_error_errno("view", "failed to pad the header");
+        ret = 1;
+        goto view_end;
+    }
+    if (settings.library) {
+        if ((settings.lib_rghash = library_rg_ids(header->text, settings.library)) == NULL) {
+            print_error("view", "out of memory");
+            ret = 1;
+            goto view_end;
+        }
+        if (kh_size(settings.lib_rghash) == 0)
+            fprintf(stderr, "[main_samview] warning: no read groups in the header belong to library \"%s\"; no reads will be output.\n", settings.library);
+    }
+    if (settings.bed && !settings.multi_region) {
+        // Resolve the BED file against the header once, so that reads can
+        // be tested by tid
+        if ((settings.bed_tids = bed_tid_index(settings.bed, header)) == NULL) {
+            print_error("view", "failed to index the regions in the BED file");
+            ret = 1;
+            goto view_end;
+        }
+    }
     if (!is_count) {
         if ((out = sam_open_format(fn_out? fn_out : "-", out_mode, &ga.out)) == 0) {
             print_error_errno("view", "failed to open \"%s\" for writing", fn_out? fn_out : "standard output");
@@ -494,7 +1149,14 @@ int main_samview(int argc, char *argv[])
         }
     }
 
+    if (open_split_outputs(&settings, header, fn_list, out_format,
+                           compress_level, is_header) != 0) {
+        ret = 1;
+        goto view_end;
+    }
+
     if (ga.nthreads > 1) {
+        int i;
         if (!(p.pool = hts_tpool_init(ga.nthreads))) {
             fprintf(stderr, "Error creating thread pool\n");
             ret = 1;
@@ -502,20 +1164,82 @@ int main_samview(int argc, char *argv[])
         }
         hts_set_opt(in,  HTS_OPT_THREAD_POOL, &p);
         if (out) hts_set_opt(out, HTS_OPT_THREAD_POOL, &p);
+        if (un_out) hts_set_opt(un_out, HTS_OPT_THREAD_POOL, &p);
+        for (i = 0; i < settings.n_split; i++)
+            hts_set_opt(settings.split[i].fp, HTS_OPT_THREAD_POOL, &p);
     }
     if (is_header_only) goto view_end; // no need to print alignments
 
-    if (settings.multi_region) {
-        if (optind < argc - 1) { //regions have been specified in the command line
+    // Pass whole-file BAM to BAM records through without unpacking them.
+    // Simple filters are cheap enough that the thread pool is better used
+    // for BGZF, but expressions still go to the record pipeline.
+    use_raw = !settings.multi_region && optind + 1 >= argc
+        && view_raw_ok(in, out, un_out, &settings, is_count)
+        && !(p.pool && settings.filter);
+
+    if (p.pool && !use_raw) {
+        // Filter and transform records in the thread pool too
+        pl = view_pipeline_init(p.pool, header, &settings, out, fn_out,
+                                un_out, fn_un_out, is_count, &count, &ret);
+        if (!pl) {
+            print_error("view", "failed to set up the record processing pipeline");
+            ret = 1;
+            goto view_end;
+        }
+    }
+
+    if (is_count && !un_out && !settings.n_split) {
+        // Counting needs less work than writing out the alignments.  With
+        // no filters and whole references as regions, the BAM index has
+        // the answer; otherwise CRAM can skip decoding unneeded fields.
+        // (Whole BAM files are counted without unpacking each record by
+        // the raw pass-through code.)
+        if (optind < argc - 1 && !view_has_filters(&settings)
+            && hts_get_format(in)->format == bam) {
+            hts_idx_t *idx = sam_index_load(in, fn_in);
+            if (idx) {
+                int r = view_count_whole_refs(in, idx, header, argv + optind + 1,
+                                              argc - optind - 1,
+                                              merge_regions || settings.multi_region,
+                                              &count);
+                hts_idx_destroy(idx);
+                if (r < 0) {
+                    fprintf(stderr, "[main_samview] failed to count the alignments using the index\n");
+                    ret = 1;
+                }
+                if (r <= 0) goto view_end;
+            }
+        }
+        if (hts_get_format(in)->format == cram) {
+            int rf = view_count_fields(&settings, optind < argc - 1 || settings.multi_region);
+            if (rf && hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, rf)) {
+                fprintf(stderr, "[main_samview] failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
+                ret = 1;
+                goto view_end;
+            }
+        }
+    }
+
+    if (settings.multi_region || (optind < argc - 1 && merge_regions)) {
+        void *regs;
+        if (!settings.multi_region) {
+            // Command-line regions are sorted and merged into a single
+            // multi-region query, so overlapping regions are only read
+            // once and each alignment is output once.  Any BED file is
+            // still applied as a filter on the alignments.
+            regs = bed_hash_regions(NULL, argv, optind+1, argc, &filter_op);
+        } else if (optind < argc - 1) { //regions have been specified in the command line
             settings.bed = bed_hash_regions(settings.bed, argv, optind+1, argc, &filter_op); //insert(1) or filter out(0) the regions from the command line in the same hash table as the bed file
             if (!filter_op)
                 filter_state = FILTERED;
+            regs = settings.bed;
         } else {
             bed_unify(settings.bed);
+            regs = settings.bed;
         }
 
         bam1_t *b = bam_init1();
-        if (settings.bed == NULL) { // index is unavailable or no regions have been specified
+        if (regs == NULL) { // index is unavailable or no regions have been specified
             fprintf(stderr, "[main_samview] no regions or BED file have been provided. Aborting.\n");
         } else {
             hts_idx_t *idx = sam_index_load(in, fn_in); // load index
@@ -523,18 +1247,23 @@ int main_samview(int argc, char *argv[])
 
                 int regcount = 0;
 
-                hts_reglist_t *reglist = bed_reglist(settings.bed, filter_state, &regcount);
+                hts_reglist_t *reglist = bed_reglist(regs, filter_state, &regcount);
                 if(reglist) {
                     hts_itr_multi_t *iter = sam_itr_regions(idx, header, reglist, regcount);
                     if (iter) {
                         // fetch alignments
                         while ((result = sam_itr_multi_next(in, iter, b)) >= 0) {
-                            if (!process_aln(header, b, &settings)) {
+                            if (pl) {
+                                if (view_pipeline_add(pl, &b) < 0) break;
+                                continue;
+                            }
+                            if (!process_aln_split(header, b, &settings, &split)) {
                                 if (!is_count) { if (check_sam_write1(out, header, b, fn_out, &ret) < 0) break; }
                                 count++;
                             } else {
                                 if (un_out) { if (check_sam_write1(un_out, header, b, fn_un_out, &ret) < 0) break; }
                             }
+                            if (split && write_split(&settings, header, b, NULL, split, &ret) < 0) break;
                         }
                         if (result < -1) {
                             fprintf(stderr, "[main_samview] retrieval of region %d failed due to truncated file or corrupt BAM index file\n", iter->curr_tid);
@@ -544,6 +1273,7 @@ int main_samview(int argc, char *argv[])
                         hts_itr_multi_destroy(iter);
                     } else {
                         fprintf(stderr, "[main_samview] iterator could not be created. Aborting.\n");
+                        ret = 1;
                     }
                 } else {
                     fprintf(stderr, "[main_samview] region list is empty or could not be created. Aborting.\n");
@@ -551,20 +1281,52 @@ int main_samview(int argc, char *argv[])
                 hts_idx_destroy(idx); // destroy the BAM index
             } else {
                 fprintf(stderr, "[main_samview] random alignment retrieval only works for indexed BAM or CRAM files.\n");
+                ret = 1;
             }
         }
         bam_destroy1(b);
+        if (regs != settings.bed) bed_destroy(regs);
     } else {
-        if (optind + 1 >= argc) { // convert/print the entire file
+        if (use_raw) { // copy the selected records of a BAM file
+            view_raw_t raw = { { 0 }, NULL, 0, 0 };
+            bam1_t b;
+            int r;
+            memset(&b, 0, sizeof(b));
+            while ((r = view_raw_read(in->fp.bgzf, header, &raw, &b)) >= 0) {
+                if (!process_aln_split(header, &b, &settings, &split)) {
+                    if (!is_count) { if (check_raw_write(out, &raw, &b, fn_out, &ret) < 0) break; }
+                    count++;
+                } else {
+                    if (un_out) { if (check_raw_write(un_out, &raw, &b, fn_un_out, &ret) < 0) break; }
+                }
+                if (split && write_split(&settings, header, &b, &raw, split, &ret) < 0) break;
+            }
+            if (r == -4) {
+                fprintf(stderr, "[main_samview] invalid BAM record.\n");
+                ret = 1;
+            } else if (r == -5) {
+                print_error("view", "out of memory");
+                ret = 1;
+            } else if (r < -1) {
+                fprintf(stderr, "[main_samview] truncated file.\n");
+                ret = 1;
+            }
+            free(raw.buf);
+        } else if (optind + 1 >= argc) { // convert/print the entire file
             bam1_t *b = bam_init1();
             int r;
             while ((r = sam_read1(in, header, b)) >= 0) { // read one alignment from `in'
-                if (!process_aln(header, b, &settings)) {
+                if (pl) {
+                    if (view_pipeline_add(pl, &b) < 0) break;
+                    continue;
+                }
+                if (!process_aln_split(header, b, &settings, &split)) {
                     if (!is_count) { if (check_sam_write1(out, header, b, fn_out, &ret) < 0) break; }
                     count++;
                 } else {
                     if (un_out) { if (check_sam_write1(un_out, header, b, fn_un_out, &ret) < 0) break; }
                 }
+                if (split && write_split(&settings, header, b, NULL, split, &ret) < 0) break;
             }
             if (r < -1) {
                 fprintf(stderr, "[main_samview] truncated file.\n");
@@ -594,12 +1356,17 @@ int main_samview(int argc, char *argv[])
                 }
                 // fetch alignments
                 while ((result = sam_itr_next(in, iter, b)) >= 0) {
-                    if (!process_aln(header, b, &settings)) {
+                    if (pl) {
+                        if (view_pipeline_add(pl, &b) < 0) break;
+                        continue;
+                    }
+                    if (!process_aln_split(header, b, &settings, &split)) {
                         if (!is_count) { if (check_sam_write1(out, header, b, fn_out, &ret) < 0) break; }
                         count++;
                     } else {
                         if (un_out) { if (check_sam_write1(un_out, header, b, fn_un_out, &ret) < 0) break; }
                     }
+                    if (split && write_split(&settings, header, b, NULL, split, &ret) < 0) break;
                 }
                 hts_itr_destroy(iter);
                 if (result < -1) {
@@ -614,6 +1381,10 @@ int main_samview(int argc, char *argv[])
     }
 
 view_end:
+    if (pl) {
+        if (ret == 0) view_pipeline_flush(pl);
+        view_pipeline_destroy(pl);
+    }
     if (is_count && ret == 0) {
         if (fprintf(fn_out? fp_out : stdout, "%" PRId64 "\n", count) < 0) {
             if (fn_out) print_error_errno("view", "writing to \"%s\" failed", fn_out);
@@ -626,21 +1397,40 @@ view_end:
     if (in) check_sam_close("view", in, fn_in, "standard input", &ret);
     if (out) check_sam_close("view", out, fn_out, "standard output", &ret);
     if (un_out) check_sam_close("view", un_out, fn_un_out, "file", &ret);
+    if (settings.split) {
+        int i;
+        for (i = 0; i < settings.n_split; i++) {
+            view_output_t *o = &settings.split[i];
+            if (o->fp) check_sam_close("view", o->fp, o->fn, "file", &ret);
+            free(o->fn);
+            sam_filter_destroy(o->filter);
+        }
+        free(settings.split);
+    }
     if (fp_out) fclose(fp_out);
 
     free(fn_list); free(fn_out); free(settings.library);  free(fn_un_out);
     sam_global_args_free(&ga);
     if ( header ) bam_hdr_destroy(header);
     if (settings.bed) bed_destroy(settings.bed);
+    if (settings.bed_tids) bed_tid_destroy(settings.bed_tids);
     if (settings.rghash) {
         khint_t k;
         for (k = 0; k < kh_end(settings.rghash); ++k)
             if (kh_exist(settings.rghash, k)) free((char*)kh_key(settings.rghash, k));
         kh_destroy(rg, settings.rghash);
     }
+    if (settings.lib_rghash) {
+        khint_t k;
+        for (k = 0; k < kh_end(settings.lib_rghash); ++k)
+            if (kh_exist(settings.lib_rghash, k)) free((char*)kh_key(settings.lib_rghash, k));
+        kh_destroy(rg, settings.lib_rghash);
+    }
     if (settings.remove_aux_len) {
         free(settings.remove_aux);
     }
+    sam_filter_destroy(settings.filter);
+    free(settings.filter_buf.s);
 
     if (p.pool)
         hts_tpool_destroy(p.pool);
@@ -680,8 +1470,18 @@ static int usage(FILE *fp, int exit_status, int is_long_help)
 "  -G INT   only EXCLUDE reads with all  of the FLAGs in INT present [0]\n"       // !(F&x == x)
 "  -s FLOAT subsample reads (given INT.FRAC option value, 0.FRAC is the\n"
 "           fraction of templates/read pairs to keep; INT part sets seed)\n"
+"  -e STR   only include reads for which the expression STR is true\n"
+"           (see the man page for the syntax) [null]\n"
 "  -M       use the multi-region iterator (increases the speed, removes\n"
 "           duplicates and outputs the reads as they are ordered in the file)\n"
+"  --split FILE=EXPR\n"
+"           also write reads for which the expression EXPR is true to FILE,\n"
+"           in the format given by its extension (repeatable) [null]\n"
+"  --no-merge-regions\n"
+"           query each region separately, in the order given, reporting\n"
+"           reads that overlap several regions more than once\n"
+"  --header-pad INT\n"
+"           reserve space for INT more bytes of header, for reheader -i\n"
 // read processing
 "  -x STR   read tag to strip (repeatable) [null]\n"
 "  -B       collapse the backward CIGAR operation\n"
@@ -783,7 +1583,11 @@ static void bam2fq_usage(FILE *to, const char *command)
 "  --i2 FILE            write second index reads to FILE\n"
 "  --barcode-tag TAG    Barcode tag [default: " DEFAULT_BARCODE_TAG "]\n"
 "  --quality-tag TAG    Quality tag [default: " DEFAULT_QUALITY_TAG "]\n"
-"  --index-format STR   How to parse barcode and quality tags\n\n");
+"  --index-format STR   How to parse barcode and quality tags\n"
+"  --any-order          pair reads in any order, e.g. from coordinate sorted input\n"
+"  --pair-memory SIZE   memory for unpaired reads with --any-order, until the\n"
+"                       input ends [768M]\n"
+"  --tmp-prefix PREFIX  write --any-order temporary files to PREFIX.nnnn\n\n");
     sam_global_opt_help(to, "-.--.@");
     fprintf(to,
 "   \n"
@@ -813,6 +1617,9 @@ typedef struct bam2fq_opts {
     char *index_format;
     char *extra_tags;
     char compression_level;
+    bool any_order;
+    size_t pair_mem;
+    char *tmp_prefix;
 } bam2fq_opts_t;
 
 typedef struct bam2fq_state {
@@ -829,78 +1636,104 @@ typedef struct bam2fq_state {
     klist_t(ktaglist) *taglist;
     char *index_sequence;
     char compression_level;
+    htsThreadPool p;
+    kstring_t seq_buf, qual_buf; // reused for each record
 } bam2fq_state_t;
 
 /*
- * Get and decode the read from a BAM record.
- *
- * TODO: htslib really needs an interface for this.  Consider this or perhaps
- * bam_get_seq_str (current vs original orientation) and bam_get_qual_str
- * functions as string formatted equivalents to bam_get_{seq,qual}?
+ * Tables giving the two bases coded by each byte of a BAM sequence, in
+ * forward order and reverse complemented.  The reverse complemented pair
+ * is in output order, so a read can be decoded a byte at a time in a
+ * single pass whichever way round it goes.
  */
+static char code2base[512], code2base_rc[512];
 
-/*
- * Reverse a string in place.
- * From http://stackoverflow.com/questions/8534274/is-the-strrev-function-not-available-in-linux.
- * Author Sumit-naik: http://stackoverflow.com/users/4590926/sumit-naik
- */
-static char *reverse(char *str)
+static void init_code2base(void)
 {
-    int i = strlen(str)-1,j=0;
-    char ch;
-    while (i>j) {
-        ch = str[i];
-        str[i]= str[j];
-        str[j] = ch;
-        i--;
-        j++;
-    }
-    return str;
+    int i;
+    for (i = 0; i < 256; i++) {
+        code2base[i*2]      = seq_nt16_str[i >> 4];
+        code2base[i*2+1]    = seq_nt16_str[i & 15];
+        code2base_rc[i*2]   = seq_nt16_str[seq_comp_table[i & 15]];
+        code2base_rc[i*2+1] = seq_nt16_str[seq_comp_table[i >> 4]];
+    }
 }
 
-/* return the read, reverse complemented if necessary */
-static char *get_read(const bam1_t *rec)
+/*
+ * Get and decode the read from a BAM record into buf, reverse complemented
+ * if necessary.
+ *
+ * TODO: htslib really needs an interface for this.  Consider this or perhaps
+ * bam_get_seq_str (current vs original orientation) and bam_get_qual_str
+ * functions as string formatted equivalents to bam_get_{seq,qual}?
+ */
+static char *get_read(const bam1_t *rec, kstring_t *buf)
 {
-    int len = rec->core.l_qseq + 1;
-    char *read = calloc(1, len);
-    char *seq = (char *)bam_get_seq(rec);
-    int n;
-
-    if (!read) return NULL;
-
-    for (n=0; n < rec->core.l_qseq; n++) {
-        if (rec->core.flag & BAM_FREVERSE) read[n] = seq_nt16_str[seq_comp_table[bam_seqi(seq,n)]];
-        else                               read[n] = seq_nt16_str[bam_seqi(seq,n)];
+    int len = rec->core.l_qseq, i, n2 = len / 2;
+    const uint8_t *seq = bam_get_seq(rec);
+    char *out;
+
+    if (ks_resize(buf, len + 1) < 0) return NULL;
+    out = buf->s;
+    if (!(rec->core.flag & BAM_FREVERSE)) {
+        for (i = 0; i < n2; i++)
+            memcpy(out + i*2, &code2base[seq[i]*2], 2);
+        if (len & 1) out[len-1] = seq_nt16_str[seq[n2] >> 4];
+    } else {
+        char *o = out + len;
+        for (i = 0; i < n2; i++) {
+            o -= 2;
+            memcpy(o, &code2base_rc[seq[i]*2], 2);
+        }
+        if (len & 1) out[0] = seq_nt16_str[seq_comp_table[seq[n2] >> 4]];
     }
-    if (rec->core.flag & BAM_FREVERSE) reverse(read);
-    return read;
+    out[len] = '\0';
+    buf->l = len;
+    return out;
 }
 
 /*
- * get and decode the quality from a BAM record
+ * Get and decode the quality from a BAM record into buf, reversed if
+ * necessary.  *qual_out is set to NULL if the record has no qualities.
  */
-static int get_quality(const bam1_t *rec, char **qual_out)
+static int get_quality(const bam1_t *rec, kstring_t *buf, char **qual_out)
 {
-    char *quality = calloc(1, rec->core.l_qseq + 1);
-    char *q = (char *)bam_get_qual(rec);
-    int n;
+    const uint8_t *q = bam_get_qual(rec);
+    int len = rec->core.l_qseq, n;
+    char *quality;
 
-    if (!quality) return -1;
-
-    if (*q == '\xff') {
-        free(quality);
+    if (len > 0 && q[0] == 0xff) {
         *qual_out = NULL;
         return 0;
     }
-
-    for (n=0; n < rec->core.l_qseq; n++) {
-        quality[n] = q[n]+33;
+    if (ks_resize(buf, len + 1) < 0) return -1;
+    quality = buf->s;
+    if (rec->core.flag & BAM_FREVERSE) {
+        for (n = 0; n < len; n++) quality[len-1-n] = q[n] + 33;
+    } else {
+        for (n = 0; n < len; n++) quality[n] = q[n] + 33;
     }
-    if (rec->core.flag & BAM_FREVERSE) reverse(quality);
+    quality[len] = '\0';
+    buf->l = len;
     *qual_out = quality;
     return 0;
 }
 
+/* Copy a quality string into buf, reversed if necessary */
+static char *copy_quality(const char *qual, int reverse, kstring_t *buf)
+{
+    size_t len = strlen(qual), n;
+    if (ks_resize(buf, len + 1) < 0) return NULL;
+    if (reverse) {
+        for (n = 0; n < len; n++) buf->s[len-1-n] = qual[n];
+    } else {
+        memcpy(buf->s, qual, len);
+    }
+    buf->s[len] = '\0';
+    buf->l = len;
+    return buf->s;
+}
+
 //
 // End of htslib complaints
 //
@@ -1152,37 +1985,26 @@ static bool tags2fq(bam1_t *rec, bam2fq_state_t *state, const bam2fq_opts_t* opt
 
 // Transform a bam1_t record into a string with the FASTQ representation of it
 // @returns false for error, true for success
-static bool bam1_to_fq(const bam1_t *b, kstring_t *linebuf, const bam2fq_state_t *state)
+static bool bam1_to_fq(const bam1_t *b, kstring_t *linebuf, bam2fq_state_t *state)
 {
     int32_t qlen = b->core.l_qseq;
     assert(qlen >= 0);
     const uint8_t *oq = NULL;
     char *qual = NULL;
 
-    char *seq = get_read(b);
+    char *seq = get_read(b, &state->seq_buf);
     if (!seq) return false;
 
     if (state->use_oq) oq = bam_aux_get(b, "OQ");
     if (oq && *oq=='Z') {
-        qual = strdup(bam_aux2Z(oq));
-        if (!qual) goto fail;
-        if (b->core.flag & BAM_FREVERSE) { // read is reverse complemented
-            reverse(qual);
-        }
+        // read may be reverse complemented
+        qual = copy_quality(bam_aux2Z(oq), b->core.flag & BAM_FREVERSE, &state->qual_buf);
+        if (!qual) return false;
     } else {
-        if (get_quality(b, &qual) < 0) goto fail;
+        if (get_quality(b, &state->qual_buf, &qual) < 0) return false;
     }
 
-    if (!make_fq_line(b, seq, qual, linebuf, state)) goto fail;
-
-    free(qual);
-    free(seq);
-    return true;
-
- fail:
-    free(seq);
-    free(qual);
-    return false;
+    return make_fq_line(b, seq, qual, linebuf, state);
 }
 
 static void free_opts(bam2fq_opts_t *opts)
@@ -1191,6 +2013,7 @@ static void free_opts(bam2fq_opts_t *opts)
     free(opts->quality_tag);
     free(opts->index_format);
     free(opts->extra_tags);
+    free(opts->tmp_prefix);
     free(opts);
 }
 
@@ -1210,6 +2033,7 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
     opts->index_file[1] = NULL;
     opts->extra_tags = NULL;
     opts->compression_level = 1;
+    opts->pair_mem = 768 << 20;
 
     int c;
     sam_global_args_init(&opts->ga);
@@ -1224,6 +2048,9 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
         {"index-format", required_argument, NULL, 3},
         {"barcode-tag", required_argument, NULL, 'b'},
         {"quality-tag", required_argument, NULL, 'q'},
+        {"any-order", no_argument, NULL, 4},
+        {"pair-memory", required_argument, NULL, 5},
+        {"tmp-prefix", required_argument, NULL, 6},
         { NULL, 0, NULL, 0 }
     };
     while ((c = getopt_long(argc, argv, "0:1:2:f:F:G:niNOs:c:tT:v:@:", lopts, NULL)) > 0) {
@@ -1233,6 +2060,14 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
             case  1 : opts->index_file[0] = optarg; break;
             case  2 : opts->index_file[1] = optarg; break;
             case  3 : opts->index_format = strdup(optarg); break;
+            case  4 : opts->any_order = true; break;
+            case  5 :
+                if (sam_mem_size_parse("bam2fq", "--pair-memory", optarg, &opts->pair_mem) < 0) {
+                    free_opts(opts);
+                    return false;
+                }
+                break;
+            case  6 : free(opts->tmp_prefix); opts->tmp_prefix = strdup(optarg); break;
             case '0': opts->fnr[0] = optarg; break;
             case '1': opts->fnr[1] = optarg; break;
             case '2': opts->fnr[2] = optarg; break;
@@ -1342,14 +2177,22 @@ static bool parse_opts(int argc, char *argv[], bam2fq_opts_t** opts_out)
     return true;
 }
 
-static BGZF *open_fqfile(char *filename, int c)
+/* Open an output file.  When threads are in use, ".gz" files are written
+   as BGZF, which is still gzip compatible but can be compressed in
+   parallel. */
+static BGZF *open_fqfile(char *filename, int c, htsThreadPool *p)
 {
     char mode[4] = "w";
     size_t len = strlen(filename);
+    BGZF *fp;
 
     mode[2] = 0; mode[3] = 0;
     if (len > 3 && strstr(filename + (len - 3),".gz")) {
-        mode[1] = 'g'; mode[2] = c+'0';
+        if (p->pool) {
+            mode[1] = c+'0';
+        } else {
+            mode[1] = 'g'; mode[2] = c+'0';
+        }
     } else if ((len > 4 && strstr(filename + (len - 4),".bgz"))
                || (len > 5 && strstr(filename + (len - 5),".bgzf"))) {
         mode[1] = c+'0';
@@ -1357,7 +2200,14 @@ static BGZF *open_fqfile(char *filename, int c)
         mode[1] = 'u';
     }
 
-    return bgzf_open(filename,mode);
+    fp = bgzf_open(filename,mode);
+    if (fp && p->pool && mode[1] != 'u' && mode[1] != 'g') {
+        if (bgzf_thread_pool(fp, p->pool, p->qsize) < 0) {
+            bgzf_close(fp);
+            return NULL;
+        }
+    }
+    return fp;
 }
 
 static bool init_state(const bam2fq_opts_t* opts, bam2fq_state_t** state_out)
@@ -1374,6 +2224,7 @@ static bool init_state(const bam2fq_opts_t* opts, bam2fq_state_t** state_out)
     state->def_qual = opts->def_qual;
     state->index_sequence = NULL;
     state->hstdout = bgzf_dopen(fileno(stdout), "wu");
+    init_code2base();
     state->compression_level = opts->compression_level;
 
     state->taglist = kl_init(ktaglist);
@@ -1398,8 +2249,15 @@ static bool init_state(const bam2fq_opts_t* opts, bam2fq_state_t** state_out)
         free(state);
         return false;
     }
-    if (opts->ga.nthreads > 0)
-        hts_set_threads(state->fp, opts->ga.nthreads);
+    if (opts->ga.nthreads > 0) {
+        // One pool for decoding the input and compressing all the outputs
+        if (!(state->p.pool = hts_tpool_init(opts->ga.nthreads))) {
+            fprintf(stderr, "Failed to create thread pool\n");
+            free(state);
+            return false;
+        }
+        hts_set_opt(state->fp, HTS_OPT_THREAD_POOL, &state->p);
+    }
     uint32_t rf = SAM_QNAME | SAM_FLAG | SAM_SEQ | SAM_QUAL;
     if (opts->use_oq || opts->extra_tags || opts->index_file[0]) rf |= SAM_AUX;
     if (hts_set_opt(state->fp, CRAM_OPT_REQUIRED_FIELDS, rf)) {
@@ -1413,7 +2271,7 @@ static bool init_state(const bam2fq_opts_t* opts, bam2fq_state_t** state_out)
         return false;
     }
     if (opts->fnse) {
-        state->fpse = open_fqfile(opts->fnse, state->compression_level);
+        state->fpse = open_fqfile(opts->fnse, state->compression_level, &state->p);
         if (state->fpse == NULL) {
             print_error_errno("bam2fq", "Cannot write to singleton file \"%s\"", opts->fnse);
             free(state);
@@ -1432,7 +2290,7 @@ static bool init_state(const bam2fq_opts_t* opts, bam2fq_state_t** state_out)
     int i;
     for (i = 0; i < 3; ++i) {
         if (opts->fnr[i]) {
-            state->fpr[i] = open_fqfile(opts->fnr[i], state->compression_level);
+            state->fpr[i] = open_fqfile(opts->fnr[i], state->compression_level, &state->p);
             if (state->fpr[i] == NULL) {
                 print_error_errno("bam2fq", "Cannot write to r%d file \"%s\"", i, opts->fnr[i]);
                 free(state);
@@ -1445,7 +2303,7 @@ static bool init_state(const bam2fq_opts_t* opts, bam2fq_state_t** state_out)
     for (i = 0; i < 2; i++) {
         state->fpi[i] = NULL;
         if (opts->index_file[i]) {
-            state->fpi[i] = open_fqfile(opts->index_file[i], state->compression_level);
+            state->fpi[i] = open_fqfile(opts->index_file[i], state->compression_level, &state->p);
             if (state->fpi[i] == NULL) {
                 print_error_errno("bam2fq", "Cannot write to i%d file \"%s\"", i+1, opts->index_file[i]);
                 free(state);
@@ -1487,6 +2345,9 @@ static bool destroy_state(const bam2fq_opts_t *opts, bam2fq_state_t *state, int*
     }
     kl_destroy(ktaglist,state->taglist);
     free(state->index_sequence);
+    free(state->seq_buf.s);
+    free(state->qual_buf.s);
+    if (state->p.pool) hts_tpool_destroy(state->p.pool);
     free(state);
     return valid;
 }
@@ -1500,9 +2361,70 @@ static inline bool filter_it_out(const bam1_t *b, const bam2fq_state_t *state)
 
 }
 
-static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
+// Add a read to the set being collected for its template, preferring a copy
+// of the read that has base qualities.
+// @returns false for error, true for success
+static bool fq_group_add(bam1_t *b, kstring_t linebuf[3], bam1_t *records[3],
+                         int score[3], bam2fq_state_t *state,
+                         bam2fq_opts_t *opts)
+{
+    readpart part = which_readpart(b);
+    int b_score = bam_get_qual(b)[0] != 0xff? 2 : 1;
+    if (b_score > score[part]) {
+        if (state->fpi[0]) if (!tags2fq(b, state, opts)) return false;
+        records[part] = b;
+        if(!bam1_to_fq(b, &linebuf[part], state)) {
+            fprintf(stderr, "[%s] Error converting read to FASTA/Q\n", __func__);
+            return false;
+        }
+        score[part] = b_score;
+    }
+    return true;
+}
+
+// Write out the reads collected for one template
+// @returns false for error, true for success
+static bool fq_group_write(kstring_t linebuf[3], bam1_t *records[3],
+                           int score[3], bam2fq_state_t *state,
+                           int64_t *n_singletons)
 {
     int n;
+    if (state->illumina_tag) {
+        for (n=0; n<3; n++) {
+            if (score[n] && insert_index_sequence_into_linebuf(state->index_sequence, &linebuf[n], records[n]) < 0) return false;
+        }
+    }
+    free(state->index_sequence); state->index_sequence = NULL;
+    if (score[1] > 0 && score[2] > 0) {
+        // print linebuf[1] to fpr[1], linebuf[2] to fpr[2]
+        if (bgzf_write(state->fpr[1], linebuf[1].s, linebuf[1].l) < 0) return false;
+        if (bgzf_write(state->fpr[2], linebuf[2].s, linebuf[2].l) < 0) return false;
+    } else if (score[1] > 0 || score[2] > 0) {
+        if (state->fpse) {
+            // print whichever one exists to fpse
+            if (score[1] > 0) {
+                if (bgzf_write(state->fpse, linebuf[1].s, linebuf[1].l) < 0) return false;
+            } else {
+                if (bgzf_write(state->fpse, linebuf[2].s, linebuf[2].l) < 0) return false;
+            }
+            ++*n_singletons;
+        } else {
+            if (score[1] > 0) {
+                if (bgzf_write(state->fpr[1], linebuf[1].s, linebuf[1].l) < 0) return false;
+            } else {
+                if (bgzf_write(state->fpr[2], linebuf[2].s, linebuf[2].l) < 0) return false;
+            }
+        }
+    }
+    if (score[0]) { // TODO: check this
+        // print linebuf[0] to fpr[0]
+        if (bgzf_write(state->fpr[0], linebuf[0].s, linebuf[0].l) < 0) return false;
+    }
+    return true;
+}
+
+static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
+{
     bam1_t *records[3];
     bam1_t* b = bam_init1();
     char *current_qname = NULL;
@@ -1529,37 +2451,9 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
 
         if (at_eof || !current_qname || (strcmp(current_qname, bam_get_qname(b)) != 0)) {
             if (current_qname) {
-                if (state->illumina_tag) {
-                    for (n=0; valid && n<3; n++) {
-                        if (insert_index_sequence_into_linebuf(state->index_sequence, &linebuf[n], records[n]) < 0) valid = false;
-                    }
-                    if (!valid) break;
-                }
-                free(state->index_sequence); state->index_sequence = NULL;
-                if (score[1] > 0 && score[2] > 0) {
-                    // print linebuf[1] to fpr[1], linebuf[2] to fpr[2]
-                    if (bgzf_write(state->fpr[1], linebuf[1].s, linebuf[1].l) < 0) { valid = false; break; }
-                    if (bgzf_write(state->fpr[2], linebuf[2].s, linebuf[2].l) < 0) { valid = false; break; }
-                } else if (score[1] > 0 || score[2] > 0) {
-                    if (state->fpse) {
-                        // print whichever one exists to fpse
-                        if (score[1] > 0) {
-                            if (bgzf_write(state->fpse, linebuf[1].s, linebuf[1].l) < 0) { valid = false; break; }
-                        } else {
-                            if (bgzf_write(state->fpse, linebuf[2].s, linebuf[2].l) < 0) { valid = false; break; }
-                        }
-                        ++n_singletons;
-                    } else {
-                        if (score[1] > 0) {
-                            if (bgzf_write(state->fpr[1], linebuf[1].s, linebuf[1].l) < 0) { valid = false; break; }
-                        } else {
-                            if (bgzf_write(state->fpr[2], linebuf[2].s, linebuf[2].l) < 0) { valid = false; break; }
-                        }
-                    }
-                }
-                if (score[0]) { // TODO: check this
-                    // print linebuf[0] to fpr[0]
-                    if (bgzf_write(state->fpr[0], linebuf[0].s, linebuf[0].l) < 0) { valid = false; break; }
+                if (!fq_group_write(linebuf, records, score, state, &n_singletons)) {
+                    valid = false;
+                    break;
                 }
             }
 
@@ -1571,17 +2465,7 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
             score[0] = score[1] = score[2] = 0;
         }
 
-        // Prefer a copy of the read that has base qualities
-        int b_score = bam_get_qual(b)[0] != 0xff? 2 : 1;
-        if (b_score > score[which_readpart(b)]) {
-            if (state->fpi[0]) if (!tags2fq(b, state, opts)) return false;
-            records[which_readpart(b)] = b;
-            if(!bam1_to_fq(b, &linebuf[which_readpart(b)], state)) {
-                fprintf(stderr, "[%s] Error converting read to FASTA/Q\n", __func__);
-                return false;
-            }
-            score[which_readpart(b)] = b_score;
-        }
+        if (!fq_group_add(b, linebuf, records, score, state, opts)) return false;
     }
     if (!valid)
     {
@@ -1598,6 +2482,273 @@ static bool bam2fq_mainloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
     return valid;
 }
 
+/*
+ * Pairing of reads that arrive in any order (--any-order).
+ *
+ * Reads wait in a hash keyed on the read name until their mate turns up.
+ * If the waiting reads use more than the memory limit, they are all moved
+ * to a set of LZ4 compressed temporary files, chosen by a hash of the read
+ * name so both reads of a pair always land in the same one.  Once the input
+ * has been read, each temporary file is paired in memory in turn.  That pass
+ * is not held to the memory limit: it needs room for the unpaired reads of
+ * one file, about 1/FQ_SPILL_FILES of those written out.
+ */
+
+KHASH_MAP_INIT_STR(fq_mates, bam1_t *)
+
+#define FQ_SPILL_FILES 16
+
+typedef struct {
+    khash_t(fq_mates) *mates; // reads waiting for their mate
+    size_t mem, max_mem;      // memory used by mates, and the limit
+    char *prefix;             // temporary file name prefix
+    tmp_file_t spill[FQ_SPILL_FILES];
+    int n_open, n_done;       // temporary files opened and finished with
+    int64_t n_spilled;
+    kstring_t linebuf[3];
+    int64_t n_singletons;
+} fq_pairs_t;
+
+static inline size_t fq_pairs_mem(const bam1_t *b)
+{
+    return sizeof(*b) + b->m_data + 2 * sizeof(void *);
+}
+
+// Write out a template consisting of n reads
+static bool fq_pairs_write(fq_pairs_t *pr, bam1_t **recs, int n,
+                           bam2fq_state_t *state, bam2fq_opts_t *opts)
+{
+    bam1_t *records[3] = { NULL, NULL, NULL };
+    int score[3] = { 0, 0, 0 }, i;
+    for (i = 0; i < n; i++) {
+        if (!fq_group_add(recs[i], pr->linebuf, records, score, state, opts))
+            return false;
+    }
+    if (!fq_group_write(pr->linebuf, records, score, state, &pr->n_singletons)) {
+        perror("[bam2fq_mainloop] Error writing to FASTx files.");
+        return false;
+    }
+    return true;
+}
+
+// Move all the waiting reads into the temporary files
+static bool fq_pairs_spill(fq_pairs_t *pr)
+{
+    khint_t k;
+
+    if (pr->n_open == 0) {
+        kstring_t name = { 0, 0, NULL };
+        for (; pr->n_open < FQ_SPILL_FILES; pr->n_open++) {
+            name.l = 0;
+            ksprintf(&name, "%s.%04d", pr->prefix, pr->n_open);
+            if (tmp_file_open_write(&pr->spill[pr->n_open], name.s, 1)) {
+                print_error("bam2fq", "unable to open temporary file \"%s\"", name.s);
+                free(name.s);
+                return false;
+            }
+        }
+        free(name.s);
+    }
+
+    for (k = kh_begin(pr->mates); k != kh_end(pr->mates); k++) {
+        if (!kh_exist(pr->mates, k)) continue;
+        bam1_t *b = kh_val(pr->mates, k);
+        int i = __ac_X31_hash_string(bam_get_qname(b)) % FQ_SPILL_FILES;
+        if (tmp_file_write(&pr->spill[i], b)) {
+            print_error("bam2fq", "failed to write to temporary file");
+            return false;
+        }
+        bam_destroy1(b);
+        pr->n_spilled++;
+    }
+    kh_clear(fq_mates, pr->mates);
+    pr->mem = 0;
+    return true;
+}
+
+/*
+ * Add a read to those waiting for mates, or write out the pair if its mate
+ * is already there.  Keeping the read takes ownership of *bp, in which case
+ * it is replaced by a new record.
+ */
+static bool fq_pairs_add(fq_pairs_t *pr, bam1_t **bp, int can_spill,
+                         bam2fq_state_t *state, bam2fq_opts_t *opts)
+{
+    bam1_t *b = *bp, *recs[2];
+    readpart part = which_readpart(b);
+    khint_t k;
+    int ret;
+
+    if (part == READ_UNKNOWN)
+        return fq_pairs_write(pr, bp, 1, state, opts);
+
+    k = kh_put(fq_mates, pr->mates, bam_get_qname(b), &ret);
+    if (ret < 0) {
+        perror("[bam2fq_mainloop]");
+        return false;
+    }
+
+    if (ret == 0) {
+        bam1_t *mate = kh_val(pr->mates, k);
+        if (which_readpart(mate) == part) {
+            // Same read seen twice; keep a copy with qualities if there is one
+            if (bam_get_qual(b)[0] == 0xff || bam_get_qual(mate)[0] != 0xff)
+                return true;
+            pr->mem -= fq_pairs_mem(mate);
+            pr->mem += fq_pairs_mem(b);
+            kh_key(pr->mates, k) = bam_get_qname(b);
+            kh_val(pr->mates, k) = b;
+            *bp = mate;
+            return true;
+        }
+        recs[0] = mate; recs[1] = b;
+        bool ok = fq_pairs_write(pr, recs, 2, state, opts);
+        kh_del(fq_mates, pr->mates, k);
+        pr->mem -= fq_pairs_mem(mate);
+        bam_destroy1(mate);
+        return ok;
+    }
+
+    if (!(*bp = bam_init1())) {
+        *bp = b;
+        kh_del(fq_mates, pr->mates, k);
+        perror("[bam2fq_mainloop]");
+        return false;
+    }
+    kh_val(pr->mates, k) = b;
+    pr->mem += fq_pairs_mem(b);
+    if (can_spill && pr->mem > pr->max_mem)
+        return fq_pairs_spill(pr);
+    return true;
+}
+
+// Write out all the reads that are still waiting as singletons
+static bool fq_pairs_flush(fq_pairs_t *pr, bam2fq_state_t *state,
+                           bam2fq_opts_t *opts)
+{
+    bool ok = true;
+    khint_t k;
+    for (k = kh_begin(pr->mates); k != kh_end(pr->mates); k++) {
+        if (!kh_exist(pr->mates, k)) continue;
+        bam1_t *b = kh_val(pr->mates, k);
+        if (ok) ok = fq_pairs_write(pr, &b, 1, state, opts);
+        bam_destroy1(b);
+    }
+    kh_clear(fq_mates, pr->mates);
+    pr->mem = 0;
+    return ok;
+}
+
+// Pair up the reads sent to the temporary files
+static bool fq_pairs_finish(fq_pairs_t *pr, bam2fq_state_t *state,
+                            bam2fq_opts_t *opts)
+{
+    bam1_t *tb = NULL, *b = NULL;
+    bool ok = false;
+    int ret;
+
+    if (pr->n_open == 0)
+        return fq_pairs_flush(pr, state, opts);
+
+    if (!fq_pairs_spill(pr)) return false;
+    if (!(tb = bam_init1()) || !(b = bam_init1())) {
+        perror("[bam2fq_mainloop]");
+        goto out;
+    }
+
+    for (; pr->n_done < pr->n_open; pr->n_done++) {
+        tmp_file_t *tmp = &pr->spill[pr->n_done];
+        if (tmp_file_end_write(tmp) || tmp_file_begin_read(tmp, NULL)) {
+            print_error("bam2fq", "failed to rewind temporary file");
+            goto out;
+        }
+        // tmp_file_read() lends tb the file's buffer, so copy before keeping
+        while ((ret = tmp_file_read(tmp, tb)) > 0) {
+            if (!bam_copy1(b, tb)) {
+                perror("[bam2fq_mainloop]");
+                goto out;
+            }
+            if (!fq_pairs_add(pr, &b, 0, state, opts)) goto out;
+        }
+        if (ret < 0) {
+            print_error("bam2fq", "failed to read temporary file");
+            goto out;
+        }
+        tmp_file_destroy(tmp, tb, 0);
+        if (!fq_pairs_flush(pr, state, opts)) {
+            pr->n_done++;
+            goto out;
+        }
+    }
+    ok = true;
+
+ out:
+    if (pr->n_done < pr->n_open) {
+        // Failed part way through a file; tb may be using its buffer
+        tmp_file_destroy(&pr->spill[pr->n_done], tb, 0);
+        pr->n_done++;
+    }
+    if (tb) bam_destroy1(tb);
+    if (b) bam_destroy1(b);
+    return ok;
+}
+
+static bool bam2fq_pairloop(bam2fq_state_t *state, bam2fq_opts_t* opts)
+{
+    fq_pairs_t pairs;
+    kstring_t prefix = { 0, 0, NULL };
+    int64_t n_reads = 0;
+    bam1_t *b = NULL;
+    bool valid = false;
+    int res, i;
+    khint_t k;
+
+    memset(&pairs, 0, sizeof(pairs));
+    pairs.max_mem = opts->pair_mem;
+    if (opts->tmp_prefix) {
+        kputs(opts->tmp_prefix, &prefix);
+    } else {
+        const char *tmpdir = getenv("TMPDIR");
+        ksprintf(&prefix, "%s/samtools.%d.fastq.tmp",
+                 tmpdir && *tmpdir ? tmpdir : "/tmp", (int) getpid());
+    }
+    pairs.prefix = prefix.s;
+    if (!pairs.prefix || !(pairs.mates = kh_init(fq_mates)) || !(b = bam_init1())) {
+        perror("[bam2fq_mainloop]");
+        goto out;
+    }
+
+    while ((res = sam_read1(state->fp, state->h, b)) >= 0) {
+        if (filter_it_out(b, state)) continue;
+        ++n_reads;
+        if (!fq_pairs_add(&pairs, &b, 1, state, opts)) goto out;
+    }
+    if (res < -1) {
+        fprintf(stderr, "[bam2fq_mainloop] Failed to read bam record.\n");
+        goto out;
+    }
+    if (!fq_pairs_finish(&pairs, state, opts)) goto out;
+    valid = true;
+
+    if (pairs.n_spilled)
+        fprintf(stderr, "[M::bam2fq_mainloop] paired %" PRId64 " reads using temporary files\n", pairs.n_spilled);
+    fprintf(stderr, "[M::bam2fq_mainloop] discarded %" PRId64 " singletons\n", pairs.n_singletons);
+    fprintf(stderr, "[M::bam2fq_mainloop] processed %" PRId64 " reads\n", n_reads);
+
+ out:
+    if (pairs.mates) {
+        for (k = kh_begin(pairs.mates); k != kh_end(pairs.mates); k++)
+            if (kh_exist(pairs.mates, k)) bam_destroy1(kh_val(pairs.mates, k));
+        kh_destroy(fq_mates, pairs.mates);
+    }
+    for (i = pairs.n_done; i < pairs.n_open; i++)
+        tmp_file_destroy(&pairs.spill[i], NULL, 0);
+    for (i = 0; i < 3; i++) free(pairs.linebuf[i].s);
+    if (b) bam_destroy1(b);
+    free(prefix.s);
+    return valid;
+}
+
 int main_bam2fq(int argc, char *argv[])
 {
     int status = EXIT_SUCCESS;
@@ -1609,7 +2760,11 @@ int main_bam2fq(int argc, char *argv[])
 
     if (!init_state(opts, &state)) return EXIT_FAILURE;
 
-    if (!bam2fq_mainloop(state,opts)) status = EXIT_FAILURE;
+    if (opts->any_order) {
+        if (!bam2fq_pairloop(state,opts)) status = EXIT_FAILURE;
+    } else {
+        if (!bam2fq_mainloop(state,opts)) status = EXIT_FAILURE;
+    }
 
     if (!destroy_state(opts, state, &status)) return EXIT_FAILURE;
     sam_global_args_free(&opts->ga);
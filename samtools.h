@@ -25,6 +25,9 @@ DEALINGS IN THE SOFTWARE.  */
 #ifndef SAMTOOLS_H
 #define SAMTOOLS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 const char *samtools_version(void);
 
 #if defined __GNUC__ && __GNUC__ >= 2
@@ -36,4 +39,47 @@ const char *samtools_version(void);
 void print_error(const char *subcommand, const char *format, ...) CHECK_PRINTF(2, 3);
 void print_error_errno(const char *subcommand, const char *format, ...) CHECK_PRINTF(2, 3);
 
+/*
+ * Header padding.  A @CO line starting with SAM_HDR_PAD_TAG and holding n
+ * pseudo-random characters is appended to the header text.  As it barely
+ * compresses, it reserves room in the BAM header blocks that
+ * "reheader --in-place" can use for a larger header later.  text is
+ * reallocated as needed.  Returns 0 on success, -1 on failure.
+ */
+#define SAM_HDR_PAD_TAG "@CO\tsamtools-header-padding:"
+int sam_hdr_text_pad(char **text, uint32_t *l_text, size_t n);
+
+/*
+ * Parses the argument of a --header-pad option into *n, reporting an error
+ * for subcommand if it is not a number or too large.  Returns 0 on success,
+ * -1 on failure.
+ */
+int sam_hdr_pad_parse(const char *subcommand, const char *arg, size_t *n);
+
+/*
+ * Parses a memory size with an optional K, M or G suffix, as given to
+ * option, into *n.  Reports an error for subcommand if arg is not a positive
+ * size or is too large.  Returns 0 on success, -1 on failure.
+ */
+int sam_mem_size_parse(const char *subcommand, const char *option,
+                       const char *arg, size_t *n);
+
+/*
+ * Read counts sidecar.  CRAM indexes hold no read counts, so commands
+ * writing CRAM files save the mapped and unmapped reads for each reference
+ * in fn SAM_COUNTS_SUFFIX, along with the size and modification time of fn
+ * so that idxstats can tell whether the counts still apply.  counts has
+ * n_ref + 1 entries, the last being for reads with no reference.
+ * Both functions return 0 on success and -1 on failure; sam_counts_load()
+ * fails if the sidecar is missing, stale or doesn't match n_ref.
+ */
+#define SAM_COUNTS_SUFFIX ".cnt"
+
+typedef struct {
+    uint64_t mapped, unmapped;
+} sam_count_t;
+
+int sam_counts_save(const char *fn, int n_ref, const sam_count_t *counts);
+int sam_counts_load(const char *fn, int n_ref, sam_count_t *counts);
+
 #endif
@@ -0,0 +1,173 @@
+/*  test/bedidx/test_bed_overlap_all.c -- BED interval query test harness.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include "../../bedidx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define N_INTERVALS 1000
+#define N_QUERIES 5000
+#define MAX_POS 100000
+
+// Small portable generator, so that failures can be reproduced anywhere
+static uint32_t lcg_state = 12345;
+static uint32_t lcg(uint32_t n)
+{
+    lcg_state = lcg_state * 1103515245 + 12345;
+    return (lcg_state >> 8) % n;
+}
+
+static int cmp_pair(const void *av, const void *bv)
+{
+    const hts_pair32_t *a = av, *b = bv;
+    if (a->beg != b->beg) return a->beg < b->beg ? -1 : 1;
+    if (a->end != b->end) return a->end < b->end ? -1 : 1;
+    return 0;
+}
+
+// Intervals overlapping [beg, end), found the slow way, in sorted order
+static int brute_force(const hts_pair32_t *all, int n, int beg, int end,
+                       hts_pair32_t *out)
+{
+    int i, n_out = 0;
+    if (end <= 0 || beg >= end) return 0;
+    if (beg < 0) beg = 0;
+    for (i = 0; i < n; i++)
+        if (all[i].beg < (uint32_t) end && (uint32_t) beg < all[i].end)
+            out[n_out++] = all[i];
+    return n_out;
+}
+
+int main(int argc, char**argv)
+{
+    int verbose = 0, success = 0, failure = 0;
+    int getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v':
+                ++verbose;
+                break;
+            default:
+                printf(
+                       "usage: test_bed_overlap_all [-v]\n\n"
+                       " -v verbose output\n"
+                       );
+                return EXIT_FAILURE;
+        }
+    }
+
+    char* tempfname = (optind < argc)? argv[optind] : "test_bed_overlap_all.tmp";
+    hts_pair32_t *all = malloc(N_INTERVALS * sizeof(*all));
+    hts_pair32_t *expected = malloc(N_INTERVALS * sizeof(*expected));
+    hts_pair32_t *found = NULL;
+    int m_found = 0, i, j;
+    FILE *fp;
+    void *bed;
+
+    if (!all || !expected) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    // A mixture of short intervals, long ones and intervals nested in them,
+    // which defeat a linear scan from the query start
+    for (i = 0; i < N_INTERVALS; i++) {
+        uint32_t len;
+        switch (lcg(4)) {
+            case 0:  len = 1 + lcg(MAX_POS / 2); break;
+            case 1:  len = 0; break;
+            default: len = 1 + lcg(200); break;
+        }
+        all[i].beg = lcg(MAX_POS);
+        all[i].end = all[i].beg + len;
+    }
+
+    fp = fopen(tempfname, "w");
+    if (!fp) {
+        perror(tempfname);
+        return EXIT_FAILURE;
+    }
+    fprintf(fp, "# nested and overlapping intervals\n");
+    for (i = 0; i < N_INTERVALS; i++)
+        fprintf(fp, "chr1\t%u\t%u\n", all[i].beg, all[i].end);
+    fprintf(fp, "chr2\t10\t20\n");
+    fclose(fp);
+
+    bed = bed_read(tempfname);
+    remove(tempfname);
+    if (!bed) {
+        fprintf(stderr, "Failed to read \"%s\"\n", tempfname);
+        return EXIT_FAILURE;
+    }
+    qsort(all, N_INTERVALS, sizeof(*all), cmp_pair);
+
+    // Random queries, including ones starting before 0 and running off the end
+    for (i = 0; i < N_QUERIES; i++) {
+        int beg = (int) lcg(MAX_POS * 2) - 100;
+        int end = beg + (i % 10 == 0 ? (int) lcg(MAX_POS) : 1 + (int) lcg(500));
+        int n_exp = brute_force(all, N_INTERVALS, beg, end, expected);
+        int n = bed_overlap_all(bed, "chr1", beg, end, &found, &m_found);
+
+        if (n == n_exp
+            && (n == 0 || memcmp(found, expected, n * sizeof(*found)) == 0)
+            && (n > 0) == bed_overlap(bed, "chr1", beg, end)) {
+            ++success;
+        } else {
+            ++failure;
+            if (verbose) {
+                printf("FAIL query chr1:%d-%d: got %d intervals, expected %d\n",
+                       beg, end, n, n_exp);
+                for (j = 0; j < n && j < n_exp; j++)
+                    if (cmp_pair(&found[j], &expected[j]) != 0)
+                        printf("  %d: got %u-%u, expected %u-%u\n", j,
+                               found[j].beg, found[j].end,
+                               expected[j].beg, expected[j].end);
+            }
+        }
+    }
+
+    // Edge cases: other reference, unknown reference, empty query
+    if (bed_overlap_all(bed, "chr2", 0, 100, &found, &m_found) == 1
+        && found[0].beg == 10 && found[0].end == 20
+        && bed_overlap_all(bed, "chr2", 20, 30, &found, &m_found) == 0
+        && bed_overlap_all(bed, "chr3", 0, MAX_POS, &found, &m_found) == 0
+        && bed_overlap_all(bed, "chr1", 50, 50, &found, &m_found) == 0) {
+        ++success;
+    } else {
+        ++failure;
+        if (verbose) printf("FAIL edge cases\n");
+    }
+
+    if (verbose) printf("%d failures %d successes\n", failure, success);
+    bed_destroy(bed);
+    free(found);
+    free(expected);
+    free(all);
+
+    if (failure > 0)
+        fprintf(stderr, "%d failures %d successes\n", failure, success);
+    return failure == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -60,6 +60,9 @@ bool check_test_2(const parsed_opts_t* opts) {
         || opts->unaccounted_header_name != NULL
         || opts->unaccounted_name != NULL
         || strcmp(opts->output_format_string,"%*_%#.%.")
+        || opts->tag != NULL
+        || opts->by_ref
+        || opts->max_open != 0
         || opts->verbose == true )
         return false;
     return true;
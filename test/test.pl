@@ -31,6 +31,7 @@ use lib "$FindBin::Bin";
 use Getopt::Long;
 use File::Temp;
 use IO::Handle;
+use Compress::Raw::Zlib;
 
 my $opts = parse_params();
 
@@ -43,6 +44,8 @@ test_index($opts, threads=>2);
 test_mpileup($opts);
 test_usage($opts, cmd=>'samtools');
 test_view($opts);
+test_view_expr($opts);
+test_view_library($opts);
 test_cat($opts);
 test_bam2fq($opts);
 test_bam2fq($opts, threads=>2);
@@ -59,6 +62,8 @@ test_fixmate($opts, threads=>2);
 test_calmd($opts);
 test_calmd($opts, threads=>2);
 test_idxstat($opts);
+test_flagstat($opts);
+test_flagstat($opts, threads=>2);
 test_quickcheck($opts);
 test_reheader($opts);
 test_addrprg($opts);
@@ -66,6 +71,7 @@ test_addrprg($opts, threads=>2);
 test_markdup($opts);
 test_markdup($opts, threads=>2);
 test_bedcov($opts);
+test_split($opts);
 
 
 print "\nNumber of tests:\n";
@@ -547,6 +553,17 @@ sub test_faidx
     cmd("$$opts{bin}/samtools faidx $$opts{tmp}/faidx.fa 1 2:5-10 3:20-30 > $$opts{tmp}/output_faidx_base.fa");
     cmd("$$opts{bin}/samtools faidx $$opts{tmp}/faidx.fa -r $$opts{tmp}/region.txt > $$opts{tmp}/output_faidx.fa && $$opts{diff} $$opts{tmp}/output_faidx.fa $$opts{tmp}/output_faidx_base.fa");
 
+    # Batch mode: out of order and overlapping regions, a missing one with -c.
+    # Messages on stderr must match the default mode too.
+    open($fh, ">$$opts{tmp}/region_batch.txt") or error("$$opts{tmp}/region_batch.txt: $!");
+    print $fh "3:20-30\n1:99990-100010\n2:5-10\n1:1-20\n3:25,001-26,000\nEEE\n1:10-15\n2\n3:1-90000\n1:99998-100099\n2:7-8\n";
+    close $fh;
+    for my $file ("$$opts{tmp}/faidx.fa","$$opts{tmp}/faidx.fa.gz")
+    {
+        cmd("$$opts{bin}/samtools faidx -c $file -r $$opts{tmp}/region_batch.txt 1:50-60 > $$opts{tmp}/output_faidx_base.fa 2> $$opts{tmp}/output_faidx_base.err");
+        cmd("$$opts{bin}/samtools faidx -c -b $file -r $$opts{tmp}/region_batch.txt 1:50-60 > $$opts{tmp}/output_faidx.fa 2> $$opts{tmp}/output_faidx.err && $$opts{diff} $$opts{tmp}/output_faidx.fa $$opts{tmp}/output_faidx_base.fa && $$opts{diff} $$opts{tmp}/output_faidx.err $$opts{tmp}/output_faidx_base.err");
+    }
+
     for my $reg ('3:11-13','2:998-1003','1:100-104','1:99998-100007')
     {
         for my $file ("$$opts{tmp}/faidx.fa","$$opts{tmp}/faidx.fa.gz")
@@ -658,6 +675,17 @@ sub test_fqidx
     cmd("$$opts{bin}/samtools fqidx $$opts{tmp}/fqidx.fq 1 2:5-10 3:20-30 > $$opts{tmp}/output_fqidx_base.fq");
     cmd("$$opts{bin}/samtools faidx -f $$opts{tmp}/fqidx.fq -r $$opts{tmp}/region.txt > $$opts{tmp}/output_fqidx.fq && $$opts{diff} $$opts{tmp}/output_fqidx.fq $$opts{tmp}/output_fqidx_base.fq");
 
+    # Batch mode: out of order and overlapping regions, a missing one with -c.
+    # Messages on stderr must match the default mode too.
+    open($fh, ">$$opts{tmp}/region_batch.txt") or error("$$opts{tmp}/region_batch.txt: $!");
+    print $fh "3:20-30\n1:99990-100010\n2:5-10\n1:1-20\n3:25,001-26,000\nEEE\n1:10-15\n2\n3:1-90000\n1:99998-100099\n2:7-8\n";
+    close $fh;
+    for my $file ("$$opts{tmp}/fqidx.fq","$$opts{tmp}/fqidx.fq.gz")
+    {
+        cmd("$$opts{bin}/samtools fqidx -c $file -r $$opts{tmp}/region_batch.txt 1:50-60 > $$opts{tmp}/output_fqidx_base.fq 2> $$opts{tmp}/output_fqidx_base.err");
+        cmd("$$opts{bin}/samtools fqidx -c -b $file -r $$opts{tmp}/region_batch.txt 1:50-60 > $$opts{tmp}/output_fqidx.fq 2> $$opts{tmp}/output_fqidx.err && $$opts{diff} $$opts{tmp}/output_fqidx.fq $$opts{tmp}/output_fqidx_base.fq && $$opts{diff} $$opts{tmp}/output_fqidx.err $$opts{tmp}/output_fqidx_base.err");
+    }
+
     for my $reg ('3:11-13','2:998-1003','1:100-104','1:99998-100007')
     {
         for my $file ("$$opts{tmp}/fqidx.fq","$$opts{tmp}/fqidx.fq.gz")
@@ -692,6 +720,35 @@ sub test_dict
     test_cmd($opts,out=>'dat/dict.out',cmd=>"$$opts{bin}/samtools dict -a hf37d5 -s 'Homo floresiensis' -u ftp://example.com/hf37d5.fa.gz $$opts{path}/dat/dict.fa");
     test_cmd($opts,out=>'dat/dict.out',cmd=>"$$opts{bin}/samtools dict -a hf37d5 -s 'Homo floresiensis' -u ftp://example.com/hf37d5.fa.gz $$opts{tmp}/dict.fa.gz");
     test_cmd($opts,out=>'dat/dict.out',cmd=>"cat $$opts{path}/dat/dict.fa | $$opts{bin}/samtools dict -a hf37d5 -s 'Homo floresiensis' -u ftp://example.com/hf37d5.fa.gz");
+
+    # Threaded hashing, using an index.  faidx cannot index the sequences with
+    # irregular line lengths, so they are left out.
+    my $opt = "-a hf37d5 -s 'Homo floresiensis' -u ftp://example.com/hf37d5.fa.gz";
+    open(my $in, '<', "$$opts{path}/dat/dict.fa") or error("$$opts{path}/dat/dict.fa: $!");
+    open(my $out, '>', "$$opts{tmp}/dict_fai.fa") or error("$$opts{tmp}/dict_fai.fa: $!");
+    while (my $line = <$in>)
+    {
+        last if ($line =~ /^>chr9_whitespace/);
+        print $out $line;
+    }
+    close($out);
+    close($in);
+    cmd("$$opts{bin}/samtools faidx $$opts{tmp}/dict_fai.fa");
+    cmd("$$opts{bgzip} -ci -I $$opts{tmp}/dict_fai.fa.gz.gzi < $$opts{tmp}/dict_fai.fa > $$opts{tmp}/dict_fai.fa.gz");
+    cmd("$$opts{bin}/samtools faidx $$opts{tmp}/dict_fai.fa.gz");
+    cmd("$$opts{bin}/samtools dict $opt $$opts{tmp}/dict_fai.fa > $$opts{tmp}/dict_fai.expected");
+    for my $file ("$$opts{tmp}/dict_fai.fa","$$opts{tmp}/dict_fai.fa.gz")
+    {
+        cmd("$$opts{bin}/samtools dict -@ 2 $opt $file > $$opts{tmp}/dict_fai.out && $$opts{diff} $$opts{tmp}/dict_fai.out $$opts{tmp}/dict_fai.expected");
+    }
+    # An index that does not match the file is not used
+    cmd("cp $$opts{path}/dat/dict.fa $$opts{tmp}/dict_stale.fa && cp $$opts{tmp}/dict_fai.fa.fai $$opts{tmp}/dict_stale.fa.fai");
+    test_cmd($opts,out=>'dat/dict.out',cmd=>"$$opts{bin}/samtools dict -@ 2 $opt $$opts{tmp}/dict_stale.fa 2>/dev/null");
+    # Thread counts must be numbers
+    for my $bad ('foo', '-1', '2x', '')
+    {
+        test_cmd($opts,out=>'dat/empty.expected',want_fail=>1,cmd=>"$$opts{bin}/samtools dict -@ '$bad' $$opts{tmp}/dict_fai.fa 2>/dev/null");
+    }
 }
 
 sub test_index
@@ -705,6 +762,40 @@ sub test_index
     test_cmd($opts,out=>'dat/large_chrom.out',cmd=>"$$opts{bin}/samtools view${threads} $$opts{tmp}/large_chrom.bam ref2");
     test_cmd($opts,out=>'dat/large_chrom.out',cmd=>"$$opts{bin}/samtools view${threads} $$opts{tmp}/large_chrom.bam ref2:1-541556283");
     test_cmd($opts,out=>'dat/test_input_1_a.bam.bai.expected',cmd=>"$$opts{bin}/samtools index${threads} $$opts{path}/dat/test_input_1_a.bam && cat $$opts{path}/dat/test_input_1_a.bam.bai",binary=>1);
+
+    # A file big enough to be split between threads must give the same index
+    return if (!exists($args{threads}));
+    my $big = "$$opts{tmp}/index_big";
+    open(my $fh, '>', "$big.sam") or error("$big.sam: $!");
+    print $fh "\@HD\tVN:1.4\tSO:coordinate\n";
+    print $fh "\@SQ\tSN:ref$_\tLN:5000000\n" foreach (1..3);
+    my @bases = qw(A C G T);
+    srand(15);
+    foreach my $ref (1..3) {
+        my $pos = 1;
+        for (my $i = 0; $i < 6000; $i++) {
+            my $seq = join('', map { $bases[int(rand(4))] } (1..100));
+            my $flag = $i % 97 == 0 ? 4 : 0;
+            my $cigar = $flag ? '*' : (rand() < 0.01 ? '50M30000N50M' : '100M');
+            print $fh "r${ref}_$i\t$flag\tref$ref\t$pos\t30\t$cigar\t*\t0\t0\t$seq\t*\n";
+            $pos += int(rand(700));
+        }
+    }
+    for (my $i = 0; $i < 500; $i++) {
+        print $fh "u$i\t4\t*\t0\t0\t*\t*\t0\t0\tACGTACGTAC\t*\n";
+    }
+    close($fh) or error("$big.sam: $!");
+    cmd("$$opts{bin}/samtools view -u -o $big.bam $big.sam");
+    foreach my $fmt ('bai', 'csi') {
+        my $opt = $fmt eq 'csi' ? ' -c' : '';
+        my $msg = "index${threads}${opt} on a file split between threads";
+        print "test_index:\n\t$msg\n";
+        cmd("$$opts{bin}/samtools index${opt} $big.bam $big.1.$fmt");
+        cmd("$$opts{bin}/samtools index${threads}${opt} $big.bam $big.2.$fmt");
+        my ($ret) = _cmd("cmp $big.1.$fmt $big.2.$fmt");
+        if ($ret) { failed($opts, msg => $msg, reason => "$big.1.$fmt and $big.2.$fmt differ"); }
+        else { passed($opts, msg => $msg); }
+    }
 }
 
 sub test_mpileup
@@ -1903,6 +1994,8 @@ sub test_view
         # Libraries
         ['lib2', { libraries => { 'Library 2' => 1 }}, ['-l', 'Library 2'], 0],
         ['lib3', { libraries => { 'Library 3' => 1 }}, ['-l', 'Library 3'], 0],
+        ['lib_none', { libraries => { 'No such library' => 1 }},
+         ['-l', 'No such library'], 0],
         # Mapping qualities
         ['mq50',  { min_map_qual => 50 },  ['-q', 50], 0],
         ['mq99',  { min_map_qual => 99 },  ['-q', 99], 0],
@@ -1921,6 +2014,12 @@ sub test_view
         ['qlen11', { min_qlen => 11 }, ['-m', 11], 0],
         ['qlen15', { min_qlen => 15 }, ['-m', 15], 0],
         ['qlen16', { min_qlen => 16 }, ['-m', 16], 0],
+        # Filter expressions
+        ['expr_mq50', { min_map_qual => 50 }, ['-e', 'mapq >= 50'], 0],
+        ['expr_rej128', { flags_rejected => 128 }, ['-e', '!flag.read2'], 0],
+        ['expr_mq_flag', { min_map_qual => 50, flags_rejected => 128 },
+         ['-e', 'mapq >= 50 && (flag & 128) == 0'], 0],
+        ['expr_bad', {}, ['-e', 'mapq >'], 1],
         );
 
     my @filter_inputs = ([SAM  => $sam_with_ur],
@@ -1942,6 +2041,26 @@ sub test_view
                           expect_fail => $$filter[3]);
             $test++;
 
+            # Filter test with the records processed by the thread pool
+            run_view_test($opts,
+                          msg => "$test: Filter @{$$filter[2]} ($$ip[0] input, 2 threads)",
+                          args => ['-h', '-@', 2, @{$$filter[2]}, $$ip[1]],
+                          out => sprintf("%s.test%03d.sam", $out, $test),
+                          compare => $sam_file,
+                          expect_fail => $$filter[3]);
+            $test++;
+
+            if ($$ip[0] eq 'BAM') {
+                # BAM to BAM, which passes the raw records through
+                run_view_test($opts,
+                              msg => "$test: Filter @{$$filter[2]} (BAM input, BAM output)",
+                              args => ['-b', @{$$filter[2]}, $$ip[1]],
+                              out => sprintf("%s.test%03d.bam", $out, $test),
+                              compare_sam => $sam_file,
+                              expect_fail => $$filter[3]);
+                $test++;
+            }
+
             # Count test
             run_view_test($opts,
                           msg => "$test: Count @{$$filter[2]} ($$ip[0] input)",
@@ -1954,6 +2073,41 @@ sub test_view
         }
     }
 
+    # Split outputs (--split)
+    my $split_main = "$$opts{tmp}/view.001.split_main.sam";
+    my $split_r2   = "$$opts{tmp}/view.001.split_r2.sam";
+    my $split_mq   = "$$opts{tmp}/view.001.split_mq.sam";
+    filter_sam($sam_with_ur, $split_main, { min_map_qual => 50 });
+    filter_sam($sam_with_ur, $split_r2, { flags_required => 128 });
+    filter_sam($sam_with_ur, $split_mq,
+               { min_map_qual => 50, flags_rejected => 128 });
+    foreach my $threads (0, 2) {
+        my @threads = $threads ? ('-@', $threads) : ();
+        my $split_bam = sprintf("%s.test%03d.split.bam", $out, $test);
+        my $split_sam = sprintf("%s.test%03d.split.sam", $out, $test);
+        run_view_test($opts,
+                      msg => "$test: Split outputs (@threads)",
+                      args => ['-h', '-q', 50, @threads,
+                               '--split', "$split_bam=flag.read2",
+                               '--split', "$split_sam=mapq >= 50 && !(flag & 128)",
+                               $bam_with_ur_out],
+                      out => sprintf("%s.test%03d.sam", $out, $test),
+                      compare => $split_main);
+        $test++;
+        run_view_test($opts,
+                      msg => "$test: Split output to BAM",
+                      args => ['-h', $split_bam],
+                      out => sprintf("%s.test%03d.sam", $out, $test),
+                      compare => $split_r2);
+        $test++;
+        run_view_test($opts,
+                      msg => "$test: Split output to SAM",
+                      args => ['-h', $split_sam],
+                      out => sprintf("%s.test%03d.sam", $out, $test),
+                      compare => $split_mq);
+        $test++;
+    }
+
     # Region query tests
     my $sam_no_ur2 = "$$opts{path}/dat/view.002.sam";
     my $sam_with_ur2 = "$$opts{tmp}/view.002.sam";
@@ -2003,6 +2157,13 @@ sub test_view
          [], ['ref1:15-45', 'ref2:16-31']],
         ['reg7', 1, { region => [['ref1', 15, 15], ['ref1', 45, 45]] },
          [], ['ref1:15-15', 'ref1:45-45']],
+        # Overlapping and out of order regions are merged
+        ['reg_merge1', 1, { region => [['ref1', 15, 45], ['ref1', 20, 50]] },
+         [], ['ref1:15-45', 'ref1:20-50']],
+        ['reg_merge2', 1, { region => [['ref2'], ['ref1', 15, 45]] },
+         [], ['ref2', 'ref1:15-45']],
+        ['reg_dup', 1, { region => [['ref1'], ['ref2']] },
+         [], ['ref2', 'ref1', 'ref2']],
         # Regions combined with other filters.
         ['reg8', 1, { region => [['ref1']], flags_required => 128 },
          ['-f', 128], ['ref1']],
@@ -2234,6 +2395,99 @@ sub test_view
 # $sam_in is the name of the input file.  More than one of these can be
 #   passed in.  The header is taken from the first file.
 
+
+# Filter expressions (view -e) on each kind of operand, checked against
+# record counts worked out independently from dat/mpileup.1.sam
+sub test_view_expr
+{
+    my ($opts,%args) = @_;
+    my $sam = "$$opts{path}/dat/mpileup.1.sam";
+    my $bam = "$$opts{tmp}/view_expr.bam";
+    cmd("$$opts{bin}/samtools view -b -o $bam $sam");
+
+    my @tests = (
+        # Integer tag; one record has no NM so the two don't add up to 569
+        ['[NM] <= 3', 545],
+        ['[NM] > 3', 23],
+        # String tag
+        ['[RG] == "ERR013140"', 71],
+        ['[RG] != "ERR013140"', 498],
+        # Missing tags are null: false, and false in any comparison
+        ['[XA]', 1],
+        ['![XA]', 568],
+        ['[MQ] >= 0', 546],
+        ['[ZZ] != 1', 0],
+        ['[RG] == 71', 0],
+        # Core fields
+        ['tlen > 300', 248],
+        ['-tlen > 300', 222],
+        ['mapq > 29', 530],
+        ['rname == "17"', 569],
+        ['flag.reverse', 279],
+        # Sequence and string matching and ordering
+        ['seq =~ "^AGAG"', 2],
+        ['seq !~ "N"', 568],
+        ['qname =~ "^ERR156632\\."', 60],
+        ['qname < "ERR1"', 84],
+        # Precedence
+        ['flag & 16 == 16', 569],
+        ['(flag & 16) == 16', 279],
+        ['mapq - 10 * 2 > 9', 530],
+        ['1 + 2 * 3 == 7', 569],
+        ['mapq > 29 || tlen > 300 && tlen < 0', 530],
+        ['(mapq > 29 || tlen > 300) && tlen < 0', 240],
+        # Short-circuit && and || with a null operand
+        ['mapq >= 0 || [ZZ]', 569],
+        ['[ZZ] || mapq >= 0', 569],
+        ['[ZZ] && mapq >= 0', 0],
+        ['!([ZZ] && 1)', 569],
+        ['mapq >= 20 && [NM] <= 3 && !flag.dup && seq !~ "N"', 523],
+        );
+    foreach my $t (@tests)
+    {
+        foreach my $in ($sam, $bam)
+        {
+            my $test = "$$opts{bin}/samtools view -c -e '$$t[0]' $in";
+            print "$test\n";
+            my ($ret, $out, $err) = _cmd($test);
+            chomp($out);
+            if ( $ret || $out ne $$t[1] ) { failed($opts,msg=>$test,reason=>"Expected $$t[1] got \"$out\"\n$err"); }
+            else { passed($opts,msg=>$test); }
+        }
+    }
+
+    # Invalid expressions must be rejected
+    foreach my $expr ('mapq >', '[NM', 'nosuch == 1', 'flag.nosuch', 'seq =~ 3', 'seq =~ "("', '(mapq > 1')
+    {
+        my $test = "$$opts{bin}/samtools view -c -e '$expr' $sam";
+        print "$test\n";
+        my ($ret, $out, $err) = _cmd($test);
+        if ( !$ret ) { failed($opts,msg=>$test,reason=>"Expected failure, got \"$out\"\n"); }
+        else { passed($opts,msg=>$test); }
+    }
+}
+
+# -l must only match RG tags holding a string
+sub test_view_library
+{
+    my ($opts,%args) = @_;
+    my $sam = "$$opts{tmp}/view_library.sam";
+    open(my $fh, '>', $sam) or error("$sam: $!");
+    print $fh "\@SQ\tSN:c1\tLN:100\n\@RG\tID:1\tLB:lib1\n";
+    print $fh "r1\t0\tc1\t1\t20\t4M\t*\t0\t0\tACGT\t*\tRG:Z:1\n";
+    print $fh "r2\t0\tc1\t1\t20\t4M\t*\t0\t0\tACGT\t*\tRG:i:1\n";
+    print $fh "r3\t0\tc1\t1\t20\t4M\t*\t0\t0\tACGT\t*\n";
+    close($fh);
+    foreach my $threads ('', ' -@ 2') {
+        my $test = "$$opts{bin}/samtools view$threads -c -l lib1 $sam";
+        print "$test\n";
+        my ($ret, $out, $err) = _cmd($test);
+        chomp($out);
+        if ( $ret || $out ne '1' ) { failed($opts,msg=>$test,reason=>"Expected 1 got \"$out\"\n$err"); }
+        else { passed($opts,msg=>$test); }
+    }
+}
+
 sub cat_sams
 {
     my $sam_out = shift(@_);
@@ -2371,6 +2625,88 @@ sub test_cat
                   out => sprintf("%s.test%03d.cram", $out, $test),
                   compare_sam => $catsam2);
     $test++;
+
+    # Test index splicing on a sorted file cut into two indexed halves
+    my $sorted = "$out.sorted.bam";
+    cmd("$$opts{bin}/samtools sort -o $sorted $bams[0]");
+    cmd("$$opts{bin}/samtools index $sorted");
+    foreach my $fmt ('', '-c') {
+        my @parts = ("$out.part1.bam", "$out.part2.bam");
+        cmd("$$opts{bin}/samtools view -b -e 'pos <= 5000' -o $parts[0] $sorted");
+        cmd("$$opts{bin}/samtools view -b -e 'pos > 5000' -o $parts[1] $sorted");
+        unlink(map { ("$_.bai", "$_.csi") } @parts);
+        cmd("$$opts{bin}/samtools index $fmt $_") foreach (@parts);
+        my $spliced = sprintf("%s.test%03d.bam", $out, $test);
+        my $msg = "$test: cat --write-index" . ($fmt ? " (CSI)" : " (BAI)");
+        print "$test_name:\n\t$msg\n";
+        cmd("$$opts{bin}/samtools cat --write-index -o $spliced @parts");
+        my $ok = -e $spliced . ($fmt ? '.csi' : '.bai');
+        foreach my $region ('ref1', 'ref1:3000-7000', 'ref1:4990-5010', 'ref1:9000-9500') {
+            my $exp = cmd("$$opts{bin}/samtools view $sorted $region");
+            my $got = cmd("$$opts{bin}/samtools view $spliced $region");
+            $ok &&= ($exp eq $got);
+        }
+        if ($ok) {
+            passed($opts, msg => $msg);
+        } else {
+            failed($opts, msg => $msg, reason => "region queries differ between $spliced and $sorted");
+        }
+        $test++;
+    }
+
+    # Several references, one split part way through, with unplaced reads
+    # at the end.  The spliced index must give the same counts as a new one.
+    my $multi = "$out.multi";
+    open(my $fh, '>', "$multi.sam") || die "Couldn't open $multi.sam : $!\n";
+    print $fh "\@SQ\tSN:ref$_\tLN:50000\n" foreach (1..3);
+    srand(66);
+    for (my $i = 0; $i < 3000; $i++) {
+        printf $fh "m%d\t%d\tref%d\t%d\t30\t10M\t*\t0\t0\tACGTACGTAC\t*\n",
+            $i, rand() < 0.05 ? 4 : 0, 1 + int(rand(3)), 1 + int(rand(49990));
+    }
+    printf $fh "u%d\t4\t*\t0\t0\t*\t*\t0\t0\tACGTACGTAC\t*\n", $_ foreach (1..100);
+    close($fh);
+    $sorted = "$multi.sorted.bam";
+    cmd("$$opts{bin}/samtools sort -o $sorted $multi.sam");
+    cmd("$$opts{bin}/samtools index $sorted");
+    my %parts = (a => 'rname == "ref1" || (rname == "ref2" && pos <= 20000)',
+                 b => 'rname == "ref2" && pos > 20000',
+                 c => 'rname == "ref3" || rname == "*"',
+                 overlap => 'rname == "ref2" && pos > 19000');
+    foreach my $fmt ('', '-c') {
+        foreach my $part (sort keys %parts) {
+            cmd("$$opts{bin}/samtools view -b -e '$parts{$part}' -o $multi.$part.bam $sorted");
+            unlink("$multi.$part.bam.bai", "$multi.$part.bam.csi");
+            cmd("$$opts{bin}/samtools index $fmt $multi.$part.bam");
+        }
+        my $spliced = sprintf("%s.test%03d.bam", $out, $test);
+        my $msg = "$test: cat --write-index, several references" . ($fmt ? " (CSI)" : " (BAI)");
+        print "$test_name:\n\t$msg\n";
+        unlink("$spliced.bai", "$spliced.csi");
+        cmd("$$opts{bin}/samtools cat --write-index -o $spliced $multi.a.bam $multi.b.bam $multi.c.bam");
+        my $got = cmd("$$opts{bin}/samtools idxstats $spliced");
+        cmd("cp $spliced $multi.fresh.bam && $$opts{bin}/samtools index $fmt $multi.fresh.bam");
+        my $exp = cmd("$$opts{bin}/samtools idxstats $multi.fresh.bam");
+        my $ok = ($exp eq $got);
+        foreach my $region ('ref1', 'ref2:19000-21000', 'ref3:100-40000') {
+            $ok &&= (cmd("$$opts{bin}/samtools view $sorted $region")
+                     eq cmd("$$opts{bin}/samtools view $spliced $region"));
+        }
+        if ($ok) {
+            passed($opts, msg => $msg);
+        } else {
+            failed($opts, msg => $msg, reason => "idxstats or region queries differ between $spliced and a new index");
+        }
+        $test++;
+
+        # Inputs out of order or overlapping can't have their indexes spliced
+        foreach my $bad ("$multi.b.bam $multi.a.bam $multi.c.bam",
+                         "$multi.c.bam $multi.a.bam",
+                         "$multi.a.bam $multi.overlap.bam") {
+            test_cmd($opts, out => 'dat/empty.expected', want_fail => 1,
+                     cmd => "$$opts{bin}/samtools cat --write-index -o $multi.bad.bam $bad");
+        }
+    }
 }
 
 sub sam2fq
@@ -2476,6 +2812,50 @@ sub test_bam2fq
     test_cmd($opts, out=>'bam2fq/2.stdout.expected', out_map=>{'1.fq' => 'bam2fq/7.1.fq.expected', '2.fq' => 'bam2fq/7.2.fq.expected', 's.fq' => 'bam2fq/7.s.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads -N -t -i -T MD,ia -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.005.sam");
     # -i flag with index
     test_cmd($opts, out=>'bam2fq/2.stdout.expected', out_map=>{'1.fq' => 'bam2fq/8.1.fq.expected', '2.fq' => 'bam2fq/8.2.fq.expected', 's.fq' => 'bam2fq/8.s.fq.expected', 'i.fq' => 'bam2fq/8.i.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads --barcode-tag BC -i --index-format 'n2i2' --i1 $$opts{path}/i.fq -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.004.sam");
+
+    # --any-order on name grouped input gives the same output as normal
+    test_cmd($opts, out=>'bam2fq/2.stdout.expected', out_map=>{'1.fq' => 'bam2fq/2.1.fq.expected', '2.fq' => 'bam2fq/2.2.fq.expected', 's.fq' => 'bam2fq/2.s.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads --any-order -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.001.sam");
+    test_cmd($opts, out=>'bam2fq/2.stdout.expected', out_map=>{'1.fq' => 'bam2fq/3.1.fq.expected', '2.fq' => 'bam2fq/3.2.fq.expected', 's.fq' => 'bam2fq/3.s.fq.expected'}, cmd=>"$$opts{bin}/samtools fastq @$threads --any-order -s $$opts{path}/s.fq -1 $$opts{path}/1.fq -2 $$opts{path}/2.fq $$opts{path}/dat/bam2fq.002.sam");
+
+    # Coordinate sorted input, using temporary files.  The pairs come out in
+    # a different order, but the two files must stay in step.
+    cmd("$$opts{bin}/samtools sort @$threads -o $out.sorted.bam $$opts{path}/dat/bam2fq.001.sam");
+    my $msg = "fastq --any-order --pair-memory 1 (sorted input)$nthreads";
+    print "test_bam2fq:\n\t$msg\n";
+    cmd("$$opts{bin}/samtools fastq @$threads --any-order --pair-memory 1 --tmp-prefix $out.pairs -1 $out.any.1.fq -2 $out.any.2.fq $out.sorted.bam");
+    my @got = fastq_pairs("$out.any.1.fq", "$out.any.2.fq");
+    my @exp = fastq_pairs("$$opts{path}/bam2fq/2.1.fq.expected", "$$opts{path}/bam2fq/2.2.fq.expected");
+    if (!@got || join("", sort @got) ne join("", sort @exp)) {
+        failed($opts, msg => $msg, reason => "READ1 and READ2 files differ from $$opts{path}/bam2fq/2.[12].fq.expected");
+    } else {
+        passed($opts, msg => $msg);
+    }
+
+    foreach my $mem ('foo', '0', '-5', '10X', '1Mb') {
+        test_cmd($opts, out=>'dat/empty.expected', want_fail=>1, cmd=>"$$opts{bin}/samtools fastq --any-order --pair-memory '$mem' -1 $out.any.1.fq -2 $out.any.2.fq $out.sorted.bam");
+    }
+}
+
+# Read two FASTQ files into a list of read pairs, returning an empty list if
+# the files are not in step.
+sub fastq_pairs
+{
+    my ($fq1, $fq2) = @_;
+    my @pairs;
+    open(my $f1, '<', $fq1) || error("Couldn't open $fq1 : $!\n");
+    open(my $f2, '<', $fq2) || error("Couldn't open $fq2 : $!\n");
+    while (my $n1 = <$f1>) {
+        my $n2 = <$f2>;
+        my $r1 = join('', $n1, map { scalar(<$f1>) } 1..3);
+        my $r2 = join('', $n2 // '', map { scalar(<$f2>) // '' } 1..3);
+        my ($q1, $q2) = map { (split(/[\s\/]/, $_))[0] } ($n1, $n2 // '');
+        return () if ($q1 ne $q2);
+        push(@pairs, $r1 . $r2);
+    }
+    return () if (defined(<$f2>));
+    close($f1);
+    close($f2);
+    return @pairs;
 }
 
 sub test_depad
@@ -2667,6 +3047,18 @@ sub test_collate
 	     out_map=>{"collate/collate3.tmp.sam"
 			   =>"collate/collate.expected.sam"},
 	     cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate3.tmp");
+
+    # Too little memory to collate in memory, so temporary files are used
+    test_cmd($opts, out=>"dat/empty.expected",
+	     out_map=>{"collate/collate4.tmp.sam"
+			   =>"collate/collate.expected.sam"},
+	     cmd=>"$$opts{bin}/samtools collate${threads} -m 1 -o $$opts{path}/collate/collate4.tmp.sam $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate4.tmp");
+
+    # Memory sizes that aren't positive numbers are rejected
+    foreach my $mem ('foo', '0', '-1', '1.5G', '100Q') {
+        test_cmd($opts, out=>"dat/empty.expected", want_fail=>1,
+                 cmd=>"$$opts{bin}/samtools collate${threads} -m '$mem' -o $$opts{path}/collate/collate5.tmp.sam $$opts{path}/dat/test_input_1_d.sam $$opts{path}/collate/collate5.tmp");
+    }
              
     # fast collate, supplementary files not output
     test_cmd($opts, out=>"dat/empty.expected",
@@ -2677,6 +3069,41 @@ sub test_collate
     test_cmd($opts, out=>"dat/empty.expected",
              out_map=>{"collate/2_fast_collate_with_tmp.sam" => "collate/2_fast_collate_with_tmp_used.sam.expected"},
              cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam -f -r 4 $$opts{path}/collate/fast_collate.sam -o $$opts{path}/collate/2_fast_collate_with_tmp.sam");
+
+    # streaming collate, reads leaving the small window are still paired in memory
+    test_cmd($opts, out=>"dat/empty.expected",
+             out_map=>{"collate/3_stream_collate.sam" => "collate/1_fast_collate.sam.expected"},
+             cmd=>"$$opts{bin}/samtools collate${threads} --output-fmt=sam --stream -r 4 $$opts{path}/collate/fast_collate.sam -o $$opts{path}/collate/3_stream_collate.sam");
+
+    # Mates up to a few thousand reads apart, so reads spill out of the
+    # window, are taken from the spill store and the window grows.  With
+    # little memory some reads also go through the temporary files.
+    my $tmp = "$$opts{tmp}/collate_stream";
+    my @slots;
+    srand(64);
+    for (my $i = 0; $i < 5000; $i++) {
+        my $d = rand() < 0.5 ? 1 + int(rand(8)) : 1 + int(rand(4000));
+        push @{$slots[2 * $i]}, "p$i\t77\t*\t0\t0\t*\t*\t0\t0\tACGT\tIIII\n";
+        push @{$slots[2 * $i + $d]}, "p$i\t141\t*\t0\t0\t*\t*\t0\t0\tTGCA\tIIII\n";
+    }
+    my @in = map { defined($_) ? @$_ : () } @slots;
+    open(my $fh, '>', "$tmp.sam") or error("$tmp.sam: $!");
+    print $fh "\@HD\tVN:1.4\tSO:unsorted\n", @in;
+    close($fh);
+    foreach my $mem ('', ' -m 100K') {
+        my $msg = "collate --stream -r 4$mem with distant mates";
+        my ($ret, $out) = _cmd("$$opts{bin}/samtools collate${threads} --output-fmt=sam --stream -r 4$mem -O $tmp.sam $tmp.tmp");
+        my @out = grep { !/^\@/ } split(/^/, $out);
+        my $reason = $ret ? "exit status $ret" : '';
+        for (my $i = 0; !$reason && $i < @out; $i += 2) {
+            my @r1 = split(/\t/, $out[$i]);
+            my @r2 = split(/\t/, $out[$i + 1] // '');
+            $reason = "reads not paired at line $i" if (@r2 < 2 || $r1[0] ne $r2[0] || $r1[1] != 77 || $r2[1] != 141);
+        }
+        $reason ||= "records differ from the input" if (join('', sort @out) ne join('', sort @in));
+        if ($reason) { failed($opts, msg=>$msg, reason=>$reason); }
+        else { passed($opts, msg=>$msg); }
+    }
 }
 
 sub test_fixmate
@@ -2703,6 +3130,24 @@ sub test_calmd
     my $out = cmd($test);
     if (substr($out, 0, 2) eq "\x1f\x8b") { passed($opts,msg=>$test); }
     else { failed($opts,msg=>$test,reason=>"Expected BGZF-compressed output"); }
+
+    # Threads work on batches of reads, but must give the same output
+    return if (!exists($args{threads}));
+    my $in = "$$opts{tmp}/calmd.in.sam";
+    open(my $fh, '<', "$$opts{path}/dat/mpileup.1.sam") or error("$$opts{path}/dat/mpileup.1.sam: $!");
+    my @lines = <$fh>;
+    close($fh);
+    open($fh, '>', $in) or error("$in: $!");
+    print $fh grep { /^@/ } @lines;
+    print $fh grep { !/^@/ } @lines foreach (1..4);
+    close($fh) or error("$in: $!");
+    my $msg = "calmd${threads} -e gives the same records as calmd -e";
+    print "test_calmd:\n\t$msg\n";
+    cmd("$$opts{bin}/samtools calmd -e $in $$opts{path}/dat/mpileup.ref.fa > $$opts{tmp}/calmd.1.sam 2>/dev/null");
+    cmd("$$opts{bin}/samtools calmd${threads} -e $in $$opts{path}/dat/mpileup.ref.fa > $$opts{tmp}/calmd.2.sam 2>/dev/null");
+    my ($ret) = _cmd("cmp $$opts{tmp}/calmd.1.sam $$opts{tmp}/calmd.2.sam");
+    if ($ret) { failed($opts, msg => $msg, reason => "$$opts{tmp}/calmd.1.sam and $$opts{tmp}/calmd.2.sam differ"); }
+    else { passed($opts, msg => $msg); }
 }
 
 sub test_idxstat
@@ -2712,6 +3157,89 @@ sub test_idxstat
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.bam", expect_fail=>0);
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.cram", expect_fail=>0);
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.sam", expect_fail=>0);
+
+    # Sorting to CRAM saves read counts that idxstats uses instead of
+    # decoding the file
+    my $cram = "$$opts{tmp}/idxstats_sorted.cram";
+    unlink("$cram.cnt");
+    cmd("$$opts{bin}/samtools sort -O cram --output-fmt-option no_ref=1 -o $cram $$opts{path}/dat/test_input_1_a.sam");
+    if (-e "$cram.cnt") { passed($opts,msg=>"sort writes $cram.cnt"); }
+    else { failed($opts,msg=>"sort writes $cram.cnt",reason=>"$cram.cnt is missing"); }
+    test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $cram", expect_fail=>0);
+
+    # Prove the counts really come from the .cnt file by editing them
+    open(my $fh, '<', "$cram.cnt") or error("$cram.cnt: $!");
+    my @cnt = <$fh>;
+    close($fh);
+    my $hdr = shift(@cnt);
+    my @fake = ([11,1], [22,2], [33,3], [44,4], [0,55]);
+    if (@cnt != @fake) { failed($opts,msg=>"idxstats $cram.cnt",reason=>"unexpected number of lines"); return; }
+    open($fh, '>', "$cram.cnt") or error("$cram.cnt: $!");
+    print $fh $hdr, map { "$$_[0]\t$$_[1]\n" } @fake;
+    close($fh);
+    my @names = (['insert',599], ['ref1',45], ['ref2',40], ['ref3',4], ['*',0]);
+    my $want = join('', map { "$names[$_][0]\t$names[$_][1]\t$fake[$_][0]\t$fake[$_][1]\n" } (0..$#fake));
+    my ($ret, $out) = _cmd("$$opts{bin}/samtools idxstats $cram");
+    if ($ret == 0 && $out eq $want) { passed($opts,msg=>"idxstats reads $cram.cnt"); }
+    else { failed($opts,msg=>"idxstats reads $cram.cnt",reason=>"got:\n$out\nexpected:\n$want"); }
+
+    # A .cnt older than the CRAM, or a damaged one, must be ignored and the
+    # CRAM decoded instead
+    my $expected = "$$opts{path}/idxstats/test_input_1_a.bam.expected";
+    open($fh, '<', $expected) or error("$expected: $!");
+    $want = join('', <$fh>);
+    close($fh);
+    my $mtime = (stat($cram))[9];
+    utime($mtime + 10, $mtime + 10, $cram) or error("utime $cram: $!");
+    ($ret, $out) = _cmd("$$opts{bin}/samtools idxstats $cram");
+    if ($ret == 0 && $out eq $want) { passed($opts,msg=>"idxstats ignores stale $cram.cnt"); }
+    else { failed($opts,msg=>"idxstats ignores stale $cram.cnt",reason=>"got:\n$out\nexpected:\n$want"); }
+
+    utime($mtime, $mtime, $cram) or error("utime $cram: $!");
+    open($fh, '>', "$cram.cnt") or error("$cram.cnt: $!");
+    print $fh $hdr, "11\t1\n22\n";
+    close($fh);
+    ($ret, $out) = _cmd("$$opts{bin}/samtools idxstats $cram");
+    if ($ret == 0 && $out eq $want) { passed($opts,msg=>"idxstats ignores corrupt $cram.cnt"); }
+    else { failed($opts,msg=>"idxstats ignores corrupt $cram.cnt",reason=>"got:\n$out\nexpected:\n$want"); }
+}
+
+sub test_flagstat
+{
+    my ($opts,%args) = @_;
+    my $threads = exists($args{threads}) ? " -@ $args{threads}" : "";
+
+    cmd("$$opts{bin}/samtools view -b -o $$opts{tmp}/flagstat.bam $$opts{path}/dat/mpileup.2.sam");
+    foreach my $in ("$$opts{path}/dat/mpileup.2.sam", "$$opts{tmp}/flagstat.bam") {
+        test_cmd($opts,out=>'stat/flagstat.expected',cmd=>"$$opts{bin}/samtools flagstat${threads} $in");
+        test_cmd($opts,out=>'stat/flagstat.json.expected',cmd=>"$$opts{bin}/samtools flagstat${threads} -O json $in");
+    }
+
+    # A file big enough to be split between threads must give the same counts
+    return if (!exists($args{threads}));
+    my $big = "$$opts{tmp}/flagstat_big";
+    open(my $fh, '>', "$big.sam") or error("$big.sam: $!");
+    print $fh "\@SQ\tSN:ref$_\tLN:5000000\n" foreach (1..2);
+    my @flags = (0, 4, 16, 256, 512, 1024, 2048, 99, 147, 83, 163, 73, 133, 89, 121, 609);
+    my @bases = qw(A C G T);
+    srand(71);
+    for (my $i = 0; $i < 20000; $i++) {
+        my $flag = $flags[int(rand(@flags))];
+        my $mref = rand() < 0.1 ? 'ref2' : '=';
+        my $seq = join('', map { $bases[int(rand(4))] } (1..80));
+        print $fh "r$i\t$flag\tref1\t", 1 + int(rand(4000000)), "\t", int(rand(60)), "\t80M\t$mref\t100\t0\t$seq\t*\n";
+    }
+    close($fh) or error("$big.sam: $!");
+    cmd("$$opts{bin}/samtools view -u -o $big.bam $big.sam");
+    foreach my $fmt ('default', 'json') {
+        my $msg = "flagstat${threads} -O $fmt on a file split between threads";
+        print "test_flagstat:\n\t$msg\n";
+        cmd("$$opts{bin}/samtools flagstat -O $fmt $big.sam > $big.1.$fmt");
+        cmd("$$opts{bin}/samtools flagstat${threads} -O $fmt $big.bam > $big.2.$fmt");
+        my ($ret) = _cmd("cmp $big.1.$fmt $big.2.$fmt");
+        if ($ret) { failed($opts, msg => $msg, reason => "$big.1.$fmt and $big.2.$fmt differ"); }
+        else { passed($opts, msg => $msg); }
+    }
 }
 
 sub test_quickcheck
@@ -2741,6 +3269,62 @@ sub test_quickcheck
 
     test_cmd($opts, out => 'quickcheck/all.expected', want_fail => 1,
         cmd => "$$opts{bin}/samtools quickcheck -v $all_testfiles | sed 's,.*/quickcheck/,,'");
+
+    # Damage the middle of a good file in ways only the deep checks find:
+    # a bad CRC32 in the second block, and a recompressed second block whose
+    # first record is too short
+    my $ok = "$$opts{path}/quickcheck/3.quickcheck.ok.bam";
+    open(my $fh, '<', $ok) or error("$ok: $!");
+    binmode($fh);
+    my $data = do { local $/; <$fh> };
+    close($fh);
+    my $b1 = unpack('v', substr($data, 16, 2)) + 1;
+    my $s2 = unpack('v', substr($data, $b1 + 16, 2)) + 1;
+
+    my $badcrc = $data;
+    substr($badcrc, $b1 + $s2 - 8, 1) = chr(ord(substr($badcrc, $b1 + $s2 - 8, 1)) ^ 0xff);
+
+    my ($u, $c, $c2);
+    my $zin = Compress::Raw::Zlib::Inflate->new(-WindowBits => -MAX_WBITS);
+    my $cdata = substr($data, $b1 + 18, $s2 - 26);
+    $zin->inflate($cdata, $u);
+    substr($u, 0, 4) = pack('V', 20);
+    my $zout = Compress::Raw::Zlib::Deflate->new(-WindowBits => -MAX_WBITS);
+    $zout->deflate($u, $c);
+    $zout->flush($c2);
+    $c .= $c2;
+    my $badrec = substr($data, 0, $b1) . substr($data, $b1, 16) . pack('v', length($c) + 25)
+        . $c . pack('VV', crc32($u), length($u)) . substr($data, $b1 + $s2);
+
+    foreach my $bad (['badcrc', $badcrc], ['badrec', $badrec]) {
+        my $fn = "$$opts{tmp}/quickcheck.$$bad[0].bam";
+        open($fh, '>', $fn) or error("$fn: $!");
+        binmode($fh);
+        print $fh $$bad[1];
+        close($fh) or error("$fn: $!");
+    }
+    my $good = "$$opts{path}/quickcheck/3.quickcheck.ok.bam $$opts{path}/quickcheck/4.quickcheck.ok.bam";
+    test_cmd($opts, out => 'dat/empty.expected',
+        cmd => "$$opts{bin}/samtools quickcheck -d -r $good");
+    test_cmd($opts, out => 'dat/empty.expected',
+        cmd => "$$opts{bin}/samtools quickcheck -d -r -@ 2 $good");
+    test_cmd($opts, out => 'dat/empty.expected',
+        cmd => "$$opts{bin}/samtools quickcheck $$opts{tmp}/quickcheck.badcrc.bam");
+    test_cmd($opts, out => 'dat/empty.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -d $$opts{tmp}/quickcheck.badcrc.bam");
+    test_cmd($opts, out => 'dat/empty.expected',
+        cmd => "$$opts{bin}/samtools quickcheck -d $$opts{tmp}/quickcheck.badrec.bam");
+    test_cmd($opts, out => 'quickcheck/deep.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -v -d -r -@ 2 $good $$opts{tmp}/quickcheck.badcrc.bam $$opts{tmp}/quickcheck.badrec.bam | sed 's,.*/,,'");
+
+    # view passes BAM records through without unpacking them, and must tell
+    # a bad record from a truncated file
+    my ($ret, $out, $err) = _cmd("$$opts{bin}/samtools view -c $$opts{tmp}/quickcheck.badrec.bam");
+    if ($ret && $err =~ /invalid BAM record/ && $err !~ /truncated/) {
+        passed($opts, msg => "view -c quickcheck.badrec.bam");
+    } else {
+        failed($opts, msg => "view -c quickcheck.badrec.bam", reason => "expected an invalid record error, got:\n$err");
+    }
 }
 
 sub test_reheader
@@ -2753,6 +3337,12 @@ sub test_reheader
 
     # Create local BAM and CRAM inputs
     system("$$opts{bin}/samtools view -b $fn.sam > $fn.tmp.bam")  == 0 or die "failed to create bam: $?";
+    system("$$opts{bin}/samtools view -b --header-pad 1000 $fn.sam > $fn.tmp.pad.bam")  == 0 or die "failed to create bam: $?";
+    foreach my $pad ('foo', '-5', '10k', '4294967296') {
+        my ($ret) = _cmd("$$opts{bin}/samtools view -b --header-pad '$pad' -o $fn.tmp.badpad.bam $fn.sam");
+        if ( $ret ) { passed($opts, msg=>"view --header-pad '$pad' rejected"); }
+        else { failed($opts, msg=>"view --header-pad '$pad' rejected", reason=>"exit status 0"); }
+    }
     system("$$opts{bin}/samtools view -C --output-fmt-option version=2.1 $fn.sam > $fn.tmp.v21.cram") == 0 or die "failed to create cram: $?";
     system("$$opts{bin}/samtools view -C --output-fmt-option version=3.0 $fn.sam > $fn.tmp.v30.cram") == 0 or die "failed to create cram: $?";
 
@@ -2789,6 +3379,67 @@ sub test_reheader
              err=>'reheader/3_view1.sam.expected.err',
              cmd=>"$$opts{bin}/samtools reheader --in-place $$opts{path}/reheader/hdr.sam $fn.tmp.v30.cram && $$opts{bin}/samtools view -h $fn.tmp.v30.cram | perl -pe 's/\tVN:.*//'",
 	     exp_fix=>1);
+
+    test_cmd($opts,
+             out=>'reheader/1_view1.sam.expected',
+             err=>'reheader/1_view1.sam.expected.err',
+             cmd=>"$$opts{bin}/samtools reheader --in-place $$opts{path}/reheader/hdr.sam $fn.tmp.pad.bam && $$opts{bin}/samtools view -h $fn.tmp.pad.bam | grep -v samtools-header-padding | perl -pe 's/\tVN:.*//'",
+	     exp_fix=>1);
+
+    test_reheader_inplace_space($opts, $fn);
+}
+
+# Replaces headers in place with a little more or less room than they need,
+# checking that headers which don't fit are rejected and leave the file
+# alone, including when there is room for the padding tag but no padding.
+# Compressed sizes don't grow evenly, so a few new header lengths are tried
+# until both sides of the limit have been hit exactly.
+sub test_reheader_inplace_space
+{
+    my ($opts, $fn) = @_;
+    my $tmp = "$$opts{tmp}/reheader_space";
+    my @chars = ('A'..'Z', 'a'..'z', 0..9);
+    my ($too_large, $one_byte, $one_char) = (0, 0, 0);
+
+    srand(68);
+    my $recs = cmd("$$opts{bin}/samtools view $fn.sam");
+    for (my $extra = 150; $extra < 160 && !($one_byte && $one_char); $extra++) {
+        my $hdr = cmd("$$opts{bin}/samtools view -H $fn.sam");
+        $hdr .= "\@CO\t" . join('', map { $chars[int(rand(@chars))] } (1..$extra)) . "\n";
+        open(my $fh, '>', "$tmp.hdr.sam") or error("$tmp.hdr.sam: $!");
+        print $fh $hdr;
+        close($fh);
+
+        for (my $pad = 100; $pad <= 400; $pad++) {
+            cmd("$$opts{bin}/samtools view -b --header-pad $pad -o $tmp.bam $fn.sam");
+            my $before = cmd("$$opts{bin}/samtools view -h $tmp.bam");
+            my ($ret, $out, $err) = _cmd("$$opts{bin}/samtools reheader --no-PG --in-place $tmp.hdr.sam $tmp.bam");
+            my $after = cmd("$$opts{bin}/samtools view -h $tmp.bam");
+            if ($ret) {
+                if ($err !~ /bytes too large to replace in place/ || $after ne $before) {
+                    failed($opts, msg=>"reheader -i --header-pad $pad", reason=>"unexpected failure, or file changed:\n$err");
+                    return;
+                }
+                $too_large++;
+                $one_byte++ if ($err =~ / 1 bytes too large/);
+                next;
+            }
+            my @pad = ($after =~ /^\@CO\tsamtools-header-padding:(.*)\n/mg);
+            my $got = join('', grep { !/samtools-header-padding/ } split(/^/, $after));
+            if (@pad != 1 || length($pad[0]) == 0 || $got ne $hdr . $recs) {
+                failed($opts, msg=>"reheader -i --header-pad $pad", reason=>"unexpected output:\n$after");
+                return;
+            }
+            $one_char++ if (length($pad[0]) == 1);
+            last if (length($pad[0]) > 20); # well clear of the limit now
+        }
+    }
+    if ($too_large && $one_byte && $one_char) {
+        passed($opts, msg=>"reheader -i around the space limit");
+    } else {
+        failed($opts, msg=>"reheader -i around the space limit",
+               reason=>"limit not reached: $too_large rejected, $one_byte by one byte, $one_char with one padding character");
+    }
 }
 
 sub test_addrprg
@@ -2824,5 +3475,109 @@ sub test_bedcov
 
     test_cmd($opts,out=>'bedcov/bedcov.expected',cmd=>"$$opts{bin}/samtools bedcov $$opts{path}/bedcov/bedcov.bed $$opts{path}/bedcov/bedcov.bam");
     test_cmd($opts,out=>'bedcov/bedcov_j.expected',cmd=>"$$opts{bin}/samtools bedcov -j $$opts{path}/bedcov/bedcov.bed $$opts{path}/bedcov/bedcov.bam");
+    test_cmd($opts,out=>'bedcov/bedcov.expected',cmd=>"$$opts{bin}/samtools bedcov -@ 2 $$opts{path}/bedcov/bedcov.bed $$opts{path}/bedcov/bedcov.bam");
+
+    # Enough BED lines for several batches to run at once, checked against
+    # the unthreaded output for both BAM and CRAM
+    my $tmp = "$$opts{tmp}/bedcov_big";
+    open(my $fh, '>', "$tmp.sam") or error("$tmp.sam: $!");
+    print $fh "\@SQ\tSN:ref$_\tLN:200000\n" foreach (1..3);
+    my @bases = qw(A C G T);
+    srand(51);
+    for (my $i = 0; $i < 20000; $i++) {
+        my $seq = join('', map { $bases[int(rand(4))] } (1..50));
+        printf $fh "r%d\t%d\tref%d\t%d\t%d\t50M\t*\t0\t0\t%s\t*\n",
+            $i, rand() < 0.5 ? 0 : 16, 1 + int(rand(3)), 1 + int(rand(199900)),
+            int(rand(60)), $seq;
+    }
+    close($fh);
+    open($fh, '>', "$tmp.bed") or error("$tmp.bed: $!");
+    for (my $i = 0; $i < 5000; $i++) {
+        my $beg = int(rand(199000));
+        printf $fh "ref%d\t%d\t%d\n", 1 + int(rand(3)), $beg, $beg + 1 + int(rand(1000));
+    }
+    close($fh);
+    cmd("$$opts{bin}/samtools sort -o $tmp.bam $tmp.sam && $$opts{bin}/samtools index $tmp.bam");
+    cmd("$$opts{bin}/samtools sort -O cram --output-fmt-option no_ref=1 -o $tmp.cram $tmp.sam && $$opts{bin}/samtools index $tmp.cram");
+    foreach my $in ("$tmp.bam", "$tmp.cram", "$tmp.bam $tmp.cram") {
+        my $want = cmd("$$opts{bin}/samtools bedcov -Q 10 $tmp.bed $in");
+        my ($ret, $out) = _cmd("$$opts{bin}/samtools bedcov -Q 10 -@ 4 $tmp.bed $in");
+        if ($ret == 0 && $out eq $want) { passed($opts,msg=>"bedcov -@ 4 $in"); }
+        else { failed($opts,msg=>"bedcov -@ 4 $in",reason=>"output differs from bedcov without -@"); }
+    }
 }
 
+# Generates an input with interleaved read groups, tag values and
+# references, big enough for split's per-output batches to fill up, and
+# checks each output against the records that should be in it.
+sub test_split
+{
+    my ($opts,%args) = @_;
+    my $tmp = "$$opts{tmp}/split";
+    my (%by_rg, %by_tag, %by_ref);
+
+    open(my $fh, '>', "$tmp.sam") or error("$tmp.sam: $!");
+    print $fh "\@HD\tVN:1.4\tSO:unsorted\n";
+    print $fh "\@SQ\tSN:ref1\tLN:100000\n\@SQ\tSN:ref2\tLN:100000\n";
+    print $fh "\@RG\tID:grp$_\tSM:s$_\n" foreach (1..3);
+    my @bases = qw(A C G T);
+    srand(65);
+    for (my $i = 1; $i <= 6000; $i++)
+    {
+        my $seq = join('', map { $bases[int(rand(4))] } 1..10);
+        my $r = rand();
+        my ($flag, $ref, $pos, $mapq, $cigar) = (0, 'ref' . (1 + int(rand(2))), 1 + int(rand(99000)), 30, '10M');
+        if ($r < 0.1) { ($flag, $ref, $pos, $mapq, $cigar) = (4, '*', 0, 0, '*'); } # unplaced
+        elsif ($r < 0.15) { ($flag, $mapq, $cigar) = (4, 0, '*'); }                 # placed, unmapped
+        my $line = "r$i\t$flag\t$ref\t$pos\t$mapq\t$cigar\t*\t0\t0\t$seq\t*";
+        my $rg = rand() < 0.02 ? '' : 'grp' . (1 + int(rand(3)));
+        my $tag = rand() < 0.2 ? '' : (qw(a b c))[int(rand(3))];
+        $line .= "\tRG:Z:$rg" if ($rg ne '');
+        $line .= "\tXT:Z:$tag" if ($tag ne '');
+        $line .= "\n";
+        print $fh $line;
+        $by_rg{$rg ne '' ? $rg : 'none'} .= $line;
+        $by_tag{$tag ne '' ? $tag : 'none'} .= $line;
+        $by_ref{$ref ne '*' ? $ref : 'none'} .= $line;
+    }
+    close($fh);
+    cmd("$$opts{bin}/samtools view -b -o $tmp.bam $tmp.sam");
+
+    my $check = sub {
+        my ($file, $expected) = @_;
+        my $test = "$$opts{bin}/samtools view $file";
+        print "$test\n";
+        my ($ret, $out, $err) = _cmd($test);
+        if ( $ret || $out ne $expected ) { failed($opts,msg=>$test,reason=>"Records differ from those expected\n$err"); }
+        else { passed($opts,msg=>$test); }
+    };
+    my $same_header = sub {
+        my ($file1, $file2) = @_;
+        my $test = "$$opts{bin}/samtools view -H $file1 | grep -v '^\@PG' > $file1.hdr && $$opts{bin}/samtools view -H $file2 | grep -v '^\@PG' | $$opts{diff} $file1.hdr -";
+        print "$test\n";
+        my ($ret, $out, $err) = _cmd($test);
+        if ( $ret ) { failed($opts,msg=>$test,reason=>"$out$err"); }
+        else { passed($opts,msg=>$test); }
+    };
+
+    # By read group, without a limit and with one output open at a time,
+    # so outputs are repeatedly closed and reopened for appending
+    cmd("$$opts{bin}/samtools split -u ${tmp}_rg_none.bam -f '${tmp}_rg_%!.%.' $tmp.bam");
+    cmd("$$opts{bin}/samtools split -M 1 -u ${tmp}_m1_none.bam -f '${tmp}_m1_%!.%.' $tmp.bam");
+    foreach my $rg (sort keys %by_rg)
+    {
+        $check->("${tmp}_rg_$rg.bam", $by_rg{$rg});
+        $check->("${tmp}_m1_$rg.bam", $by_rg{$rg});
+        $same_header->("${tmp}_rg_$rg.bam", "${tmp}_m1_$rg.bam");
+    }
+    cmd("$$opts{bin}/samtools quickcheck " . join(' ', map { "${tmp}_m1_$_.bam" } sort keys %by_rg));
+
+    # By tag value, reads without the tag going to -u
+    cmd("$$opts{bin}/samtools split -d XT -M 2 -u ${tmp}_tag_none.bam -f '${tmp}_tag_%!.%.' $tmp.bam");
+    foreach my $tag (sort keys %by_tag) { $check->("${tmp}_tag_$tag.bam", $by_tag{$tag}); }
+
+    # By reference, unplaced reads going to -u and placed unmapped ones to
+    # their reference
+    cmd("$$opts{bin}/samtools split --by-ref -u ${tmp}_ref_none.bam -f '${tmp}_ref_%!.%.' $tmp.bam");
+    foreach my $ref (sort keys %by_ref) { $check->("${tmp}_ref_$ref.bam", $by_ref{$ref}); }
+}